@@ -0,0 +1,214 @@
+/*
+ * affinity.h:
+ *
+ * This file contains the thread pinning (--bind) and the first-touch
+ * initialisation of the arrays of the generated RENPSM simulators, and
+ * the report of the NUMA nodes holding them.
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define BIND_NONE 0
+#define BIND_CLOSE 1
+#define BIND_SPREAD 2
+
+#define AFFINITY_WORDS 16
+#define AFFINITY_MAX_PLACES 1024
+#define FIRST_TOUCH_CHUNK 4096
+#define NUMA_MAX_NODES 64
+
+/* CPU masks through the system calls, so that _GNU_SOURCE is not needed */
+typedef struct
+{
+	unsigned long bits[AFFINITY_WORDS];
+} AFFINITY_MASK;
+
+#define MASK_BITS (8*sizeof(unsigned long))
+
+AFFINITY_MASK affinity_places[AFFINITY_MAX_PLACES];
+int affinity_places_count = 0;
+
+/*
+ * Places are those of OMP_PLACES if it is set, otherwise every CPU the
+ * process may run on.
+ */
+void affinity_find_places()
+{
+	affinity_places_count = 0;
+#ifdef _OPENMP
+	int places = omp_get_num_places();
+	for (int i=0;i<places && i<AFFINITY_MAX_PLACES;i++) {
+		int ids[AFFINITY_WORDS*MASK_BITS];
+		int n = omp_get_place_num_procs(i);
+		if (n>AFFINITY_WORDS*(int)MASK_BITS) {
+			continue;
+		}
+		omp_get_place_proc_ids(i,ids);
+		AFFINITY_MASK* mask = &affinity_places[affinity_places_count];
+		memset(mask,0,sizeof(AFFINITY_MASK));
+		int procs = 0;
+		/* CPUs past the mask cannot be bound through it and are left out */
+		for (int j=0;j<n;j++) {
+			if (ids[j]>=0 && ids[j]<AFFINITY_WORDS*(int)MASK_BITS) {
+				mask->bits[ids[j]/MASK_BITS] |= 1UL << (ids[j]%MASK_BITS);
+				procs++;
+			}
+		}
+		if (procs>0) {
+			affinity_places_count++;
+		}
+	}
+#endif
+	if (affinity_places_count>0) {
+		return;
+	}
+	AFFINITY_MASK all;
+	memset(&all,0,sizeof(all));
+	if (syscall(SYS_sched_getaffinity,0,sizeof(all),&all)<0) {
+		return;
+	}
+	for (int cpu=0;cpu<AFFINITY_WORDS*(int)MASK_BITS && affinity_places_count<AFFINITY_MAX_PLACES;cpu++) {
+		if ((all.bits[cpu/MASK_BITS] >> (cpu%MASK_BITS)) & 1) {
+			AFFINITY_MASK* mask = &affinity_places[affinity_places_count++];
+			memset(mask,0,sizeof(AFFINITY_MASK));
+			mask->bits[cpu/MASK_BITS] |= 1UL << (cpu%MASK_BITS);
+		}
+	}
+}
+
+/*
+ * Pins the threads of the OpenMP pool, which is reused by the later
+ * parallel regions with the same number of threads: close puts thread t
+ * on place t, spread spaces the threads evenly over the places (one
+ * socket after the other when the places are numbered by socket).
+ */
+void bind_threads(int threads, int policy)
+{
+	if (policy==BIND_NONE) {
+		return;
+	}
+	affinity_find_places();
+	int places = affinity_places_count;
+	if (places==0) {
+		fprintf(stderr,"Bind: no places found\n");
+		return;
+	}
+	#pragma omp parallel num_threads(threads)
+	{
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		int place = policy==BIND_CLOSE ? t%places : (int)(((long)t*places/threads)%places);
+		syscall(SYS_sched_setaffinity,0,sizeof(AFFINITY_MASK),&affinity_places[place]);
+	}
+}
+
+/*
+ * First touch: the pages of an array are placed on the node of the
+ * thread which writes them first, so the arrays are initialised by every
+ * thread with a static schedule over page-sized chunks and their pages
+ * are spread over the nodes instead of all landing on the node of the
+ * main thread. The kernels reach the per-label arrays through the label
+ * lists, with a dynamic schedule, so no thread owns a range of them: this
+ * balances the memory traffic over the nodes, it does not make the
+ * accesses of a thread local.
+ */
+void parallel_memset(void* data, int value, size_t bytes, int threads)
+{
+	unsigned char* p = (unsigned char*)data;
+	long chunks = (bytes + FIRST_TOUCH_CHUNK - 1) / FIRST_TOUCH_CHUNK;
+	#pragma omp parallel for schedule(static) num_threads(threads) if(chunks>1)
+	for (long i=0;i<chunks;i++) {
+		size_t begin = (size_t)i*FIRST_TOUCH_CHUNK;
+		memset(p+begin,value,bytes-begin < FIRST_TOUCH_CHUNK ? bytes-begin : FIRST_TOUCH_CHUNK);
+	}
+}
+
+void parallel_fill_int32(int32_t* data, int32_t value, size_t size, int threads)
+{
+	long chunks = (size*sizeof(int32_t) + FIRST_TOUCH_CHUNK - 1) / FIRST_TOUCH_CHUNK;
+	size_t per_chunk = FIRST_TOUCH_CHUNK / sizeof(int32_t);
+	#pragma omp parallel for schedule(static) num_threads(threads) if(chunks>1)
+	for (long i=0;i<chunks;i++) {
+		for (size_t j=i*per_chunk;j<(i+1)*per_chunk && j<size;j++) {
+			data[j] = value;
+		}
+	}
+}
+
+/* Adds the node of each page of data to nodes (move_pages without moving) */
+void numa_pages(const void* data, size_t bytes, long* nodes)
+{
+	enum { BATCH = 1024 };
+	void* pages[BATCH];
+	int status[BATCH];
+	uintptr_t first = (uintptr_t)data / FIRST_TOUCH_CHUNK * FIRST_TOUCH_CHUNK;
+	uintptr_t end = (uintptr_t)data + bytes;
+	while (first<end) {
+		int n = 0;
+		for (;n<BATCH && first<end;n++, first+=FIRST_TOUCH_CHUNK) {
+			pages[n] = (void*)first;
+		}
+		if (syscall(SYS_move_pages,0,(unsigned long)n,pages,NULL,status,0)!=0) {
+			return;
+		}
+		for (int i=0;i<n;i++) {
+			if (status[i]>=0 && status[i]<NUMA_MAX_NODES) {
+				nodes[status[i]]++;
+			}
+		}
+	}
+}
+
+void numa_print(const char* name, const long* nodes)
+{
+	long total = 0;
+	for (int i=0;i<NUMA_MAX_NODES;i++) {
+		total += nodes[i];
+	}
+	printf("NUMA: %s",name);
+	for (int i=0;i<NUMA_MAX_NODES;i++) {
+		if (nodes[i]>0) {
+			printf(" node%d %.1f%%",i,100.0*nodes[i]/total);
+		}
+	}
+	printf(total>0 ? " (%ld pages)\n" : " unknown\n",total);
+}
+
+#endif
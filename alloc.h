@@ -0,0 +1,255 @@
+/*
+ * alloc.h:
+ *
+ * This file contains the allocation of the arrays of the generated RENPSM
+ * simulators (--alloc): plain malloc, 64-byte aligned blocks, 2 MB aligned
+ * regions advised for transparent huge pages or explicit hugetlbfs pages,
+ * and the report of the data TLB misses of the run.
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define ALLOC_MALLOC 0
+#define ALLOC_ALIGNED 1
+#define ALLOC_THP 2
+#define ALLOC_HUGETLB 3
+
+#define ALLOC_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2UL*1024*1024)
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+const char* alloc_names[4] = {"malloc","aligned","thp","hugetlb"};
+
+int alloc_mode = ALLOC_ALIGNED;
+
+/* Regions obtained with mmap, sim_free releases everything else with free */
+typedef struct ALLOC_REGION
+{
+	void* data;
+	void* base;
+	size_t length;
+	struct ALLOC_REGION* next;
+} ALLOC_REGION;
+
+ALLOC_REGION* alloc_regions = NULL;
+size_t alloc_huge_bytes = 0;
+size_t alloc_total_bytes = 0;
+
+int tlb_fd = -1;
+long long tlb_start = 0;
+
+int alloc_parse(const char* name)
+{
+	for (int i=0;i<4;i++) {
+		if (strcmp(name,alloc_names[i])==0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * 2 MB aligned region of whole huge pages: from hugetlbfs (which must have
+ * enough pages reserved in /proc/sys/vm/nr_hugepages), or from an
+ * anonymous mapping trimmed to the alignment and advised for THP.
+ */
+void* alloc_map(size_t bytes, int hugetlb)
+{
+	size_t length = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	void* base;
+	void* data;
+	if (hugetlb) {
+		base = mmap(NULL,length,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,-1,0);
+		if (base==MAP_FAILED) {
+			return NULL;
+		}
+		data = base;
+	} else {
+		length += HUGE_PAGE_SIZE;
+		base = mmap(NULL,length,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+		if (base==MAP_FAILED) {
+			return NULL;
+		}
+		data = (void*)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+#ifdef MADV_HUGEPAGE
+		madvise(data,length - HUGE_PAGE_SIZE,MADV_HUGEPAGE);
+#endif
+	}
+	ALLOC_REGION* region = (ALLOC_REGION*)malloc(sizeof(ALLOC_REGION));
+	region->data = data;
+	region->base = base;
+	region->length = length;
+	#pragma omp critical(alloc)
+	{
+		region->next = alloc_regions;
+		alloc_regions = region;
+		alloc_huge_bytes += bytes;
+	}
+	return data;
+}
+
+/*
+ * Storage of the simulator arrays. Arrays of at least a huge page go to
+ * 2 MB aligned regions in the thp and hugetlb modes (hugetlb falls back
+ * to thp when no huge page is left), the others are 64-byte aligned
+ * except in the malloc mode.
+ */
+void* sim_alloc(size_t bytes)
+{
+	void* data = NULL;
+	#pragma omp atomic
+	alloc_total_bytes += bytes;
+	if (alloc_mode==ALLOC_HUGETLB && bytes>=HUGE_PAGE_SIZE) {
+		data = alloc_map(bytes,1);
+		if (data==NULL) {
+			static int warned = 0;
+			if (!warned) {
+				fprintf(stderr,"Alloc: no hugetlbfs pages left, using transparent huge pages\n");
+				warned = 1;
+			}
+		}
+	}
+	if (data==NULL && alloc_mode>=ALLOC_THP && bytes>=HUGE_PAGE_SIZE) {
+		data = alloc_map(bytes,0);
+	}
+	if (data==NULL && alloc_mode!=ALLOC_MALLOC) {
+		if (posix_memalign(&data,ALLOC_ALIGNMENT,bytes)!=0) {
+			data = NULL;
+		}
+	}
+	if (data==NULL) {
+		data = malloc(bytes);
+	}
+	if (data==NULL) {
+		fprintf(stderr,"Alloc: out of memory (%zu bytes)\n",bytes);
+		exit(1);
+	}
+	return data;
+}
+
+void sim_free(void* data)
+{
+	ALLOC_REGION* found = NULL;
+	#pragma omp critical(alloc)
+	{
+		for (ALLOC_REGION** p=&alloc_regions;*p!=NULL;p=&(*p)->next) {
+			if ((*p)->data==data) {
+				found = *p;
+				*p = found->next;
+				break;
+			}
+		}
+	}
+	if (found!=NULL) {
+		munmap(found->base,found->length);
+		free(found);
+	} else {
+		free(data);
+	}
+}
+
+/*
+ * Data TLB load misses of the process, threads included: the counter is
+ * inherited by the threads created after it is opened, so it has to be
+ * opened before the first parallel region.
+ */
+void tlb_open()
+{
+	struct perf_event_attr attr;
+	memset(&attr,0,sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	tlb_fd = (int)syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+}
+
+long long tlb_read()
+{
+	long long count = -1;
+	if (tlb_fd<0 || read(tlb_fd,&count,sizeof(count))!=sizeof(count)) {
+		return -1;
+	}
+	return count;
+}
+
+void tlb_begin()
+{
+	tlb_start = tlb_read();
+}
+
+/* Huge pages actually backing the anonymous memory of the process, in kB */
+long anon_huge_pages()
+{
+	char line[256];
+	long kb = -1;
+	FILE* fp = fopen("/proc/self/smaps_rollup","r");
+	if (fp==NULL) {
+		return -1;
+	}
+	while (fgets(line,sizeof(line),fp)!=NULL) {
+		if (strncmp(line,"AnonHugePages:",14)==0) {
+			kb = atol(line+14);
+		}
+	}
+	fclose(fp);
+	return kb;
+}
+
+void alloc_report()
+{
+	long long end = tlb_read();
+	long huge = anon_huge_pages();
+	printf("Alloc: %s, %.1f MB allocated, %.1f MB in 2 MB aligned regions",alloc_names[alloc_mode],
+	  alloc_total_bytes/1048576.0,alloc_huge_bytes/1048576.0);
+	if (huge>=0) {
+		printf(", %.1f MB on huge pages",huge/1024.0);
+	}
+	printf("\n");
+	if (end>=0 && tlb_start>=0) {
+		printf("dTLB load misses: %lld\n",end-tlb_start);
+	} else {
+		printf("dTLB load misses: unavailable (perf_event_open)\n");
+	}
+}
+
+#endif
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# alloc.sh:
+#
+# Runs the second bidirectional RRT model with every allocation mode
+# (--alloc=malloc|aligned|thp|hugetlb) and prints the best wall time of
+# the runs, the data TLB load misses of the main loop and their reduction
+# against malloc. The misses need perf_event_open (perf_event_paranoid
+# at most 2 and a virtual PMU on virtual machines); hugetlb needs pages
+# reserved in /proc/sys/vm/nr_hugepages, otherwise it behaves as thp.
+#
+# Usage: benchmarks/alloc.sh [runs] [threads] [seed] [generator]
+#
+#   runs       runs per mode (default 5)
+#   threads    number of threads (default 1)
+#   seed       pseudo-random number generator seed (default 42)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# Run it from the repository root, it needs the model, the map and pgm.c.
+# The simulator is written to simulator.c in the current directory.
+#
+
+N=${1:-5}
+T=${2:-1}
+S=${3:-42}
+GEN=${4:-./renpsm_openmp}
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_alloc.$$
+mkdir -p "$TMP"
+
+"$GEN" < birrt_renpsm_test2.pli > /dev/null || exit 1
+$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/test2" || exit 1
+
+echo "Runs $N, threads $T, seed $S"
+for a in malloc aligned thp hugetlb; do
+	for i in $(seq 1 $N); do
+		"$TMP/test2" --alloc=$a -t $T -r $S -m office.pgm -o "$TMP/out.pgm" 2> /dev/null
+	done > "$TMP/$a.txt"
+	grep "^Alloc" "$TMP/$a.txt" | head -1
+	awk -v mode=$a '
+		/^Wall time/ { if (best=="" || $3<best) best = $3 }
+		/^dTLB load misses: [0-9]/ { if (misses=="" || $4<misses) misses = $4 }
+		END {
+			printf "%s: best wall time %.3f s", mode, best
+			if (misses!="") printf ", dTLB load misses %d", misses
+			printf "\n"
+			if (misses!="") print misses > "'"$TMP"'/" mode ".misses"
+		}' "$TMP/$a.txt"
+	if [ -f "$TMP/malloc.misses" ] && [ -f "$TMP/$a.misses" ] && [ $a != malloc ]; then
+		echo "$(cat "$TMP/malloc.misses") $(cat "$TMP/$a.misses")" |
+		  awk '{ if ($1>0) printf "dTLB miss reduction against malloc: %.1f%%\n", 100*(1-$2/$1) }'
+	fi
+done
+
+rm -rf "$TMP"
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# connect.sh:
+#
+# Runs the bidirectional RRT models on both bundled maps as they are (one
+# step of delta per protein cycle, checked by collision()) and with the
+# RRT-Connect extension (as many steps as extend() allows towards the
+# sample, created at once by chain()), and prints the steps to halt over a
+# number of seeds, in the deterministic mode with 1 thread.
+#
+# Usage: benchmarks/connect.sh [seeds] [generator]
+#
+#   seeds      seeds 1..seeds per model (default 20)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# Run it from the repository root, it needs pgm.c and the models. The
+# simulator is written to simulator.c in the current directory.
+#
+
+N=${1:-20}
+GEN=${2:-./renpsm_openmp}
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_connect.$$
+mkdir -p "$TMP"
+
+# Steps 10, 11 and 13 of the model with extend() and chain()
+connect()
+{
+	sed -e "s/FlagA{mem} <- if(collision(Y{1,mem},Y{2,mem},U{1,mem},U{2,mem},delta),0,p\*q+1),/K{1,mem} <- extend(Y{1,mem},Y{2,mem},U{1,mem},U{2,mem},delta,X{1,mem},X{2,mem}),/" \
+	    -e "s/FlagB{mem} <- if(collision(Y{3,mem},Y{4,mem},U{3,mem},U{4,mem},delta),0,p\*q+1),/K{2,mem} <- extend(Y{3,mem},Y{4,mem},U{3,mem},U{4,mem},delta,X{3,mem},X{4,mem}),/" \
+	    -e "s/U{i,mem} \* delta), alpha{11} ?FlagA/U{i,mem} * delta * K{1,mem}), alpha{11} ?FlagA/" \
+	    -e "s/U{i,mem} \* delta), alpha{11} ?FlagB/U{i,mem} * delta * K{2,mem}), alpha{11} ?FlagB/" \
+	    -e "s/\[ \[ \]'HA{mem} \]'NA{mem}/[ [ ]'chain(Y{1,mem},Y{2,mem},U{1,mem},U{2,mem},delta,K{1,mem},p) ]'NA{mem}/" \
+	    -e "s/\[ \[ \]'HB{mem} \]'NB{mem}/[ [ ]'chain(Y{3,mem},Y{4,mem},U{3,mem},U{4,mem},delta,K{2,mem},p) ]'NB{mem}/" "$MODEL"
+}
+
+for m in 1 2; do
+	MODEL=birrt_renpsm_test$m.pli
+	if [ $m = 1 ]; then MAP=map.pgm; else MAP=office.pgm; fi
+	for s in single connect; do
+		case $s in
+			single) cp "$MODEL" "$TMP/model.pli" ;;
+			connect) connect > "$TMP/model.pli" ;;
+		esac
+		"$GEN" < "$TMP/model.pli" > /dev/null || exit 1
+		$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/sim" || exit 1
+		for i in $(seq 1 $N); do
+			"$TMP/sim" --deterministic -t 1 -r $i -m "$MAP" -o "$TMP/out.pgm" | grep "^Steps"
+		done | sort -n -k 2 | awk -v s=$s -v map=$MAP '
+			{ steps[NR] = $2; sum += $2 }
+			END {
+				n = NR
+				printf "%s %s: mean %.0f, median %d, max %d steps over %d seeds\n", map, s, sum/n, steps[int((n+1)/2)], steps[n], n
+			}'
+	done
+done
+
+rm -rf "$TMP"
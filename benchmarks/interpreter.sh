@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# interpreter.sh:
+#
+# Compares the bytecode interpreter (renpsm_openmp -i) with the generated
+# simulator on the two bidirectional RRT models. For each model it prints
+# the time spent generating and compiling the simulator and the steps per
+# second of both backends on the same deterministic run, and checks that
+# both write the same output file.
+#
+# Usage: benchmarks/interpreter.sh [threads] [seed] [generator]
+#
+#   threads    number of threads (default 1)
+#   seed       pseudo-random number generator seed (default 42)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# Run it from the repository root, it needs the models, the maps and pgm.c.
+# The simulator is written to simulator.c in the current directory.
+#
+
+T=${1:-1}
+SEED=${2:-42}
+GEN=${3:-./renpsm_openmp}
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_interpreter.$$
+mkdir -p "$TMP"
+
+rate() {
+	awk '/^Wall time:/ {t=$3} /^Steps:/ {s=$2} END {printf "%d steps in %.4f s (%.0f steps/s)\n", s, t, s/t}' "$1"
+}
+
+for m in 1 2; do
+	if [ $m = 1 ]; then MAP=map.pgm; else MAP=office.pgm; fi
+	MODEL=birrt_renpsm_test$m.pli
+	echo "Model: $MODEL (threads $T, seed $SEED)"
+	t0=$(date +%s.%N)
+	"$GEN" < $MODEL > /dev/null || exit 1
+	$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/test$m" || exit 1
+	t1=$(date +%s.%N)
+	echo "Generate and compile: $(echo "$t0 $t1" | awk '{printf "%.3f s", $2-$1}')"
+	"$TMP/test$m" -t $T -r $SEED -m $MAP -o "$TMP/generated$m.pgm" --deterministic > "$TMP/generated$m.txt"
+	"$GEN" -i -t $T -r $SEED -m $MAP -o "$TMP/interpreter$m.pgm" --deterministic < $MODEL > "$TMP/interpreter$m.txt"
+	echo "Generated C: $(rate "$TMP/generated$m.txt")"
+	echo "Interpreter: $(rate "$TMP/interpreter$m.txt")"
+	if cmp -s "$TMP/generated$m.pgm" "$TMP/interpreter$m.pgm"; then
+		echo "Output: identical"
+	else
+		echo "Output: DIFFERENT"
+	fi
+	echo
+done
+
+rm -rf "$TMP"
@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# labels.sh:
+#
+# Checks the conversions of doubles to the integer variables of the
+# generated simulators (to_label and to_flag in functions.h): values that
+# do not fit, such as a coordinate of 1e12, infinities and NaN, must be
+# stored as LABEL_UNSET/FLAG_UNSET, and the others rounded. Exits with 1
+# on a mismatch.
+#
+# Usage: benchmarks/labels.sh
+#
+# Run it from the repository root, it needs functions.h and pgm.c.
+#
+
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_labels.$$
+mkdir -p "$TMP"
+
+cat > "$TMP/labels.c" <<'END'
+#include "functions.h"
+
+int failed = 0;
+
+void check_label(double x, int32_t expected)
+{
+	int32_t y = to_label(x);
+	printf("to_label(%g) = %d%s\n",x,y,y==expected ? "" : " FAILED");
+	failed |= y!=expected;
+}
+
+void check_flag(double x, uint8_t expected)
+{
+	uint8_t y = to_flag(x);
+	printf("to_flag(%g) = %d%s\n",x,y,y==expected ? "" : " FAILED");
+	failed |= y!=expected;
+}
+
+int main()
+{
+	check_label(357.4,357);
+	check_label(-2.5,-3);
+	check_label(1e12,LABEL_UNSET);
+	check_label(-1e12,LABEL_UNSET);
+	check_label(2147483647.0,INT32_MAX);
+	check_label(2147483648.0,LABEL_UNSET);
+	check_label(INT32_MIN,LABEL_UNSET);
+	check_label(INFINITY,LABEL_UNSET);
+	check_label(-INFINITY,LABEL_UNSET);
+	check_label(NAN,LABEL_UNSET);
+	check_flag(1,1);
+	check_flag(-0.2,0);
+	check_flag(254,254);
+	check_flag(300,FLAG_UNSET);
+	check_flag(-1,FLAG_UNSET);
+	check_flag(1e12,FLAG_UNSET);
+	check_flag(INFINITY,FLAG_UNSET);
+	check_flag(NAN,FLAG_UNSET);
+	return failed;
+}
+END
+$CC -I. "$TMP/labels.c" pgm.c -lm -O2 -fopenmp -fsanitize=float-cast-overflow -fno-sanitize-recover=all -o "$TMP/labels" || exit 1
+"$TMP/labels"
+STATUS=$?
+if [ $STATUS = 0 ]; then
+	echo "Label conversions: OK"
+else
+	echo "Label conversions: FAILED"
+fi
+rm -rf "$TMP"
+exit $STATUS
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# large_model.sh:
+#
+# Writes a synthetic RENPSM model with N production rules spread over
+# N/10 variables and 10 proteins, and measures the time spent by the
+# generator in parsing, rolling out and generating the simulator.
+#
+# Usage: benchmarks/large_model.sh [N] [generator]
+#
+#   N          number of production rules (default 20000)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# The model is written to large_model.pli and the simulator to
+# simulator.c in the current directory.
+#
+
+N=${1:-20000}
+GEN=${2:-./renpsm_openmp}
+
+awk -v n="$N" 'BEGIN {
+	m = int(n/10); if (m<1) m = 1;
+	print "@model<renpsm>";
+	print "def main()";
+	print "{";
+	print "\tp = 100;";
+	print "\tskin = 3;";
+	print "\tmem = 0;";
+	print "\t@mu = [ []'"'"'1 []'"'"'2 ]'"'"'skin;";
+	print "\t@ms(mem) = alpha{1};";
+	print "\t@Y{1,1} = 1;";
+	print "\t@Y{2,1} = 1;";
+	print "\t@Y{1,2} = 2;";
+	print "\t@Y{2,2} = 2;";
+	print "\tcall rules();";
+	print "}";
+	print "def rules()";
+	print "{";
+	for (k=0;k<n;k++) {
+		j = k % m;
+		printf "\tV%d{%d,mem} <- if(V%d{%d,mem} < p, V%d{%d,mem} + random(1,p), %d), alpha{%d};\n",
+			j, int(k/m), (j+1)%m, int(k/m), (j+1)%m, int(k/m), k, (k%10)+1;
+	}
+	print "\tD{h} <- euclideanDistance(Y{1,h},Y{2,h},1,1), alpha{1} : h in skin;";
+	print "\tHalt{mem} <- if(V0{0,mem} > p, 1, 0), alpha{10};";
+	print "\t[alpha{i} -> alpha{i+1}]'"'"'mem : 1<=i<=9;";
+	print "\t[alpha{10} -> alpha{1}]'"'"'mem;";
+	print "}";
+}' > large_model.pli
+
+echo "Rules: $N"
+"$GEN" -b < large_model.pli > /dev/null
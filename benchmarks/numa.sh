@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# numa.sh:
+#
+# Runs the second bidirectional RRT model with the threads confined to one
+# socket (numactl --cpunodebind=0 --membind=0) and spread over every
+# socket, with --bind=close and --bind=spread, and prints the wall times
+# and the NUMA nodes holding the pages of the arrays. Without numactl, or
+# on a single node machine, only the whole machine is measured.
+#
+# Usage: benchmarks/numa.sh [threads] [seed] [generator]
+#
+#   threads    number of threads (default: the number of CPUs)
+#   seed       pseudo-random number generator seed (default 42)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# Run it from the repository root, it needs the model, the map and pgm.c.
+# The simulator is written to simulator.c in the current directory.
+#
+
+T=${1:-$(nproc)}
+S=${2:-42}
+GEN=${3:-./renpsm_openmp}
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_numa.$$
+mkdir -p "$TMP"
+
+"$GEN" < birrt_renpsm_test2.pli > /dev/null || exit 1
+$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/test2" || exit 1
+
+NODES=$(ls -d /sys/devices/system/node/node[0-9]* 2>/dev/null | wc -l)
+echo "Threads $T, seed $S, $NODES NUMA node(s)"
+
+run()
+{
+	echo
+	echo "$1"
+	shift
+	"$@" "$TMP/test2" --bind=$b -t $T -r $S -m office.pgm -o "$TMP/out.pgm" | grep "^NUMA\|^Wall\|^Steps"
+}
+
+for b in close spread; do
+	if command -v numactl > /dev/null && [ $NODES -gt 1 ]; then
+		run "One socket, --bind=$b" numactl --cpunodebind=0 --membind=0 -- env OMP_PLACES=cores
+		run "Two sockets, --bind=$b" env OMP_PLACES=cores
+	else
+		run "All CPUs, --bind=$b" env OMP_PLACES=cores
+	fi
+done
+
+rm -rf "$TMP"
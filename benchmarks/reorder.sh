@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# reorder.sh:
+#
+# Runs a model without reordering (--reorder=0) and with the Morton
+# reordering of the packed columns every given number of steps, in the
+# deterministic mode, and prints the best wall time of the runs, the time
+# spent reordering and the cache misses of the fused kernels. The state
+# hashes must be the same. The misses need perf_event_open (see alloc.sh).
+#
+# Usage: benchmarks/reorder.sh [intervals] [runs] [steps] [model] [map] [generator]
+#
+#   intervals  reorder intervals in steps (default "1000 100")
+#   runs       runs per interval (default 5)
+#   steps      maximum number of steps (default 1048576)
+#   model      P-Lingua model (default birrt_renpsm_test2.pli)
+#   map        obstacle map (default office.pgm)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# Run it from the repository root, it needs pgm.c. The simulator is
+# written to simulator.c in the current directory.
+#
+
+INTERVALS=${1:-1000 100}
+N=${2:-5}
+STEPS=${3:-1048576}
+MODEL=${4:-birrt_renpsm_test2.pli}
+MAP=${5:-office.pgm}
+GEN=${6:-./renpsm_openmp}
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_reorder.$$
+mkdir -p "$TMP"
+
+"$GEN" < "$MODEL" > /dev/null || exit 1
+$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/sim" || exit 1
+
+FAILED=0
+for r in 0 $INTERVALS; do
+	for i in $(seq 1 $N); do
+		"$TMP/sim" --deterministic --reorder=$r -t 1 -r 42 -s $STEPS -m "$MAP" -o "$TMP/out.pgm"
+	done > "$TMP/$r.txt"
+	awk -v r=$r '
+		/^Wall time/ { if (best=="" || $3<best) best = $3 }
+		/^Reorder: every/ { reorder = $7 }
+		/^Scan cache misses: [0-9]/ { if (misses=="" || $4<misses) misses = $4 }
+		END {
+			printf "reorder %s: best wall time %.3f s", r, best
+			if (reorder!="") printf ", reordering %.3f s", reorder/'$N'
+			if (misses!="") printf ", scan cache misses %d", misses
+			printf "\n"
+		}' "$TMP/$r.txt"
+	H=$(grep "^State hash" "$TMP/$r.txt" | sort -u)
+	if [ "$H" != "$(grep "^State hash" "$TMP/0.txt" | sort -u)" ]; then
+		echo "reorder $r: the state hash differs ($H)"
+		FAILED=1
+	fi
+done
+
+rm -rf "$TMP"
+exit $FAILED
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# sampling.sh:
+#
+# Runs the bidirectional RRT models on both bundled maps with the samples
+# of step 1 drawn by random() (the models as they are), uniform(), goal()
+# towards the root and towards the newest node of the other tree, halton(),
+# sobol(), random_free() over the free cells of the map and over the cells
+# connected to the roots, and prints the steps to halt over a number of
+# seeds, in the deterministic mode with 1 thread.
+#
+# Usage: benchmarks/sampling.sh [seeds] [bias] [generator]
+#
+#   seeds      seeds 1..seeds per sampler (default 20)
+#   bias       probability of goal() (default 0.1)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# Run it from the repository root, it needs pgm.c and the models. The
+# simulator is written to simulator.c in the current directory.
+#
+
+N=${1:-20}
+BIAS=${2:-0.1}
+GEN=${3:-./renpsm_openmp}
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_sampling.$$
+mkdir -p "$TMP"
+
+# Step 1 of the model with the given four right-hand sides
+sampler()
+{
+	sed -e "s/X{1,mem} <- random(1,p)/X{1,mem} <- $1/" -e "s/X{2,mem} <- random(1,q)/X{2,mem} <- $2/" \
+	    -e "s/X{3,mem} <- random(1,p)/X{3,mem} <- $3/" -e "s/X{4,mem} <- random(1,q)/X{4,mem} <- $4/" "$MODEL"
+}
+
+for m in 1 2; do
+	MODEL=birrt_renpsm_test$m.pli
+	if [ $m = 1 ]; then MAP=map.pgm; else MAP=office.pgm; fi
+	for s in random uniform goal_root goal_newest halton sobol free reachable; do
+		case $s in
+			random) cp "$MODEL" "$TMP/model.pli" ;;
+			uniform) sampler "uniform(1,p)" "uniform(1,q)" "uniform(1,p)" "uniform(1,q)" > "$TMP/model.pli" ;;
+			goal_root) sampler "goal($BIAS,1,p,x1)" "goal($BIAS,1,q,y1)" "goal($BIAS,1,p,x0)" "goal($BIAS,1,q,y0)" > "$TMP/model.pli" ;;
+			goal_newest) sampler "goal($BIAS,1,p,Z{3,mem})" "goal($BIAS,1,q,Z{4,mem})" \
+			  "goal($BIAS,1,p,Z{1,mem})" "goal($BIAS,1,q,Z{2,mem})" > "$TMP/model.pli" ;;
+			halton) sampler "halton(1,1,p)" "halton(2,1,q)" "halton(3,1,p)" "halton(4,1,q)" > "$TMP/model.pli" ;;
+			sobol) sampler "sobol(1,1,p)" "sobol(2,1,q)" "sobol(3,1,p)" "sobol(4,1,q)" > "$TMP/model.pli" ;;
+			free) sampler "random_free(1,1,-1,-1)" "random_free(2,1,-1,-1)" "random_free(1,2,-1,-1)" \
+			  "random_free(2,2,-1,-1)" > "$TMP/model.pli" ;;
+			reachable) sampler "random_free(1,1,x0,y0)" "random_free(2,1,x0,y0)" "random_free(1,2,x1,y1)" \
+			  "random_free(2,2,x1,y1)" > "$TMP/model.pli" ;;
+		esac
+		"$GEN" < "$TMP/model.pli" > /dev/null || exit 1
+		$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/sim" || exit 1
+		for i in $(seq 1 $N); do
+			"$TMP/sim" --deterministic -t 1 -r $i -m "$MAP" -o "$TMP/out.pgm" | grep "^Steps"
+		done | sort -n -k 2 | awk -v s=$s -v map=$MAP '
+			{ steps[NR] = $2; sum += $2 }
+			END {
+				n = NR
+				printf "%s %s: mean %.0f, median %d, max %d steps over %d seeds\n", map, s, sum/n, steps[int((n+1)/2)], steps[n], n
+			}'
+	done
+done
+
+rm -rf "$TMP"
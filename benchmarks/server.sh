@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# server.sh:
+#
+# Compares the latency of a query answered by a new simulator process
+# with the latency of the same query sent to a simulator in server mode
+# (--server=socket), which loads the map and allocates the arrays once.
+# Both run the first bidirectional RRT model with seeds 1..n. Before that
+# it checks that a request id with JSON escapes (quote, backslash, control
+# characters) is written back escaped, in an answer and in an error, and
+# that negative, overflowing or trailing-garbage numbers are refused.
+#
+# Usage: benchmarks/server.sh [requests] [threads] [generator]
+#
+#   requests   number of queries (default 50)
+#   threads    number of threads (default 1)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# Run it from the repository root, it needs the model, the map and pgm.c.
+# The simulator is written to simulator.c in the current directory.
+#
+
+N=${1:-50}
+T=${2:-1}
+GEN=${3:-./renpsm_openmp}
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_server.$$
+mkdir -p "$TMP"
+
+"$GEN" < birrt_renpsm_test1.pli > /dev/null || exit 1
+$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/test1" || exit 1
+$CC -O2 benchmarks/server_latency.c -o "$TMP/server_latency" || exit 1
+
+printf '%s\n' '{"id":"q\"1\\2\n\u0001","seed":1,"steps":10}' '{"id":"e\"1","start":[0,0]}' |
+	"$TMP/test1" --server -t 1 -m map.pgm > "$TMP/answers"
+if ! grep -F -q '{"id":"q\"1\\2\n\u0001","status":"ok",' "$TMP/answers" ||
+   ! grep -F -q '{"id":"e\"1","status":"error",' "$TMP/answers"; then
+	echo "Escaped request id: FAILED"
+	cat "$TMP/answers"
+	rm -rf "$TMP"
+	exit 1
+fi
+echo "Escaped request id: OK"
+
+printf '%s\n' '{"id":"s1","seed":-1}' '{"id":"s2","seed":"42abc"}' '{"id":"s3","seed":99999999999999999999}' \
+	'{"id":"s4","seed":4294967296}' '{"id":"s5","steps":-5}' '{"id":"s6","steps":"10x"}' '{"id":"s7","start":[1.5,2]}' \
+	'{"id":"s8","seed":"4294967295","steps":10}' |
+	"$TMP/test1" --server -t 1 -m map.pgm > "$TMP/answers"
+if [ $(grep -c '"status":"error"' "$TMP/answers") != 7 ] ||
+   ! grep -F -q '{"id":"s8","status":"ok","halted":false,"seed":4294967295,' "$TMP/answers"; then
+	echo "Malformed numbers: FAILED"
+	cat "$TMP/answers"
+	rm -rf "$TMP"
+	exit 1
+fi
+echo "Malformed numbers: OK"
+echo
+
+echo "Process per query ($N queries, threads $T)"
+t0=$(date +%s.%N)
+for s in $(seq 1 $N); do
+	"$TMP/test1" -t $T -r $s -m map.pgm -o "$TMP/out.pgm" > /dev/null
+done
+t1=$(date +%s.%N)
+echo "Mean (ms): $(echo "$t0 $t1 $N" | awk '{printf "%.3f", ($2-$1)/$3*1000}')"
+echo
+
+echo "Server mode ($N queries, threads $T)"
+"$TMP/test1" --server="$TMP/socket" -t $T -m map.pgm &
+PID=$!
+while [ ! -S "$TMP/socket" ]; do sleep 0.1; done
+"$TMP/server_latency" "$TMP/socket" $N
+kill $PID
+
+rm -rf "$TMP"
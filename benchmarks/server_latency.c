@@ -0,0 +1,118 @@
+/*
+ * server_latency.c:
+ *
+ * Latency client for the server mode of the generated simulators
+ * (./simulator --server=socket). Sends requests with seeds 1..n one after
+ * the other on a Unix domain socket and prints the distribution of the
+ * round-trip times and of the simulation times reported by the server.
+ *
+ * Usage: server_latency socket [requests] [steps] [start_x start_y goal_x goal_y]
+ *
+ * Build: gcc -O2 benchmarks/server_latency.c -o server_latency
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+double seconds()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+int compare(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x<y ? -1 : x>y;
+}
+
+void report(const char* name, double* values, int n)
+{
+	double sum = 0;
+	for (int i=0;i<n;i++) {
+		sum += values[i];
+	}
+	qsort(values,n,sizeof(double),compare);
+	printf("%s (ms): min %.3f median %.3f p95 %.3f max %.3f mean %.3f\n",name,
+	  values[0]*1e3,values[n/2]*1e3,values[(int)(n*0.95)]*1e3,values[n-1]*1e3,sum/n*1e3);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc<2) {
+		fprintf(stderr,"Usage: %s socket [requests] [steps] [start_x start_y goal_x goal_y]\n",argv[0]);
+		return 1;
+	}
+	int requests = argc>2 ? atoi(argv[2]) : 100;
+	int steps = argc>3 ? atoi(argv[3]) : 0;
+	char points[128] = "";
+	if (argc>7) {
+		snprintf(points,sizeof(points),",\"start\":[%s,%s],\"goal\":[%s,%s]",argv[4],argv[5],argv[6],argv[7]);
+	}
+	struct sockaddr_un addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path,sizeof(addr.sun_path),"%s",argv[1]);
+	int fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if (fd<0 || connect(fd,(struct sockaddr*)&addr,sizeof(addr))!=0) {
+		perror("Cannot connect");
+		return 1;
+	}
+	FILE* in = fdopen(fd,"r");
+	FILE* out = fdopen(dup(fd),"w");
+	double* latency = (double*)malloc(sizeof(double)*requests);
+	double* simulation = (double*)malloc(sizeof(double)*requests);
+	char* line = NULL;
+	size_t capacity = 0;
+	int halted = 0;
+	for (int i=0;i<requests;i++) {
+		double t0 = seconds();
+		fprintf(out,"{\"id\":%d,\"seed\":%d,\"steps\":%d%s}\n",i,i+1,steps,points);
+		fflush(out);
+		if (getline(&line,&capacity,in)<=0) {
+			fprintf(stderr,"Connection closed\n");
+			return 1;
+		}
+		latency[i] = seconds()-t0;
+		char* time = strstr(line,"\"time\":");
+		if (time==NULL) {
+			fprintf(stderr,"Bad answer: %s",line);
+			return 1;
+		}
+		simulation[i] = atof(time+7);
+		halted += strstr(line,"\"halted\":true")!=NULL;
+	}
+	printf("Requests: %d (%d halted)\n",requests,halted);
+	report("Round trip",latency,requests);
+	report("Simulation",simulation,requests);
+	free(line);
+	free(latency);
+	free(simulation);
+	fclose(out);
+	fclose(in);
+	return 0;
+}
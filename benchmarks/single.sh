@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# single.sh:
+#
+# Validates the single precision mode (renpsm_openmp -f) against the
+# double build: both simulators run the model with seeds 1..n in the
+# deterministic mode, and the final state hashes and the output trees
+# must be the same. Prints the mean wall time of each build.
+#
+# Usage: benchmarks/single.sh [model] [map] [seeds] [threads] [generator]
+#
+#   model      P-Lingua model (default birrt_renpsm_test2.pli)
+#   map        obstacle map (default office.pgm)
+#   seeds      number of seeds (default 10)
+#   threads    number of threads (default 1)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# Run it from the repository root, it needs pgm.c. The simulators are
+# written to simulator.c in the current directory.
+#
+
+MODEL=${1:-birrt_renpsm_test2.pli}
+MAP=${2:-office.pgm}
+N=${3:-10}
+T=${4:-1}
+GEN=${5:-./renpsm_openmp}
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_single.$$
+mkdir -p "$TMP"
+
+"$GEN" < "$MODEL" > /dev/null || exit 1
+$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/double" || exit 1
+"$GEN" -f < "$MODEL" > /dev/null || exit 1
+$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/single" || exit 1
+
+FAILED=0
+for s in $(seq 1 $N); do
+	for b in double single; do
+		"$TMP/$b" --deterministic -t $T -r $s -m "$MAP" -o "$TMP/$b.pgm" > "$TMP/$b.txt" || exit 1
+		grep "^Wall" "$TMP/$b.txt" | awk '{print $3}' >> "$TMP/$b.times"
+	done
+	H0=$(grep "^State hash" "$TMP/double.txt")
+	H1=$(grep "^State hash" "$TMP/single.txt")
+	if [ "$H0" != "$H1" ] || ! cmp -s "$TMP/double.pgm" "$TMP/single.pgm"; then
+		echo "Seed $s: the trees differ ($H0, single $H1)"
+		FAILED=1
+	fi
+done
+[ $FAILED = 0 ] && echo "Seeds 1-$N: same trees and state hashes"
+for b in double single; do
+	awk -v b=$b '{ sum += $1 } END { printf "%s: mean wall time %.3f s\n", b, sum/NR }' "$TMP/$b.times"
+done
+
+rm -rf "$TMP"
+exit $FAILED
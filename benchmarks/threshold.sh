@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# threshold.sh:
+#
+# Runs a model with every loop over a label list sequential
+# (--threshold=2147483647), always parallel (--threshold=0), with the
+# thresholds calibrated during the run and with the thresholds of a
+# profile written by a first run (--profile), in the deterministic mode,
+# and prints the best wall time of each policy. The state hashes must be
+# the same and the first run must calibrate at least one loop.
+#
+# The loops of birrt_renpsm_test2.pli are replaced by the broadcast rows
+# and the 2-d tree, so by default the model is the test 2 with two more
+# rules over the trees at step 3, which run as loops.
+#
+# Usage: benchmarks/threshold.sh [threads] [runs] [model] [map] [generator]
+#
+#   threads    number of threads (default 4)
+#   runs       runs per policy (default 5)
+#   model      P-Lingua model (default the test 2 with two loops)
+#   map        obstacle map (default office.pgm)
+#   generator  path to renpsm_openmp (default ./renpsm_openmp)
+#
+# Run it from the repository root, it needs pgm.c. The simulator is
+# written to simulator.c in the current directory.
+#
+
+T=${1:-4}
+N=${2:-5}
+MODEL=$3
+MAP=${4:-office.pgm}
+GEN=${5:-./renpsm_openmp}
+CC=${CC:-gcc}
+TMP=${TMPDIR:-/tmp}/renpsm_threshold.$$
+mkdir -p "$TMP"
+
+if [ -z "$MODEL" ]; then
+	MODEL="$TMP/loops.pli"
+	sed -e '/alpha{3} : h in skin;/a\
+	W{h} <- euclideanDistance(Y{1,h},Y{2,h},x1,y1), alpha{3} : h in ha;\
+	V{h} <- round(Y{1,h}+random(0,3)), alpha{3} : h in hb;' birrt_renpsm_test2.pli > "$MODEL"
+fi
+"$GEN" < "$MODEL" > /dev/null || exit 1
+$CC simulator.c pgm.c -lm -O3 -fopenmp -o "$TMP/sim" || exit 1
+"$TMP/sim" --deterministic -t $T -r 42 -m "$MAP" -o "$TMP/out.pgm" --profile="$TMP/profile" > "$TMP/first.txt"
+C=$(awk '/^Profile:/ { print $(NF-1) }' "$TMP/first.txt")
+echo "First run: ${C:-0} loops calibrated"
+FAILED=0
+if [ "${C:-0}" -eq 0 ]; then
+	echo "no loop was calibrated"
+	FAILED=1
+fi
+for p in sequential parallel calibrated profile; do
+	case $p in
+		sequential) OPT=--threshold=2147483647 ;;
+		parallel) OPT=--threshold=0 ;;
+		calibrated) OPT= ;;
+		profile) OPT=--profile="$TMP/profile" ;;
+	esac
+	for i in $(seq 1 $N); do
+		"$TMP/sim" --deterministic -t $T -r 42 -m "$MAP" -o "$TMP/out.pgm" $OPT
+	done > "$TMP/$p.txt"
+	awk -v p=$p '
+		/^Wall time/ { if (best=="" || $3<best) best = $3 }
+		/^Profile:/ { read = $4 }
+		END {
+			printf "%s: best wall time %.3f s", p, best
+			if (read!="") printf ", %s loops read from the profile", read
+			printf "\n"
+		}' "$TMP/$p.txt"
+	H=$(grep "^State hash" "$TMP/$p.txt" | sort -u)
+	if [ "$H" != "$(grep "^State hash" "$TMP/sequential.txt" | sort -u)" ]; then
+		echo "$p: the state hash differs ($H)"
+		FAILED=1
+	fi
+done
+
+rm -rf "$TMP"
+exit $FAILED
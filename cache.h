@@ -0,0 +1,241 @@
+/*
+ * cache.h:
+ *
+ * This file contains the compile-and-cache driver for the generated
+ * RENPSM simulators.
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "renpsm_parser.h"
+#include "gen_c.h"
+#include "hash.h"
+
+/*
+ * The simulator generated for a model is compiled once and kept in a
+ * cache directory, named after a hash of its source (which holds the
+ * whole rolled-out model), of the files it is built with (pgm.c and every
+ * local header it includes, followed from its #include lines) and of the
+ * compiler command. Later runs of the same model reuse the binary, or
+ * load it as a shared object and call its main() in this process.
+ *
+ * Environment: CC (gcc), RENPSM_CFLAGS (-O3 -fopenmp), RENPSM_CACHE
+ * (.renpsm_cache) and RENPSM_INCLUDE (., where functions.h and pgm.c are).
+ */
+
+/* Compiled with the simulator; the headers are found from the #include lines */
+char* cache_sources[] = {"pgm.c"};
+
+#define CACHE_MAX_SOURCES 64
+
+typedef struct CacheSources
+{
+	char names[CACHE_MAX_SOURCES][64];
+	int size;
+} CACHE_SOURCES;
+
+char* cache_env(const char* name, char* value)
+{
+	char* env = getenv(name);
+	return env!=NULL && env[0]!=0 ? env : value;
+}
+
+double cache_seconds()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+uint64_t cache_hash_file(uint64_t hash, const char* dir, const char* file, CACHE_SOURCES* seen);
+
+/* Hashes each file of the "name" includes of text once, and the files they include */
+uint64_t cache_hash_includes(uint64_t hash, const char* dir, const char* text, size_t size, CACHE_SOURCES* seen)
+{
+	const char* end = text+size;
+	for (const char* p=text;p<end;p++) {
+		if ((p!=text && p[-1]!='\n') || end-p<10 || strncmp(p,"#include \"",10)!=0) {
+			continue;
+		}
+		const char* name = p+10;
+		const char* quote = memchr(name,'"',end-name);
+		if (quote==NULL || quote==name || quote-name>=64) {
+			continue;
+		}
+		int found = 0;
+		for (int i=0;i<seen->size && !found;i++) {
+			found = strlen(seen->names[i])==(size_t)(quote-name) && strncmp(seen->names[i],name,quote-name)==0;
+		}
+		if (found) {
+			continue;
+		}
+		if (seen->size==CACHE_MAX_SOURCES) {
+			fprintf(stderr,"Cache: more than %d included files\n",CACHE_MAX_SOURCES);
+			exit(1);
+		}
+		char* copy = seen->names[seen->size++];
+		memcpy(copy,name,quote-name);
+		copy[quote-name] = 0;
+		hash = cache_hash_file(hash,dir,copy,seen);
+	}
+	return hash;
+}
+
+uint64_t cache_hash_file(uint64_t hash, const char* dir, const char* file, CACHE_SOURCES* seen)
+{
+	char path[1024];
+	char buffer[65536];
+	size_t bytes;
+	char* text = NULL;
+	size_t size = 0;
+	snprintf(path,sizeof(path),"%s/%s",dir,file);
+	FILE* fp = fopen(path,"rb");
+	if (fp==NULL) {
+		fprintf(stderr,"Cache: cannot read %s\n",path);
+		exit(1);
+	}
+	FILE* out = open_memstream(&text,&size);
+	while ((bytes = fread(buffer,1,sizeof(buffer),fp))>0) {
+		fwrite(buffer,1,bytes,out);
+	}
+	fclose(fp);
+	fclose(out);
+	hash = hash_bytes(hash,file,strlen(file)+1);
+	hash = hash_bytes(hash,text,size);
+	hash = cache_hash_includes(hash,dir,text,size,seen);
+	free(text);
+	return hash;
+}
+
+/* Compiles into a temporary file renamed at the end, so concurrent misses do not see half-written binaries */
+void cache_compile(const char* source, size_t size, const char* binary, const char* cc, const char* cflags,
+	const char* include, int shared)
+{
+	char path[1100];
+	char tmp[1100];
+	char command[4096];
+	if (mkdir(cache_env("RENPSM_CACHE",".renpsm_cache"),0755)!=0 && errno!=EEXIST) {
+		perror("Cache: cannot create the cache directory");
+		exit(1);
+	}
+	snprintf(path,sizeof(path),"%s.c",binary);
+	FILE* fp = fopen(path,"w");
+	if (fp==NULL || fwrite(source,1,size,fp)!=size) {
+		fprintf(stderr,"Cache: cannot write %s\n",path);
+		exit(1);
+	}
+	fclose(fp);
+	snprintf(tmp,sizeof(tmp),"%s.%d",binary,(int)getpid());
+	snprintf(command,sizeof(command),"%s %s %s-I\"%s\" -o \"%s\" \"%s\" \"%s/pgm.c\" -lm",
+	  cc,cflags,shared ? "-shared -fPIC -Wl,-Bsymbolic " : "",include,tmp,path,include);
+	if (system(command)!=0) {
+		fprintf(stderr,"Cache: compilation failed: %s\n",command);
+		unlink(tmp);
+		exit(1);
+	}
+	if (rename(tmp,binary)!=0) {
+		perror("Cache: cannot store the simulator");
+		exit(1);
+	}
+}
+
+/*
+ * Runs the simulator of the model with the given options (argv[0] is
+ * replaced by the binary), compiling it first on a cache miss.
+ */
+int run_cached(int argc, char* argv[], DEFINITIONS* defs, int shared, int timing)
+{
+	char* cc = cache_env("CC","gcc");
+	char* cflags = cache_env("RENPSM_CFLAGS","-O3 -fopenmp");
+	char* dir = cache_env("RENPSM_CACHE",".renpsm_cache");
+	char* include = cache_env("RENPSM_INCLUDE",".");
+	char* source = NULL;
+	size_t size = 0;
+	double t0 = cache_seconds();
+	FILE* fp = open_memstream(&source,&size);
+	generate_c_simulator(fp,defs);
+	fclose(fp);
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	hash = hash_bytes(hash,source,size);
+	CACHE_SOURCES seen;
+	seen.size = 0;
+	hash = cache_hash_includes(hash,include,source,size,&seen);
+	for (int i=0;i<(int)(sizeof(cache_sources)/sizeof(cache_sources[0]));i++) {
+		hash = cache_hash_file(hash,include,cache_sources[i],&seen);
+	}
+	hash = hash_bytes(hash,cc,strlen(cc)+1);
+	hash = hash_bytes(hash,cflags,strlen(cflags)+1);
+	hash = hash_bytes(hash,&shared,sizeof(int));
+	char binary[1024];
+	snprintf(binary,sizeof(binary),"%s/sim-%016llx%s",dir,(unsigned long long)hash,shared ? ".so" : "");
+	double t1 = cache_seconds();
+	int hit = access(binary,R_OK)==0;
+	if (!hit) {
+		cache_compile(source,size,binary,cc,cflags,include,shared);
+	}
+	free(source);
+	double t2 = cache_seconds();
+	if (timing) {
+		fprintf(stderr,"Generate: %f seconds\n",t1-t0);
+		fprintf(stderr,"Cache: %s %s\n",hit ? "hit" : "miss",binary);
+		fprintf(stderr,"Compile: %f seconds\n",t2-t1);
+	}
+	argv[0] = binary;
+	fflush(stdout);
+	if (!shared) {
+		execv(binary,argv);
+		perror("Cache: cannot run the simulator");
+		return 1;
+	}
+	void* library = dlopen(binary,RTLD_NOW | RTLD_LOCAL);
+	if (library==NULL) {
+		fprintf(stderr,"Cache: %s\n",dlerror());
+		return 1;
+	}
+	int (*simulator)(int, char**) = (int (*)(int, char**))dlsym(library,"main");
+	if (simulator==NULL) {
+		fprintf(stderr,"Cache: %s\n",dlerror());
+		return 1;
+	}
+	optind = 1;
+	int status = simulator(argc,argv);
+	fflush(stdout);
+	return status;
+}
+
+#endif
@@ -34,16 +34,143 @@
 #define _FUNCTIONS_H_
 
 #include <ctype.h>
+#include <getopt.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <math.h>
 
 #include "pgm.h"
+#include "hash.h"
+#include "reductions.h"
+#include "server.h"
+#include "affinity.h"
+#include "alloc.h"
+#include "reorder.h"
+#include "schedule.h"
+#include "kdtree.h"
+#include "metrics.h"
 
 PGM *map;
 
+/* 
+ * Deterministic mode: random numbers are drawn from a counter-based
+ * generator keyed by (seed, step, rule, membrane) instead of the shared
+ * rand() state, so the sequence does not depend on thread scheduling.
+ */
+int deterministic = 0;
+unsigned int rng_seed = 0;
+uint64_t rng_state = 0;
+#pragma omp threadprivate(rng_state)
+
+uint64_t splitmix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+void rng_key_seed(unsigned int seed, int rule, int step, int membrane)
+{
+	rng_state = splitmix64(splitmix64(splitmix64(seed ^ ((uint64_t)rule << 32)) ^ (uint64_t)step) ^ (uint64_t)membrane);
+}
+
+void rng_key(int rule, int step, int membrane)
+{
+	rng_key_seed(rng_seed,rule,step,membrane);
+}
+
+uint64_t rng_next()
+{
+	rng_state = splitmix64(rng_state);
+	return rng_state;
+}
+
+int append(int* size)
+{
+	int index;
+	#pragma omp atomic capture
+	index = (*size)++;
+	return index;
+}
+
+#define LABEL_UNSET INT32_MIN
+#define FLAG_UNSET UINT8_MAX
+
+/* NaN, infinities and values out of range are unset, as they cannot be converted */
+int32_t to_label(double x)
+{
+	double r = round(x);
+	return r>INT32_MIN && r<=INT32_MAX ? (int32_t)r : LABEL_UNSET;
+}
+
+uint8_t to_flag(double x)
+{
+	double r = round(x);
+	return r>=0 && r<FLAG_UNSET ? (uint8_t)r : FLAG_UNSET;
+}
+
+int label_unset(int32_t x)
+{
+	return x==LABEL_UNSET;
+}
+
+int flag_unset(uint8_t x)
+{
+	return x==FLAG_UNSET;
+}
+
+double from_label(int32_t x)
+{
+	return x==LABEL_UNSET ? NAN : x;
+}
+
+double from_flag(uint8_t x)
+{
+	return x==FLAG_UNSET ? NAN : x;
+}
+
+int32_t flag_label(uint8_t x)
+{
+	return x==FLAG_UNSET ? LABEL_UNSET : x;
+}
+
+/*
+ * Integer arithmetic of labels: an unset operand, or a result out of the
+ * int32_t range, gives LABEL_UNSET, as NaN propagates in double.
+ */
+int32_t label_result(int64_t x)
+{
+	return x<=INT32_MIN || x>INT32_MAX ? LABEL_UNSET : (int32_t)x;
+}
+
+int32_t label_add(int32_t a, int32_t b)
+{
+	return a==LABEL_UNSET || b==LABEL_UNSET ? LABEL_UNSET : label_result((int64_t)a+b);
+}
+
+int32_t label_sub(int32_t a, int32_t b)
+{
+	return a==LABEL_UNSET || b==LABEL_UNSET ? LABEL_UNSET : label_result((int64_t)a-b);
+}
+
+int32_t label_mul(int32_t a, int32_t b)
+{
+	return a==LABEL_UNSET || b==LABEL_UNSET ? LABEL_UNSET : label_result((int64_t)a*b);
+}
+
+void fill_label(int32_t* values, int size)
+{
+	for (int i=0;i<size;i++) {
+		values[i] = LABEL_UNSET;
+	}
+}
+
 double function_round(double x)
 {
 	return round(x);
@@ -60,39 +187,205 @@ double function_random(int min_num, int max_num)
         low_num = max_num + 1; 
         hi_num = min_num;
     }
-    result = (rand() % (hi_num - low_num)) + low_num;
+    if (deterministic) {
+        result = (rng_next() % (hi_num - low_num)) + low_num;
+    } else {
+        result = (rand() % (hi_num - low_num)) + low_num;
+    }
     return result;
 }
 
-double function_euclideanDistance(double x0, double y0, double x1, double y1)
+/* Library mode: always drawn from the keyed generator */
+double function_random_keyed(int min_num, int max_num)
 {
-	return sqrt( (x0-x1)*(x0-x1) + (y0-y1)*(y0-y1));
+	int low_num = min_num < max_num ? min_num : max_num + 1;
+	int hi_num = min_num < max_num ? max_num + 1 : min_num;
+	return (int)(rng_next() % (hi_num - low_num)) + low_num;
+}
+
+/*
+ * Sampling functions. random() keeps its modulo draw, so that a seed gives
+ * the same tree as before (the bias is below 1e-6 for a map side); uniform()
+ * rejects the draws above the last multiple of the range instead.
+ */
+int sample_uniform(int keyed, int min_num, int max_num)
+{
+	int low_num = min_num < max_num ? min_num : max_num + 1;
+	int hi_num = min_num < max_num ? max_num + 1 : min_num;
+	if (hi_num<=low_num) {
+		return low_num;
+	}
+	uint64_t n = (uint64_t)(hi_num - low_num);
+	uint64_t r;
+	if (keyed) {
+		do {
+			r = rng_next();
+		} while (r < -n % n);
+	} else {
+		uint64_t limit = ((uint64_t)RAND_MAX + 1) / n * n;
+		do {
+			r = (uint64_t)rand();
+		} while (r >= limit);
+	}
+	return (int)(r % n) + low_num;
+}
+
+double function_uniform(int min_num, int max_num)
+{
+	return sample_uniform(deterministic,min_num,max_num);
+}
+
+double function_uniform_keyed(int min_num, int max_num)
+{
+	return sample_uniform(1,min_num,max_num);
 }
 
-double function_min(double** values, int* indexes, int size_indexes)
+/*
+ * goal(b,min,max,target): target with probability b, otherwise uniform(min,max).
+ * The coin is keyed by (seed, step) only, so the coordinates drawn in a step
+ * either all take their targets or are all uniform. A target outside the
+ * range (unset, or a node not created yet) is never taken.
+ */
+double function_goal(unsigned int seed, int step, int keyed, double b, int min_num, int max_num, double target)
+{
+	int low_num = min_num < max_num ? min_num : max_num;
+	int hi_num = min_num < max_num ? max_num : min_num;
+	double coin = (splitmix64(splitmix64(seed ^ 0x676F616CULL) ^ (uint64_t)step) >> 11) * 0x1.0p-53;
+	if (coin < b && target >= low_num && target <= hi_num) {
+		return round(target);
+	}
+	return sample_uniform(keyed,min_num,max_num);
+}
+
+/*
+ * Low-discrepancy samples. Every step that samples takes the next index of
+ * the sequence, shared by the calls of the step; cycle packs the last step
+ * and its index, and is advanced lock-free by the first call of a step.
+ */
+#define SAMPLE_CYCLE_RESET 0xFFFFFFFF00000000ULL
+#define HALTON_DIMENSIONS 8
+#define SOBOL_DIMENSIONS 4
+
+uint32_t sample_index(uint64_t* cycle, int step)
 {
-	double min_val = values[indexes[0]][0];
-	#pragma omp parallel for reduction(min : min_val)
-	for (int i=1;i<size_indexes;i++) {
-		if (values[indexes[i]][0]<min_val) {
-			min_val = values[indexes[i]][0];
+	uint64_t old = __atomic_load_n(cycle,__ATOMIC_RELAXED);
+	while ((uint32_t)(old >> 32) != (uint32_t)step) {
+		uint64_t next = ((uint64_t)(uint32_t)step << 32) | (uint32_t)(old + 1);
+		if (__atomic_compare_exchange_n(cycle,&old,next,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {
+			return (uint32_t)next;
 		}
 	}
-	return min_val;
+	return (uint32_t)old;
 }
 
-double function_arg_min(double** values, int* indexes, int size_indexes)
+/* A point u in [0,1) scaled to the integers of the range, as random() */
+int sample_scale(double u, int min_num, int max_num)
 {
-	double min_val = values[indexes[0]][0];
-	double min_arg = indexes[0];
-	#pragma omp parallel for reduction(min : min_val)
-	for (int i=1;i<size_indexes;i++) {
-		if (values[indexes[i]][0]<min_val) {
-			min_val = values[indexes[i]][0];
-			min_arg = indexes[i];
+	int low_num = min_num < max_num ? min_num : max_num + 1;
+	int hi_num = min_num < max_num ? max_num + 1 : min_num;
+	int x = low_num + (int)(u * (hi_num - low_num));
+	return x < hi_num ? x : hi_num - 1;
+}
+
+/* Dimension dim (1..8) of the Halton sequence, rotated by the seed */
+double function_halton(unsigned int seed, int step, uint64_t* cycle, int dim, int min_num, int max_num)
+{
+	static const int primes[HALTON_DIMENSIONS] = {2,3,5,7,11,13,17,19};
+	int base = primes[(dim < 1 ? 1 : dim > HALTON_DIMENSIONS ? HALTON_DIMENSIONS : dim) - 1];
+	uint32_t i = sample_index(cycle,step);
+	double u = 0;
+	double f = 1.0 / base;
+	for (;i>0;i/=base,f/=base) {
+		u += f * (i % base);
+	}
+	u += (splitmix64(seed ^ ((uint64_t)dim << 32)) >> 11) * 0x1.0p-53;
+	return sample_scale(u - floor(u),min_num,max_num);
+}
+
+/*
+ * Dimension dim (1..4) of the Sobol sequence (direction numbers of Joe and
+ * Kuo), with a digital shift by the seed.
+ */
+double function_sobol(unsigned int seed, int step, uint64_t* cycle, int dim, int min_num, int max_num)
+{
+	static const int degree[SOBOL_DIMENSIONS] = {0,1,2,3};
+	static const int poly[SOBOL_DIMENSIONS] = {0,0,1,1};
+	static const uint32_t initial[SOBOL_DIMENSIONS][3] = {{0,0,0},{1,0,0},{1,3,0},{1,3,1}};
+	int d = (dim < 1 ? 1 : dim > SOBOL_DIMENSIONS ? SOBOL_DIMENSIONS : dim) - 1;
+	uint32_t m[33];
+	uint32_t i = sample_index(cycle,step);
+	uint32_t x = 0;
+	int s = degree[d];
+	for (int k=1;k<=32;k++) {
+		if (s==0) {
+			m[k] = 1;
+		} else if (k<=s) {
+			m[k] = initial[d][k-1];
+		} else {
+			m[k] = m[k-s] ^ (m[k-s] << s);
+			for (int j=1;j<s;j++) {
+				if ((poly[d] >> (s-1-j)) & 1) {
+					m[k] ^= m[k-j] << j;
+				}
+			}
+		}
+		if ((i >> (k-1)) & 1) {
+			x ^= m[k] << (32-k);
 		}
 	}
-	return min_arg;
+	x ^= (uint32_t)splitmix64(seed ^ ((uint64_t)(dim + 16) << 32));
+	return sample_scale(x * 0x1.0p-32,min_num,max_num);
+}
+
+/*
+ * random_free(axis,stream,x,y): coordinate axis (1 for x, 2 for y) of a
+ * free cell of the map drawn in O(1) from its table, restricted to the
+ * cells connected to (x,y) when it is a free cell. As goal(), the cell
+ * is keyed by (seed, step, stream), so both coordinates of a stream come
+ * from the same cell.
+ */
+double function_random_free_map(const PGM* pgm, unsigned int seed, int step, int axis, int stream, double x, double y)
+{
+	const FREE_CELLS* table = pgm_free_cells(pgm,isnan(x) ? -1 : (int)round(x),isnan(y) ? -1 : (int)round(y));
+	if (table->size==0) {
+		return NAN;
+	}
+	uint64_t n = (uint64_t)table->size;
+	uint64_t r = splitmix64(splitmix64(seed ^ 0x66726565ULL ^ ((uint64_t)(uint32_t)stream << 32)) ^ (uint64_t)step);
+	while (r < -n % n) {
+		r = splitmix64(r);
+	}
+	int cell = table->cells[r % n];
+	return axis==1 ? cell % pgm->width : cell / pgm->width;
+}
+
+double function_random_free(unsigned int seed, int step, int axis, int stream, double x, double y)
+{
+	return function_random_free_map(map,seed,step,axis,stream,x,y);
+}
+
+double function_euclideanDistance(double x0, double y0, double x1, double y1)
+{
+	return sqrt( (x0-x1)*(x0-x1) + (y0-y1)*(y0-y1));
+}
+
+double function_squaredDistance(double x0, double y0, double x1, double y1)
+{
+	return (x0-x1)*(x0-x1) + (y0-y1)*(y0-y1);
+}
+
+/* Single precision kernels (-f), exact for the bounded integers they get */
+float function_squaredDistance_f(float x0, float y0, float x1, float y1)
+{
+	return (x0-x1)*(x0-x1) + (y0-y1)*(y0-y1);
+}
+
+float pack_single(double value, double bound, int* exact)
+{
+	if (fabs(value)>bound) {
+		*exact = 0;
+	}
+	return (float)value;
 }
 
 double function_if(double cond, double yes, double no)
@@ -117,45 +410,198 @@ double function_qt(double a, double b)
 	return x/y;
 }
 
-double function_collision(double a, double b, double u0, double u1, double delta)
+double function_collision_map(const PGM* pgm, double a, double b, double u0, double u1, double delta)
 {
 	int x0 = (int)round(a);
 	int y0 = (int)round(b);
 	int x1 = (int)round(a+u0*delta);
 	int y1 = (int)round(b+u1*delta);
-	return detect_obstacle(map,x0,y0,x1,y1,250);
+	return detect_obstacle(pgm,x0,y0,x1,y1,250);
+}
+
+double function_collision(double a, double b, double u0, double u1, double delta)
+{
+	return function_collision_map(map,a,b,u0,u1,delta);
 }
 
-void parse_input(int argc, char* argv[], int *debug, int *threads, int *steps, char *map_file, char *out_file, unsigned int *seed)
+/*
+ * extend(x,y,u0,u1,delta,tx,ty): number of steps of length delta that the
+ * node (x,y) can take along (u0,u1) towards (tx,ty) before an obstacle, at
+ * least one (the single step of collision) and at most EXTEND_MAX_STEPS,
+ * without passing the target. A creation rule with chain(...) as the child
+ * creates a membrane per step (RRT-Connect).
+ */
+#define EXTEND_MAX_STEPS 256
+
+double function_extend_map(const PGM* pgm, double x, double y, double u0, double u1, double delta, double tx, double ty)
 {
+	if (isnan(x) || isnan(y) || isnan(u0) || isnan(u1) || !(delta>0)) {
+		return 0;
+	}
+	double steps = floor(sqrt((tx-x)*(tx-x) + (ty-y)*(ty-y))/delta);
+	int most = !(steps>=1) ? 1 : steps>EXTEND_MAX_STEPS ? EXTEND_MAX_STEPS : (int)steps;
+	return extend_free(pgm,(int)round(x),(int)round(y),u0,u1,delta,most,250);
+}
+
+double function_extend(double x, double y, double u0, double u1, double delta, double tx, double ty)
+{
+	return function_extend_map(map,x,y,u0,u1,delta,tx,ty);
+}
+
+/* Command line of the simulators and the interpreter, see parse_input */
+typedef struct
+{
+	int debug;
+	int threads;
+	int steps;
+	char map_file[64];
+	char out_file[64];
+	unsigned int seed;
+	int deterministic;
+	char expected_hash[64];
+	int server;
+	char server_socket[108];
+	int binding;
+	int allocation;
+	int reorder;
+	char profile_file[256];
+	int threshold;
+	int deadline;
+	char metrics_target[256];
+	int metrics_interval;
+} OPTIONS;
+
+void default_options(OPTIONS* options, int steps)
+{
+	memset(options,0,sizeof(OPTIONS));
+	options->threads = 4;
+	options->steps = steps;
+	strcpy(options->map_file,"office.pgm");
+	strcpy(options->out_file,"out.pgm");
+	options->seed = time(NULL);
+	options->binding = BIND_NONE;
+	options->allocation = -1;
+	options->reorder = -1;
+	options->threshold = -1;
+	options->metrics_interval = 1000;
+}
+
+void parse_input(int argc, char* argv[], OPTIONS* options)
+{
+	static struct option long_options[] = {
+		{"deterministic", optional_argument, NULL, 'D'},
+		{"server", optional_argument, NULL, 'S'},
+		{"bind", required_argument, NULL, 'B'},
+		{"alloc", required_argument, NULL, 'A'},
+		{"reorder", required_argument, NULL, 'R'},
+		{"profile", required_argument, NULL, 'P'},
+		{"threshold", required_argument, NULL, 'L'},
+		{"metrics", required_argument, NULL, 'M'},
+		{"metrics-interval", required_argument, NULL, 'I'},
+		{NULL, 0, NULL, 0}
+	};
 	int c;
-	while ((c = getopt (argc, argv, "dt:s:m:o:r:")) != -1)
+	while ((c = getopt_long (argc, argv, "dt:s:m:o:r:T:", long_options, NULL)) != -1)
     switch (c)
       {
+      case 'D':
+        options->deterministic = 1;
+        if (optarg!=NULL) {
+          int n = 0;
+          while (n<17 && isxdigit((unsigned char)optarg[n])) {
+            n++;
+          }
+          if (n!=16 || optarg[16]!=0) {
+            fprintf(stderr,"The expected hash must be 16 hex digits, as printed by --deterministic\n");
+            exit(1);
+          }
+          for (int i=0;i<16;i++) {
+            options->expected_hash[i] = tolower((unsigned char)optarg[i]);
+          }
+          options->expected_hash[16] = 0;
+        }
+        break;
+      case 'S':
+        options->server = 1;
+        if (optarg!=NULL) {
+          snprintf(options->server_socket,sizeof(options->server_socket),"%s",optarg);
+        }
+        break;
+      case 'B':
+        if (strcmp(optarg,"close")==0) {
+          options->binding = BIND_CLOSE;
+        } else if (strcmp(optarg,"spread")==0) {
+          options->binding = BIND_SPREAD;
+        } else {
+          fprintf(stderr,"Unknown binding %s, use close or spread\n",optarg);
+          exit(1);
+        }
+        break;
+      case 'A':
+        options->allocation = alloc_parse(optarg);
+        if (options->allocation<0) {
+          fprintf(stderr,"Unknown allocation %s, use malloc, aligned, thp or hugetlb\n",optarg);
+          exit(1);
+        }
+        break;
+      case 'R':
+        options->reorder = atoi(optarg);
+        if (options->reorder<0) {
+          fprintf(stderr,"The reorder interval must be 0 or a number of steps\n");
+          exit(1);
+        }
+        break;
+      case 'P':
+        snprintf(options->profile_file,sizeof(options->profile_file),"%s",optarg);
+        break;
+      case 'L':
+        options->threshold = atoi(optarg);
+        if (options->threshold<0) {
+          fprintf(stderr,"The threshold must be 0 or a number of iterations\n");
+          exit(1);
+        }
+        break;
+      case 'M':
+        snprintf(options->metrics_target,sizeof(options->metrics_target),"%s",optarg);
+        break;
+      case 'I':
+        options->metrics_interval = atoi(optarg);
+        if (options->metrics_interval<=0) {
+          fprintf(stderr,"The metrics interval must be a number of milliseconds\n");
+          exit(1);
+        }
+        break;
+      case 'T':
+        options->deadline = atoi(optarg);
+        if (options->deadline<=0) {
+          fprintf(stderr,"The deadline must be a number of milliseconds\n");
+          exit(1);
+        }
+        break;
       case 'd':
-        *debug = 1;
+        options->debug = 1;
         break;
       case 't':
-        *threads = atoi(optarg);
+        options->threads = atoi(optarg);
         break;
       case 's':
-		*steps = atoi(optarg);
+		options->steps = atoi(optarg);
 		break;
 	  case 'm':
-	    strcpy(map_file,optarg);
+	    snprintf(options->map_file,sizeof(options->map_file),"%s",optarg);
 	    break;
 	  case 'o':
-	    strcpy(out_file,optarg);
+	    snprintf(options->out_file,sizeof(options->out_file),"%s",optarg);
 	    break;
 	  case 'r':
-		*seed = atoi(optarg);
+		options->seed = atoi(optarg);
 		break;
       default:
        ;
       }
 }
 
-void print_header(int debug, int threads,int max_steps, char *map_file, char* out_file) {
+void print_header(int debug, int threads,int max_steps, char *map_file, char* out_file, int deterministic) {
 	printf("Ad-hoc generated RENPSM OPENMP simulator\n");
     printf("This program comes with ABSOLUTELY NO WARRANTY\n");
     printf("This is free software, and you are welcome to redistribute it\n");
@@ -165,6 +611,8 @@ void print_header(int debug, int threads,int max_steps, char *map_file, char* ou
     printf("STEPS: %d\n",max_steps);
     printf("MAP: %s\n",map_file);
     printf("OUTPUT: %s\n",out_file);
+    printf("DETERMINISTIC: %d\n",deterministic);
+    printf("SIMD: %s\n",simd_level());
 }
 
 #endif
@@ -31,7 +31,9 @@
 #ifndef _GEN_C_H_
 #define _GEN_C_H_
 
+#include <math.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -39,37 +41,248 @@
 
 #define SIM_MAX_MEMBRANES 524288
 
-#define SIM_MAX_VARS 1024
 #define SIM_MAX_ITERS 1024*1024
+#define SIM_MAX_FUSIONS 64
+#define SIM_MAX_COMMONS 64
+#define SIM_MAX_PACKED 64
+#define SIM_MAX_BROADCASTS 64
+#define SIM_MAX_NEAREST 8
 
 char *masks[8] = {"0x01000000","0x02000000","0x04000000","0x08000000","0x10000000","0x20000000","0x40000000","0x80000000"}; 
 
+#define VAR_FLAG 0
+#define VAR_LABEL 1
+#define VAR_REAL 2
+
+char *var_types[3] = {"uint8_t","int32_t","double"};
+char *unset_check[3] = {"flag_unset","label_unset","isnan"};
+char *from_type[3] = {"from_flag","from_label",""};
+char *to_type[3] = {"to_flag","to_label",""};
+
 typedef struct Var
 {
 	char name[64];
 	int indexes;
 	int limits[64];
+	int type;
+	int squared;
 } VAR;
 
-VAR vars[SIM_MAX_VARS];
+VAR* vars = NULL;
 int vars_count = 0;
+int vars_capacity = 0;
+SYMBOL_TABLE vars_index;
 
 int functions=0;
 
+int* creation_functions = NULL;
+int creation_functions_count=0;
+int creation_functions_capacity=0;
+
+int* loop_functions = NULL;
+int loop_functions_count=0;
+int loop_functions_capacity=0;
+
 int labels[8];
 int labels_count=0;
 
+/*
+ * Library mode: the state of the simulator lives in a renpsm_ctx passed
+ * to every generated function instead of in globals. state is the prefix
+ * of every access to it ("ctx->"), state_param and state_arg the extra
+ * parameter and argument of the generated functions.
+ */
+int library = 0;
+char* state = "";
+char* state_param = "";
+char* state_arg = "";
+
+/*
+ * A fusion replaces the chain
+ *   D{h} <- expr : h in S         (producer)
+ *   A{h,mem} <- D{h} : h in L     (copy)
+ *   A{mem} <- min(A{h,mem} : h in L) / arg_min(...)  (reducers)
+ * by a single kernel run at the producer step that evaluates expr over L
+ * and keeps the running (min, arg_min) pair.
+ */
+typedef struct Fusion
+{
+	INSTRUCTION* producer;
+	INSTRUCTION* copy;
+	int label;
+	int copy_needed;
+	int producer_needed;
+	int nearest;
+	EXPR* query[2];
+	EXPR* cond;
+	EXPR* otherwise;
+} FUSION;
+
+FUSION fusions[SIM_MAX_FUSIONS];
+int fusions_count = 0;
+
+/*
+ * A common subexpression is shared by several scalar production rules
+ * with the same protein and enzyme. It is evaluated once per step before
+ * the rules run (as a reciprocal if it is only used as a divisor).
+ */
+typedef struct Common
+{
+	EXPR* expr;
+	INSTRUCTION* inst;
+	int reciprocal;
+} COMMON;
+
+COMMON commons[SIM_MAX_COMMONS];
+int commons_count = 0;
+
+/*
+ * A packed column keeps V{c,h} for the membranes of a label in list
+ * order, as doubles, so that the fused kernels over the label read
+ * contiguous arrays instead of gathering through membranes_in_label.
+ * The membranes appended since the last kernel are packed when a kernel
+ * starts, later writes to V are copied by packed_store_V.
+ */
+typedef struct Packed
+{
+	int var;
+	int column;
+	int label;
+} PACKED;
+
+PACKED packed[SIM_MAX_PACKED];
+int packed_count = 0;
+int packing = -1;
+
+/*
+ * A broadcast row V{c,h} of a label is only written by rules giving the
+ * same value to every membrane of the label (V{c,h} <- e : h in L, with e
+ * not depending on h). Those rules keep the value and the number of
+ * membranes of the list it covers instead of writing the row, which is
+ * only written out for the state hash (and in debug mode, as before, or
+ * once a membrane is created again, see generate_share).
+ */
+typedef struct Broadcast
+{
+	int var;
+	int column;
+	int label;
+} BROADCAST;
+
+BROADCAST broadcasts[SIM_MAX_BROADCASTS];
+int broadcasts_count = 0;
+int kernel_label = -1;
+
+/*
+ * A nearest index keeps the points (V{c,h},W{d,h}) of the packed columns
+ * x and y of a label in a 2-d tree (kdtree.h), updated when membranes are
+ * packed. A fused kernel computing squaredDistance(q1,q2,V{c,h},W{d,h}),
+ * or if(S,squaredDistance(...),C), whose query point is the same for all
+ * the membranes of the label (expressions not depending on h, or
+ * broadcast rows covering the whole list) is answered with a nearest
+ * query in logarithmic time.
+ */
+typedef struct Nearest
+{
+	int label;
+	int x;
+	int y;
+} NEAREST;
+
+NEAREST nearests[SIM_MAX_NEAREST];
+int nearests_count = 0;
+
+/*
+ * Single precision (-f): the packed columns of a label whose kernels
+ * only read integer variables are stored as float, and the parts of the
+ * kernels that only add, subtract and multiply them are computed in
+ * float. Both are exact while every packed value is within the bound of
+ * the label (checked when the values are packed or stored); past it the
+ * kernels gather the double values as before.
+ */
+#define FLOAT_EXACT 16777216.0
+
+int single = 0;
+int packing_single = 0;
+double single_bounds[8];
+
+/*
+ * Loops over a label list: rules with a set iterator (fusion<0) and the
+ * block loops of the fused kernels, single for the float one. Each loop
+ * has a profile in the simulator (schedule.h) with its threshold and
+ * chunk size, shape tells the loops of other models apart in a profile
+ * file.
+ */
+typedef struct Loop
+{
+	INSTRUCTION* inst;
+	int fusion;
+	int single;
+	uint64_t shape;
+} LOOP;
+
+LOOP* loops = NULL;
+int loops_count = 0;
+int loops_capacity = 0;
+
+INSTRUCTION* current_inst = NULL;
+
+INSTRUCTION* reducers[SIM_MAX_FUSIONS*2];
+int reducers_fusion[SIM_MAX_FUSIONS*2];
+int reducers_count = 0;
+
 VAR* searchVar(char* id, int indexes)
 {
-	for (int i=0;i<vars_count;i++) {
-		if (strcmp(vars[i].name,id)==0 && indexes==vars[i].indexes) {
-			return &vars[i];
-		}
+	char key[80];
+	snprintf(key,sizeof(key),"%s/%d",id,indexes);
+	intptr_t i = (intptr_t)symbolGet(&vars_index,key);
+	return i==0 ? NULL : &vars[i-1];
+}
+
+VAR* addVar(char* id, int indexes)
+{
+	if (vars_count==vars_capacity) {
+		vars_capacity = vars_capacity==0 ? 64 : vars_capacity*2;
+		vars = (VAR*)realloc(vars,sizeof(VAR)*vars_capacity);
 	}
-	return NULL;
+	VAR* var = &vars[vars_count++];
+	memset(var,0,sizeof(VAR));
+	strcpy(var->name,id);
+	var->indexes = indexes;
+	char key[80];
+	snprintf(key,sizeof(key),"%s/%d",id,indexes);
+	symbolPut(&vars_index,key,(void*)(intptr_t)vars_count);
+	return var;
 }
 
 
+/* Value of an index expression for iterator id = value (ok=0 if it depends on anything else) */
+int eval_int(EXPR* expr, char* id, int value, int* ok)
+{
+	if (expr==NULL) {
+		return 0;
+	}
+	switch(expr->type) {
+		case INTEGER:
+			return expr->intValue;
+		case OBJECT:
+			if (expr->arguments==NULL && strcmp(expr->id,id)==0) {
+				return value;
+			}
+			*ok = 0;
+			return 0;
+		case ADD:
+			return eval_int(expr->left,id,value,ok) + eval_int(expr->right,id,value,ok);
+		case SUB:
+			return eval_int(expr->left,id,value,ok) - eval_int(expr->right,id,value,ok);
+		case MUL:
+			return eval_int(expr->left,id,value,ok) * eval_int(expr->right,id,value,ok);
+		default:
+			*ok = 0;
+			return 0;
+	}
+}
+
 void create_vars(DEFINITIONS* defs)
 {
 	for (int i=0; i< defs->size;i++) {
@@ -81,9 +294,9 @@ void create_vars(DEFINITIONS* defs)
 			    EXPR* obj = inst->object;
 				VAR* var = searchVar(obj->id,obj->arguments->size);
 				if (var==NULL) {
-					var = &vars[vars_count++];
-					strcpy(var->name,obj->id);
-					var->indexes = obj->arguments->size;
+					var = addVar(obj->id,obj->arguments->size);
+					var->type = VAR_FLAG;
+					var->squared = 1;
 					for (int k=0;k<var->indexes;k++) {
 						var->limits[k] = 1;
 					}
@@ -94,12 +307,18 @@ void create_vars(DEFINITIONS* defs)
 						if (x>var->limits[k]) {
 							var->limits[k]=x;
 						}
-					} else if (obj->arguments->args[k]->type==OBJECT) {
+					} else {
 						int find = 0;
 						for (int l = 0; l< inst->iterators->size; l++) {
 							ITERATOR *it = inst->iterators->iterators[l];
-							if (it->type == RANGE_ITERATOR && strcmp(it->id,obj->arguments->args[k]->id)==0) {
-								int x = it->right->intValue+1;
+							if (it->type != RANGE_ITERATOR) {
+								continue;
+							}
+							int ok0 = 1, ok1 = 1;
+							int x0 = eval_int(obj->arguments->args[k],it->id,it->left->intValue,&ok0)+1;
+							int x1 = eval_int(obj->arguments->args[k],it->id,it->right->intValue,&ok1)+1;
+							if (ok0 && ok1) {
+								int x = x0>x1 ? x0 : x1;
 								if (x>var->limits[k]) {
 									var->limits[k]=x;
 								}
@@ -117,385 +336,3073 @@ void create_vars(DEFINITIONS* defs)
 }
 
 
-void generate_loop(FILE* fp, DEFINITIONS* defs)
+/*
+ * Type inference: a variable is a flag if every value written to it is
+ * 0 or 1, a label if every value is an integer and real otherwise.
+ * Reduced variables are kept real since reductions.h works on doubles.
+ */
+int expr_type(EXPR* expr);
+
+int join_type(int a, int b)
 {
-	fprintf(fp,"// MAIN LOOP\n");
-	fprintf(fp,"\nvoid loop()\n");
-	fprintf(fp,"{\n");
-	fprintf(fp,"\tint step=0;\n");
-	fprintf(fp,"\twhile(step<max_steps && (isnan(Halt1[0]) || Halt1[0]==0))\n");
-	fprintf(fp,"\t{\n");
-	fprintf(fp,"\t\tif(debug) {\n");
-	fprintf(fp,"\t\t\tprintf(\"\\n\\n------ STEP %%d protein = %%d------\\n\",step+1,protein);\n");
-	fprintf(fp,"\t\t}\n");
-	fprintf(fp,"\t\t#pragma omp parallel num_threads(threads)\n");
-	fprintf(fp,"\t\t{\n");
-	fprintf(fp,"\t\t\t#pragma omp sections\n");
-	fprintf(fp,"\t\t\t{\n");
-	for (int i=0;i<functions;i++) {
-		fprintf(fp,"\t\t\t\t#pragma omp section\n");
-		fprintf(fp,"\t\t\t\trule%d();\n",i);
-	}		
-	fprintf(fp,"\t\t\t}\n");
-	fprintf(fp,"\t\t}\n");
-	fprintf(fp,"\t\tprotein = next_protein;\n");
-	fprintf(fp,"\t\tif(debug) {\n");
-	fprintf(fp,"\t\t\tprintf(\"\\n----MEMBRANES---\\n\");\n");
-	fprintf(fp,"\t\t\tfor (int i=0;i<%d;i++) {\n",SIM_MAX_MEMBRANES);
-	fprintf(fp,"\t\t\t\tif (membranes[i]!=0) {\n");
-	fprintf(fp,"\t\t\t\t\tprintf(\"p(%%d) = %%d \",i,(membranes[i] & 0x00FFFFFF));\n");
-	fprintf(fp,"\t\t\t\t}\n");
-	fprintf(fp,"\t\t\t}\n");
-	
-	fprintf(fp,"\t\t\tprintf(\"\\n\\n----VARIABLES---\\n\");\n");
-	
-	for (int i=0;i<vars_count;i++) {
-		if (vars[i].indexes==1) {
-			
-			fprintf(fp,"\t\t\tfor (int i=0;i<%d;i++) {\n",vars[i].limits[0]);
-			fprintf(fp,"\t\t\t\tif(!isnan(%s%d[i])) printf(\"%s%d[%%d] = %%.2f \",i,%s%d[i]);\n",
-			  vars[i].name,
-			  vars[i].indexes,
-			  vars[i].name,
-			  vars[i].indexes,
-			  vars[i].name,
-			  vars[i].indexes);	
-			fprintf(fp,"\t\t\t}\n");
-			
-		} else {
-			fprintf(fp,"\t\t\tfor (int i=0;i<%d;i++) {\n",vars[i].limits[0]);
-			fprintf(fp,"\t\t\t\tfor (int j=0;j<%d;j++) {\n",vars[i].limits[1]);
-			fprintf(fp,"\t\t\t\t\tif(!isnan(%s%d[i][j])) printf(\"%s[%%d][%%d] = %%.2f \",i,j,%s%d[i][j]);\n",
-			  vars[i].name,
-			  vars[i].indexes,
-			  vars[i].name,
-			  vars[i].name,
-			  vars[i].indexes);	
-			fprintf(fp,"\t\t\t\t}\n");	  
-			fprintf(fp,"\t\t\t}\n");	
-		}
+	return a>b ? a : b;
+}
+
+int function_type(EXPR* expr)
+{
+	char* id = expr->id;
+	if (strcmp(id,"round")==0 || strcmp(id,"rm")==0 || strcmp(id,"qt")==0 || strcmp(id,"random")==0 ||
+		strcmp(id,"uniform")==0 || strcmp(id,"goal")==0 || strcmp(id,"halton")==0 || strcmp(id,"sobol")==0 ||
+		strcmp(id,"random_free")==0 || strcmp(id,"extend")==0 ||
+		strcmp(id,"arg_min")==0 || strcmp(id,"arg_max")==0 || strcmp(id,"count")==0) {
+		return VAR_LABEL;
 	}
-	
-	fprintf(fp,"\t\t\tprintf(\"\\n\\nPress ENTER for next step\");\n");
-	fprintf(fp,"\t\t\tgetchar();\n");
-	fprintf(fp,"\t\t}\n");
-	
-	fprintf(fp,"\t\t++step;\n");
-	fprintf(fp,"\t}\n");
-	fprintf(fp,"}\n");
-	
+	if (strcmp(id,"collision")==0) {
+		return VAR_FLAG;
+	}
+	if (strcmp(id,"if")==0 && expr->arguments->size==3) {
+		return join_type(expr_type(expr->arguments->args[1]),expr_type(expr->arguments->args[2]));
+	}
+	return VAR_REAL;
 }
 
-void generate_var(FILE* fp, EXPR* obj,int in);
+int expr_type(EXPR* expr)
+{
+	if (expr==NULL) {
+		return VAR_FLAG;
+	}
+	switch(expr->type) {
+		case INTEGER:
+			return expr->intValue==0 || expr->intValue==1 ? VAR_FLAG : VAR_LABEL;
+		case REAL:
+			return VAR_REAL;
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				return VAR_LABEL;
+			} else {
+				VAR* v = searchVar(expr->id,expr->arguments->size);
+				return v==NULL ? VAR_REAL : v->type;
+			}
+		case FUNCTION:
+			return function_type(expr);
+		case ADD: case SUB: case MUL: case MOD:
+			return join_type(VAR_LABEL,join_type(expr_type(expr->left),expr_type(expr->right)));
+		case DIV:
+			return VAR_REAL;
+		case LT: case GT: case EQ: case NEQ: case NOT:
+		case LE: case GE: case AND: case OR:
+			return VAR_FLAG;
+		default:
+			return VAR_REAL;
+	}
+}
 
-void print_index(FILE* fp, EXPR* obj, int index, int in)
+char* reductions[6] = {"min","max","sum","count","arg_min","arg_max"};
+
+int is_reduction(char* id)
 {
-	VAR *v = searchVar(obj->id,obj->arguments->size);
-	
-	if (obj->arguments->args[index]->type==INTEGER) {
-		fprintf(fp,"%d",obj->arguments->args[index]->intValue);
-	} else if (strcmp(obj->arguments->args[index]->id,"h")==0) {
-		fprintf(fp,"membranes_in_%d[h]",in);
-	} else {
-		fprintf(fp,"(int)round(");
-		generate_var(fp,obj->arguments->args[index],in);
-		fprintf(fp,")");
+	for (int i=0;i<6;i++) {
+		if (strcmp(reductions[i],id)==0) {
+			return 1;
+		}
 	}
+	return 0;
 }
 
-void generate_var(FILE* fp, EXPR* obj,int in)
+void force_reduced_real(EXPR* expr)
 {
-	VAR *v = searchVar(obj->id,obj->arguments->size);
-	fprintf(fp,"%s%d[",v->name,v->indexes);
-	if (v->indexes==1) {
-		if (obj->arguments->args[0]->type==INTEGER) {
-			fprintf(fp,"%d]",obj->arguments->args[0]->intValue);
-		} else {
-			fprintf(fp,"membranes_in_%d[h]]",in);
+	if (expr==NULL) {
+		return;
+	}
+	if (expr->type==FUNCTION || expr->type==OBJECT) {
+		if (expr->arguments==NULL) {
+			return;
 		}
-		
-	} else if (v->indexes==2) {
-		if (obj->arguments->args[0]->type==INTEGER && obj->arguments->args[1]->type==INTEGER) {
-			int v1 = obj->arguments->args[0]->intValue;
-			int v2 = obj->arguments->args[1]->intValue;	
-			fprintf(fp,"%d][%d]",v1,v2);	
-		} else if (obj->arguments->args[0]->type==INTEGER && obj->arguments->args[1]->type!=INTEGER) {
-			int v1 = obj->arguments->args[0]->intValue;
-			if (strcmp(obj->arguments->args[1]->id,"h")==0) {
-				fprintf(fp,"%d][membranes_in_%d[h]]",v1,in);
-			} else {
-				fprintf(fp,"%d][(int)round(",v1);
-				generate_var(fp,obj->arguments->args[1],in);
-				fprintf(fp,")]");
-			}
-		} else if (obj->arguments->args[0]->type!=INTEGER && obj->arguments->args[1]->type==INTEGER) {
-			int v2 = obj->arguments->args[1]->intValue;
-			if (strcmp(obj->arguments->args[0]->id,"h")==0) {
-				fprintf(fp,"membranes_in_%d[h]][%d]",in,v2);
+		if (expr->type==FUNCTION && is_reduction(expr->id) && expr->arguments->args[0]->type==OBJECT) {
+			EXPR* values = expr->arguments->args[0];
+			VAR* v = searchVar(values->id,values->arguments->size);
+			if (v!=NULL) {
+				v->type = VAR_REAL;
+			}
+		}
+		for (int i=0;i<expr->arguments->size;i++) {
+			force_reduced_real(expr->arguments->args[i]);
+		}
+	} else if (expr->type!=INTEGER && expr->type!=REAL && expr->type!=ID) {
+		force_reduced_real(expr->left);
+		force_reduced_real(expr->right);
+	}
+}
+
+void infer_types(DEFINITIONS* defs)
+{
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		for (int i=0;i<defs->size;i++) {
+			DEFINITION* def = defs->definitions[i];
+			for (int j=0;j<def->size;j++) {
+				INSTRUCTION* inst = def->instructions[j];
+				if (inst->type==PRODUCTION_RULE) {
+					force_reduced_real(inst->expr);
+				}
+				if (inst->type!=PRODUCTION_RULE && inst->type!=INIT_VARIABLE) {
+					continue;
+				}
+				VAR* v = searchVar(inst->object->id,inst->object->arguments->size);
+				int type = join_type(v->type,expr_type(inst->expr));
+				if (type!=v->type) {
+					v->type = type;
+					changed = 1;
+				}
+			}
+		}
+	}
+}
+
+/* Integer arithmetic over labels and flags, generated without going through double */
+int is_int_arith(EXPR* expr)
+{
+	if (expr==NULL) {
+		return 1;
+	}
+	switch(expr->type) {
+		case INTEGER:
+			return 1;
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				return 1;
 			} else {
-				fprintf(fp,"(int)round(");
-				generate_var(fp,obj->arguments->args[0],in);
-				fprintf(fp,")][%d]",v2);
+				VAR* v = searchVar(expr->id,expr->arguments->size);
+				return v!=NULL && v->type!=VAR_REAL;
 			}
-		} 
+		case ADD: case SUB: case MUL:
+			return is_int_arith(expr->left) && is_int_arith(expr->right);
+		default:
+			return 0;
 	}
 }
 
-void generate_min(FILE* fp, EXPR* expr, int val)
+int protein_of(INSTRUCTION* inst)
 {
-	if (expr->arguments->iterators->size>0) {
-		val = expr->arguments->iterators->iterators[0]->left->intValue;
-		fprintf(fp,"function_min(%s%d,membranes_in_%d,membranes_in_%d_size)",
-		  expr->arguments->args[0]->id,expr->arguments->args[0]->arguments->size,val,val);
+	if (inst->protein==NULL || inst->protein->arguments==NULL ||
+		inst->protein->arguments->args[0]->type!=INTEGER) {
+		return -1;
 	}
+	return inst->protein->arguments->args[0]->intValue;
+}
+
+int is_iterator(EXPR* expr, char* id)
+{
+	return expr!=NULL && expr->type==OBJECT && expr->arguments==NULL && strcmp(expr->id,id)==0;
 }
 
-void generate_arg_min(FILE* fp, EXPR* expr, int val)
+int set_label(INSTRUCTION* inst)
 {
-	if (expr->arguments->iterators->size>0) {
-		val = expr->arguments->iterators->iterators[0]->left->intValue;
-		fprintf(fp,"function_arg_min(%s%d,membranes_in_%d,membranes_in_%d_size)",
-		  expr->arguments->args[0]->id,expr->arguments->args[0]->arguments->size,val,val);
+	if (inst->iterators==NULL || inst->iterators->size!=1) {
+		return -1;
+	}
+	ITERATOR* it = inst->iterators->iterators[0];
+	if (it->type!=SET_ITERATOR || strcmp(it->id,"h")!=0 || it->left->type!=INTEGER) {
+		return -1;
 	}
+	return it->left->intValue;
 }
 
-void generate_expr(FILE* fp, EXPR* expr, int val)
+int label_covers(int outer, int inner)
+{
+	return outer==inner || (outer==labels[0] && inner!=-1);
+}
+
+int expr_reads(EXPR* expr, char* id, int indexes)
 {
 	if (expr==NULL) {
-		return;
+		return 0;
 	}
 	switch(expr->type) {
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				return 0;
+			}
+			if (strcmp(expr->id,id)==0 && expr->arguments->size==indexes) {
+				return 1;
+			}
+			/* indexes are read too */
 		case FUNCTION:
-			if (strcmp(expr->id,"min")==0) {
-				generate_min(fp,expr,val);
-			} else if (strcmp(expr->id,"arg_min")==0) {
-				generate_arg_min(fp,expr,val);
-			} else {
-				fprintf(fp,"function_%s(",expr->id);
-					if (expr->arguments->size>0) {
-						generate_expr(fp,expr->arguments->args[0],val);
-					}
-					for (int i=1;i<expr->arguments->size;i++) {
-						fprintf(fp,", ");
-						generate_expr(fp,expr->arguments->args[i],val);
-					}
-					fprintf(fp,")");
+			for (int i=0;i<expr->arguments->size;i++) {
+				if (expr_reads(expr->arguments->args[i],id,indexes)) {
+					return 1;
 				}
-				break;
+			}
+			return 0;
+		case INTEGER: case REAL: case ID:
+			return 0;
+		default:
+			return expr_reads(expr->left,id,indexes) || expr_reads(expr->right,id,indexes);
+	}
+}
+
+int expr_calls(EXPR* expr, char* id)
+{
+	if (expr==NULL) {
+		return 0;
+	}
+	switch(expr->type) {
+		case FUNCTION:
+			if (strcmp(expr->id,id)==0) {
+				return 1;
+			}
 		case OBJECT:
-			generate_var(fp,expr,val);
-			break;
-		case INTEGER:
-			fprintf(fp,"%d",expr->intValue);
-			break;
-		case REAL:
-			fprintf(fp,"%f",expr->doubleValue);
-			break;
-		case ADD:case SUB:case MUL:case DIV:case MOD:
-		case LT:case GT:case EQ:case NEQ:case NOT:case LE:
-		case GE:case AND:case OR:
-			fprintf(fp,"(");
-			generate_expr(fp,expr->left,val);
-			printType(fp,expr->type);
-			generate_expr(fp,expr->right,val);
-			fprintf(fp,")");
-		break;
+			for (int i=0;expr->arguments!=NULL && i<expr->arguments->size;i++) {
+				if (expr_calls(expr->arguments->args[i],id)) {
+					return 1;
+				}
+			}
+			return 0;
+		case INTEGER: case REAL: case ID:
+			return 0;
+		default:
+			return expr_calls(expr->left,id) || expr_calls(expr->right,id);
 	}
 }
 
+/* Calls whose value changes from call to call: the random draws and the sample sequences */
+int expr_draws(EXPR* expr)
+{
+	return expr_calls(expr,"random") || expr_calls(expr,"uniform") || expr_calls(expr,"goal") ||
+		expr_calls(expr,"halton") || expr_calls(expr,"sobol") || expr_calls(expr,"random_free");
+}
 
-void generate_guard(FILE* fp, INSTRUCTION* inst)
+int expr_reduces(EXPR* expr)
 {
-	if (inst->protein!=NULL) {
-		fprintf(fp,"\tif (protein != %d) {\n",inst->protein->arguments->args[0]->intValue);
-		fprintf(fp,"\t\treturn;\n");
-		fprintf(fp,"\t}\n");
+	if (expr==NULL) {
+		return 0;
 	}
-	if (inst->enzyme!=NULL) {
-		fprintf(fp,"\tif (");
-		generate_expr(fp,inst->enzyme,0);
-		fprintf(fp," == 0) {\n");
-		fprintf(fp,"\t\treturn;\n");
-		fprintf(fp,"\t}\n");
+	switch(expr->type) {
+		case FUNCTION:
+			if (is_reduction(expr->id)) {
+				return 1;
+			}
+			for (int i=0;i<expr->arguments->size;i++) {
+				if (expr_reduces(expr->arguments->args[i])) {
+					return 1;
+				}
+			}
+			return 0;
+		case OBJECT: case INTEGER: case REAL: case ID:
+			return 0;
+		default:
+			return expr_reduces(expr->left) || expr_reduces(expr->right);
 	}
-	
 }
 
-void generate_function(FILE* fp, INSTRUCTION* inst)
+int is_chain(INSTRUCTION* inst)
 {
-	char tabs[16];
-	tabs[0]='\t';
-	tabs[1]=0;
-	fprintf(fp,"\n");
-	fprintf(fp,"// RULE: %d\n",functions);
-	fprintf(fp,"// ");
-	printInstruction(fp,inst,0);
-	fprintf(fp,"\nvoid rule%d()\n",functions++);
-	fprintf(fp,"{\n");
-	generate_guard(fp,inst);
-	int val=0;
-	if (inst->iterators->size>0) {
-		val = inst->iterators->iterators[0]->left->intValue;
-		fprintf(fp,"\t#pragma omp parallel for\n");
-		fprintf(fp,"\tfor(int h=0;h<membranes_in_%d_size;++h) {\n",val);
-		tabs[1]='\t';
-		tabs[2]=0;
+	return inst->type==CREATION_RULE && inst->object->type==FUNCTION && strcmp(inst->object->id,"chain")==0 &&
+		inst->object->arguments!=NULL && inst->object->arguments->size==7;
+}
+
+int inst_reads(INSTRUCTION* inst, char* id, int indexes)
+{
+	if (inst->type==CREATION_RULE) {
+		return expr_reads(inst->object,id,indexes) || expr_reads(inst->expr,id,indexes) ||
+			expr_reads(inst->enzyme,id,indexes);
 	}
-	if (inst->type == PRODUCTION_RULE) {
-		fprintf(fp,"%s",tabs);
-		generate_var(fp,inst->object,val);
-		fprintf(fp," = ");
-		generate_expr(fp,inst->expr, val);
-		fprintf(fp,";\n");
-		
-		fprintf(fp,"%s",tabs);
-		fprintf(fp,"if (debug) {\n");
-		fprintf(fp,"%s",tabs);
-		fprintf(fp,"\tprintf(\"%s",inst->object->id);
-		for (int i=0;i< inst->object->arguments->size;i++) {
-			fprintf(fp,"[%%d]");
+	if (inst->type!=PRODUCTION_RULE) {
+		return 0;
+	}
+	if (expr_reads(inst->expr,id,indexes) || expr_reads(inst->enzyme,id,indexes)) {
+		return 1;
+	}
+	for (int k=0;inst->object->arguments!=NULL && k<inst->object->arguments->size;k++) {
+		if (expr_reads(inst->object->arguments->args[k],id,indexes)) {
+			return 1;
 		}
-	
-		fprintf(fp," = %%f; // ");
-		
-		printInstruction(fp,inst,0);
-		fprintf(fp,"\\n\"");
+	}
+	return 0;
+}
+
+int sequential_proteins(DEFINITIONS* defs)
+{
+	int backwards = 0;
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type!=EVOLUTION_RULE) {
+				continue;
+			}
+			if (inst->enzyme!=NULL || inst->protein!=NULL) {
+				return 0;
+			}
+			char* id = "";
+			int first = 0, last = 0;
+			if (inst->iterators->size>0 && inst->iterators->iterators[0]->type==RANGE_ITERATOR) {
+				id = inst->iterators->iterators[0]->id;
+				first = inst->iterators->iterators[0]->left->intValue;
+				last = inst->iterators->iterators[0]->right->intValue;
+			}
+			for (int k=first;k<=last;k++) {
+				int ok = 1;
+				int from = eval_int(inst->object->arguments->args[0],id,k,&ok);
+				int to = eval_int(inst->expr->arguments->args[0],id,k,&ok);
+				if (!ok || (to<=from && ++backwards>1)) {
+					return 0;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+/* Last production rule writing rows of label before the given protein */
+INSTRUCTION* reaching_writer(DEFINITIONS* defs, char* id, int indexes, int label, int protein)
+{
+	INSTRUCTION* writer = NULL;
+	int writer_protein = -1;
+	int ambiguous = 0;
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type!=PRODUCTION_RULE || strcmp(inst->object->id,id)!=0 ||
+				inst->object->arguments->size!=indexes) {
+				continue;
+			}
+			int p = protein_of(inst);
+			if (p<0) {
+				return NULL;
+			}
+			int s = is_iterator(inst->object->arguments->args[0],"h") ? set_label(inst) : -1;
+			if (s!=-1 && !label_covers(s,label) && !label_covers(label,s)) {
+				continue;
+			}
+			if (p>=protein || p<writer_protein) {
+				continue;
+			}
+			ambiguous = p==writer_protein || s==-1 || !label_covers(s,label);
+			writer = inst;
+			writer_protein = p;
+		}
+	}
+	return ambiguous ? NULL : writer;
+}
+
+int creates_between(DEFINITIONS* defs, int from, int to)
+{
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type==CREATION_RULE) {
+				int p = protein_of(inst);
+				if (p<0 || (p>=from && p<=to)) {
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+int add_fusion(DEFINITIONS* defs, INSTRUCTION* reducer)
+{
+	EXPR* expr = reducer->expr;
+	int r = protein_of(reducer);
+	if (r<0 || expr->arguments->iterators==NULL || expr->arguments->iterators->size!=1) {
+		return -1;
+	}
+	ITERATOR* it = expr->arguments->iterators->iterators[0];
+	EXPR* values = expr->arguments->args[0];
+	if (it->type!=SET_ITERATOR || it->left->type!=INTEGER || values->type!=OBJECT ||
+		values->arguments==NULL || values->arguments->size!=2 ||
+		!is_iterator(values->arguments->args[0],it->id) || values->arguments->args[1]->type!=INTEGER) {
+		return -1;
+	}
+	int label = it->left->intValue;
+
+	INSTRUCTION* copy = reaching_writer(defs,values->id,2,label,r);
+	if (copy==NULL || copy->enzyme!=NULL || set_label(copy)!=label ||
+		copy->object->arguments->args[1]->type!=INTEGER ||
+		copy->object->arguments->args[1]->intValue!=values->arguments->args[1]->intValue ||
+		copy->expr->type!=OBJECT || copy->expr->arguments==NULL ||
+		copy->expr->arguments->size!=1 || !is_iterator(copy->expr->arguments->args[0],"h")) {
+		return -1;
+	}
+
+	char* id = copy->expr->id;
+	INSTRUCTION* producer = reaching_writer(defs,id,1,label,protein_of(copy));
+	if (producer==NULL || producer->enzyme!=NULL || !label_covers(set_label(producer),label) ||
+		expr_reads(producer->expr,id,1) || expr_reduces(producer->expr) ||
+		creates_between(defs,protein_of(producer),r)) {
+		return -1;
+	}
+
+	for (int k=0;k<fusions_count;k++) {
+		if (fusions[k].producer==producer && fusions[k].copy==copy) {
+			return k;
+		}
+	}
+	if (fusions_count==SIM_MAX_FUSIONS) {
+		return -1;
+	}
+	FUSION* f = &fusions[fusions_count];
+	f->producer = producer;
+	f->copy = copy;
+	f->label = label;
+	f->copy_needed = 1;
+	f->producer_needed = 1;
+	f->nearest = -1;
+	return fusions_count++;
+}
+
+int searchReducer(INSTRUCTION* inst)
+{
+	for (int i=0;i<reducers_count;i++) {
+		if (reducers[i]==inst) {
+			return reducers_fusion[i];
+		}
+	}
+	return -1;
+}
+
+FUSION* searchFusedCopy(INSTRUCTION* inst)
+{
+	for (int i=0;i<fusions_count;i++) {
+		if (fusions[i].copy==inst) {
+			return &fusions[i];
+		}
+	}
+	return NULL;
+}
+
+/* The intermediate array of a producer is only needed if something
+   other than a skipped fused copy reads it */
+int producer_needed(DEFINITIONS* defs, INSTRUCTION* producer)
+{
+	char* id = producer->object->id;
+	int indexes = producer->object->arguments->size;
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			FUSION* f = searchFusedCopy(inst);
+			if (f!=NULL && !f->copy_needed) {
+				continue;
+			}
+			if (inst_reads(inst,id,indexes)) {
+				return 1;
+			}
+		}
+	}
+	return strcmp(id,"Y")==0 && indexes==2;
+}
+
+void create_fusions(DEFINITIONS* defs)
+{
+	if (!sequential_proteins(defs)) {
+		return;
+	}
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type!=PRODUCTION_RULE || inst->expr->type!=FUNCTION ||
+				(strcmp(inst->expr->id,"min")!=0 && strcmp(inst->expr->id,"arg_min")!=0) ||
+				reducers_count==SIM_MAX_FUSIONS*2) {
+				continue;
+			}
+			int k = add_fusion(defs,inst);
+			if (k>=0) {
+				reducers[reducers_count] = inst;
+				reducers_fusion[reducers_count++] = k;
+			}
+		}
+	}
+	for (int k=0;k<fusions_count;k++) {
+		EXPR* obj = fusions[k].copy->object;
+		int needed = strcmp(obj->id,"Y")==0;
+		for (int i=0;i<defs->size && !needed;i++) {
+			DEFINITION* def = defs->definitions[i];
+			for (int j=0;j<def->size && !needed;j++) {
+				INSTRUCTION* inst = def->instructions[j];
+				needed = searchReducer(inst)<0 && inst_reads(inst,obj->id,2);
+			}
+		}
+		fusions[k].copy_needed = needed;
+	}
+	for (int k=0;k<fusions_count;k++) {
+		fusions[k].producer_needed = producer_needed(defs,fusions[k].producer);
+	}
+}
+
+/* V{c,h} with c constant */
+int packable(EXPR* expr)
+{
+	return expr->arguments!=NULL && expr->arguments->size==2 && expr->arguments->args[0]->type==INTEGER &&
+		expr->arguments->args[1]->type==OBJECT && expr->arguments->args[1]->arguments==NULL &&
+		strcmp(expr->arguments->args[1]->id,"h")==0;
+}
+
+int searchPacked(EXPR* expr, int label)
+{
+	if (!packable(expr)) {
+		return -1;
+	}
+	VAR* v = searchVar(expr->id,expr->arguments->size);
+	for (int k=0;v!=NULL && k<packed_count;k++) {
+		if (packed[k].var==v-vars && packed[k].label==label && packed[k].column==expr->arguments->args[0]->intValue) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+int packed_label(int label)
+{
+	for (int k=0;k<packed_count;k++) {
+		if (packed[k].label==label) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int packed_var(VAR* v)
+{
+	for (int k=0;k<packed_count;k++) {
+		if (packed[k].var==v-vars) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* V{c,h} read by a fused kernel over label, with c constant */
+void collect_packed(EXPR* expr, int label)
+{
+	if (expr==NULL) {
+		return;
+	}
+	switch(expr->type) {
+		case OBJECT:
+			if (packable(expr) && searchPacked(expr,label)<0 && packed_count<SIM_MAX_PACKED) {
+				packed[packed_count].var = searchVar(expr->id,2)-vars;
+				packed[packed_count].column = expr->arguments->args[0]->intValue;
+				packed[packed_count].label = label;
+				packed_count++;
+			}
+			return;
+		case FUNCTION:
+			if (is_reduction(expr->id)) {
+				return;
+			}
+			for (int i=0;i<expr->arguments->size;i++) {
+				collect_packed(expr->arguments->args[i],label);
+			}
+			return;
+		case INTEGER: case REAL: case ID:
+			return;
+		default:
+			collect_packed(expr->left,label);
+			collect_packed(expr->right,label);
+	}
+}
+
+void create_packed()
+{
+	for (int k=0;k<fusions_count;k++) {
+		collect_packed(fusions[k].producer->expr,fusions[k].label);
+	}
+}
+
+/*
+ * Largest magnitude of expr when the packed integer columns of label
+ * are within bound, INFINITY if expr is not made of those columns,
+ * integers, +, -, * and squaredDistance.
+ */
+double expr_bound(EXPR* expr, int label, double bound)
+{
+	if (expr==NULL) {
+		return INFINITY;
+	}
+	switch(expr->type) {
+		case INTEGER:
+			return fabs((double)expr->intValue);
+		case OBJECT:
+			if (expr->arguments!=NULL && searchPacked(expr,label)>=0 &&
+				searchVar(expr->id,expr->arguments->size)->type==VAR_LABEL) {
+				return bound;
+			}
+			return INFINITY;
+		case FUNCTION:
+			if (strcmp(expr->id,"squaredDistance")==0 && expr->arguments->size==4) {
+				double x = expr_bound(expr->arguments->args[0],label,bound) + expr_bound(expr->arguments->args[2],label,bound);
+				double y = expr_bound(expr->arguments->args[1],label,bound) + expr_bound(expr->arguments->args[3],label,bound);
+				return x*x + y*y;
+			}
+			return INFINITY;
+		case ADD: case SUB:
+			return expr_bound(expr->left,label,bound) + expr_bound(expr->right,label,bound);
+		case MUL:
+			return expr_bound(expr->left,label,bound) * expr_bound(expr->right,label,bound);
+		default:
+			return INFINITY;
+	}
+}
+
+/* Subexpression computed in float by the single precision kernels */
+int float_root(EXPR* expr, int label)
+{
+	int i = 0;
+	while (i<labels_count && labels[i]!=label) {
+		i++;
+	}
+	return expr->type!=OBJECT && expr->type!=INTEGER && i<labels_count && single_bounds[i]>0 &&
+		expr_bound(expr,label,single_bounds[i])<=FLOAT_EXACT;
+}
+
+/* Packed reads of a kernel: -1 if one of them is not an integer variable */
+int single_reads(EXPR* expr, int label)
+{
+	if (expr==NULL) {
+		return 0;
+	}
+	switch(expr->type) {
+		case OBJECT:
+			if (expr->arguments==NULL || searchPacked(expr,label)<0) {
+				return 0;
+			}
+			return searchVar(expr->id,expr->arguments->size)->type==VAR_LABEL ? 1 : -1;
+		case FUNCTION: {
+			if (is_reduction(expr->id)) {
+				return 0;
+			}
+			int reads = 0;
+			for (int i=0;i<expr->arguments->size;i++) {
+				int r = single_reads(expr->arguments->args[i],label);
+				if (r<0) {
+					return -1;
+				}
+				reads += r;
+			}
+			return reads;
+		}
+		case INTEGER: case REAL: case ID:
+			return 0;
+		default: {
+			int left = single_reads(expr->left,label);
+			int right = single_reads(expr->right,label);
+			return left<0 || right<0 ? -1 : left + right;
+		}
+	}
+}
+
+/*
+ * Largest bound (at most 2^24) keeping exact the float subexpressions of
+ * the kernel, found by bisection since expr_bound grows with the bound.
+ */
+double kernel_bound(EXPR* expr, int label)
+{
+	if (expr==NULL) {
+		return FLOAT_EXACT;
+	}
+	double bound = FLOAT_EXACT;
+	if (expr->type!=OBJECT && expr->type!=INTEGER && expr_bound(expr,label,1)<=FLOAT_EXACT) {
+		double lo = 1;
+		double hi = FLOAT_EXACT;
+		while (lo<hi) {
+			double mid = floor((lo+hi+1)/2);
+			if (expr_bound(expr,label,mid)<=FLOAT_EXACT) {
+				lo = mid;
+			} else {
+				hi = mid-1;
+			}
+		}
+		return lo;
+	}
+	switch(expr->type) {
+		case FUNCTION:
+			for (int i=0;!is_reduction(expr->id) && i<expr->arguments->size;i++) {
+				bound = fmin(bound,kernel_bound(expr->arguments->args[i],label));
+			}
+			return bound;
+		case OBJECT: case INTEGER: case REAL: case ID:
+			return bound;
+		default:
+			return fmin(kernel_bound(expr->left,label),kernel_bound(expr->right,label));
+	}
+}
+
+/* A label is single precision when all its kernels read packed integer columns only */
+void create_single()
+{
+	for (int i=0;i<labels_count;i++) {
+		single_bounds[i] = 0;
+		if (!single || !packed_label(labels[i])) {
+			continue;
+		}
+		double bound = FLOAT_EXACT;
+		for (int k=0;k<fusions_count && bound>0;k++) {
+			if (fusions[k].label!=labels[i]) {
+				continue;
+			}
+			if (single_reads(fusions[k].producer->expr,labels[i])<=0) {
+				bound = 0;
+			} else {
+				bound = fmin(bound,kernel_bound(fusions[k].producer->expr,labels[i]));
+			}
+		}
+		single_bounds[i] = bound;
+	}
+}
+
+double single_bound(int label)
+{
+	for (int i=0;i<labels_count;i++) {
+		if (labels[i]==label) {
+			return single_bounds[i];
+		}
+	}
+	return 0;
+}
+
+FUSION* searchFusedProducer(INSTRUCTION* inst)
+{
+	for (int i=0;i<fusions_count;i++) {
+		if (fusions[i].producer==inst) {
+			return &fusions[i];
+		}
+	}
+	return NULL;
+}
+
+int uses_iterator(EXPR* expr, char* id)
+{
+	if (expr==NULL) {
+		return 0;
+	}
+	switch(expr->type) {
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				return strcmp(expr->id,id)==0;
+			}
+		case FUNCTION:
+			for (int i=0;i<expr->arguments->size;i++) {
+				if (uses_iterator(expr->arguments->args[i],id)) {
+					return 1;
+				}
+			}
+			return 0;
+		case INTEGER: case REAL: case ID:
+			return 0;
+		default:
+			return uses_iterator(expr->left,id) || uses_iterator(expr->right,id);
+	}
+}
+
+/* V{c,h} <- e : h in L, with c constant and e the same for every h */
+int is_broadcast_rule(INSTRUCTION* inst)
+{
+	return inst->type==PRODUCTION_RULE && set_label(inst)>=0 && packable(inst->object) &&
+		!uses_iterator(inst->expr,"h") && !expr_draws(inst->expr);
+}
+
+int searchBroadcast(EXPR* expr, int label)
+{
+	if (!packable(expr)) {
+		return -1;
+	}
+	VAR* v = searchVar(expr->id,expr->arguments->size);
+	for (int k=0;v!=NULL && k<broadcasts_count;k++) {
+		if (broadcasts[k].var==v-vars && broadcasts[k].label==label && broadcasts[k].column==expr->arguments->args[0]->intValue) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+int searchBroadcastRule(INSTRUCTION* inst)
+{
+	return is_broadcast_rule(inst) ? searchBroadcast(inst->object,set_label(inst)) : -1;
+}
+
+/*
+ * Access to V{column,i} that may reach the membranes of label, i being
+ * evaluated over the set of the rule. Membrane 0 holds the shared memory
+ * (mem) and is never in a label list.
+ */
+int row_access(EXPR* obj, VAR* v, int column, int label, int set)
+{
+	if (strcmp(obj->id,v->name)!=0 || obj->arguments->size!=2) {
+		return 0;
+	}
+	EXPR* c = obj->arguments->args[0];
+	EXPR* i = obj->arguments->args[1];
+	if (c->type==INTEGER && c->intValue!=column) {
+		return 0;
+	}
+	if (i->type==INTEGER) {
+		return i->intValue!=0;
+	}
+	return !is_iterator(i,"h") || set==-1 || label_covers(set,label) || label_covers(label,set);
+}
+
+int row_reads(EXPR* expr, VAR* v, int column, int label, int set)
+{
+	if (expr==NULL) {
+		return 0;
+	}
+	switch(expr->type) {
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				return 0;
+			}
+			if (row_access(expr,v,column,label,set)) {
+				return 1;
+			}
+		case FUNCTION:
+			for (int i=0;i<expr->arguments->size;i++) {
+				/* the values of a reduction are read over its own set */
+				int s = expr->type==FUNCTION && is_reduction(expr->id) && expr->arguments->iterators!=NULL &&
+					expr->arguments->iterators->size==1 ? expr->arguments->iterators->iterators[0]->left->intValue : set;
+				if (row_reads(expr->arguments->args[i],v,column,label,s)) {
+					return 1;
+				}
+			}
+			return 0;
+		case INTEGER: case REAL: case ID:
+			return 0;
+		default:
+			return row_reads(expr->left,v,column,label,set) || row_reads(expr->right,v,column,label,set);
+	}
+}
+
+/* Reads of a fused producer not needed outside its kernels, which read the broadcast value */
+int kernel_reads_only(INSTRUCTION* producer, int label)
+{
+	FUSION* f = searchFusedProducer(producer);
+	if (f==NULL || f->producer_needed) {
+		return 0;
+	}
+	for (int k=0;k<fusions_count;k++) {
+		if (fusions[k].producer==producer && fusions[k].label!=label &&
+			(label_covers(fusions[k].label,label) || label_covers(label,fusions[k].label))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Every access to the row outside the broadcast rules and the kernels is to other membranes */
+int broadcast_ok(DEFINITIONS* defs, VAR* v, int column, int label)
+{
+	if (strcmp(v->name,"Y")==0) {
+		/* Y2 is read by the drawing and the server mode */
+		return 0;
+	}
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type!=PRODUCTION_RULE && inst->type!=CREATION_RULE) {
+				continue;
+			}
+			int set = set_label(inst);
+			if (inst->type==PRODUCTION_RULE && row_access(inst->object,v,column,label,set) &&
+				(!is_broadcast_rule(inst) || set!=label)) {
+				return 0;
+			}
+			if (inst->type==PRODUCTION_RULE && !kernel_reads_only(inst,label) &&
+				row_reads(inst->expr,v,column,label,set)) {
+				return 0;
+			}
+			if (row_reads(inst->enzyme,v,column,label,set) ||
+				(inst->type==CREATION_RULE && (row_reads(inst->object,v,column,label,set) ||
+				row_reads(inst->expr,v,column,label,set)))) {
+				return 0;
+			}
+			for (int k=0;inst->type==PRODUCTION_RULE && k<inst->object->arguments->size;k++) {
+				if (row_reads(inst->object->arguments->args[k],v,column,label,set)) {
+					return 0;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+void create_broadcasts(DEFINITIONS* defs)
+{
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (!is_broadcast_rule(inst) || searchBroadcastRule(inst)>=0 || broadcasts_count==SIM_MAX_BROADCASTS) {
+				continue;
+			}
+			VAR* v = searchVar(inst->object->id,2);
+			int column = inst->object->arguments->args[0]->intValue;
+			if (broadcast_ok(defs,v,column,set_label(inst))) {
+				broadcasts[broadcasts_count].var = v-vars;
+				broadcasts[broadcasts_count].column = column;
+				broadcasts[broadcasts_count].label = set_label(inst);
+				broadcasts_count++;
+			}
+		}
+	}
+}
+
+/* Query coordinate of a nearest kernel: the same for every membrane of label */
+int query_ok(EXPR* expr, int label)
+{
+	return searchBroadcast(expr,label)>=0 || (!uses_iterator(expr,"h") && !expr_draws(expr));
+}
+
+/* Point coordinate of a nearest kernel: a packed column */
+int point_ok(EXPR* expr, int label)
+{
+	return expr->type==OBJECT && searchPacked(expr,label)>=0 && searchBroadcast(expr,label)<0;
+}
+
+int add_nearest(int label, int x, int y)
+{
+	for (int k=0;k<nearests_count;k++) {
+		if (nearests[k].label==label && nearests[k].x==x && nearests[k].y==y) {
+			return k;
+		}
+	}
+	if (nearests_count==SIM_MAX_NEAREST) {
+		return -1;
+	}
+	nearests[nearests_count].label = label;
+	nearests[nearests_count].x = x;
+	nearests[nearests_count].y = y;
+	return nearests_count++;
+}
+
+void create_nearest()
+{
+	for (int k=0;k<fusions_count;k++) {
+		FUSION* f = &fusions[k];
+		EXPR* expr = f->producer->expr;
+		f->cond = NULL;
+		f->otherwise = NULL;
+		if (expr->type==FUNCTION && strcmp(expr->id,"if")==0 && expr->arguments->size==3 &&
+			query_ok(expr->arguments->args[0],-1) && query_ok(expr->arguments->args[2],-1)) {
+			f->cond = expr->arguments->args[0];
+			f->otherwise = expr->arguments->args[2];
+			expr = expr->arguments->args[1];
+		}
+		if (expr->type!=FUNCTION || strcmp(expr->id,"squaredDistance")!=0 || expr->arguments->size!=4) {
+			continue;
+		}
+		EXPR** args = expr->arguments->args;
+		for (int q=0;q<=2 && f->nearest<0;q+=2) {
+			int p = 2-q;
+			if (query_ok(args[q],f->label) && query_ok(args[q+1],f->label) &&
+				point_ok(args[p],f->label) && point_ok(args[p+1],f->label)) {
+				f->query[0] = args[q];
+				f->query[1] = args[q+1];
+				f->nearest = add_nearest(f->label,searchPacked(args[p],f->label),searchPacked(args[p+1],f->label));
+			}
+		}
+	}
+}
+
+/*
+ * Sqrt elision: a variable whose values are distances that only reach
+ * min/max reductions, arg_min/arg_max and comparisons is computed with
+ * squared distances instead. Constants in those positions are squared.
+ */
+int squared_changed = 0;
+
+int is_constant(EXPR* expr)
+{
+	return expr->type==INTEGER || expr->type==REAL;
+}
+
+int is_compare(EXPR* expr)
+{
+	switch(expr->type) {
+		case LT: case GT: case EQ: case NEQ: case LE: case GE:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+int squared_ok(EXPR* expr)
+{
+	switch(expr->type) {
+		case INTEGER:
+			return expr->intValue>=0;
+		case REAL:
+			return expr->doubleValue>=0;
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				return 0;
+			} else {
+				VAR* v = searchVar(expr->id,expr->arguments->size);
+				return v!=NULL && v->squared;
+			}
+		case FUNCTION:
+			if (strcmp(expr->id,"euclideanDistance")==0) {
+				return expr->arguments->size==4;
+			}
+			if (strcmp(expr->id,"min")==0 || strcmp(expr->id,"max")==0) {
+				return squared_ok(expr->arguments->args[0]);
+			}
+			if (strcmp(expr->id,"if")==0 && expr->arguments->size==3) {
+				return squared_ok(expr->arguments->args[1]) && squared_ok(expr->arguments->args[2]);
+			}
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+int squared_compare(EXPR* expr)
+{
+	return is_compare(expr) && squared_ok(expr->left) && squared_ok(expr->right) &&
+		!(is_constant(expr->left) && is_constant(expr->right));
+}
+
+void keep_squared(EXPR* expr);
+
+/* Reads in a position where the plain value is needed */
+void drop_squared(EXPR* expr)
+{
+	if (expr==NULL) {
+		return;
+	}
+	switch(expr->type) {
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				return;
+			} else {
+				VAR* v = searchVar(expr->id,expr->arguments->size);
+				if (v!=NULL && v->squared) {
+					v->squared = 0;
+					squared_changed = 1;
+				}
+			}
+			for (int i=0;i<expr->arguments->size;i++) {
+				drop_squared(expr->arguments->args[i]);
+			}
+			break;
+		case FUNCTION:
+			if (strcmp(expr->id,"arg_min")==0 || strcmp(expr->id,"arg_max")==0 || strcmp(expr->id,"count")==0) {
+				EXPR* values = expr->arguments->args[0];
+				for (int i=0;values->arguments!=NULL && i<values->arguments->size;i++) {
+					drop_squared(values->arguments->args[i]);
+				}
+				return;
+			}
+			for (int i=0;i<expr->arguments->size;i++) {
+				drop_squared(expr->arguments->args[i]);
+			}
+			break;
+		case INTEGER: case REAL: case ID:
+			break;
+		default:
+			if (squared_compare(expr)) {
+				keep_squared(expr->left);
+				keep_squared(expr->right);
+			} else {
+				drop_squared(expr->left);
+				drop_squared(expr->right);
+			}
+	}
+}
+
+/* Reads in a position where the squared value is enough */
+void keep_squared(EXPR* expr)
+{
+	switch(expr->type) {
+		case OBJECT:
+			for (int i=0;i<expr->arguments->size;i++) {
+				drop_squared(expr->arguments->args[i]);
+			}
+			break;
+		case FUNCTION:
+			if (strcmp(expr->id,"if")==0) {
+				drop_squared(expr->arguments->args[0]);
+				keep_squared(expr->arguments->args[1]);
+				keep_squared(expr->arguments->args[2]);
+			} else if (strcmp(expr->id,"euclideanDistance")==0) {
+				for (int i=0;i<expr->arguments->size;i++) {
+					drop_squared(expr->arguments->args[i]);
+				}
+			} else {
+				keep_squared(expr->arguments->args[0]);
+			}
+			break;
+		default:
+			;
+	}
+}
+
+/* The squared value comes from a distance */
+int squared_derived(EXPR* expr)
+{
+	switch(expr->type) {
+		case OBJECT:
+			return searchVar(expr->id,expr->arguments->size)->squared==2;
+		case FUNCTION:
+			if (strcmp(expr->id,"euclideanDistance")==0) {
+				return 1;
+			}
+			if (strcmp(expr->id,"if")==0) {
+				return squared_derived(expr->arguments->args[1]) || squared_derived(expr->arguments->args[2]);
+			}
+			return squared_derived(expr->arguments->args[0]);
+		default:
+			return 0;
+	}
+}
+
+void check_squared(DEFINITIONS* defs)
+{
+	do {
+		squared_changed = 0;
+		for (int i=0;i<defs->size;i++) {
+			DEFINITION* def = defs->definitions[i];
+			for (int j=0;j<def->size;j++) {
+				INSTRUCTION* inst = def->instructions[j];
+				if (inst->type==PRODUCTION_RULE || inst->type==INIT_VARIABLE) {
+					VAR* v = searchVar(inst->object->id,inst->object->arguments->size);
+					if (v->squared && !squared_ok(inst->expr)) {
+						v->squared = 0;
+						squared_changed = 1;
+					}
+					if (v->squared) {
+						keep_squared(inst->expr);
+					} else {
+						drop_squared(inst->expr);
+					}
+					for (int k=0;k<inst->object->arguments->size;k++) {
+						drop_squared(inst->object->arguments->args[k]);
+					}
+					drop_squared(inst->enzyme);
+				} else if (inst->type==CREATION_RULE) {
+					drop_squared(inst->object);
+					drop_squared(inst->expr);
+					drop_squared(inst->enzyme);
+				}
+			}
+		}
+	} while (squared_changed);
+}
+
+EXPR* square_value(EXPR* expr);
+
+EXPR* square_compares(EXPR* expr)
+{
+	if (expr==NULL) {
+		return NULL;
+	}
+	switch(expr->type) {
+		case OBJECT: case FUNCTION:
+			for (int i=0;expr->arguments!=NULL && i<expr->arguments->size;i++) {
+				expr->arguments->args[i] = square_compares(expr->arguments->args[i]);
+			}
+			break;
+		case INTEGER: case REAL: case ID:
+			break;
+		default:
+			if (squared_compare(expr)) {
+				expr->left = square_value(expr->left);
+				expr->right = square_value(expr->right);
+			} else {
+				expr->left = square_compares(expr->left);
+				expr->right = square_compares(expr->right);
+			}
+	}
+	return expr;
+}
+
+EXPR* square_value(EXPR* expr)
+{
+	switch(expr->type) {
+		case INTEGER:
+			return createReal((double)expr->intValue*expr->intValue);
+		case REAL:
+			return createReal(expr->doubleValue*expr->doubleValue);
+		case FUNCTION:
+			if (strcmp(expr->id,"euclideanDistance")==0) {
+				expr->id = "squaredDistance";
+			} else if (strcmp(expr->id,"if")==0) {
+				expr->arguments->args[0] = square_compares(expr->arguments->args[0]);
+				expr->arguments->args[1] = square_value(expr->arguments->args[1]);
+				expr->arguments->args[2] = square_value(expr->arguments->args[2]);
+			}
+			return expr;
+		default:
+			return expr;
+	}
+}
+
+void elide_sqrt(DEFINITIONS* defs)
+{
+	int derived = 1;
+	while (derived) {
+		check_squared(defs);
+		/* keep only the variables that hold squared distances */
+		for (int k=0;k<vars_count;k++) {
+			if (vars[k].squared) {
+				vars[k].squared = 1;
+			}
+		}
+		int changed = 1;
+		while (changed) {
+			changed = 0;
+			for (int i=0;i<defs->size;i++) {
+				DEFINITION* def = defs->definitions[i];
+				for (int j=0;j<def->size;j++) {
+					INSTRUCTION* inst = def->instructions[j];
+					if (inst->type!=PRODUCTION_RULE && inst->type!=INIT_VARIABLE) {
+						continue;
+					}
+					VAR* v = searchVar(inst->object->id,inst->object->arguments->size);
+					if (v->squared==1 && squared_derived(inst->expr)) {
+						v->squared = 2;
+						changed = 1;
+					}
+				}
+			}
+		}
+		derived = 0;
+		for (int k=0;k<vars_count;k++) {
+			if (vars[k].squared==1) {
+				vars[k].squared = 0;
+				derived = 1;
+			}
+		}
+	}
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type==PRODUCTION_RULE || inst->type==INIT_VARIABLE) {
+				if (searchVar(inst->object->id,inst->object->arguments->size)->squared) {
+					inst->expr = square_value(inst->expr);
+				} else {
+					inst->expr = square_compares(inst->expr);
+				}
+				inst->enzyme = square_compares(inst->enzyme);
+			} else if (inst->type==CREATION_RULE) {
+				inst->enzyme = square_compares(inst->enzyme);
+			}
+		}
+	}
+}
+
+/*
+ * Common subexpressions of scalar production rules that run in the same
+ * step under the same enzyme.
+ */
+int expr_equals(EXPR* a, EXPR* b)
+{
+	if (a==NULL || b==NULL) {
+		return a==b;
+	}
+	if (a->type!=b->type) {
+		return 0;
+	}
+	switch(a->type) {
+		case INTEGER:
+			return a->intValue==b->intValue;
+		case REAL:
+			return a->doubleValue==b->doubleValue;
+		case ID:
+			return strcmp(a->id,b->id)==0;
+		case OBJECT: case FUNCTION:
+			if (strcmp(a->id,b->id)!=0) {
+				return 0;
+			}
+			if (a->arguments==NULL || b->arguments==NULL) {
+				return a->arguments==b->arguments;
+			}
+			if (a->arguments->size!=b->arguments->size) {
+				return 0;
+			}
+			for (int i=0;i<a->arguments->size;i++) {
+				if (!expr_equals(a->arguments->args[i],b->arguments->args[i])) {
+					return 0;
+				}
+			}
+			return 1;
+		default:
+			return expr_equals(a->left,b->left) && expr_equals(a->right,b->right);
+	}
+}
+
+int same_step(INSTRUCTION* a, INSTRUCTION* b)
+{
+	return a->type==PRODUCTION_RULE && b->type==PRODUCTION_RULE &&
+		a->iterators->size==0 && b->iterators->size==0 &&
+		protein_of(a)>=0 && protein_of(a)==protein_of(b) && expr_equals(a->enzyme,b->enzyme);
+}
+
+/* Reads of the candidate do not race with writes of the same step */
+int common_safe(DEFINITIONS* defs, INSTRUCTION* user, EXPR* expr)
+{
+	if (expr_draws(expr) || expr_reduces(expr)) {
+		return 0;
+	}
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type==PRODUCTION_RULE && (protein_of(inst)<0 || protein_of(inst)==protein_of(user)) &&
+				expr_reads(expr,inst->object->id,inst->object->arguments->size)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+int searchCommon(INSTRUCTION* inst, EXPR* expr)
+{
+	if (inst==NULL) {
+		return -1;
+	}
+	for (int k=0;k<commons_count;k++) {
+		if (same_step(commons[k].inst,inst) && expr_equals(commons[k].expr,expr)) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+/* Arithmetic over variables and constants is not worth hoisting */
+int expr_cheap(EXPR* expr)
+{
+	if (expr==NULL) {
+		return 1;
+	}
+	switch(expr->type) {
+		case FUNCTION:
+			return 0;
+		case OBJECT: case INTEGER: case REAL: case ID:
+			return 1;
+		default:
+			return expr_cheap(expr->left) && expr_cheap(expr->right);
+	}
+}
+
+/* Occurrences of candidate subexpressions, hashed by step and structure */
+typedef struct Occurrence
+{
+	EXPR* expr;
+	INSTRUCTION* inst;
+	INSTRUCTION* last;
+	int uses;
+	int reciprocal;
+} OCCURRENCE;
+
+OCCURRENCE* occurrences = NULL;
+int occurrences_capacity = 0;
+
+uint64_t expr_hash(EXPR* expr)
+{
+	if (expr==NULL) {
+		return 0;
+	}
+	uint64_t h = (uint64_t)expr->type * 0x100000001B3ULL;
+	switch(expr->type) {
+		case INTEGER:
+			return h ^ (uint64_t)expr->intValue;
+		case REAL:
+			return h ^ (uint64_t)(expr->doubleValue*1024);
+		case ID:
+			return h ^ hashString(expr->id);
+		case OBJECT: case FUNCTION:
+			h ^= hashString(expr->id);
+			for (int i=0;expr->arguments!=NULL && i<expr->arguments->size;i++) {
+				h = (h ^ expr_hash(expr->arguments->args[i])) * 0x100000001B3ULL;
+			}
+			return h;
+		default:
+			h = (h ^ expr_hash(expr->left)) * 0x100000001B3ULL;
+			return (h ^ expr_hash(expr->right)) * 0x100000001B3ULL;
+	}
+}
+
+int is_candidate(EXPR* expr)
+{
+	if (expr==NULL) {
+		return 0;
+	}
+	switch(expr->type) {
+		case OBJECT: case INTEGER: case REAL: case ID:
+			return 0;
+		case FUNCTION:
+			return !is_reduction(expr->id);
+		default:
+			return 1;
+	}
+}
+
+int count_candidates(EXPR* expr)
+{
+	if (!is_candidate(expr)) {
+		return 0;
+	}
+	int count = 1;
+	if (expr->type==FUNCTION) {
+		for (int i=0;i<expr->arguments->size;i++) {
+			count += count_candidates(expr->arguments->args[i]);
+		}
+	} else {
+		count += count_candidates(expr->left) + count_candidates(expr->right);
+	}
+	return count;
+}
+
+OCCURRENCE* searchOccurrence(INSTRUCTION* inst, EXPR* expr, int add)
+{
+	uint64_t h = expr_hash(expr) ^ ((uint64_t)protein_of(inst) * 0x9E3779B97F4A7C15ULL) ^ expr_hash(inst->enzyme);
+	int i = (int)(h & (occurrences_capacity-1));
+	while (occurrences[i].expr!=NULL) {
+		if (same_step(occurrences[i].inst,inst) && expr_equals(occurrences[i].expr,expr)) {
+			return &occurrences[i];
+		}
+		i = (i+1) & (occurrences_capacity-1);
+	}
+	if (!add) {
+		return NULL;
+	}
+	occurrences[i].expr = expr;
+	occurrences[i].inst = inst;
+	occurrences[i].reciprocal = 1;
+	return &occurrences[i];
+}
+
+void add_occurrences(INSTRUCTION* inst, EXPR* expr, int divisor)
+{
+	if (!is_candidate(expr)) {
+		return;
+	}
+	OCCURRENCE* o = searchOccurrence(inst,expr,1);
+	if (o->last!=inst) {
+		o->uses++;
+		o->last = inst;
+	}
+	o->reciprocal = o->reciprocal && divisor;
+	if (expr->type==FUNCTION) {
+		for (int i=0;i<expr->arguments->size;i++) {
+			add_occurrences(inst,expr->arguments->args[i],0);
+		}
+	} else {
+		add_occurrences(inst,expr->left,0);
+		add_occurrences(inst,expr->right,expr->type==DIV);
+	}
+}
+
+void find_commons(DEFINITIONS* defs, INSTRUCTION* inst, EXPR* expr)
+{
+	if (!is_candidate(expr) || commons_count==SIM_MAX_COMMONS) {
+		return;
+	}
+	if (searchCommon(inst,expr)>=0) {
+		return;
+	}
+	OCCURRENCE* o = searchOccurrence(inst,expr,0);
+	if (o->uses>1 && !expr_cheap(expr) && common_safe(defs,inst,expr)) {
+		commons[commons_count].expr = expr;
+		commons[commons_count].inst = inst;
+		commons[commons_count].reciprocal = o->reciprocal;
+		commons_count++;
+		return;
+	}
+	if (expr->type==FUNCTION) {
+		for (int i=0;i<expr->arguments->size;i++) {
+			find_commons(defs,inst,expr->arguments->args[i]);
+		}
+	} else {
+		find_commons(defs,inst,expr->left);
+		find_commons(defs,inst,expr->right);
+	}
+}
+
+int common_rule(INSTRUCTION* inst)
+{
+	return inst->type==PRODUCTION_RULE && inst->iterators->size==0 && protein_of(inst)>=0 && searchReducer(inst)<0;
+}
+
+void create_commons(DEFINITIONS* defs)
+{
+	int candidates = 0;
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			if (common_rule(def->instructions[j])) {
+				candidates += count_candidates(def->instructions[j]->expr);
+			}
+		}
+	}
+	occurrences_capacity = 16;
+	while (occurrences_capacity < candidates*2) {
+		occurrences_capacity *= 2;
+	}
+	occurrences = (OCCURRENCE*)calloc(occurrences_capacity,sizeof(OCCURRENCE));
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			if (common_rule(def->instructions[j])) {
+				add_occurrences(def->instructions[j],def->instructions[j]->expr,0);
+			}
+		}
+	}
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			if (common_rule(def->instructions[j])) {
+				find_commons(defs,def->instructions[j],def->instructions[j]->expr);
+			}
+		}
+	}
+	free(occurrences);
+	occurrences = NULL;
+}
+
+/* creation_functions is filled in rule order */
+void add_loop(INSTRUCTION* inst, int fusion, int single, int label)
+{
+	if (loops_count==loops_capacity) {
+		loops_capacity = loops_capacity==0 ? 64 : loops_capacity*2;
+		loops = (LOOP*)realloc(loops,sizeof(LOOP)*loops_capacity);
+	}
+	LOOP* l = &loops[loops_count++];
+	l->inst = inst;
+	l->fusion = fusion;
+	l->single = single;
+	l->shape = ((uint64_t)(fusion<0 ? inst->type : 8+single) ^ ((uint64_t)label << 8)) * 0x100000001B3ULL;
+	l->shape = (l->shape ^ expr_hash(inst->expr)) * 0x100000001B3ULL;
+	l->shape = (l->shape ^ expr_hash(inst->object)) * 0x100000001B3ULL;
+}
+
+int searchLoop(INSTRUCTION* inst, int fusion, int single)
+{
+	for (int k=0;k<loops_count;k++) {
+		if (loops[k].inst==inst && loops[k].fusion==fusion && loops[k].single==single) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+/* Creation rules of the library run in rule order and have no loop */
+void create_loops(DEFINITIONS* defs)
+{
+	for (int k=0;k<fusions_count;k++) {
+		add_loop(fusions[k].producer,k,0,fusions[k].label);
+		if (single_bound(fusions[k].label)>0) {
+			add_loop(fusions[k].producer,k,1,fusions[k].label);
+		}
+	}
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type!=PRODUCTION_RULE && (inst->type!=CREATION_RULE || library)) {
+				continue;
+			}
+			for (int k=0;k<inst->iterators->size;k++) {
+				if (inst->iterators->iterators[k]->type==SET_ITERATOR) {
+					add_loop(inst,-1,0,inst->iterators->iterators[k]->left->intValue);
+					break;
+				}
+			}
+		}
+	}
+}
+
+int has_loop(INSTRUCTION* inst)
+{
+	for (int k=0;k<loops_count;k++) {
+		if (loops[k].inst==inst) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* rules is sorted, the lists of functions are filled in rule order */
+int search_function(int* rules, int count, int rule)
+{
+	int lo = 0;
+	int hi = count-1;
+	while (lo<=hi) {
+		int mid = (lo+hi)/2;
+		if (rules[mid]==rule) {
+			return 1;
+		} else if (rules[mid]<rule) {
+			lo = mid+1;
+		} else {
+			hi = mid-1;
+		}
+	}
+	return 0;
+}
+
+int is_creation_function(int rule)
+{
+	return search_function(creation_functions,creation_functions_count,rule);
+}
+
+int is_loop_function(int rule)
+{
+	return search_function(loop_functions,loop_functions_count,rule);
+}
+
+/* Writes the broadcast rows out to the membranes they cover */
+void generate_materialize(FILE* fp)
+{
+	fprintf(fp,"\nvoid broadcast_materialize(%s)\n",state_param);
+	fprintf(fp,"{\n");
+	for (int i=0;i<broadcasts_count;i++) {
+		BROADCAST* b = &broadcasts[i];
+		VAR* v = &vars[b->var];
+		fprintf(fp,"\tfor (int h=0;h<%sbroadcast_%s_%d_%d_size;h++) {\n",state,v->name,b->column,b->label);
+		fprintf(fp,"\t\t%s%s2[%d][%smembranes_in_%d[h]] = %sbroadcast_%s_%d_%d;\n",
+		  state,v->name,b->column,state,b->label,state,v->name,b->column,b->label);
+		fprintf(fp,"\t}\n");
+	}
+	fprintf(fp,"}\n");
+}
+
+void generate_state_hash(FILE* fp)
+{
+	if (broadcasts_count>0) {
+		generate_materialize(fp);
+	}
+	fprintf(fp,"\n// FINAL STATE HASH\n");
+	fprintf(fp,"\nuint64_t %s(%s)\n",library ? "ctx_hash" : "state_hash",state_param);
+	fprintf(fp,"{\n");
+	if (broadcasts_count>0) {
+		fprintf(fp,"\tbroadcast_materialize(%s);\n",state_arg);
+	}
+	fprintf(fp,"\tuint64_t hash = 0xCBF29CE484222325ULL;\n");
+	fprintf(fp,"\thash = hash_bytes(hash,&%sstep,sizeof(int));\n",state);
+	fprintf(fp,"\thash = hash_bytes(hash,&%sprotein,sizeof(int));\n",state);
+	for (int i=0;i<labels_count;i++) {
+		fprintf(fp,"\thash = hash_bytes(hash,&%smembranes_in_%d_size,sizeof(int));\n",state,labels[i]);
+		fprintf(fp,"\thash = hash_bytes(hash,%smembranes_in_%d,sizeof(int)*%smembranes_in_%d_size);\n",state,labels[i],state,labels[i]);
+	}
+	fprintf(fp,"\thash = hash_bytes(hash,%smembranes,sizeof(int)*%d);\n",state,SIM_MAX_MEMBRANES);
+	for (int i=0;i<vars_count;i++) {
+		if (vars[i].indexes==1) {
+			fprintf(fp,"\thash = hash_bytes(hash,%s%s%d,sizeof(%s)*%d);\n",state,vars[i].name,vars[i].indexes,var_types[vars[i].type],vars[i].limits[0]);
+		} else {
+			fprintf(fp,"\tfor (int i=0;i<%d;i++) hash = hash_bytes(hash,%s%s%d[i],sizeof(%s)*%d);\n",
+			  vars[i].limits[0],state,vars[i].name,vars[i].indexes,var_types[vars[i].type],vars[i].limits[1]);
+		}
+	}
+	fprintf(fp,"\treturn hash;\n");
+	fprintf(fp,"}\n");
+}
+
+/* Body of the main loop, one computation step */
+void generate_step(FILE* fp)
+{
+	if (!library) {
+		fprintf(fp,"\t\tif (metrics_on) metrics_step(protein);\n");
+	}
+	fprintf(fp,"\t\tif(%sdebug) {\n",state);
+	fprintf(fp,"\t\t\tprintf(\"\\n\\n------ STEP %%d protein = %%d------\\n\",%sstep+1,%sprotein);\n",state,state);
+	fprintf(fp,"\t\t}\n");
+	for (int i=0;i<commons_count;i++) {
+		fprintf(fp,"\t\tcommon%d(%s);\n",i,state_arg);
+	}
+	int sections = 0;
+	for (int i=0;i<functions;i++) {
+		sections += !(library && is_creation_function(i)) && !is_loop_function(i);
+	}
+	if (sections>0) {
+		fprintf(fp,"\t\t#pragma omp parallel num_threads(%sthreads)\n",state);
+		fprintf(fp,"\t\t{\n");
+		fprintf(fp,"\t\t\t#pragma omp sections\n");
+		fprintf(fp,"\t\t\t{\n");
+	}
+	for (int i=0;i<functions;i++) {
+		if ((library && is_creation_function(i)) || is_loop_function(i)) {
+			continue;
+		}
+		fprintf(fp,"\t\t\t\t#pragma omp section\n");
+		if (is_creation_function(i)) {
+			fprintf(fp,"\t\t\t\tif (!deterministic) rule%d();\n",i);
+		} else {
+			fprintf(fp,"\t\t\t\trule%d(%s);\n",i,state_arg);
+		}
+	}		
+	if (sections>0) {
+		fprintf(fp,"\t\t\t}\n");
+		fprintf(fp,"\t\t}\n");
+	}
+	if (loop_functions_count>0) {
+		fprintf(fp,"\t\t// RULES WITH A PARALLEL LOOP, OUTSIDE THE SECTIONS\n");
+	}
+	for (int i=0;i<loop_functions_count;i++) {
+		int rule = loop_functions[i];
+		if (library && is_creation_function(rule)) {
+			continue;
+		}
+		if (is_creation_function(rule)) {
+			fprintf(fp,"\t\tif (!deterministic) rule%d();\n",rule);
+		} else {
+			fprintf(fp,"\t\trule%d(%s);\n",rule,state_arg);
+		}
+	}
+	if (creation_functions_count>0) {
+		fprintf(fp,"\t\t// CREATION RULES IN RULE ORDER\n");
+		fprintf(fp,"\t\tif (%s) {\n",library ? "1" : "deterministic");
+		for (int i=0;i<creation_functions_count;i++) {
+			fprintf(fp,"\t\t\trule%d(%s);\n",creation_functions[i],state_arg);
+		}
+		fprintf(fp,"\t\t}\n");
+	}
+	fprintf(fp,"\t\t%sprotein = %snext_protein;\n",state,state);
+	fprintf(fp,"\t\tif(%sdebug) {\n",state);
+	fprintf(fp,"\t\t\tprintf(\"\\n----MEMBRANES---\\n\");\n");
+	fprintf(fp,"\t\t\tfor (int i=0;i<%d;i++) {\n",SIM_MAX_MEMBRANES);
+	fprintf(fp,"\t\t\t\tif (%smembranes[i]!=0) {\n",state);
+	fprintf(fp,"\t\t\t\t\tprintf(\"p(%%d) = %%d \",i,(%smembranes[i] & 0x00FFFFFF));\n",state);
+	fprintf(fp,"\t\t\t\t}\n");
+	fprintf(fp,"\t\t\t}\n");
+	
+	fprintf(fp,"\t\t\tprintf(\"\\n\\n----VARIABLES---\\n\");\n");
+	
+	for (int i=0;i<vars_count;i++) {
+		if (vars[i].indexes==1) {
+			
+			fprintf(fp,"\t\t\tfor (int i=0;i<%d;i++) {\n",vars[i].limits[0]);
+			fprintf(fp,"\t\t\t\tif(!%s(%s%s%d[i])) printf(\"%s%d[%%d] = %%.2f \",i,%s((double)%s%s%d[i]));\n",
+			  unset_check[vars[i].type],
+			  state,
+			  vars[i].name,
+			  vars[i].indexes,
+			  vars[i].name,
+			  vars[i].indexes,
+			  vars[i].squared ? "sqrt" : "",
+			  state,
+			  vars[i].name,
+			  vars[i].indexes);	
+			fprintf(fp,"\t\t\t}\n");
+			
+		} else {
+			fprintf(fp,"\t\t\tfor (int i=0;i<%d;i++) {\n",vars[i].limits[0]);
+			fprintf(fp,"\t\t\t\tfor (int j=0;j<%d;j++) {\n",vars[i].limits[1]);
+			fprintf(fp,"\t\t\t\t\tif(!%s(%s%s%d[i][j])) printf(\"%s[%%d][%%d] = %%.2f \",i,j,%s((double)%s%s%d[i][j]));\n",
+			  unset_check[vars[i].type],
+			  state,
+			  vars[i].name,
+			  vars[i].indexes,
+			  vars[i].name,
+			  vars[i].squared ? "sqrt" : "",
+			  state,
+			  vars[i].name,
+			  vars[i].indexes);	
+			fprintf(fp,"\t\t\t\t}\n");	  
+			fprintf(fp,"\t\t\t}\n");	
+		}
+	}
+	
+	fprintf(fp,"\t\t\tprintf(\"\\n\\nPress ENTER for next step\");\n");
+	fprintf(fp,"\t\t\tgetchar();\n");
+	fprintf(fp,"\t\t}\n");
+	
+	fprintf(fp,"\t\t++%sstep;\n",state);
+	if (nearests_count>0) {
+		fprintf(fp,"\t\tif (%sreorder>0 && %sstep%%%sreorder==0) {\n",state,state,state);
+		fprintf(fp,"\t\t\treorder_labels(%s);\n",state_arg);
+		fprintf(fp,"\t\t}\n");
+	}
+}
+
+/* Condition for one more step: Halt{mem} not set or 0, always true in a model without Halt{mem} */
+void generate_running(FILE* fp)
+{
+	VAR* halt = searchVar("Halt",1);
+	if (halt==NULL) {
+		fprintf(fp,"1");
+		return;
+	}
+	fprintf(fp,"(%s(%sHalt1[0]) || %sHalt1[0]==0)",unset_check[halt->type],state,state);
+}
+
+void generate_loop(FILE* fp, DEFINITIONS* defs)
+{
+	fprintf(fp,"// MAIN LOOP\n");
+	if (library) {
+		fprintf(fp,"\nint ctx_halted(renpsm_ctx* ctx)\n");
+		fprintf(fp,"{\n");
+		fprintf(fp,"\treturn !");
+		generate_running(fp);
+		fprintf(fp,";\n");
+		fprintf(fp,"}\n");
+		fprintf(fp,"\nint ctx_step(renpsm_ctx* ctx, int n)\n");
+		fprintf(fp,"{\n");
+		fprintf(fp,"\tint steps = 0;\n");
+		fprintf(fp,"\twhile(steps<n && !ctx_halted(ctx))\n");
+		fprintf(fp,"\t{\n");
+		generate_step(fp);
+		fprintf(fp,"\t\t++steps;\n");
+		fprintf(fp,"\t}\n");
+		fprintf(fp,"\treturn steps;\n");
+		fprintf(fp,"}\n");
+		fprintf(fp,"\nint ctx_run_until_halt(renpsm_ctx* ctx)\n");
+		fprintf(fp,"{\n");
+		fprintf(fp,"\treturn ctx->step<ctx->max_steps ? ctx_step(ctx,ctx->max_steps-ctx->step) : 0;\n");
+		fprintf(fp,"}\n");
+		return;
+	}
+	fprintf(fp,"\nvoid loop()\n");
+	fprintf(fp,"{\n");
+	fprintf(fp,"\ttimed_out = 0;\n");
+	fprintf(fp,"\twhile(step<max_steps && ");
+	generate_running(fp);
+	fprintf(fp,")\n");
+	fprintf(fp,"\t{\n");
+	fprintf(fp,"\t\tif (deadline_time>0 && protein==1 && omp_get_wtime()>=deadline_time) {\n");
+	fprintf(fp,"\t\t\ttimed_out = 1;\n");
+	fprintf(fp,"\t\t\tbreak;\n");
+	fprintf(fp,"\t\t}\n");
+	generate_step(fp);
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"}\n");
+	
+}
+
+void generate_var(FILE* fp, EXPR* obj,int in);
+void generate_expr(FILE* fp, EXPR* expr, int val);
+
+void generate_iterator(FILE* fp, EXPR* expr, int val)
+{
+	if (strcmp(expr->id,"h")==0 && packing>=0) {
+		fprintf(fp,"%spacked_label_%d[h]",state,packing);
+	} else if (strcmp(expr->id,"h")==0) {
+		fprintf(fp,"%smembranes_in_%d[h]",state,val);
+	} else {
+		fprintf(fp,"%s",expr->id);
+	}
+}
+
+/* Integer arithmetic only on iterators and constants, which are always set */
+int may_be_unset(EXPR* expr)
+{
+	if (expr==NULL) {
+		return 0;
+	}
+	switch(expr->type) {
+		case OBJECT:
+			return expr->arguments!=NULL;
+		case ADD: case SUB: case MUL:
+			return may_be_unset(expr->left) || may_be_unset(expr->right);
+		default:
+			return 0;
+	}
+}
+
+void generate_label_operand(FILE* fp, EXPR* expr, int val);
+
+void generate_int_expr(FILE* fp, EXPR* expr, int val)
+{
+	if (expr==NULL) {
+		return;
+	}
+	switch(expr->type) {
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				generate_iterator(fp,expr,val);
+			} else {
+				generate_var(fp,expr,val);
+			}
+			break;
+		case INTEGER:
+			fprintf(fp,"%d",expr->intValue);
+			break;
+		default:
+			if (!may_be_unset(expr)) {
+				fprintf(fp,"(");
+				generate_int_expr(fp,expr->left,val);
+				printType(fp,expr->type);
+				generate_int_expr(fp,expr->right,val);
+				fprintf(fp,")");
+				break;
+			}
+			fprintf(fp,"label_%s(",expr->type==ADD ? "add" : expr->type==SUB ? "sub" : "mul");
+			if (expr->left==NULL) {
+				fprintf(fp,"0");
+			} else {
+				generate_label_operand(fp,expr->left,val);
+			}
+			fprintf(fp,",");
+			generate_label_operand(fp,expr->right,val);
+			fprintf(fp,")");
+	}
+}
+
+/* An operand of label arithmetic, with the unset flags turned into unset labels */
+void generate_label_operand(FILE* fp, EXPR* expr, int val)
+{
+	if (expr->type==OBJECT && expr->arguments!=NULL && searchVar(expr->id,expr->arguments->size)->type==VAR_FLAG) {
+		fprintf(fp,"flag_label(");
+		generate_var(fp,expr,val);
+		fprintf(fp,")");
+	} else {
+		generate_int_expr(fp,expr,val);
+	}
+}
+
+/* Membrane labels and indexes: plain integers when inferred, rounded otherwise */
+void generate_index(FILE* fp, EXPR* expr, int val)
+{
+	if (is_int_arith(expr)) {
+		generate_int_expr(fp,expr,val);
+	} else {
+		fprintf(fp,"(int)round(");
+		generate_expr(fp,expr,val);
+		fprintf(fp,")");
+	}
+}
+
+/* Value written to a variable of the given type */
+void generate_value(FILE* fp, EXPR* expr, int val, int type)
+{
+	if (type==VAR_LABEL && is_int_arith(expr)) {
+		generate_label_operand(fp,expr,val);
+	} else if (type==VAR_FLAG && is_int_arith(expr) && expr_type(expr)==VAR_FLAG) {
+		generate_int_expr(fp,expr,val);
+	} else {
+		fprintf(fp,"%s(",to_type[type]);
+		generate_expr(fp,expr,val);
+		fprintf(fp,")");
+	}
+}
+
+void print_index(FILE* fp, EXPR* obj, int index, int in)
+{
+	EXPR* arg = obj->arguments->args[index];
+	if (arg->type==INTEGER) {
+		fprintf(fp,"%d",arg->intValue);
+	} else {
+		generate_index(fp,arg,in);
+	}
+}
+
+void generate_var(FILE* fp, EXPR* obj,int in)
+{
+	VAR *v = searchVar(obj->id,obj->arguments->size);
+	fprintf(fp,"%s%s%d",state,v->name,v->indexes);
+	for (int i=0;i<v->indexes;i++) {
+		fprintf(fp,"[");
+		print_index(fp,obj,i,in);
+		fprintf(fp,"]");
+	}
+}
+
+void generate_reduction(FILE* fp, EXPR* expr)
+{
+	if (expr->arguments->iterators!=NULL && expr->arguments->iterators->size>0) {
+		EXPR* values = expr->arguments->args[0];
+		int val = expr->arguments->iterators->iterators[0]->left->intValue;
+		int column = 0;
+		if (values->arguments->size>1 && values->arguments->args[1]->type==INTEGER) {
+			column = values->arguments->args[1]->intValue;
+		}
+		fprintf(fp,"function_%s(%s%s%d,%d,%smembranes_in_%d,%smembranes_in_%d_size)",
+		  expr->id,state,values->id,values->arguments->size,column,state,val,state,val);
+	}
+}
+
+void generate_broadcast_value(FILE* fp, BROADCAST* b, char* cast)
+{
+	VAR* v = &vars[b->var];
+	fprintf(fp,"%s%s(%sbroadcast_%s_%d_%d)",cast,from_type[v->type],state,v->name,b->column,b->label);
+}
+
+/* Float part of a single precision kernel, see float_root */
+void generate_float_expr(FILE* fp, EXPR* expr)
+{
+	switch(expr->type) {
+		case INTEGER:
+			fprintf(fp,"%d",expr->intValue);
+			break;
+		case OBJECT: {
+			PACKED* p = &packed[searchPacked(expr,packing)];
+			int b = searchBroadcast(expr,packing);
+			if (b>=0) {
+				fprintf(fp,"(h<%sbroadcast_%s_%d_%d_size ? ",state,vars[p->var].name,p->column,packing);
+				generate_broadcast_value(fp,&broadcasts[b],"(float)");
+				fprintf(fp," : %spacked_%s_%d_%d[h])",state,vars[p->var].name,p->column,packing);
+			} else {
+				fprintf(fp,"%spacked_%s_%d_%d[h]",state,vars[p->var].name,p->column,packing);
+			}
+			break;
+		}
+		case FUNCTION:
+			fprintf(fp,"function_%s_f(",expr->id);
+			for (int i=0;i<expr->arguments->size;i++) {
+				fprintf(fp,"%s",i>0 ? ", " : "");
+				generate_float_expr(fp,expr->arguments->args[i]);
+			}
+			fprintf(fp,")");
+			break;
+		default:
+			fprintf(fp,"(");
+			generate_float_expr(fp,expr->left);
+			printType(fp,expr->type);
+			generate_float_expr(fp,expr->right);
+			fprintf(fp,")");
+	}
+}
+
+void generate_expr(FILE* fp, EXPR* expr, int val)
+{
+	if (expr==NULL) {
+		return;
+	}
+	if (packing_single && float_root(expr,packing)) {
+		fprintf(fp,"(double)");
+		generate_float_expr(fp,expr);
+		return;
+	}
+	int column;
+	int common = searchCommon(current_inst,expr);
+	if (common>=0) {
+		fprintf(fp,"%scommon_%d",state,common);
+		return;
+	}
+	if (expr->type==DIV && (common = searchCommon(current_inst,expr->right))>=0 && commons[common].reciprocal) {
+		fprintf(fp,"(");
+		generate_expr(fp,expr->left,val);
+		fprintf(fp,"*%scommon_%d)",state,common);
+		return;
+	}
+	switch(expr->type) {
+		case FUNCTION:
+			if (is_reduction(expr->id)) {
+				generate_reduction(fp,expr);
+			} else {
+				/* In library mode the map and the random generator are those of the context */
+				int collision = library && (strcmp(expr->id,"collision")==0 || strcmp(expr->id,"extend")==0);
+				if (collision) {
+					fprintf(fp,"function_%s_map(%smap",expr->id,state);
+				} else if (library && strcmp(expr->id,"random")==0) {
+					fprintf(fp,"function_random_keyed(");
+				} else if (library && strcmp(expr->id,"uniform")==0) {
+					fprintf(fp,"function_uniform_keyed(");
+				} else if (strcmp(expr->id,"goal")==0) {
+					/* The coin of a step, and the sequence index, are keyed by the seed and the step */
+					fprintf(fp,"function_goal(%s,%sstep,%s,",library ? "ctx->seed" : "rng_seed",state,library ? "1" : "deterministic");
+				} else if (strcmp(expr->id,"random_free")==0) {
+					fprintf(fp,"%s,%sstep,",library ? "function_random_free_map(ctx->map,ctx->seed" : "function_random_free(rng_seed",state);
+				} else if (strcmp(expr->id,"halton")==0 || strcmp(expr->id,"sobol")==0) {
+					fprintf(fp,"function_%s(%s,%sstep,&%ssample_cycle,",expr->id,library ? "ctx->seed" : "rng_seed",state,state);
+				} else {
+					fprintf(fp,"function_%s(",expr->id);
+				}
+					for (int i=0;i<expr->arguments->size;i++) {
+						if (i>0 || collision) {
+							fprintf(fp,", ");
+						}
+						generate_expr(fp,expr->arguments->args[i],val);
+					}
+					fprintf(fp,")");
+				}
+				break;
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				generate_iterator(fp,expr,val);
+				break;
+			}
+			if (kernel_label>=0 && (column = searchBroadcast(expr,kernel_label))>=0) {
+				fprintf(fp,"(h<%sbroadcast_%s_%d_%d_size ? ",state,expr->id,broadcasts[column].column,kernel_label);
+				generate_broadcast_value(fp,&broadcasts[column],"");
+				fprintf(fp," : ");
+			}
+			if (packing>=0 && (column = searchPacked(expr,packing))>=0) {
+				fprintf(fp,"%spacked_%s_%d_%d[h]",state,vars[packed[column].var].name,packed[column].column,packing);
+			} else {
+				fprintf(fp,"%s(",from_type[searchVar(expr->id,expr->arguments->size)->type]);
+				generate_var(fp,expr,val);
+				fprintf(fp,")");
+			}
+			if (kernel_label>=0 && searchBroadcast(expr,kernel_label)>=0) {
+				fprintf(fp,")");
+			}
+			break;
+		case INTEGER:
+			fprintf(fp,"%d",expr->intValue);
+			break;
+		case REAL:
+			fprintf(fp,"%f",expr->doubleValue);
+			break;
+		case ADD:case SUB:case MUL:case DIV:case MOD:
+		case LT:case GT:case EQ:case NEQ:case NOT:case LE:
+		case GE:case AND:case OR:
+			fprintf(fp,"(");
+			generate_expr(fp,expr->left,val);
+			printType(fp,expr->type);
+			generate_expr(fp,expr->right,val);
+			fprintf(fp,")");
+		break;
+	}
+}
+
+
+void generate_guard(FILE* fp, INSTRUCTION* inst)
+{
+	if (inst->protein!=NULL) {
+		fprintf(fp,"\tif (%sprotein != %d) {\n",state,inst->protein->arguments->args[0]->intValue);
+		fprintf(fp,"\t\treturn;\n");
+		fprintf(fp,"\t}\n");
+	}
+	if (inst->enzyme!=NULL) {
+		fprintf(fp,"\tif (");
+		if (is_int_arith(inst->enzyme)) {
+			generate_int_expr(fp,inst->enzyme,0);
+		} else {
+			generate_expr(fp,inst->enzyme,0);
+		}
+		fprintf(fp," == 0) {\n");
+		fprintf(fp,"\t\treturn;\n");
+		fprintf(fp,"\t}\n");
+	}
+	
+}
+
+void generate_range(FILE* fp, ITERATOR* range, char* tabs)
+{
+	fprintf(fp,"%sfor(int %s=%d;%s<=%d;++%s) {\n",tabs,range->id,range->left->intValue,range->id,range->right->intValue,range->id);
+}
+
+/* Broadcast rule: the row is only written in debug mode */
+void generate_broadcast(FILE* fp, INSTRUCTION* inst, BROADCAST* b)
+{
+	VAR* v = &vars[b->var];
+	fprintf(fp,"\t%sbroadcast_%s_%d_%d = ",state,v->name,b->column,b->label);
+	generate_value(fp,inst->expr,b->label,v->type);
+	fprintf(fp,";\n");
+	fprintf(fp,"\t%sbroadcast_%s_%d_%d_size = %sbroadcast_shared ? 0 : %smembranes_in_%d_size;\n",state,v->name,b->column,b->label,state,state,b->label);
+	int k = searchPacked(inst->object,b->label);
+	if (k>=0 && single_bound(b->label)>0) {
+		fprintf(fp,"\tpack_single(");
+		generate_broadcast_value(fp,b,"");
+		fprintf(fp,",%.0f,&%spacked_%d_single);\n",single_bound(b->label),state,b->label);
+	}
+	fprintf(fp,"\tif (!%sdebug && !%sbroadcast_shared) {\n",state,state);
+	fprintf(fp,"\t\treturn;\n");
+	fprintf(fp,"\t}\n");
+}
+
+/* Times a sequential run of loop k over count iterations, see schedule.h */
+void generate_profile_start(FILE* fp, int k, char* count, char* t)
+{
+	fprintf(fp,"%sdouble loop_start_%d = loop_start(&%sloops[%d],%s);\n",t,k,state,k,count);
+}
+
+/* Clauses of the parallel for of loop k, cond is a further condition for the team */
+void generate_profile_clauses(FILE* fp, int k, char* count, char* cond)
+{
+	fprintf(fp," if(%s%s>%sloops[%d].threshold) num_threads(%sthreads) schedule(dynamic,loop_chunk(&%sloops[%d],%s))\n",
+	  cond,count,state,k,state,state,k,count);
+}
+
+void generate_profile_end(FILE* fp, int k, char* count, char* t)
+{
+	fprintf(fp,"%sloop_end(&%sloops[%d],%s,loop_start_%d);\n",t,state,k,count,k);
+}
+
+/* Links child to parent and adds it to the lists of the labels it inherits */
+void generate_membrane(FILE* fp, char* tabs)
+{
+	if (broadcasts_count>0) {
+		fprintf(fp,"%sif ((%smembranes[child] & 0xFF000000)!=0) {\n",tabs,state);
+		fprintf(fp,"%s\tbroadcast_share(%s);\n",tabs,state_arg);
+		fprintf(fp,"%s}\n",tabs);
+	}
+	fprintf(fp,"%s%smembranes[child] = parent;\n",tabs,state);
+	fprintf(fp,"%s%smembranes[child] |= (%smembranes[parent] & 0xFF000000);\n",tabs,state,state);
+	for (int i=0;i<labels_count;i++) {
+		fprintf(fp,"%sif ((%smembranes[child] & %s)!=0) %smembranes_in_%d[append(&%smembranes_in_%d_size)] = child;\n",
+		  tabs,state,masks[i],state,labels[i],state,labels[i]);
+	}
+}
+
+void generate_membrane_debug(FILE* fp, INSTRUCTION* inst, char* tabs)
+{
+	fprintf(fp,"%s",tabs);
+	fprintf(fp,"if (%sdebug) {\n",state);
+	fprintf(fp,"%s",tabs);
+	fprintf(fp,"\tprintf(\"[ [ ]'%%d ]'%%d; // ");
+	printInstruction(fp,inst,0);
+	fprintf(fp,"\\n\",child,parent);\n%s}\n",tabs);
+}
+
+/*
+ * [ [ ]'chain(x,y,u0,u1,delta,k,width) ]'parent creates k membranes at once,
+ * one per step of length delta from (x,y) along (u0,u1), labelled as the
+ * cell y*width+x+1, each the child of the previous one; their coordinates
+ * are written to Y{1,h} and Y{2,h}. The chain stops at the map border.
+ */
+void generate_chain(FILE* fp, INSTRUCTION* inst, int val, char* tabs)
+{
+	EXPR** args = inst->object->arguments->args;
+	VAR* v = searchVar("Y",2);
+	if (v==NULL || v->limits[0]<3) {
+		fprintf(stderr,"chain() needs the coordinates Y{1,h} and Y{2,h}\n");
+		exit(1);
+	}
+	char inner[16];
+	snprintf(inner,sizeof(inner),"%s\t",tabs);
+	char* names[5] = {"chain_x","chain_y","chain_u0","chain_u1","chain_delta"};
+	for (int i=0;i<5;i++) {
+		fprintf(fp,"%sdouble %s = ",tabs,names[i]);
+		generate_expr(fp,args[i],val);
+		fprintf(fp,";\n");
+	}
+	fprintf(fp,"%sint chain_k = ",tabs);
+	generate_index(fp,args[5],val);
+	fprintf(fp,";\n");
+	fprintf(fp,"%sint chain_width = ",tabs);
+	generate_index(fp,args[6],val);
+	fprintf(fp,";\n");
+	fprintf(fp,"%sint parent = ",tabs);
+	generate_index(fp,inst->expr,val);
+	fprintf(fp,";\n");
+	fprintf(fp,"%sfor (int j=1;j<=chain_k;j++) {\n",tabs);
+	fprintf(fp,"%sint node_x = (int)round(chain_x + chain_u0*chain_delta*j);\n",inner);
+	fprintf(fp,"%sint node_y = (int)round(chain_y + chain_u1*chain_delta*j);\n",inner);
+	fprintf(fp,"%sif (node_x<0 || node_y<0 || node_x>=chain_width || (int64_t)node_y*chain_width+node_x+1>=%d) {\n",
+	  inner,SIM_MAX_MEMBRANES);
+	fprintf(fp,"%s\tbreak;\n",inner);
+	fprintf(fp,"%s}\n",inner);
+	fprintf(fp,"%sint child = node_y*chain_width + node_x + 1;\n",inner);
+	generate_membrane(fp,inner);
+	for (int i=1;i<=2;i++) {
+		fprintf(fp,"%s%sY2[%d][child] = %s(%s);\n",inner,state,i,to_type[v->type],i==1 ? "node_x" : "node_y");
+		if (packed_var(v)) {
+			fprintf(fp,"%spacked_store_Y(%s%s%d,child);\n",inner,state_arg,library ? "," : "",i);
+		}
+	}
+	generate_membrane_debug(fp,inst,inner);
+	fprintf(fp,"%sparent = child;\n",inner);
+	fprintf(fp,"%s}\n",tabs);
+}
+
+void generate_function(FILE* fp, INSTRUCTION* inst)
+{
+	char tabs[16];
+	tabs[0]='\t';
+	tabs[1]=0;
+	fprintf(fp,"\n");
+	fprintf(fp,"// RULE: %d\n",functions);
+	fprintf(fp,"// ");
+	printInstruction(fp,inst,0);
+	int rule = functions++;
+	fprintf(fp,"\nvoid rule%d(%s)\n",rule,state_param);
+	fprintf(fp,"{\n");
+	generate_guard(fp,inst);
+	if (!library) {
+		fprintf(fp,"\tif (metrics_on) metrics_rule();\n");
+	}
+	current_inst = inst;
+	int broadcast = searchBroadcastRule(inst);
+	if (broadcast>=0) {
+		generate_broadcast(fp,inst,&broadcasts[broadcast]);
+	}
+	int random = expr_draws(inst->expr) || expr_draws(inst->object);
+	for (int k=0;k<fusions_count;k++) {
+		if (fusions[k].producer==inst) {
+			if (library) {
+				fprintf(fp,"\tfused%d(%s);\n",k,state_arg);
+			} else {
+				fprintf(fp,"\tscan_begin();\n");
+				fprintf(fp,"\tfused%d();\n",k);
+				fprintf(fp,"\tscan_end();\n");
+			}
+		}
+	}
+	FUSION* copy = searchFusedCopy(inst);
+	FUSION* producer = searchFusedProducer(inst);
+	if ((copy!=NULL && !copy->copy_needed) || (producer!=NULL && !producer->producer_needed)) {
+		fprintf(fp,"\tif (!%sdebug) {\n",state);
+		fprintf(fp,"\t\treturn;\n");
+		fprintf(fp,"\t}\n");
+	}
+	if (inst->type == CREATION_RULE) {
+		if (creation_functions_count==creation_functions_capacity) {
+			creation_functions_capacity = creation_functions_capacity==0 ? 64 : creation_functions_capacity*2;
+			creation_functions = (int*)realloc(creation_functions,sizeof(int)*creation_functions_capacity);
+		}
+		creation_functions[creation_functions_count++] = rule;
+	}
+	if (has_loop(inst)) {
+		if (loop_functions_count==loop_functions_capacity) {
+			loop_functions_capacity = loop_functions_capacity==0 ? 64 : loop_functions_capacity*2;
+			loop_functions = (int*)realloc(loop_functions,sizeof(int)*loop_functions_capacity);
+		}
+		loop_functions[loop_functions_count++] = rule;
+	}
+	int val=0;
+	int loop = searchLoop(inst,-1,0);
+	char count[64];
+	ITERATOR* set = NULL;
+	ITERATOR* range = NULL;
+	for (int k=0;k<inst->iterators->size;k++) {
+		ITERATOR* it = inst->iterators->iterators[k];
+		if (it->type==SET_ITERATOR && set==NULL) {
+			set = it;
+		} else if (it->type==RANGE_ITERATOR) {
+			range = it;
+		}
+	}
+	if (set!=NULL) {
+		val = set->left->intValue;
+		sprintf(count,"%smembranes_in_%d_size",state,val);
+		if (loop>=0) {
+			/* Creation rules of the library always run in rule order */
+			generate_profile_start(fp,loop,count,"\t");
+			fprintf(fp,"\t#pragma omp parallel for");
+			generate_profile_clauses(fp,loop,count,inst->type==CREATION_RULE ? "!deterministic && " : "");
+		}
+		fprintf(fp,"\tfor(int h=0;h<%smembranes_in_%d_size;++h) {\n",state,val);
+		tabs[1]='\t';
+		tabs[2]=0;
+		if (random && library) {
+			fprintf(fp,"\t\trng_key_seed(ctx->seed,%d,ctx->step,ctx->membranes_in_%d[h]);\n",rule,val);
+		} else if (random) {
+			fprintf(fp,"\t\tif (deterministic) rng_key(%d,step,membranes_in_%d[h]);\n",rule,val);
+		}
+	} else if (random && library) {
+		fprintf(fp,"\trng_key_seed(ctx->seed,%d,ctx->step,0);\n",rule);
+	} else if (random) {
+		fprintf(fp,"\tif (deterministic) rng_key(%d,step,0);\n",rule);
+	}
+	if (inst->type == PRODUCTION_RULE) {
+		int indexes = inst->object->arguments->size;
+		if (range!=NULL) {
+			if (!random && !inst_reads(inst,inst->object->id,indexes)) {
+				fprintf(fp,"%s#pragma omp simd\n",tabs);
+			}
+			generate_range(fp,range,tabs);
+			strcat(tabs,"\t");
+		}
+		fprintf(fp,"%s",tabs);
+		generate_var(fp,inst->object,val);
+		fprintf(fp," = ");
+		int type = searchVar(inst->object->id,indexes)->type;
+		int fused = searchReducer(inst);
+		if (fused>=0) {
+			fprintf(fp,"%s(%sfused_%s_%d)",to_type[type],state,inst->expr->id,fused);
+		} else {
+			generate_value(fp,inst->expr,val,type);
+		}
+		fprintf(fp,";\n");
+		if (indexes==2 && packed_var(searchVar(inst->object->id,indexes))) {
+			fprintf(fp,"%spacked_store_%s(%s%s",tabs,inst->object->id,state_arg,library ? "," : "");
+			print_index(fp,inst->object,0,val);
+			fprintf(fp,",");
+			print_index(fp,inst->object,1,val);
+			fprintf(fp,");\n");
+		}
+		if (range!=NULL) {
+			tabs[strlen(tabs)-1] = 0;
+			fprintf(fp,"%s}\n",tabs);
+		}
+		
+		fprintf(fp,"%s",tabs);
+		fprintf(fp,"if (%sdebug) {\n",state);
+		if (range!=NULL) {
+			strcat(tabs,"\t");
+			generate_range(fp,range,tabs);
+		}
+		fprintf(fp,"%s",tabs);
+		fprintf(fp,"\tprintf(\"%s",inst->object->id);
+		for (int i=0;i< inst->object->arguments->size;i++) {
+			fprintf(fp,"[%%d]");
+		}
+	
+		fprintf(fp," = %%f; // ");
+		
+		printInstruction(fp,inst,0);
+		fprintf(fp,"\\n\"");
 		
 		for (int i=0;i< inst->object->arguments->size;i++) {
 			fprintf(fp,",");
 			print_index(fp,inst->object,i,val);
 		}
 		fprintf(fp,",");
-		generate_var(fp,inst->object,val);
+		if (searchVar(inst->object->id,inst->object->arguments->size)->squared) {
+			fprintf(fp,"sqrt");
+		}
+		generate_expr(fp,inst->object,val);
 		fprintf(fp,");\n");
+		if (range!=NULL) {
+			fprintf(fp,"%s}\n",tabs);
+			tabs[strlen(tabs)-1] = 0;
+		}
 		fprintf(fp,"%s",tabs);
 		fprintf(fp,"}\n");
 		
 		
+	} else if (inst->type == EVOLUTION_RULE && range!=NULL) {
+		generate_range(fp,range,tabs);
+		fprintf(fp,"%s\tif (%sprotein == ",tabs,state);
+		generate_int_expr(fp,inst->object->arguments->args[0],val);
+		fprintf(fp,") {\n");
+		fprintf(fp,"%s\t\t%snext_protein = ",tabs,state);
+		generate_int_expr(fp,inst->expr->arguments->args[0],val);
+		fprintf(fp,";\n");
+		fprintf(fp,"%s\t}\n",tabs);
+		fprintf(fp,"%s}\n",tabs);
+		
 	} else if (inst->type == EVOLUTION_RULE) {
-		fprintf(fp,"\tif (protein != %d) {\n",inst->object->arguments->args[0]->intValue);
+		fprintf(fp,"\tif (%sprotein != %d) {\n",state,inst->object->arguments->args[0]->intValue);
 		fprintf(fp,"\t\treturn;\n");
 		fprintf(fp,"\t}\n");
-		fprintf(fp,"\tnext_protein = %d;\n",inst->expr->arguments->args[0]->intValue);
+		fprintf(fp,"\t%snext_protein = %d;\n",state,inst->expr->arguments->args[0]->intValue);
 		
+	} else if (is_chain(inst)) {
+		generate_chain(fp,inst,val,tabs);
 	} else {
 		EXPR *parent = inst->expr;
 		EXPR *child = inst->object;
-		fprintf(fp,"\tint child = (int)round(");
-		generate_expr(fp,child, val);
-		fprintf(fp,");\n");
-		fprintf(fp,"\tint parent = (int)round(");
-		generate_expr(fp,parent, val);
-		fprintf(fp,");\n");
-		fprintf(fp,"\tmembranes[child] = parent;\n");
-		fprintf(fp,"\tmembranes[child] |= (membranes[parent] & 0xFF000000);\n");
-		for (int i=0;i<labels_count;i++) {
-			fprintf(fp,"\tif ((membranes[child] & %s)!=0) membranes_in_%d[membranes_in_%d_size++] = child;\n",masks[i],labels[i],labels[i]);
-		}
-		fprintf(fp,"%s",tabs);
-		fprintf(fp,"if (debug) {\n");
-		fprintf(fp,"%s",tabs);
-		fprintf(fp,"\tprintf(\"[ [ ]'%%d ]'%%d; // ");
-		printInstruction(fp,inst,0);
-		fprintf(fp,"\\n\",child,parent);\n%s}\n",tabs);
+		fprintf(fp,"\tint child = ");
+		generate_index(fp,child,val);
+		fprintf(fp,";\n");
+		fprintf(fp,"\tint parent = ");
+		generate_index(fp,parent,val);
+		fprintf(fp,";\n");
+		generate_membrane(fp,"\t");
+		generate_membrane_debug(fp,inst,tabs);
 		
 	}
-	if (inst->iterators->size>0) {
+	if (set!=NULL) {
+		fprintf(fp,"\t}\n");
+	}
+	if (set!=NULL && loop>=0) {
+		generate_profile_end(fp,loop,count,"\t");
+	}
+	current_inst = NULL;
+	
+	fprintf(fp,"}\n");
+}
+
+void generate_common(FILE* fp, int k)
+{
+	COMMON* c = &commons[k];
+	fprintf(fp,"\n// COMMON SUBEXPRESSION: %d\n",k);
+	fprintf(fp,"// ");
+	printExpr(fp,c->expr,0);
+	fprintf(fp,"\nvoid common%d(%s)\n",k,state_param);
+	fprintf(fp,"{\n");
+	generate_guard(fp,c->inst);
+	fprintf(fp,"\t%scommon_%d = ",state,k);
+	if (c->reciprocal) {
+		fprintf(fp,"1.0/");
+	}
+	generate_expr(fp,c->expr,0);
+	fprintf(fp,";\n");
+	fprintf(fp,"}\n");
+}
+
+char* column_type(int label)
+{
+	return single_bound(label)>0 ? "float" : "double";
+}
+
+/* Value of a packed column for membrane h, checked against the bound in single precision */
+void generate_packed_value(FILE* fp, PACKED* p, char* h)
+{
+	VAR* v = &vars[p->var];
+	double bound = single_bound(p->label);
+	if (bound>0) {
+		fprintf(fp,"pack_single(%s(%s%s2[%d][%s]),%.0f,&%spacked_%d_single)",
+		  from_type[v->type],state,v->name,p->column,h,bound,state,p->label);
+	} else {
+		fprintf(fp,"%s(%s%s2[%d][%s])",from_type[v->type],state,v->name,p->column,h);
+	}
+}
+
+/* Coordinates of membrane h in a nearest index, as the double kernels read them */
+void generate_point(FILE* fp, NEAREST* n, char* h)
+{
+	VAR* x = &vars[packed[n->x].var];
+	VAR* y = &vars[packed[n->y].var];
+	fprintf(fp,"%s(%s%s2[%d][%s]),%s(%s%s2[%d][%s])",from_type[x->type],state,x->name,packed[n->x].column,h,
+	  from_type[y->type],state,y->name,packed[n->y].column,h);
+}
+
+/* Packs the membranes appended to the list of label since the last call */
+void generate_pack(FILE* fp, int label)
+{
+	fprintf(fp,"\nvoid pack_%d(%s)\n",label,state_param);
+	fprintf(fp,"{\n");
+	fprintf(fp,"\tif (%spacked_%d_size==%smembranes_in_%d_size) {\n",state,label,state,label);
+	fprintf(fp,"\t\treturn;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\t#pragma omp critical(pack_%d)\n",label);
+	fprintf(fp,"\tfor(;%spacked_%d_size<%smembranes_in_%d_size;%spacked_%d_size++) {\n",state,label,state,label,state,label);
+	fprintf(fp,"\t\tint h = %spacked_%d_size;\n",state,label);
+	fprintf(fp,"\t\tint m = %smembranes_in_%d[h];\n",state,label);
+	fprintf(fp,"\t\t%spacked_pos_%d[m] = h+1;\n",state,label);
+	fprintf(fp,"\t\t%spacked_label_%d[h] = m;\n",state,label);
+	for (int k=0;k<packed_count;k++) {
+		if (packed[k].label==label) {
+			fprintf(fp,"\t\t%spacked_%s_%d_%d[h] = ",state,vars[packed[k].var].name,packed[k].column,label);
+			generate_packed_value(fp,&packed[k],"m");
+			fprintf(fp,";\n");
+		}
+	}
+	for (int k=0;k<nearests_count;k++) {
+		if (nearests[k].label==label) {
+			fprintf(fp,"\t\tkdtree_insert(%snearest_%d,",state,k);
+			generate_point(fp,&nearests[k],"m");
+			fprintf(fp,",m);\n");
+		}
+	}
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"}\n");
+}
+
+/* Copies a write to V{column,h} into the packed columns of V holding h */
+void generate_packed_store(FILE* fp, VAR* v)
+{
+	fprintf(fp,"\nstatic inline void packed_store_%s(%s%sint column, int h)\n",v->name,state_param,library ? ", " : "");
+	fprintf(fp,"{\n");
+	fprintf(fp,"\tint p;\n");
+	for (int k=0;k<packed_count;k++) {
+		if (packed[k].var==v-vars) {
+			fprintf(fp,"\tif (column==%d && (p = %spacked_pos_%d[h])>0) {\n",packed[k].column,state,packed[k].label);
+			fprintf(fp,"\t\t%spacked_%s_%d_%d[p-1] = ",state,v->name,packed[k].column,packed[k].label);
+			generate_packed_value(fp,&packed[k],"h");
+			fprintf(fp,";\n");
+			for (int n=0;n<nearests_count;n++) {
+				if (nearests[n].x==k || nearests[n].y==k) {
+					fprintf(fp,"\t\tkdtree_move(%snearest_%d,p-1,",state,n);
+					generate_point(fp,&nearests[n],"h");
+					fprintf(fp,");\n");
+				}
+			}
+			fprintf(fp,"\t}\n");
+		}
+	}
+	fprintf(fp,"}\n");
+}
+
+/*
+ * A membrane created again is in two lists, or twice in the same one, and
+ * its row gets the value of the last rule writing it. The broadcast rows
+ * are written out and broadcast rules write the rows from then on.
+ */
+void generate_share(FILE* fp)
+{
+	fprintf(fp,"\nvoid broadcast_share(%s)\n",state_param);
+	fprintf(fp,"{\n");
+	fprintf(fp,"\tif (%sbroadcast_shared) {\n",state);
+	fprintf(fp,"\t\treturn;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\t%sbroadcast_shared = 1;\n",state);
+	for (int i=0;i<broadcasts_count;i++) {
+		BROADCAST* b = &broadcasts[i];
+		VAR* v = &vars[b->var];
+		fprintf(fp,"\tfor (int h=0;h<%sbroadcast_%s_%d_%d_size;h++) {\n",state,v->name,b->column,b->label);
+		fprintf(fp,"\t\t%s%s2[%d][%smembranes_in_%d[h]] = %sbroadcast_%s_%d_%d;\n",
+		  state,v->name,b->column,state,b->label,state,v->name,b->column,b->label);
+		if (packed_var(v)) {
+			fprintf(fp,"\t\tpacked_store_%s(%s%s%d,%smembranes_in_%d[h]);\n",v->name,state_arg,library ? "," : "",b->column,state,b->label);
+		}
+		fprintf(fp,"\t}\n");
+		fprintf(fp,"\t%sbroadcast_%s_%d_%d_size = 0;\n",state,v->name,b->column,b->label);
+	}
+	fprintf(fp,"}\n");
+}
+
+int nearest_label(int label)
+{
+	for (int i=0;i<nearests_count;i++) {
+		if (nearests[i].label==label) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Morton order (reorder.h) of the packed positions of a label with a
+ * nearest index, keyed by the points of the index. The packed columns,
+ * the labels and the points of the indexes are permuted together, the
+ * list keeps its order. A broadcast row covering part of the packed
+ * positions is written out first, as its size is a position of the list.
+ */
+void generate_reorder(FILE* fp, int label)
+{
+	int first = nearest_label(label);
+	fprintf(fp,"\nvoid reorder_%d(%s)\n",label,state_param);
+	fprintf(fp,"{\n");
+	fprintf(fp,"\tpack_%d(%s);\n",label,state_arg);
+	fprintf(fp,"\tint n = %spacked_%d_size;\n",state,label);
+	fprintf(fp,"\tif (n<2) {\n");
+	fprintf(fp,"\t\treturn;\n");
+	fprintf(fp,"\t}\n");
+	for (int i=0;i<broadcasts_count;i++) {
+		BROADCAST* b = &broadcasts[i];
+		VAR* v = &vars[b->var];
+		if (b->label!=label) {
+			continue;
+		}
+		fprintf(fp,"\tif (%sbroadcast_%s_%d_%d_size<n) {\n",state,v->name,b->column,b->label);
+		fprintf(fp,"\t\tfor (int h=0;h<%sbroadcast_%s_%d_%d_size;h++) {\n",state,v->name,b->column,b->label);
+		fprintf(fp,"\t\t\t%s%s2[%d][%smembranes_in_%d[h]] = %sbroadcast_%s_%d_%d;\n",
+		  state,v->name,b->column,state,label,state,v->name,b->column,b->label);
+		if (packed_var(v)) {
+			fprintf(fp,"\t\t\tpacked_store_%s(%s%s%d,%smembranes_in_%d[h]);\n",v->name,state_arg,library ? "," : "",b->column,state,label);
+		}
+		fprintf(fp,"\t\t}\n");
+		fprintf(fp,"\t\t%sbroadcast_%s_%d_%d_size = 0;\n",state,v->name,b->column,b->label);
+		fprintf(fp,"\t}\n");
+	}
+	fprintf(fp,"\tMORTON_ENTRY* order = (MORTON_ENTRY*)malloc(sizeof(MORTON_ENTRY)*2*n);\n");
+	fprintf(fp,"\tint* from = (int*)malloc(sizeof(int)*2*n);\n");
+	fprintf(fp,"\tint* to = from+n;\n");
+	fprintf(fp,"\tvoid* buffer = malloc(sizeof(double)*n);\n");
+	fprintf(fp,"\t#pragma omp parallel for num_threads(%sthreads)\n",state);
+	fprintf(fp,"\tfor (int h=0;h<n;h++) {\n");
+	fprintf(fp,"\t\torder[h].key = morton_key(%snearest_%d->x[h],%snearest_%d->y[h]);\n",state,first,state,first);
+	fprintf(fp,"\t\torder[h].pos = h;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tmorton_sort(order,order+n,n,%sthreads);\n",state);
+	fprintf(fp,"\tint* live = (int*)buffer;\n");
+	fprintf(fp,"\t#pragma omp parallel for num_threads(%sthreads)\n",state);
+	fprintf(fp,"\tfor (int q=0;q<n;q++) {\n");
+	fprintf(fp,"\t\tfrom[q] = order[q].pos;\n");
+	fprintf(fp,"\t\tto[from[q]] = q;\n");
+	fprintf(fp,"\t\tlive[q] = %spacked_pos_%d[%spacked_label_%d[from[q]]]==from[q]+1;\n",state,label,state,label);
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tfor (int q=0;q<n;q++) {\n");
+	fprintf(fp,"\t\tif (live[q]) {\n");
+	fprintf(fp,"\t\t\t%spacked_pos_%d[%spacked_label_%d[from[q]]] = q+1;\n",state,label,state,label);
+	fprintf(fp,"\t\t}\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\treorder_int(%spacked_label_%d,from,n,buffer,%sthreads);\n",state,label,state);
+	for (int k=0;k<packed_count;k++) {
+		if (packed[k].label==label) {
+			fprintf(fp,"\treorder_%s(%spacked_%s_%d_%d,from,n,buffer,%sthreads);\n",
+			  column_type(label),state,vars[packed[k].var].name,packed[k].column,label,state);
+		}
+	}
+	for (int k=0;k<nearests_count;k++) {
+		if (nearests[k].label==label) {
+			fprintf(fp,"\tkdtree_permute(%snearest_%d,from,to,n,buffer,%sthreads);\n",state,k,state);
+		}
+	}
+	fprintf(fp,"\tfree(buffer);\n");
+	fprintf(fp,"\tfree(from);\n");
+	fprintf(fp,"\tfree(order);\n");
+	fprintf(fp,"}\n");
+}
+
+void generate_reorder_labels(FILE* fp)
+{
+	for (int i=0;i<labels_count;i++) {
+		if (nearest_label(labels[i])>=0) {
+			generate_reorder(fp,labels[i]);
+		}
+	}
+	fprintf(fp,"\nvoid reorder_labels(%s)\n",state_param);
+	fprintf(fp,"{\n");
+	if (!library) {
+		fprintf(fp,"\tdouble start = omp_get_wtime();\n");
+	}
+	for (int i=0;i<labels_count;i++) {
+		if (nearest_label(labels[i])>=0) {
+			fprintf(fp,"\treorder_%d(%s);\n",labels[i],state_arg);
+		}
+	}
+	if (!library) {
+		fprintf(fp,"\treorder_seconds += omp_get_wtime()-start;\n");
+		fprintf(fp,"\treorder_count++;\n");
+	}
+	fprintf(fp,"}\n");
+}
+
+/* Block loop of a fused kernel, reading the packed columns of packing or gathering (-1) */
+void generate_fusion_loop(FILE* fp, FUSION* f, int columns, char* t)
+{
+	int label = f->label;
+	int loop = searchLoop(f->producer,f-fusions,packing_single);
+	char tabs[16];
+	sprintf(tabs,"%s\t",t);
+	fprintf(fp,"%sint blocks = (%smembranes_in_%d_size+REDUCTION_BLOCK-1)/REDUCTION_BLOCK;\n",tabs,state,label);
+	generate_profile_start(fp,loop,"blocks",tabs);
+	fprintf(fp,"%s\t#pragma omp parallel for reduction(min_loc:acc)",t);
+	generate_profile_clauses(fp,loop,"blocks","");
+	fprintf(fp,"%s\tfor(int b=0;b<%smembranes_in_%d_size;b+=REDUCTION_BLOCK) {\n",t,state,label);
+	fprintf(fp,"%s\t\tdouble d[REDUCTION_BLOCK];\n",t);
+	fprintf(fp,"%s\t\tint n = %smembranes_in_%d_size-b < REDUCTION_BLOCK ? %smembranes_in_%d_size-b : REDUCTION_BLOCK;\n",
+	  t,state,label,state,label);
+	fprintf(fp,"%s\t\tdouble min = INFINITY;\n",t);
+	fprintf(fp,"%s\t\tint arg = INT_MAX;\n",t);
+	fprintf(fp,"%s\t\t#pragma omp simd reduction(min:min)\n",t);
+	fprintf(fp,"%s\t\tfor(int i=0;i<n;i++) {\n",t);
+	fprintf(fp,"%s\t\t\tint h = b+i;\n",t);
+	fprintf(fp,"%s\t\t\td[i] = ",t);
+	packing = columns;
+	kernel_label = label;
+	generate_expr(fp,f->producer->expr,label);
+	kernel_label = -1;
+	packing = -1;
+	fprintf(fp,";\n");
+	fprintf(fp,"%s\t\t\tmin = d[i] < min ? d[i] : min;\n",t);
+	fprintf(fp,"%s\t\t}\n",t);
+	fprintf(fp,"%s\t\t#pragma omp simd reduction(min:arg)\n",t);
+	fprintf(fp,"%s\t\tfor(int i=0;i<n;i++) {\n",t);
+	fprintf(fp,"%s\t\t\tint h = %s%s_%d[b+i];\n",t,state,columns>=0 ? "packed_label" : "membranes_in",label);
+	fprintf(fp,"%s\t\t\targ = d[i] == min && h < arg ? h : arg;\n",t);
+	fprintf(fp,"%s\t\t}\n",t);
+	fprintf(fp,"%s\t\tacc = min_loc(acc,min,arg);\n",t);
+	fprintf(fp,"%s\t}\n",t);
+	generate_profile_end(fp,loop,"blocks",tabs);
+}
+
+/*
+ * Nearest query of a kernel, when the query point covers the whole list.
+ * With if(S,...,C) and S false every value is C, so the minimum is C at
+ * the lowest label. Ends with an else for the block loop.
+ */
+void generate_nearest(FILE* fp, FUSION* f)
+{
+	fprintf(fp,"\t");
+	if (f->cond!=NULL) {
+		fprintf(fp,"if (function_if(");
+		generate_expr(fp,f->cond,f->label);
+		fprintf(fp,",1,0)==0) {\n");
+		fprintf(fp,"\t\tdouble value = ");
+		generate_expr(fp,f->otherwise,f->label);
+		fprintf(fp,";\n");
+		fprintf(fp,"\t\tif (!isnan(value) && %snearest_%d->count>0) {\n",state,f->nearest);
+		fprintf(fp,"\t\t\tacc.value = value;\n");
+		fprintf(fp,"\t\t\tacc.arg = %snearest_%d->lowest;\n",state,f->nearest);
+		fprintf(fp,"\t\t}\n");
+		fprintf(fp,"\t} else ");
+	}
+	fprintf(fp,"if (");
+	int covered = 0;
+	for (int i=0;i<2;i++) {
+		int b = searchBroadcast(f->query[i],f->label);
+		if (b>=0) {
+			fprintf(fp,"%s%sbroadcast_%s_%d_%d_size==%smembranes_in_%d_size",covered++ ? " && " : "",
+			  state,vars[broadcasts[b].var].name,broadcasts[b].column,f->label,state,f->label);
+		}
+	}
+	fprintf(fp,"%s) {\n",covered ? "" : "1");
+	fprintf(fp,"\t\tacc = kdtree_nearest(%snearest_%d,",state,f->nearest);
+	for (int i=0;i<2;i++) {
+		int b = searchBroadcast(f->query[i],f->label);
+		if (b>=0) {
+			generate_broadcast_value(fp,&broadcasts[b],"");
+		} else {
+			generate_expr(fp,f->query[i],f->label);
+		}
+		fprintf(fp,"%s",i==0 ? "," : ");\n");
+	}
+	fprintf(fp,"\t} else ");
+}
+
+void generate_fusion(FILE* fp, int k)
+{
+	FUSION* f = &fusions[k];
+	int label = f->label;
+	fprintf(fp,"\n");
+	fprintf(fp,"// FUSED KERNEL: %d\n",k);
+	fprintf(fp,"// ");
+	printInstruction(fp,f->producer,0);
+	fprintf(fp,"\n// ");
+	printInstruction(fp,f->copy,0);
+	fprintf(fp,"\nSIMD_CLONES void fused%d(%s)\n",k,state_param);
+	fprintf(fp,"{\n");
+	if (packed_label(label)) {
+		fprintf(fp,"\tpack_%d(%s);\n",label,state_arg);
+	}
+	fprintf(fp,"\tVALUE_LOC acc = {INFINITY,INT_MAX};\n");
+	if (f->nearest>=0) {
+		generate_nearest(fp,f);
+	}
+	if (single_bound(label)>0) {
+		fprintf(fp,"%sif (%spacked_%d_single) {\n",f->nearest>=0 ? "" : "\t",state,label);
+		packing_single = 1;
+		generate_fusion_loop(fp,f,label,"\t");
+		packing_single = 0;
+		fprintf(fp,"\t} else {\n");
+		generate_fusion_loop(fp,f,-1,"\t");
+		fprintf(fp,"\t}\n");
+	} else if (f->nearest>=0) {
+		fprintf(fp,"{\n");
+		generate_fusion_loop(fp,f,label,"\t");
 		fprintf(fp,"\t}\n");
+	} else {
+		generate_fusion_loop(fp,f,label,"");
 	}
-	
+	fprintf(fp,"\t%sfused_min_%d = acc.arg==INT_MAX ? NAN : acc.value;\n",state,k);
+	fprintf(fp,"\t%sfused_arg_min_%d = acc.arg==INT_MAX ? NAN : acc.arg;\n",state,k);
 	fprintf(fp,"}\n");
 }
 
 void create_membranes(FILE* fp, DEFINITIONS* defs)
 {
-	fprintf(fp,"\n// MEMBRANES\n");
-	fprintf(fp,"int *membranes;\n");
+	char* indent = library ? "\t" : "";
+	char* zero = library ? "" : " = 0";
+	fprintf(fp,"\n%s// MEMBRANES\n",indent);
+	fprintf(fp,"%sint *membranes;\n",indent);
 	for (int i=0;i<defs->size;i++) {
 		DEFINITION* def = defs->definitions[i];
 		for (int j=0;j<def->size;j++) {
 			INSTRUCTION* inst = def->instructions[j];
 			if (inst->type==MU) {
 				int label = inst->mu->label->intValue;
-				fprintf(fp,"int* membranes_in_%d;\n",label);
-				fprintf(fp,"int membranes_in_%d_size = 0;\n",label);
+				fprintf(fp,"%sint* membranes_in_%d;\n",indent,label);
+				fprintf(fp,"%sint membranes_in_%d_size%s;\n",indent,label,zero);
 				labels[labels_count++] = label;
 				for (int k=0;k<inst->mu->size;k++) {
 					int label = inst->mu->membranes[k]->label->intValue;
-					fprintf(fp,"int* membranes_in_%d;\n",label);
-					fprintf(fp,"int membranes_in_%d_size = 0;\n",label);
+					fprintf(fp,"%sint* membranes_in_%d;\n",indent,label);
+					fprintf(fp,"%sint membranes_in_%d_size%s;\n",indent,label,zero);
 					labels[labels_count++] = label;
 				}
 			}
 		}
 	}
+	if (!library && labels_count>1) {
+		fprintf(fp,"int roots[] = {");
+		for (int i=1;i<labels_count;i++) {
+			fprintf(fp,"%s%d",i>1 ? "," : "",labels[i]);
+		}
+		fprintf(fp,"};\n");
+	}
 }
 
-
-void generate_c_simulator(FILE* fp, DEFINITIONS* defs)
+/* Analysis passes run once the variables are known */
+void analyse(DEFINITIONS* defs)
 {
-	fprintf(fp,"#include <stdio.h>\n");
-	fprintf(fp,"#include <stdlib.h>\n");
-	fprintf(fp,"#include <string.h>\n");
-	fprintf(fp,"#include <time.h>\n");
-	fprintf(fp,"#include <omp.h>\n");
-	fprintf(fp,"#include \"functions.h\"\n");	
-	fprintf(fp,"#include \"pgm.h\"\n");	
-	fprintf(fp,"char map_file[64];\n");
-	fprintf(fp,"char out_file[64];\n");
-	fprintf(fp,"extern PGM *map;\n");
-	fprintf(fp,"int debug = 0;\n");
-	fprintf(fp,"int threads = 4;\n");
-	fprintf(fp,"int max_steps = %d;\n",SIM_MAX_ITERS);
-	fprintf(fp,"\nvoid loop();\n");
-
-	create_membranes(fp,defs);
 	create_vars(defs);	
-	fprintf(fp,"\n//PROTEIN\n");
-	fprintf(fp,"int protein = 1;\n");
-	fprintf(fp,"int next_protein = 1;\n");
+	elide_sqrt(defs);
+	infer_types(defs);
+	create_fusions(defs);
+	create_broadcasts(defs);
+	create_packed();
+	create_nearest();
+	create_single();
+	create_commons(defs);
+	create_loops(defs);
+}
+
+/* Protein, variables, fused reductions and common subexpressions */
+void create_state(FILE* fp)
+{
+	char* indent = library ? "\t" : "";
+	fprintf(fp,"\n%s//PROTEIN\n",indent);
+	fprintf(fp,"%sint protein%s;\n",indent,library ? "" : " = 1");
+	fprintf(fp,"%sint next_protein%s;\n",indent,library ? "" : " = 1");
+	fprintf(fp,"%suint64_t sample_cycle;\n",indent);
 
 	
-	fprintf(fp,"\n//VARIABLES\n");
+	fprintf(fp,"\n%s//VARIABLES\n",indent);
 	for (int i=0;i<vars_count;i++) {
-		fprintf(fp,"double ");
+		fprintf(fp,"%s%s ",indent,var_types[vars[i].type]);
 		for(int j=0;j<vars[i].indexes;j++) {
 			fprintf(fp,"*");
 		}
 		fprintf(fp,"%s%d;\n",vars[i].name,vars[i].indexes);
 	}
-		
-	fprintf(fp,"\nint main(int argc, char* argv[])\n");
-	fprintf(fp,"{\n");
-	fprintf(fp,"\tunsigned int seed = time(NULL);\n");
-	fprintf(fp,"\tstrcpy(map_file,\"office.pgm\");\n");
-	fprintf(fp,"\tstrcpy(out_file,\"out.pgm\");\n");
-	fprintf(fp,"\tparse_input(argc,argv,&debug,&threads,&max_steps,map_file,out_file,&seed);\n");
-	fprintf(fp,"\tsrand(seed);\n");
-	fprintf(fp,"\tprint_header(debug,threads,max_steps,map_file,out_file);\n");
-	fprintf(fp,"\tmap = load_pgm(map_file);\n");
+	
+	if (fusions_count>0) {
+		fprintf(fp,"\n%s//FUSED REDUCTIONS\n",indent);
+	}
+	for (int i=0;i<fusions_count;i++) {
+		fprintf(fp,"%sdouble fused_min_%d;\n",indent,i);
+		fprintf(fp,"%sdouble fused_arg_min_%d;\n",indent,i);
+	}
+	if (packed_count>0) {
+		fprintf(fp,"\n%s//PACKED COLUMNS\n",indent);
+	}
+	for (int i=0;i<labels_count;i++) {
+		if (packed_label(labels[i])) {
+			fprintf(fp,"%sint packed_%d_size;\n",indent,labels[i]);
+			fprintf(fp,"%sint* packed_pos_%d;\n",indent,labels[i]);
+			fprintf(fp,"%sint* packed_label_%d;\n",indent,labels[i]);
+		}
+		if (single_bounds[i]>0) {
+			fprintf(fp,"%sint packed_%d_single;\n",indent,labels[i]);
+		}
+	}
+	for (int i=0;i<packed_count;i++) {
+		fprintf(fp,"%s%s* packed_%s_%d_%d;\n",indent,column_type(packed[i].label),vars[packed[i].var].name,packed[i].column,packed[i].label);
+	}
+	if (broadcasts_count>0) {
+		fprintf(fp,"\n%s//BROADCAST ROWS\n",indent);
+	}
+	for (int i=0;i<broadcasts_count;i++) {
+		BROADCAST* b = &broadcasts[i];
+		fprintf(fp,"%s%s broadcast_%s_%d_%d;\n",indent,var_types[vars[b->var].type],vars[b->var].name,b->column,b->label);
+		fprintf(fp,"%sint broadcast_%s_%d_%d_size;\n",indent,vars[b->var].name,b->column,b->label);
+	}
+	if (broadcasts_count>0) {
+		fprintf(fp,"%sint broadcast_shared;\n",indent);
+	}
+	if (nearests_count>0) {
+		fprintf(fp,"\n%s//NEAREST INDEXES\n",indent);
+	}
+	for (int i=0;i<nearests_count;i++) {
+		fprintf(fp,"%sstruct KdTree* nearest_%d;\n",indent,i);
+	}
+	fprintf(fp,"\n%s//LOOP PROFILES\n",indent);
+	fprintf(fp,"%sstruct LoopProfile* loops;\n",indent);
+	if (commons_count>0) {
+		fprintf(fp,"\n%s//COMMON SUBEXPRESSIONS\n",indent);
+	}
+	for (int i=0;i<commons_count;i++) {
+		fprintf(fp,"%sdouble common_%d;\n",indent,i);
+	}
+}
+
+/* Standalone simulator: index of a tree root (a membrane inside the skin), relabelled by server requests */
+int root_index(int label)
+{
+	for (int i=1;!library && i<labels_count;i++) {
+		if (labels[i]==label) {
+			return i-1;
+		}
+	}
+	return -1;
+}
+
+void generate_label(FILE* fp, int label)
+{
+	int root = root_index(label);
+	if (root>=0) {
+		fprintf(fp,"roots[%d]",root);
+	} else {
+		fprintf(fp,"%d",label);
+	}
+}
+
+/* Initialised variable, the membrane is the last index */
+void generate_init_var(FILE* fp, EXPR* obj)
+{
+	VAR *v = searchVar(obj->id,obj->arguments->size);
+	fprintf(fp,"%s%s%d",state,v->name,v->indexes);
+	for (int i=0;i<v->indexes;i++) {
+		EXPR* arg = obj->arguments->args[i];
+		fprintf(fp,"[");
+		if (i==v->indexes-1 && arg->type==INTEGER) {
+			generate_label(fp,arg->intValue);
+		} else {
+			print_index(fp,obj,i,0);
+		}
+		fprintf(fp,"]");
+	}
+}
+
+/* Storage goes through sim_alloc (alloc.h), the rows of a 2-D variable are one block */
+void generate_alloc(FILE* fp)
+{
 	fprintf(fp,"\t// SET MEMORY FOR MEMBRANES\n");
-	fprintf(fp,"\tmembranes = (int*)malloc(sizeof(int)*%d);\n",SIM_MAX_MEMBRANES);
-	fprintf(fp,"\tmemset(membranes,0,sizeof(int)*%d);\n",SIM_MAX_MEMBRANES);
+	fprintf(fp,"\t%smembranes = (int*)sim_alloc(sizeof(int)*%d);\n",state,SIM_MAX_MEMBRANES);
 	for (int i=0;i<labels_count;i++) {
-		fprintf(fp,"\tmembranes_in_%d = (int*)malloc(sizeof(int)*%d);\n",labels[i],SIM_MAX_MEMBRANES);
-		
+		fprintf(fp,"\t%smembranes_in_%d = (int*)sim_alloc(sizeof(int)*%d);\n",state,labels[i],SIM_MAX_MEMBRANES);
+		fprintf(fp,"\tparallel_memset(%smembranes_in_%d,0,sizeof(int)*%d,%sthreads);\n",state,labels[i],SIM_MAX_MEMBRANES,state);
+	}
+	for (int i=0;i<labels_count;i++) {
+		if (packed_label(labels[i])) {
+			fprintf(fp,"\t%spacked_pos_%d = (int*)sim_alloc(sizeof(int)*%d);\n",state,labels[i],SIM_MAX_MEMBRANES);
+			fprintf(fp,"\t%spacked_label_%d = (int*)sim_alloc(sizeof(int)*%d);\n",state,labels[i],SIM_MAX_MEMBRANES);
+		}
+	}
+	for (int i=0;i<packed_count;i++) {
+		char* type = column_type(packed[i].label);
+		fprintf(fp,"\t%spacked_%s_%d_%d = (%s*)sim_alloc(sizeof(%s)*%d);\n",
+		  state,vars[packed[i].var].name,packed[i].column,packed[i].label,type,type,SIM_MAX_MEMBRANES);
 	}
+	for (int i=0;i<nearests_count;i++) {
+		fprintf(fp,"\t%snearest_%d = kdtree_create(%d);\n",state,i,SIM_MAX_MEMBRANES);
+	}
+	fprintf(fp,"\t%sloops = loops_create(loop_shapes,%d,%sthreads,%sdebug ? LOOP_SEQUENTIAL : %s);\n",
+	  state,loops_count,state,state,library ? "-1" : "threshold");
 	fprintf(fp,"\t// SET MEMORY FOR VARIABLES\n");
 	
 	for (int i=0;i<vars_count;i++) {
 		
+		char* type = var_types[vars[i].type];
 		if (vars[i].indexes==1) {
-			fprintf(fp,"\t%s%d = (double*)malloc(sizeof(double)*%d);\n",vars[i].name,vars[i].indexes,vars[i].limits[0]);
-			fprintf(fp,"\tmemset(%s%d,0xFF,sizeof(double)*%d);\n",vars[i].name,vars[i].indexes,vars[i].limits[0]);	
+			fprintf(fp,"\t%s%s%d = (%s*)sim_alloc(sizeof(%s)*%d);\n",state,vars[i].name,vars[i].indexes,type,type,vars[i].limits[0]);
 		} else {
-			fprintf(fp,"\t%s%d = (double**)malloc(sizeof(double*)*%d);\n",vars[i].name,vars[i].indexes,vars[i].limits[0]);	
-			fprintf(fp,"\tfor(int i=0;i<%d;i++) {%s%d[i] = (double*)malloc(sizeof(double)*%d);memset(%s%d[i],0xFF,sizeof(double)*%d);}\n",
-			  vars[i].limits[0],vars[i].name,vars[i].indexes,vars[i].limits[1],
-			  vars[i].name,vars[i].indexes,vars[i].limits[1]);
+			fprintf(fp,"\t%s%s2 = (%s**)malloc(sizeof(%s*)*%d);\n",state,vars[i].name,type,type,vars[i].limits[0]);
+			fprintf(fp,"\t%s%s2[0] = (%s*)sim_alloc(sizeof(%s)*%d);\n",state,vars[i].name,type,type,vars[i].limits[0]*vars[i].limits[1]);
+			fprintf(fp,"\tfor(int i=1;i<%d;i++) %s%s2[i] = %s%s2[0] + i*%d;\n",
+			  vars[i].limits[0],state,vars[i].name,state,vars[i].name,vars[i].limits[1]);
 		}
 	
 	}
+}
+
+/* Shapes of the loops, checked against the ones of a profile file */
+void generate_loop_shapes(FILE* fp)
+{
+	fprintf(fp,"\nstatic const uint64_t loop_shapes[%d] = {",loops_count+1);
+	for (int k=0;k<loops_count;k++) {
+		fprintf(fp,"0x%016llxULL,",(unsigned long long)loops[k].shape);
+	}
+	fprintf(fp,"0};\n");
+}
+
+/*
+ * Initial configuration, also used between the requests of the server
+ * mode. The arrays are filled by all the threads (first touch).
+ */
+void generate_reset(FILE* fp, DEFINITIONS* defs)
+{
+	fprintf(fp,"\t%sstep = 0;\n",state);
+	fprintf(fp,"\t%sprotein = 1;\n",state);
+	fprintf(fp,"\t%snext_protein = 1;\n",state);
+	fprintf(fp,"\t%ssample_cycle = SAMPLE_CYCLE_RESET;\n",state);
+	fprintf(fp,"\tparallel_memset(%smembranes,0,sizeof(int)*%d,%sthreads);\n",state,SIM_MAX_MEMBRANES,state);
+	for (int i=0;i<labels_count;i++) {
+		fprintf(fp,"\t%smembranes_in_%d_size = 0;\n",state,labels[i]);
+		if (packed_label(labels[i])) {
+			fprintf(fp,"\t%spacked_%d_size = 0;\n",state,labels[i]);
+			if (single_bounds[i]>0) {
+				fprintf(fp,"\t%spacked_%d_single = 1;\n",state,labels[i]);
+			}
+			fprintf(fp,"\tparallel_memset(%spacked_pos_%d,0,sizeof(int)*%d,%sthreads);\n",state,labels[i],SIM_MAX_MEMBRANES,state);
+		}
+	}
+	for (int i=0;i<broadcasts_count;i++) {
+		fprintf(fp,"\t%sbroadcast_%s_%d_%d_size = 0;\n",state,vars[broadcasts[i].var].name,broadcasts[i].column,broadcasts[i].label);
+	}
+	if (broadcasts_count>0) {
+		fprintf(fp,"\t%sbroadcast_shared = 0;\n",state);
+	}
+	for (int i=0;i<nearests_count;i++) {
+		fprintf(fp,"\tkdtree_clear(%snearest_%d);\n",state,i);
+	}
+	for (int i=0;i<vars_count;i++) {
+		
+		char* type = var_types[vars[i].type];
+		/* 2-D variables are one block, see generate_alloc */
+		int size = vars[i].indexes==1 ? vars[i].limits[0] : vars[i].limits[0]*vars[i].limits[1];
+		char* block = vars[i].indexes==1 ? "" : "[0]";
+		if (vars[i].type==VAR_LABEL) {
+			fprintf(fp,"\tparallel_fill_int32(%s%s%d%s,LABEL_UNSET,%d,%sthreads);\n",state,vars[i].name,vars[i].indexes,block,size,state);
+		} else {
+			fprintf(fp,"\tparallel_memset(%s%s%d%s,0xFF,sizeof(%s)*%d,%sthreads);\n",state,vars[i].name,vars[i].indexes,block,type,size,state);
+		}
+	}
 	fprintf(fp,"\t// INIT MEMBRANES AND VARIABLES\n");
 	for (int i=0;i<defs->size;i++) {
 		DEFINITION* def = defs->definitions[i];
@@ -503,46 +3410,288 @@ void generate_c_simulator(FILE* fp, DEFINITIONS* defs)
 			INSTRUCTION* inst = def->instructions[j];
 			if (inst->type==INIT_VARIABLE) {
 				fprintf(fp,"\t");
-				generate_var(fp,inst->object,0);
+				generate_init_var(fp,inst->object);
 				fprintf(fp," = ");
-				generate_expr(fp,inst->expr, 0);
+				generate_value(fp,inst->expr,0,searchVar(inst->object->id,inst->object->arguments->size)->type);
 				fprintf(fp,";\n");
 			} else if (inst->type==MU) {
 				int label0 = inst->mu->label->intValue;
 				for (int k=0;k<inst->mu->size;k++) {
 					int label1 = inst->mu->membranes[k]->label->intValue;
-					fprintf(fp,"\tmembranes_in_%d[membranes_in_%d_size++] = %d;\n",label0,label0,label1);
-					fprintf(fp,"\tmembranes_in_%d[membranes_in_%d_size++] = %d;\n",label1,label1,label1);
+					fprintf(fp,"\t%smembranes_in_%d[%smembranes_in_%d_size++] = ",state,label0,state,label0);
+					generate_label(fp,label1);
+					fprintf(fp,";\n\t%smembranes_in_%d[%smembranes_in_%d_size++] = ",state,label1,state,label1);
+					generate_label(fp,label1);
+					fprintf(fp,";\n");
 				}
 				
 			} 
 		}
 	}
 	for (int i=1;i<labels_count;i++) {
-		fprintf(fp,"\tmembranes[%d] = %d;\n",labels[i],labels[0]);
-		fprintf(fp,"\tmembranes[%d] |= %s;\n",labels[i],masks[0]);
-		fprintf(fp,"\tmembranes[%d] |= %s;\n",labels[i],masks[i]);
+		for (int k=0;k<3;k++) {
+			fprintf(fp,"\t%smembranes[",state);
+			generate_label(fp,labels[i]);
+			if (k==0) {
+				fprintf(fp,"] = %d;\n",labels[0]);
+			} else {
+				fprintf(fp,"] |= %s;\n",masks[k==1 ? 0 : i]);
+			}
+		}
 	}
-	
-	fprintf(fp,"\t// MAIN LOOP\n");
+}
+
+/*
+ * Server mode: every request resets the state, moves the roots of the two
+ * trees to its start and goal (label y*width+x+1 and coordinates Y{1,h},
+ * Y{2,h}, as in the bidirectional RRT models) and runs the loop with its
+ * seed and step budget. The answer is the path between the two roots.
+ */
+void generate_server(FILE* fp)
+{
+	VAR* y = searchVar("Y",2);
+	fprintf(fp,"\n// SERVER MODE\n");
+	fprintf(fp,"\nvoid position(int h, double* x, double* y)\n");
+	fprintf(fp,"{\n");
+	fprintf(fp,"\t*x = %s(Y2[1][h]);\n",from_type[y->type]);
+	fprintf(fp,"\t*y = %s(Y2[2][h]);\n",from_type[y->type]);
+	fprintf(fp,"}\n");
+	fprintf(fp,"\nint root_label(int* point, int* label)\n");
+	fprintf(fp,"{\n");
+	fprintf(fp,"\tif (point[0]<0 || point[1]<0 || point[0]>=map->width || point[1]>=map->height) {\n");
+	fprintf(fp,"\t\treturn 0;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\t*label = point[1]*map->width + point[0] + 1;\n");
+	fprintf(fp,"\treturn *label<%d && map->raster[*label-1]>=250;\n",SIM_MAX_MEMBRANES);
+	fprintf(fp,"}\n");
+	fprintf(fp,"\nvoid serve_request(SERVER_REQUEST* req, FILE* out)\n");
+	fprintf(fp,"{\n");
+	for (int i=1;i<labels_count;i++) {
+		fprintf(fp,"\troots[%d] = %d;\n",i-1,labels[i]);
+	}
+	fprintf(fp,"\tif (req->has_start && !root_label(req->start,&roots[0])) {\n");
+	fprintf(fp,"\t\tserver_error(out,req,\"start out of the map or in an obstacle\");\n");
+	fprintf(fp,"\t\treturn;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tif (req->has_goal && !root_label(req->goal,&roots[1])) {\n");
+	fprintf(fp,"\t\tserver_error(out,req,\"goal out of the map or in an obstacle\");\n");
+	fprintf(fp,"\t\treturn;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tif (roots[0]==roots[1]) {\n");
+	fprintf(fp,"\t\tserver_error(out,req,\"start and goal are the same cell\");\n");
+	fprintf(fp,"\t\treturn;\n");
+	fprintf(fp,"\t}\n");
 	fprintf(fp,"\tdouble init_time = omp_get_wtime();\n");
+	fprintf(fp,"\tif (deadline>0) {\n");
+	fprintf(fp,"\t\tdeadline_time = init_time + deadline/1000.0;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\treset();\n");
+	fprintf(fp,"\tif (req->has_start) {\n");
+	fprintf(fp,"\t\tY2[1][roots[0]] = %s(req->start[0]);\n",to_type[y->type]);
+	fprintf(fp,"\t\tY2[2][roots[0]] = %s(req->start[1]);\n",to_type[y->type]);
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tif (req->has_goal) {\n");
+	fprintf(fp,"\t\tY2[1][roots[1]] = %s(req->goal[0]);\n",to_type[y->type]);
+	fprintf(fp,"\t\tY2[2][roots[1]] = %s(req->goal[1]);\n",to_type[y->type]);
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tunsigned int seed = req->has_seed ? req->seed : time(NULL);\n");
+	fprintf(fp,"\tsrand(seed);\n");
+	fprintf(fp,"\trng_seed = seed;\n");
+	fprintf(fp,"\tint budget = max_steps;\n");
+	fprintf(fp,"\tif (req->steps>0) {\n");
+	fprintf(fp,"\t\tmax_steps = req->steps;\n");
+	fprintf(fp,"\t}\n");
 	fprintf(fp,"\tloop();\n");
+	fprintf(fp,"\tmax_steps = budget;\n");
+	fprintf(fp,"\tint halted = !");
+	generate_running(fp);
+	fprintf(fp,";\n");
+	fprintf(fp,"\tint* path = (int*)malloc(sizeof(int)*(membranes_in_%d_size+membranes_in_%d_size));\n",labels[1],labels[2]);
+	fprintf(fp,"\tint length = halted ? server_path(membranes,membranes_in_%d,membranes_in_%d_size,membranes_in_%d,membranes_in_%d_size,position,path) : 0;\n",
+	  labels[1],labels[1],labels[2],labels[2]);
+	fprintf(fp,"\tint pair[2];\n");
+	fprintf(fp,"\tdouble distance;\n");
+	fprintf(fp,"\tif (timed_out) {\n");
+	fprintf(fp,"\t\tlength = partial_path(path,pair,&distance);\n");
+	fprintf(fp,"\t}\n");
 	fprintf(fp,"\tdouble end_time = omp_get_wtime();\n");
-	fprintf(fp,"\tprintf(\"Wall time: %%f seconds\\n\",end_time - init_time);\n");
-	fprintf(fp,"\t// WRITE OUTPUT FILE\n");
-	fprintf(fp,"\tfor (int i=0;i<membranes_in_%d_size;i++) {\n",labels[0]);
-	fprintf(fp,"\t\tint child = membranes_in_%d[i];\n",labels[0]);
-	fprintf(fp,"\t\tint parent = membranes[child] & 0x00FFFFFF;\n");
-	fprintf(fp,"\t\tif (parent == %d) continue;\n",labels[0]);
-	fprintf(fp,"\t\tint x0 = (int)round(Y2[1][child]);\n");
-	fprintf(fp,"\t\tint y0 = (int)round(Y2[2][child]);\n");
-	fprintf(fp,"\t\tint x1 = (int)round(Y2[1][parent]);\n");
-	fprintf(fp,"\t\tint y1 = (int)round(Y2[2][parent]);\n");
-	fprintf(fp,"\t\tdraw_line(map,x0,y0,x1,y1,0);\n");
+	fprintf(fp,"\tfprintf(out,\"{\\\"id\\\":\");\n");
+	fprintf(fp,"\tjson_string(out,req->id);\n");
+	fprintf(fp,"\tfprintf(out,\",\\\"status\\\":\\\"ok\\\",\\\"halted\\\":%%s,\\\"seed\\\":%%u,\\\"steps\\\":%%d,\\\"nodes\\\":%%d,\\\"time\\\":%%f,\\\"timeout\\\":%%s,\\\"path\\\":[\",\n");
+	fprintf(fp,"\t  halted ? \"true\" : \"false\",seed,step,membranes_in_%d_size+membranes_in_%d_size,end_time-init_time,\n",labels[1],labels[2]);
+	fprintf(fp,"\t  timed_out ? \"true\" : \"false\");\n");
+	fprintf(fp,"\tfor (int i=0;i<length;i++) {\n");
+	fprintf(fp,"\t\tdouble x, y;\n");
+	fprintf(fp,"\t\tposition(path[i],&x,&y);\n");
+	fprintf(fp,"\t\tfprintf(out,\"%%s[%%g,%%g]\",i>0 ? \",\" : \"\",x,y);\n");
 	fprintf(fp,"\t}\n");
-	fprintf(fp,"\tstrcpy(map->file,out_file);\n");
-	fprintf(fp,"\tsave_pgm(map);\n");
+	fprintf(fp,"\tfprintf(out,\"]\");\n");
+	fprintf(fp,"\tif (deterministic) {\n");
+	fprintf(fp,"\t\tfprintf(out,\",\\\"hash\\\":\\\"%%016llx\\\"\",(unsigned long long)state_hash());\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tfprintf(out,\"}\\n\");\n");
+	fprintf(fp,"\tfree(path);\n");
+	fprintf(fp,"}\n");
+}
+
+/*
+ * Best result of a run stopped by its deadline (-T): the closest pair of
+ * nodes of the two trees and the path between the roots through it.
+ */
+void generate_partial(FILE* fp)
+{
+	fprintf(fp,"\nint partial_path(int* path, int* pair, double* distance)\n");
+	fprintf(fp,"{\n");
+	if (labels_count<3) {
+		fprintf(fp,"\t*distance = INFINITY;\n");
+		fprintf(fp,"\treturn 0;\n");
+		fprintf(fp,"}\n");
+	} else {
+		fprintf(fp,"\t*distance = sqrt(closest_pair(membranes_in_%d,membranes_in_%d_size,membranes_in_%d,membranes_in_%d_size,position,&pair[0],&pair[1]));\n",
+		  labels[1],labels[1],labels[2],labels[2]);
+		fprintf(fp,"\tif (pair[0]<0) {\n");
+		fprintf(fp,"\t\treturn 0;\n");
+		fprintf(fp,"\t}\n");
+		fprintf(fp,"\treturn tree_path(membranes,membranes_in_%d,membranes_in_%d_size,membranes_in_%d,membranes_in_%d_size,pair[0],pair[1],path);\n",
+		  labels[1],labels[1],labels[2],labels[2]);
+		fprintf(fp,"}\n");
+	}
+	fprintf(fp,"\nvoid deadline_report()\n");
+	fprintf(fp,"{\n");
+	fprintf(fp,"\tprintf(\"Deadline: %%d ms, stopped at step %%d\\n\",deadline,step);\n");
+	fprintf(fp,"\tprintf(\"Tree sizes:");
+	for (int i=1;i<labels_count;i++) {
+		fprintf(fp," %%d");
+	}
+	fprintf(fp,"\\n\"");
+	for (int i=1;i<labels_count;i++) {
+		fprintf(fp,",membranes_in_%d_size",labels[i]);
+	}
+	fprintf(fp,");\n");
+	fprintf(fp,"\tint* path = (int*)malloc(sizeof(int)*(");
+	for (int i=1;i<labels_count && i<3;i++) {
+		fprintf(fp,"membranes_in_%d_size+",labels[i]);
+	}
+	fprintf(fp,"1));\n");
+	fprintf(fp,"\tint pair[2];\n");
+	fprintf(fp,"\tdouble distance;\n");
+	fprintf(fp,"\tint length = partial_path(path,pair,&distance);\n");
+	fprintf(fp,"\tif (length>0) {\n");
+	fprintf(fp,"\t\tdouble x0, y0, x1, y1;\n");
+	fprintf(fp,"\t\tposition(pair[0],&x0,&y0);\n");
+	fprintf(fp,"\t\tposition(pair[1],&x1,&y1);\n");
+	fprintf(fp,"\t\tprintf(\"Closest pair: [%%g,%%g] [%%g,%%g], distance %%f\\n\",x0,y0,x1,y1,distance);\n");
+	fprintf(fp,"\t\tprintf(\"Partial path: %%d nodes\",length);\n");
+	fprintf(fp,"\t\tfor (int i=0;i<length;i++) {\n");
+	fprintf(fp,"\t\t\tposition(path[i],&x0,&y0);\n");
+	fprintf(fp,"\t\t\tprintf(\" [%%g,%%g]\",x0,y0);\n");
+	fprintf(fp,"\t\t}\n");
+	fprintf(fp,"\t\tprintf(\"\\n\");\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tfree(path);\n");
 	fprintf(fp,"}\n");
+}
+
+/* Gauges of the live metrics (--metrics): step, protein and the size of every label list */
+void generate_metrics(FILE* fp)
+{
+	fprintf(fp,"\tif (options.metrics_target[0]!=0) {\n");
+	fprintf(fp,"\t\tmetrics_gauge(\"renpsm_step\",\"Current computation step.\",\"\",&step);\n");
+	fprintf(fp,"\t\tmetrics_gauge(\"renpsm_protein\",\"Current protein.\",\"\",&protein);\n");
+	for (int i=0;i<labels_count;i++) {
+		fprintf(fp,"\t\tmetrics_gauge(\"renpsm_membranes\",\"Membranes in the list of a label.\",\"label=\\\"%d\\\"\",&membranes_in_%d_size);\n",
+		  labels[i],labels[i]);
+	}
+	fprintf(fp,"\t\tif (metrics_start(options.metrics_target,options.metrics_interval,&step)<0) {\n");
+	fprintf(fp,"\t\t\tfprintf(stderr,\"Cannot publish the metrics to %%s\\n\",options.metrics_target);\n");
+	fprintf(fp,"\t\t\treturn 1;\n");
+	fprintf(fp,"\t\t}\n");
+	fprintf(fp,"\t}\n");
+}
+
+/*
+ * Nodes holding the pages of the membranes, the label lists, the variables
+ * and the packed columns, after the run: the packed columns are not
+ * initialised, their pages are placed by the steps that write them.
+ */
+void generate_numa_report(FILE* fp)
+{
+	fprintf(fp,"\t\tlong nodes[NUMA_MAX_NODES];\n");
+	fprintf(fp,"\t\tmemset(nodes,0,sizeof(nodes));\n");
+	fprintf(fp,"\t\tnuma_pages(membranes,sizeof(int)*%d,nodes);\n",SIM_MAX_MEMBRANES);
+	fprintf(fp,"\t\tnuma_print(\"membranes\",nodes);\n");
+	fprintf(fp,"\t\tmemset(nodes,0,sizeof(nodes));\n");
+	for (int i=0;i<labels_count;i++) {
+		fprintf(fp,"\t\tnuma_pages(membranes_in_%d,sizeof(int)*%d,nodes);\n",labels[i],SIM_MAX_MEMBRANES);
+	}
+	fprintf(fp,"\t\tnuma_print(\"membranes_in\",nodes);\n");
+	for (int i=0;i<vars_count;i++) {
+		char* type = var_types[vars[i].type];
+		fprintf(fp,"\t\tmemset(nodes,0,sizeof(nodes));\n");
+		if (vars[i].indexes==1) {
+			fprintf(fp,"\t\tnuma_pages(%s1,sizeof(%s)*%d,nodes);\n",vars[i].name,type,vars[i].limits[0]);
+		} else {
+			fprintf(fp,"\t\tnuma_pages(%s2[0],sizeof(%s)*%d,nodes);\n",vars[i].name,type,vars[i].limits[0]*vars[i].limits[1]);
+		}
+		fprintf(fp,"\t\tnuma_print(\"%s%d\",nodes);\n",vars[i].name,vars[i].indexes);
+	}
+	for (int i=0;i<labels_count;i++) {
+		if (packed_label(labels[i])) {
+			fprintf(fp,"\t\tmemset(nodes,0,sizeof(nodes));\n");
+			fprintf(fp,"\t\tnuma_pages(packed_label_%d,sizeof(int)*%d,nodes);\n",labels[i],SIM_MAX_MEMBRANES);
+			for (int k=0;k<packed_count;k++) {
+				if (packed[k].label==labels[i]) {
+					char* type = column_type(packed[k].label);
+					fprintf(fp,"\t\tnuma_pages(packed_%s_%d_%d,sizeof(%s)*%d,nodes);\n",
+					  vars[packed[k].var].name,packed[k].column,packed[k].label,type,SIM_MAX_MEMBRANES);
+				}
+			}
+			fprintf(fp,"\t\tnuma_print(\"packed_%d\",nodes);\n",labels[i]);
+		}
+	}
+}
+
+/* Draws the Y2 tree on the given map */
+void generate_draw(FILE* fp, char* map)
+{
+	fprintf(fp,"\tfor (int i=0;i<%smembranes_in_%d_size;i++) {\n",state,labels[0]);
+	fprintf(fp,"\t\tint child = %smembranes_in_%d[i];\n",state,labels[0]);
+	fprintf(fp,"\t\tint parent = %smembranes[child] & 0x00FFFFFF;\n",state);
+	fprintf(fp,"\t\tif (parent == %d) continue;\n",labels[0]);
+	char* rounding = searchVar("Y",2)->type==VAR_REAL ? "(int)round" : "";
+	fprintf(fp,"\t\tint x0 = %s(%sY2[1][child]);\n",rounding,state);
+	fprintf(fp,"\t\tint y0 = %s(%sY2[2][child]);\n",rounding,state);
+	fprintf(fp,"\t\tint x1 = %s(%sY2[1][parent]);\n",rounding,state);
+	fprintf(fp,"\t\tint y1 = %s(%sY2[2][parent]);\n",rounding,state);
+	fprintf(fp,"\t\tdraw_line(%s,x0,y0,x1,y1,0);\n",map);
+	fprintf(fp,"\t}\n");
+}
+
+/* Fused kernels, common subexpressions, rules and the main loop */
+void generate_functions(FILE* fp, DEFINITIONS* defs)
+{
+	for (int i=0;i<labels_count;i++) {
+		if (packed_label(labels[i])) {
+			generate_pack(fp,labels[i]);
+		}
+	}
+	for (int i=0;i<vars_count;i++) {
+		if (packed_var(&vars[i])) {
+			generate_packed_store(fp,&vars[i]);
+		}
+	}
+	if (broadcasts_count>0) {
+		generate_share(fp);
+	}
+	if (nearests_count>0) {
+		generate_reorder_labels(fp);
+	}
+	for (int i=0;i<fusions_count;i++) {
+		generate_fusion(fp,i);
+	}
+	for (int i=0;i<commons_count;i++) {
+		generate_common(fp,i);
+	}
 		
 	for (int i=0;i<defs->size;i++) {
 		DEFINITION* def = defs->definitions[i];
@@ -554,6 +3703,247 @@ void generate_c_simulator(FILE* fp, DEFINITIONS* defs)
 		}
 	}
 	generate_loop(fp,defs);
+	generate_state_hash(fp);
+}
+
+void generate_c_simulator(FILE* fp, DEFINITIONS* defs)
+{
+	fprintf(fp,"#include <stdio.h>\n");
+	fprintf(fp,"#include <stdlib.h>\n");
+	fprintf(fp,"#include <string.h>\n");
+	fprintf(fp,"#include <time.h>\n");
+	fprintf(fp,"#include <omp.h>\n");
+	fprintf(fp,"#include \"functions.h\"\n");	
+	fprintf(fp,"#include \"pgm.h\"\n");	
+	fprintf(fp,"extern PGM *map;\n");
+	fprintf(fp,"int debug = 0;\n");
+	fprintf(fp,"int threads = 4;\n");
+	fprintf(fp,"int max_steps = %d;\n",SIM_MAX_ITERS);
+	fprintf(fp,"int step = 0;\n");
+	fprintf(fp,"int reorder = -1;\n");
+	fprintf(fp,"int threshold = -1;\n");
+	fprintf(fp,"int deadline = 0;\n");
+	fprintf(fp,"double deadline_time = 0;\n");
+	fprintf(fp,"int timed_out = 0;\n");
+	fprintf(fp,"\nvoid loop();\n");
+	fprintf(fp,"int partial_path(int* path, int* pair, double* distance);\n");
+	fprintf(fp,"void deadline_report();\n");
+	fprintf(fp,"void reset();\n");
+	fprintf(fp,"uint64_t state_hash();\n");
+	fprintf(fp,"void serve_request(SERVER_REQUEST* req, FILE* out);\n");
+
+	create_membranes(fp,defs);
+	analyse(defs);
+	create_state(fp);
+	generate_loop_shapes(fp);
+		
+	fprintf(fp,"\nint main(int argc, char* argv[])\n");
+	fprintf(fp,"{\n");
+	fprintf(fp,"\tdouble start_time = omp_get_wtime();\n");
+	fprintf(fp,"\tOPTIONS options;\n");
+	fprintf(fp,"\tdefault_options(&options,max_steps);\n");
+	fprintf(fp,"\tparse_input(argc,argv,&options);\n");
+	fprintf(fp,"\tdebug = options.debug;\n");
+	fprintf(fp,"\tthreads = options.threads;\n");
+	fprintf(fp,"\tmax_steps = options.steps;\n");
+	fprintf(fp,"\tdeterministic = options.deterministic;\n");
+	fprintf(fp,"\treorder = options.reorder;\n");
+	fprintf(fp,"\tthreshold = options.threshold;\n");
+	fprintf(fp,"\tdeadline = options.deadline;\n");
+	fprintf(fp,"\tsrand(options.seed);\n");
+	fprintf(fp,"\trng_seed = options.seed;\n");
+	fprintf(fp,"\tif (deadline>0) {\n");
+	fprintf(fp,"\t\tdeadline_time = start_time + deadline/1000.0;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tif (!options.server) {\n");
+	fprintf(fp,"\t\tprint_header(debug,threads,max_steps,options.map_file,options.out_file,deterministic);\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tmap = load_pgm(options.map_file);\n");
+	fprintf(fp,"\tif (map==NULL) {\n");
+	fprintf(fp,"\t\tfprintf(stderr,\"%%s\\n\",last_error);\n");
+	fprintf(fp,"\t\treturn 1;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tif (options.allocation>=0) {\n");
+	fprintf(fp,"\t\talloc_mode = options.allocation;\n");
+	fprintf(fp,"\t\ttlb_open();\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tif (reorder>=0) {\n");
+	fprintf(fp,"\t\tscan_open();\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tbind_threads(threads,options.binding);\n");
+	generate_alloc(fp);
+	fprintf(fp,"\tint profile_loaded = options.profile_file[0]!=0 ? profile_load(options.profile_file,loops,%d,threads) : -1;\n",loops_count);
+	generate_metrics(fp);
+	fprintf(fp,"\tif (options.server) {\n");
+	fprintf(fp,"\t\treturn serve(options.server_socket,serve_request);\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\treset();\n");
+	
+	fprintf(fp,"\t// MAIN LOOP\n");
+	fprintf(fp,"\ttlb_begin();\n");
+	fprintf(fp,"\tdouble init_time = omp_get_wtime();\n");
+	fprintf(fp,"\tloop();\n");
+	fprintf(fp,"\tdouble end_time = omp_get_wtime();\n");
+	fprintf(fp,"\tmetrics_stop();\n");
+	fprintf(fp,"\tprintf(\"Wall time: %%f seconds\\n\",end_time - init_time);\n");
+	fprintf(fp,"\tif (options.binding) {\n");
+	generate_numa_report(fp);
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tif (options.allocation>=0) {\n");
+	fprintf(fp,"\t\talloc_report();\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tif (reorder>=0) {\n");
+	fprintf(fp,"\t\treorder_report(reorder);\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tif (options.profile_file[0]!=0) {\n");
+	fprintf(fp,"\t\tint saved = profile_save(options.profile_file,loops,%d,threads);\n",loops_count);
+	fprintf(fp,"\t\tif (saved<0) {\n");
+	fprintf(fp,"\t\t\tfprintf(stderr,\"Cannot write the profile %%s\\n\",options.profile_file);\n");
+	fprintf(fp,"\t\t} else {\n");
+	fprintf(fp,"\t\t\tprintf(\"Profile: %d loops, %%d read from %%s, %%d calibrated\\n\",profile_loaded<0 ? 0 : profile_loaded,options.profile_file,saved);\n",
+	  loops_count);
+	fprintf(fp,"\t\t}\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tprintf(\"Steps: %%d\\n\",step);\n");
+	fprintf(fp,"\tif (timed_out) {\n");
+	fprintf(fp,"\t\tdeadline_report();\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\tchar hash[64] = \"\";\n");
+	fprintf(fp,"\tif (deterministic) {\n");
+	fprintf(fp,"\t\tsprintf(hash,\"%%016llx\",(unsigned long long)state_hash());\n");
+	fprintf(fp,"\t\tprintf(\"State hash: %%s\\n\",hash);\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\t// WRITE OUTPUT FILE\n");
+	generate_draw(fp,"map");
+	fprintf(fp,"\tstrcpy(map->file,options.out_file);\n");
+	fprintf(fp,"\tsave_pgm(map);\n");
+	fprintf(fp,"\tif (deterministic && options.expected_hash[0]!=0) {\n");
+	fprintf(fp,"\t\tprintf(\"Self-check: %%s\\n\",strcmp(hash,options.expected_hash)==0 ? \"OK\" : \"FAILED\");\n");
+	fprintf(fp,"\t\treturn strcmp(hash,options.expected_hash)==0 ? 0 : 1;\n");
+	fprintf(fp,"\t}\n");
+	fprintf(fp,"\treturn 0;\n");
+	fprintf(fp,"}\n");
+	
+	generate_functions(fp,defs);
+	fprintf(fp,"\nvoid reset()\n");
+	fprintf(fp,"{\n");
+	generate_reset(fp,defs);
+	fprintf(fp,"}\n");
+	generate_server(fp);
+	generate_partial(fp);
+}
+
+/*
+ * Library mode: header declares renpsm_ctx and the API, fp gets its
+ * implementation. Random numbers always come from the keyed generator
+ * and creation rules run in rule order, so a context gives the same
+ * result as the standalone simulator with --deterministic and the same
+ * seed, whatever the number of threads or of concurrent contexts.
+ */
+void generate_c_library(FILE* header, FILE* fp, DEFINITIONS* defs)
+{
+	library = 1;
+	state = "ctx->";
+	state_param = "renpsm_ctx* ctx";
+	state_arg = "ctx";
+	fprintf(header,"#ifndef _SIMULATOR_H_\n");
+	fprintf(header,"#define _SIMULATOR_H_\n");
+	fprintf(header,"\n#include <stdint.h>\n");
+	fprintf(header,"#include \"pgm.h\"\n");
+	fprintf(header,"\n#ifdef __cplusplus\n");
+	fprintf(header,"extern \"C\" {\n");
+	fprintf(header,"#endif\n");
+	fprintf(header,"\ntypedef struct\n");
+	fprintf(header,"{\n");
+	fprintf(header,"\tint threads;\n");
+	fprintf(header,"\tint max_steps;\n");
+	fprintf(header,"\tunsigned int seed;\n");
+	fprintf(header,"\tint debug;\n");
+	fprintf(header,"\tint reorder;\n");
+	fprintf(header,"} renpsm_params;\n");
+	fprintf(header,"\ntypedef struct\n");
+	fprintf(header,"{\n");
+	fprintf(header,"\t// SHARED READ-ONLY MAP\n");
+	fprintf(header,"\tconst PGM* map;\n");
+	fprintf(header,"\tint threads;\n");
+	fprintf(header,"\tint max_steps;\n");
+	fprintf(header,"\tunsigned int seed;\n");
+	fprintf(header,"\tint debug;\n");
+	fprintf(header,"\tint reorder;\n");
+	fprintf(header,"\tint step;\n");
+	create_membranes(header,defs);
+	analyse(defs);
+	create_state(header);
+	fprintf(header,"} renpsm_ctx;\n");
+	fprintf(header,"\n// params==NULL: 4 threads, %d steps, seed 0\n",SIM_MAX_ITERS);
+	fprintf(header,"renpsm_ctx* ctx_create(const PGM* map, const renpsm_params* params);\n");
+	fprintf(header,"// Runs up to n steps, returns the number of steps run\n");
+	fprintf(header,"int ctx_step(renpsm_ctx* ctx, int n);\n");
+	fprintf(header,"int ctx_run_until_halt(renpsm_ctx* ctx);\n");
+	fprintf(header,"int ctx_halted(renpsm_ctx* ctx);\n");
+	fprintf(header,"uint64_t ctx_hash(renpsm_ctx* ctx);\n");
+	fprintf(header,"// Draws the tree on out, which may be a copy of the map\n");
+	fprintf(header,"void ctx_draw(renpsm_ctx* ctx, PGM* out);\n");
+	fprintf(header,"void ctx_destroy(renpsm_ctx* ctx);\n");
+	fprintf(header,"\n#ifdef __cplusplus\n");
+	fprintf(header,"}\n");
+	fprintf(header,"#endif\n");
+	fprintf(header,"\n#endif\n");
+
+	fprintf(fp,"#include <stdio.h>\n");
+	fprintf(fp,"#include <stdlib.h>\n");
+	fprintf(fp,"#include <string.h>\n");
+	fprintf(fp,"#include <omp.h>\n");
+	fprintf(fp,"#include \"functions.h\"\n");	
+	fprintf(fp,"#include \"simulator.h\"\n");	
+	generate_loop_shapes(fp);
+	fprintf(fp,"\nrenpsm_ctx* ctx_create(const PGM* map, const renpsm_params* params)\n");
+	fprintf(fp,"{\n");
+	fprintf(fp,"\trenpsm_ctx* ctx = (renpsm_ctx*)calloc(1,sizeof(renpsm_ctx));\n");
+	fprintf(fp,"\tctx->map = map;\n");
+	fprintf(fp,"\tctx->threads = params!=NULL ? params->threads : 4;\n");
+	fprintf(fp,"\tctx->max_steps = params!=NULL ? params->max_steps : %d;\n",SIM_MAX_ITERS);
+	fprintf(fp,"\tctx->seed = params!=NULL ? params->seed : 0;\n");
+	fprintf(fp,"\tctx->debug = params!=NULL ? params->debug : 0;\n");
+	fprintf(fp,"\tctx->reorder = params!=NULL ? params->reorder : 0;\n");
+	generate_alloc(fp);
+	generate_reset(fp,defs);
+	fprintf(fp,"\treturn ctx;\n");
+	fprintf(fp,"}\n");
+	fprintf(fp,"\nvoid ctx_draw(renpsm_ctx* ctx, PGM* out)\n");
+	fprintf(fp,"{\n");
+	generate_draw(fp,"out");
+	fprintf(fp,"}\n");
+	fprintf(fp,"\nvoid ctx_destroy(renpsm_ctx* ctx)\n");
+	fprintf(fp,"{\n");
+	fprintf(fp,"\tsim_free(ctx->membranes);\n");
+	for (int i=0;i<labels_count;i++) {
+		if (packed_label(labels[i])) {
+			fprintf(fp,"\tsim_free(ctx->packed_pos_%d);\n",labels[i]);
+			fprintf(fp,"\tsim_free(ctx->packed_label_%d);\n",labels[i]);
+		}
+	}
+	for (int i=0;i<packed_count;i++) {
+		fprintf(fp,"\tsim_free(ctx->packed_%s_%d_%d);\n",vars[packed[i].var].name,packed[i].column,packed[i].label);
+	}
+	for (int i=0;i<nearests_count;i++) {
+		fprintf(fp,"\tkdtree_free(ctx->nearest_%d);\n",i);
+	}
+	fprintf(fp,"\tloops_free(ctx->loops);\n");
+	for (int i=0;i<labels_count;i++) {
+		fprintf(fp,"\tsim_free(ctx->membranes_in_%d);\n",labels[i]);
+	}
+	for (int i=0;i<vars_count;i++) {
+		if (vars[i].indexes==2) {
+			fprintf(fp,"\tsim_free(ctx->%s2[0]);\n",vars[i].name);
+			fprintf(fp,"\tfree(ctx->%s2);\n",vars[i].name);
+		} else {
+			fprintf(fp,"\tsim_free(ctx->%s1);\n",vars[i].name);
+		}
+	}
+	fprintf(fp,"\tfree(ctx);\n");
+	fprintf(fp,"}\n");
+	generate_functions(fp,defs);
 }
 
 #endif
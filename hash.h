@@ -0,0 +1,53 @@
+/*
+ * hash.h:
+ *
+ * This file contains the 64-bit FNV-1a hash, over words where it can, of
+ * the state hash of the deterministic mode and of the compile cache.
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdint.h>
+#include <string.h>
+
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	size_t i = 0;
+	for (;i+8<=size;i+=8) {
+		uint64_t word;
+		memcpy(&word,bytes+i,8);
+		hash = (hash ^ word) * 0x100000001B3ULL;
+	}
+	for (;i<size;i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+#endif
@@ -0,0 +1,977 @@
+/*
+ * interpreter.h:
+ *
+ * This file contains a bytecode interpreter for RENPSM models, an
+ * alternative to the generation of ad-hoc simulators.
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INTERPRETER_H_
+#define _INTERPRETER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <omp.h>
+
+#include "renpsm_parser.h"
+#include "gen_c.h"
+#include "functions.h"
+
+/*
+ * Every rule of the rolled-out model is compiled into a short register
+ * program: the value goes to register 0 and the target indexes (or the
+ * child/parent labels, or the protein pair) to registers 1 and 2. The
+ * nodes of an expression use one register per depth level. A register
+ * holds BC_BLOCK lanes, so a program runs for a block of membranes of a
+ * set at once and the dispatch is paid once per block. Variables are
+ * stored as doubles (NaN when not produced yet) and the functions are the
+ * ones of functions.h, so a run gives the same results as the generated
+ * simulator with the same options.
+ */
+
+#define BC_MAX_REGISTERS 64
+#define BC_BLOCK 32
+#define BC_TARGET_REGISTER -1
+#define BC_TARGET_MEMBRANE -2
+
+enum {
+	BC_END, BC_CONST, BC_MEMBRANE, BC_ITERATOR,
+	BC_GET, BC_LOAD, BC_LOADH, BC_LOAD2,
+	BC_ADD, BC_SUB, BC_MUL, BC_DIV, BC_MOD, BC_NEG,
+	BC_LT, BC_GT, BC_LE, BC_GE, BC_EQ, BC_NEQ, BC_AND, BC_OR, BC_NOT,
+	BC_ROUND, BC_RANDOM, BC_EUCLIDEAN, BC_SQUARED, BC_IF, BC_RM, BC_QT, BC_COLLISION,
+	BC_UNIFORM, BC_GOAL, BC_HALTON, BC_SOBOL, BC_RANDOM_FREE, BC_EXTEND,
+	BC_MIN, BC_MAX, BC_SUM, BC_COUNT, BC_ARG_MIN, BC_ARG_MAX
+};
+
+/*
+ * dst, a, b are registers. arg is a constant (in bc_consts), a variable or
+ * a function; offset is the position of a constant index in the variable.
+ * Reductions take the label list in a and the column in offset.
+ */
+typedef struct Bytecode
+{
+	uint8_t op;
+	uint8_t dst;
+	uint8_t a;
+	uint8_t b;
+	int32_t arg;
+	int32_t offset;
+} BYTECODE;
+
+typedef double REGISTERS[BC_MAX_REGISTERS][BC_BLOCK];
+
+typedef struct Slot
+{
+	double* data;
+	double** rows;
+	int width;
+	int height;
+} SLOT;
+
+typedef struct Rule
+{
+	INSTRUCTION* inst;
+	int type;
+	int id;
+	int protein;
+	int enzyme;
+	int code;
+	int set;
+	char* set_id;
+	ITERATOR* range;
+	int random;
+	int chain;
+	int var;
+	int index[2];
+} RULE;
+
+typedef struct RuleList
+{
+	RULE** rules;
+	int size;
+} RULE_LIST;
+
+typedef struct Function
+{
+	char* name;
+	int op;
+	int args;
+} FUNCTION_OP;
+
+FUNCTION_OP bc_functions[] = {
+	{"round",BC_ROUND,1},{"random",BC_RANDOM,2},{"euclideanDistance",BC_EUCLIDEAN,4},
+	{"squaredDistance",BC_SQUARED,4},{"if",BC_IF,3},{"rm",BC_RM,2},{"qt",BC_QT,2},
+	{"collision",BC_COLLISION,5},{"uniform",BC_UNIFORM,2},{"goal",BC_GOAL,4},{"halton",BC_HALTON,3},
+	{"sobol",BC_SOBOL,3},{"random_free",BC_RANDOM_FREE,4},{"extend",BC_EXTEND,7},
+	{"min",BC_MIN,1},{"max",BC_MAX,1},{"sum",BC_SUM,1},{"count",BC_COUNT,1},
+	{"arg_min",BC_ARG_MIN,1},{"arg_max",BC_ARG_MAX,1},{NULL,0,0}
+};
+
+BYTECODE* bc_code = NULL;
+int bc_code_size = 0;
+int bc_code_capacity = 0;
+
+double* bc_consts = NULL;
+int bc_consts_size = 0;
+int bc_consts_capacity = 0;
+
+RULE* bc_rules = NULL;
+int bc_rules_count = 0;
+
+RULE_LIST* bc_by_protein = NULL;
+RULE_LIST bc_any_protein;
+int bc_max_protein = -1;
+
+SLOT* bc_vars = NULL;
+
+int* bc_membranes = NULL;
+int* bc_members[8];
+int bc_members_size[8];
+
+int bc_debug = 0;
+int bc_threads = 4;
+int bc_max_steps = SIM_MAX_ITERS;
+int bc_step = 0;
+int bc_protein = 1;
+int bc_next_protein = 1;
+uint64_t bc_sample_cycle = SAMPLE_CYCLE_RESET;
+
+void bc_error(const char* message, const char* id)
+{
+	fprintf(stderr,"Interpreter: %s %s\n",message,id);
+	exit(1);
+}
+
+int bc_emit(int op, int dst, int a, int b, int arg, int offset)
+{
+	if (bc_code_size==bc_code_capacity) {
+		bc_code_capacity = bc_code_capacity==0 ? 1024 : bc_code_capacity*2;
+		bc_code = (BYTECODE*)realloc(bc_code,sizeof(BYTECODE)*bc_code_capacity);
+	}
+	if (dst>=BC_MAX_REGISTERS || a>=BC_MAX_REGISTERS || b>=BC_MAX_REGISTERS) {
+		bc_error("Expression too deep in rule","");
+	}
+	BYTECODE* bc = &bc_code[bc_code_size];
+	bc->op = op;
+	bc->dst = dst;
+	bc->a = a;
+	bc->b = b;
+	bc->arg = arg;
+	bc->offset = offset;
+	return bc_code_size++;
+}
+
+void bc_emit_const(double value, int dst)
+{
+	if (bc_consts_size==bc_consts_capacity) {
+		bc_consts_capacity = bc_consts_capacity==0 ? 256 : bc_consts_capacity*2;
+		bc_consts = (double*)realloc(bc_consts,sizeof(double)*bc_consts_capacity);
+	}
+	bc_consts[bc_consts_size] = value;
+	bc_emit(BC_CONST,dst,0,0,bc_consts_size++,0);
+}
+
+int bc_label_index(int label)
+{
+	for (int i=0;i<labels_count;i++) {
+		if (labels[i]==label) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int bc_var_index(EXPR* obj)
+{
+	VAR* var = searchVar(obj->id,obj->arguments->size);
+	if (var==NULL) {
+		bc_error("Unknown variable",obj->id);
+	}
+	if (var->indexes<1 || var->indexes>2) {
+		bc_error("Only variables with one or two indexes are supported:",obj->id);
+	}
+	return var-vars;
+}
+
+void bc_compile_expr(EXPR* expr, int dst, RULE* rule);
+
+int bc_is_membrane(EXPR* expr, RULE* rule)
+{
+	return rule->set_id!=NULL && is_iterator(expr,rule->set_id);
+}
+
+/* Register loads, constant indexes are folded into the offset */
+void bc_compile_var(EXPR* obj, int dst, RULE* rule)
+{
+	int var = bc_var_index(obj);
+	VAR* v = &vars[var];
+	EXPR* first = obj->arguments->args[0];
+	EXPR* last = obj->arguments->args[v->indexes-1];
+	int row = 0;
+	if (v->indexes==2) {
+		if (first->type!=INTEGER) {
+			bc_compile_expr(first,dst,rule);
+			bc_compile_expr(last,dst+1,rule);
+			bc_emit(BC_LOAD2,dst,dst,dst+1,var,0);
+			return;
+		}
+		if (first->intValue<0 || first->intValue>=v->limits[0]) {
+			bc_emit_const(NAN,dst);
+			return;
+		}
+		row = first->intValue*v->limits[1];
+	}
+	int width = v->limits[v->indexes-1];
+	if (last->type==INTEGER) {
+		if (last->intValue<0 || last->intValue>=width) {
+			bc_emit_const(NAN,dst);
+		} else {
+			bc_emit(BC_GET,dst,0,0,var,row+last->intValue);
+		}
+	} else if (bc_is_membrane(last,rule)) {
+		bc_emit(BC_LOADH,dst,0,0,var,row);
+	} else {
+		bc_compile_expr(last,dst,rule);
+		bc_emit(BC_LOAD,dst,dst,0,var,row);
+	}
+}
+
+void bc_compile_function(EXPR* expr, int dst, RULE* rule)
+{
+	FUNCTION_OP* f = bc_functions;
+	while (f->name!=NULL && strcmp(f->name,expr->id)!=0) {
+		f++;
+	}
+	if (f->name==NULL) {
+		bc_error("Unknown function",expr->id);
+	}
+	if (is_reduction(expr->id)) {
+		EXPR* values = expr->arguments->args[0];
+		if (expr->arguments->iterators==NULL || expr->arguments->iterators->size==0 ||
+			values->type!=OBJECT || values->arguments==NULL || values->arguments->size!=2) {
+			bc_error("Unsupported reduction",expr->id);
+		}
+		int label = bc_label_index(expr->arguments->iterators->iterators[0]->left->intValue);
+		int column = 0;
+		if (values->arguments->args[1]->type==INTEGER) {
+			column = values->arguments->args[1]->intValue;
+		}
+		if (label<0) {
+			bc_error("Unknown membrane label in",expr->id);
+		}
+		bc_emit(f->op,dst,label,0,bc_var_index(values),column);
+		return;
+	}
+	if (expr->arguments->size!=f->args) {
+		bc_error("Wrong number of arguments for",expr->id);
+	}
+	for (int i=0;i<f->args;i++) {
+		bc_compile_expr(expr->arguments->args[i],dst+i,rule);
+	}
+	bc_emit(f->op,dst,dst,0,0,0);
+}
+
+void bc_compile_expr(EXPR* expr, int dst, RULE* rule)
+{
+	if (expr==NULL) {
+		bc_emit_const(0,dst);
+		return;
+	}
+	int op;
+	switch(expr->type) {
+		case INTEGER:
+			bc_emit_const(expr->intValue,dst);
+			return;
+		case REAL:
+			bc_emit_const(expr->doubleValue,dst);
+			return;
+		case OBJECT:
+			if (expr->arguments!=NULL) {
+				bc_compile_var(expr,dst,rule);
+			} else if (bc_is_membrane(expr,rule)) {
+				bc_emit(BC_MEMBRANE,dst,0,0,0,0);
+			} else if (rule->range!=NULL && is_iterator(expr,rule->range->id)) {
+				bc_emit(BC_ITERATOR,dst,0,0,0,0);
+			} else {
+				bc_error("Unknown iterator",expr->id);
+			}
+			return;
+		case FUNCTION:
+			bc_compile_function(expr,dst,rule);
+			return;
+		case SUB:
+			if (expr->left==NULL) {
+				bc_compile_expr(expr->right,dst,rule);
+				bc_emit(BC_NEG,dst,dst,0,0,0);
+				return;
+			}
+			op = BC_SUB;
+			break;
+		case NOT:
+			bc_compile_expr(expr->right,dst,rule);
+			bc_emit(BC_NOT,dst,dst,0,0,0);
+			return;
+		case ADD: op = BC_ADD; break;
+		case MUL: op = BC_MUL; break;
+		case DIV: op = BC_DIV; break;
+		case MOD: op = BC_MOD; break;
+		case LT: op = BC_LT; break;
+		case GT: op = BC_GT; break;
+		case LE: op = BC_LE; break;
+		case GE: op = BC_GE; break;
+		case EQ: op = BC_EQ; break;
+		case NEQ: op = BC_NEQ; break;
+		case AND: op = BC_AND; break;
+		case OR: op = BC_OR; break;
+		default:
+			bc_error("Unsupported expression in rule","");
+			return;
+	}
+	bc_compile_expr(expr->left,dst,rule);
+	bc_compile_expr(expr->right,dst+1,rule);
+	bc_emit(op,dst,dst,dst+1,0,0);
+}
+
+/* Target indexes: constants and the membrane are kept in the rule, the rest go to registers 1 and 2 */
+void bc_compile_target(EXPR* obj, RULE* rule)
+{
+	rule->var = bc_var_index(obj);
+	for (int i=0;i<obj->arguments->size;i++) {
+		EXPR* arg = obj->arguments->args[i];
+		if (arg->type==INTEGER) {
+			rule->index[i] = arg->intValue;
+		} else if (bc_is_membrane(arg,rule)) {
+			rule->index[i] = BC_TARGET_MEMBRANE;
+		} else {
+			rule->index[i] = BC_TARGET_REGISTER;
+			bc_compile_expr(arg,i+1,rule);
+		}
+	}
+}
+
+void bc_compile_rule(INSTRUCTION* inst, RULE* rule)
+{
+	memset(rule,0,sizeof(RULE));
+	rule->inst = inst;
+	rule->type = inst->type;
+	rule->protein = inst->protein!=NULL ? inst->protein->arguments->args[0]->intValue : -1;
+	rule->random = expr_draws(inst->expr) || expr_draws(inst->object);
+	rule->set = -1;
+	for (int k=0;k<inst->iterators->size;k++) {
+		ITERATOR* it = inst->iterators->iterators[k];
+		if (it->type==SET_ITERATOR && rule->set_id==NULL) {
+			rule->set = bc_label_index(it->left->intValue);
+			rule->set_id = it->id;
+			if (rule->set<0) {
+				bc_error("Unknown membrane label for iterator",it->id);
+			}
+		} else if (it->type==RANGE_ITERATOR) {
+			rule->range = it;
+		}
+	}
+	rule->enzyme = -1;
+	if (inst->enzyme!=NULL) {
+		RULE scalar = *rule;
+		scalar.set_id = NULL;
+		scalar.range = NULL;
+		rule->enzyme = bc_code_size;
+		bc_compile_expr(inst->enzyme,0,&scalar);
+		bc_emit(BC_END,0,0,0,0,0);
+	}
+	rule->code = bc_code_size;
+	if (inst->type==PRODUCTION_RULE) {
+		bc_compile_expr(inst->expr,0,rule);
+		bc_compile_target(inst->object,rule);
+	} else if (inst->type==EVOLUTION_RULE) {
+		bc_compile_expr(inst->object->arguments->args[0],0,rule);
+		bc_compile_expr(inst->expr->arguments->args[0],1,rule);
+	} else if (is_chain(inst)) {
+		/* The parent in register 1 and the arguments of chain() from register 2 */
+		VAR* v = searchVar("Y",2);
+		if (v==NULL || v->limits[0]<3) {
+			bc_error("chain() needs the coordinates","Y{1,h} and Y{2,h}");
+		}
+		rule->chain = 1;
+		rule->var = v-vars;
+		bc_compile_expr(inst->expr,1,rule);
+		for (int i=0;i<7;i++) {
+			bc_compile_expr(inst->object->arguments->args[i],i+2,rule);
+		}
+	} else {
+		bc_compile_expr(inst->object,0,rule);
+		bc_compile_expr(inst->expr,1,rule);
+	}
+	bc_emit(BC_END,0,0,0,0,0);
+}
+
+void bc_add_to_list(RULE_LIST* list, RULE* rule)
+{
+	list->rules = (RULE**)realloc(list->rules,sizeof(RULE*)*(list->size+1));
+	list->rules[list->size++] = rule;
+}
+
+/* Rules are numbered as in the generated simulator, so deterministic runs draw the same random numbers */
+void bc_compile(DEFINITIONS* defs)
+{
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type==MU) {
+				labels[labels_count++] = inst->mu->label->intValue;
+				for (int k=0;k<inst->mu->size;k++) {
+					labels[labels_count++] = inst->mu->membranes[k]->label->intValue;
+				}
+			} else if (inst->type==PRODUCTION_RULE || inst->type==CREATION_RULE || inst->type==EVOLUTION_RULE) {
+				bc_rules_count++;
+			}
+		}
+	}
+	if (labels_count==0) {
+		bc_error("The model has no membrane structure","");
+	}
+	create_vars(defs);
+	bc_rules = (RULE*)malloc(sizeof(RULE)*(bc_rules_count>0 ? bc_rules_count : 1));
+	int rule = 0;
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type==PRODUCTION_RULE || inst->type==CREATION_RULE || inst->type==EVOLUTION_RULE) {
+				bc_compile_rule(inst,&bc_rules[rule]);
+				bc_rules[rule].id = rule;
+				if (bc_rules[rule].protein>bc_max_protein) {
+					bc_max_protein = bc_rules[rule].protein;
+				}
+				rule++;
+			}
+		}
+	}
+	bc_by_protein = (RULE_LIST*)calloc(bc_max_protein+1,sizeof(RULE_LIST));
+	memset(&bc_any_protein,0,sizeof(RULE_LIST));
+	for (int i=0;i<bc_rules_count;i++) {
+		RULE* r = &bc_rules[i];
+		for (int p=0;p<=bc_max_protein;p++) {
+			if (r->protein==-1 || r->protein==p) {
+				bc_add_to_list(&bc_by_protein[p],r);
+			}
+		}
+		if (r->protein==-1) {
+			bc_add_to_list(&bc_any_protein,r);
+		}
+	}
+}
+
+int bc_index(double x, int limit)
+{
+	if (isnan(x)) {
+		return -1;
+	}
+	int i = (int)round(x);
+	return i>=0 && i<limit ? i : -1;
+}
+
+#define BC_LANES(x) for (int k=0;k<n;k++) { x; } break
+
+/*
+ * Runs a program for n membranes, one lane each. With rng (deterministic
+ * mode) every lane draws its random numbers from its own keyed state.
+ */
+void bc_eval(const BYTECODE* pc, REGISTERS r, const int* membranes, int n, int iterator, uint64_t* rng)
+{
+	for (;;pc++) {
+		double* d = r[pc->dst];
+		const double* a = r[pc->a];
+		const double* b = r[pc->b];
+		const SLOT* v;
+		double x;
+		switch(pc->op) {
+			case BC_END:
+				return;
+			case BC_CONST:
+				x = bc_consts[pc->arg];
+				BC_LANES(d[k] = x);
+			case BC_MEMBRANE:
+				BC_LANES(d[k] = membranes[k]);
+			case BC_ITERATOR:
+				BC_LANES(d[k] = iterator);
+			case BC_GET:
+				x = bc_vars[pc->arg].data[pc->offset];
+				BC_LANES(d[k] = x);
+			case BC_LOAD:
+				v = &bc_vars[pc->arg];
+				BC_LANES(int i = bc_index(a[k],v->width); d[k] = i<0 ? NAN : v->data[pc->offset+i]);
+			case BC_LOADH:
+				v = &bc_vars[pc->arg];
+				BC_LANES(d[k] = membranes[k]<v->width ? v->data[pc->offset+membranes[k]] : NAN);
+			case BC_LOAD2:
+				v = &bc_vars[pc->arg];
+				BC_LANES(int i = bc_index(a[k],v->height); int j = bc_index(b[k],v->width); d[k] = i<0 || j<0 ? NAN : v->rows[i][j]);
+			case BC_ADD: BC_LANES(d[k] = a[k] + b[k]);
+			case BC_SUB: BC_LANES(d[k] = a[k] - b[k]);
+			case BC_MUL: BC_LANES(d[k] = a[k] * b[k]);
+			case BC_DIV: BC_LANES(d[k] = a[k] / b[k]);
+			case BC_MOD: BC_LANES(d[k] = fmod(a[k],b[k]));
+			case BC_NEG: BC_LANES(d[k] = -a[k]);
+			case BC_LT: BC_LANES(d[k] = a[k] < b[k]);
+			case BC_GT: BC_LANES(d[k] = a[k] > b[k]);
+			case BC_LE: BC_LANES(d[k] = a[k] <= b[k]);
+			case BC_GE: BC_LANES(d[k] = a[k] >= b[k]);
+			case BC_EQ: BC_LANES(d[k] = a[k] == b[k]);
+			case BC_NEQ: BC_LANES(d[k] = a[k] != b[k]);
+			case BC_AND: BC_LANES(d[k] = a[k] && b[k]);
+			case BC_OR: BC_LANES(d[k] = a[k] || b[k]);
+			case BC_NOT: BC_LANES(d[k] = !a[k]);
+			case BC_ROUND:
+				BC_LANES(d[k] = function_round(a[k]));
+			case BC_RANDOM:
+				for (int k=0;k<n;k++) {
+					if (rng!=NULL) {
+						rng_state = rng[k];
+					}
+					d[k] = function_random(a[k],r[pc->a+1][k]);
+					if (rng!=NULL) {
+						rng[k] = rng_state;
+					}
+				}
+				break;
+			case BC_UNIFORM:
+			case BC_GOAL:
+				for (int k=0;k<n;k++) {
+					if (rng!=NULL) {
+						rng_state = rng[k];
+					}
+					d[k] = pc->op==BC_UNIFORM ? function_uniform(a[k],r[pc->a+1][k]) :
+					  function_goal(rng_seed,bc_step,deterministic,a[k],r[pc->a+1][k],r[pc->a+2][k],r[pc->a+3][k]);
+					if (rng!=NULL) {
+						rng[k] = rng_state;
+					}
+				}
+				break;
+			case BC_HALTON:
+				BC_LANES(d[k] = function_halton(rng_seed,bc_step,&bc_sample_cycle,a[k],r[pc->a+1][k],r[pc->a+2][k]));
+			case BC_SOBOL:
+				BC_LANES(d[k] = function_sobol(rng_seed,bc_step,&bc_sample_cycle,a[k],r[pc->a+1][k],r[pc->a+2][k]));
+			case BC_RANDOM_FREE:
+				BC_LANES(d[k] = function_random_free(rng_seed,bc_step,a[k],r[pc->a+1][k],r[pc->a+2][k],r[pc->a+3][k]));
+			case BC_EUCLIDEAN:
+				BC_LANES(d[k] = function_euclideanDistance(a[k],r[pc->a+1][k],r[pc->a+2][k],r[pc->a+3][k]));
+			case BC_SQUARED:
+				BC_LANES(d[k] = function_squaredDistance(a[k],r[pc->a+1][k],r[pc->a+2][k],r[pc->a+3][k]));
+			case BC_IF:
+				BC_LANES(d[k] = function_if(a[k],r[pc->a+1][k],r[pc->a+2][k]));
+			case BC_RM:
+				BC_LANES(d[k] = function_rm(a[k],r[pc->a+1][k]));
+			case BC_QT:
+				BC_LANES(d[k] = function_qt(a[k],r[pc->a+1][k]));
+			case BC_COLLISION:
+				BC_LANES(d[k] = function_collision(a[k],r[pc->a+1][k],r[pc->a+2][k],r[pc->a+3][k],r[pc->a+4][k]));
+			case BC_EXTEND:
+				BC_LANES(d[k] = function_extend(a[k],r[pc->a+1][k],r[pc->a+2][k],r[pc->a+3][k],r[pc->a+4][k],
+				  r[pc->a+5][k],r[pc->a+6][k]));
+			case BC_MIN:
+				x = function_min(bc_vars[pc->arg].rows,pc->offset,bc_members[pc->a],bc_members_size[pc->a]);
+				BC_LANES(d[k] = x);
+			case BC_MAX:
+				x = function_max(bc_vars[pc->arg].rows,pc->offset,bc_members[pc->a],bc_members_size[pc->a]);
+				BC_LANES(d[k] = x);
+			case BC_SUM:
+				x = function_sum(bc_vars[pc->arg].rows,pc->offset,bc_members[pc->a],bc_members_size[pc->a]);
+				BC_LANES(d[k] = x);
+			case BC_COUNT:
+				x = function_count(bc_vars[pc->arg].rows,pc->offset,bc_members[pc->a],bc_members_size[pc->a]);
+				BC_LANES(d[k] = x);
+			case BC_ARG_MIN:
+				x = function_arg_min(bc_vars[pc->arg].rows,pc->offset,bc_members[pc->a],bc_members_size[pc->a]);
+				BC_LANES(d[k] = x);
+			case BC_ARG_MAX:
+				x = function_arg_max(bc_vars[pc->arg].rows,pc->offset,bc_members[pc->a],bc_members_size[pc->a]);
+				BC_LANES(d[k] = x);
+		}
+	}
+}
+
+int bc_target(int index, double x, int membrane, int limit)
+{
+	int i = index>=0 ? index : index==BC_TARGET_MEMBRANE ? membrane : bc_index(x,limit);
+	return i>=0 && i<limit ? i : -1;
+}
+
+void bc_print_rule(RULE* rule, REGISTERS r, const int* membranes, int k)
+{
+	if (rule->type==PRODUCTION_RULE) {
+		printf("%s",rule->inst->object->id);
+		for (int i=0;i<vars[rule->var].indexes;i++) {
+			int index = rule->index[i];
+			printf("[%d]",index>=0 ? index : index==BC_TARGET_MEMBRANE ? membranes[k] : (int)round(r[i+1][k]));
+		}
+		printf(" = %f; // ",r[0][k]);
+	} else {
+		printf("[ [ ]'%d ]'%d; // ",(int)round(r[0][k]),(int)round(r[1][k]));
+	}
+	printInstruction(stdout,rule->inst,0);
+	printf("\n");
+}
+
+/* Writes the n lanes of register 0, targets out of the variable limits are skipped */
+void bc_store(RULE* rule, REGISTERS r, const int* membranes, int n)
+{
+	SLOT* v = &bc_vars[rule->var];
+	int last = vars[rule->var].indexes-1;
+	for (int k=0;k<n;k++) {
+		int row = last==0 ? 0 : bc_target(rule->index[0],r[1][k],membranes[k],v->height);
+		int column = bc_target(rule->index[last],r[last+1][k],membranes[k],v->width);
+		if (row>=0 && column>=0) {
+			v->rows[row][column] = r[0][k];
+		}
+	}
+}
+
+void bc_link(int child, int parent)
+{
+	bc_membranes[child] = parent;
+	bc_membranes[child] |= (bc_membranes[parent] & 0xFF000000);
+	for (int i=0;i<labels_count;i++) {
+		if (((unsigned int)bc_membranes[child] & (0x01000000u<<i))!=0) {
+			bc_members[i][bc_members_size[i]++] = child;
+		}
+	}
+}
+
+void bc_create(RULE* rule, REGISTERS r, const int* membranes, int k)
+{
+	int parent = bc_index(r[1][k],SIM_MAX_MEMBRANES);
+	if (!rule->chain) {
+		int child = bc_index(r[0][k],SIM_MAX_MEMBRANES);
+		if (child<0 || parent<0) {
+			fprintf(stderr,"Interpreter: membrane label out of range in rule %d\n",rule->id);
+			exit(1);
+		}
+		bc_link(child,parent);
+		if (bc_debug) {
+			bc_print_rule(rule,r,membranes,k);
+		}
+		return;
+	}
+	if (parent<0) {
+		fprintf(stderr,"Interpreter: membrane label out of range in rule %d\n",rule->id);
+		exit(1);
+	}
+	/* As the chain of the generated simulator */
+	SLOT* v = &bc_vars[rule->var];
+	int chain_k = (int)round(r[7][k]);
+	int width = (int)round(r[8][k]);
+	for (int j=1;j<=chain_k;j++) {
+		int x = (int)round(r[2][k] + r[4][k]*r[6][k]*j);
+		int y = (int)round(r[3][k] + r[5][k]*r[6][k]*j);
+		if (x<0 || y<0 || x>=width || (int64_t)y*width+x+1>=SIM_MAX_MEMBRANES) {
+			break;
+		}
+		int child = y*width + x + 1;
+		bc_link(child,parent);
+		if (child<v->width) {
+			v->rows[1][child] = x;
+			v->rows[2][child] = y;
+		}
+		r[0][k] = child;
+		if (bc_debug) {
+			bc_print_rule(rule,r,membranes,k);
+		}
+		r[1][k] = parent = child;
+	}
+}
+
+/* Runs a rule for n membranes of its set (a single membrane 0 for rules without set) */
+void bc_run_rule(RULE* rule, const int* membranes, int n, REGISTERS r)
+{
+	uint64_t lanes[BC_BLOCK];
+	uint64_t* rng = NULL;
+	if (rule->random && deterministic) {
+		for (int k=0;k<n;k++) {
+			rng_key(rule->id,bc_step,membranes[k]);
+			lanes[k] = rng_state;
+		}
+		rng = lanes;
+	}
+	int from = rule->range!=NULL ? rule->range->left->intValue : 0;
+	int to = rule->range!=NULL ? rule->range->right->intValue : 0;
+	const BYTECODE* code = &bc_code[rule->code];
+	for (int i=from;i<=to;i++) {
+		bc_eval(code,r,membranes,n,i,rng);
+		if (rule->type==PRODUCTION_RULE) {
+			bc_store(rule,r,membranes,n);
+		}
+		for (int k=0;k<n;k++) {
+			if (rule->type==EVOLUTION_RULE) {
+				if (bc_protein==(int)round(r[0][k])) {
+					bc_next_protein = (int)round(r[1][k]);
+				}
+				continue;
+			} else if (rule->type==CREATION_RULE) {
+				bc_create(rule,r,membranes,k);
+				continue;
+			}
+			if (bc_debug) {
+				bc_print_rule(rule,r,membranes,k);
+			}
+		}
+	}
+}
+
+void bc_print_state()
+{
+	printf("\n----MEMBRANES---\n");
+	for (int i=0;i<SIM_MAX_MEMBRANES;i++) {
+		if (bc_membranes[i]!=0) {
+			printf("p(%d) = %d ",i,(bc_membranes[i] & 0x00FFFFFF));
+		}
+	}
+	printf("\n\n----VARIABLES---\n");
+	for (int k=0;k<vars_count;k++) {
+		SLOT* v = &bc_vars[k];
+		for (int i=0;i<v->height;i++) {
+			for (int j=0;j<v->width;j++) {
+				if (isnan(v->rows[i][j])) {
+					continue;
+				}
+				if (vars[k].indexes==1) {
+					printf("%s1[%d] = %.2f ",vars[k].name,j,v->rows[i][j]);
+				} else {
+					printf("%s[%d][%d] = %.2f ",vars[k].name,i,j,v->rows[i][j]);
+				}
+			}
+		}
+	}
+	printf("\n\nPress ENTER for next step");
+	getchar();
+}
+
+int bc_no_membrane[BC_BLOCK];
+
+/*
+ * One step: the enzymes are checked first, then the scalar rules are
+ * shared among the threads and the loops over membrane sets are split
+ * between them by blocks. Creation rules run afterwards in rule order,
+ * as in the deterministic mode of the generated simulator.
+ */
+void bc_run_step(RULE** active, REGISTERS r)
+{
+	RULE_LIST* list = bc_protein>=0 && bc_protein<=bc_max_protein ? &bc_by_protein[bc_protein] : &bc_any_protein;
+	int scalars = 0;
+	int sets = 0;
+	int creations = 0;
+	RULE** scalar = active;
+	RULE** set = active+list->size;
+	RULE** creation = active+2*list->size;
+	for (int i=0;i<list->size;i++) {
+		RULE* rule = list->rules[i];
+		if (rule->enzyme>=0) {
+			bc_eval(&bc_code[rule->enzyme],r,bc_no_membrane,1,0,NULL);
+			if (r[0][0]==0) {
+				continue;
+			}
+		}
+		if (rule->type==CREATION_RULE) {
+			creation[creations++] = rule;
+		} else if (rule->set>=0) {
+			set[sets++] = rule;
+		} else {
+			scalar[scalars++] = rule;
+		}
+	}
+	#pragma omp parallel num_threads(bc_threads) if(sets>0 || scalars>1)
+	{
+		REGISTERS regs;
+		#pragma omp for schedule(dynamic,1) nowait
+		for (int i=0;i<scalars;i++) {
+			bc_run_rule(scalar[i],bc_no_membrane,1,regs);
+		}
+		for (int i=0;i<sets;i++) {
+			int label = set[i]->set;
+			int size = bc_members_size[label];
+			#pragma omp for schedule(static) nowait
+			for (int h=0;h<size;h+=BC_BLOCK) {
+				bc_run_rule(set[i],bc_members[label]+h,size-h<BC_BLOCK ? size-h : BC_BLOCK,regs);
+			}
+		}
+	}
+	for (int i=0;i<creations;i++) {
+		RULE* rule = creation[i];
+		if (rule->set<0) {
+			bc_run_rule(rule,bc_no_membrane,1,r);
+			continue;
+		}
+		for (int h=0;h<bc_members_size[rule->set];h+=BC_BLOCK) {
+			int n = bc_members_size[rule->set]-h;
+			bc_run_rule(rule,bc_members[rule->set]+h,n<BC_BLOCK ? n : BC_BLOCK,r);
+		}
+	}
+}
+
+void bc_init(DEFINITIONS* defs, REGISTERS r)
+{
+	bc_vars = (SLOT*)malloc(sizeof(SLOT)*(vars_count>0 ? vars_count : 1));
+	for (int k=0;k<vars_count;k++) {
+		SLOT* v = &bc_vars[k];
+		v->height = vars[k].indexes==2 ? vars[k].limits[0] : 1;
+		v->width = vars[k].limits[vars[k].indexes-1];
+		v->data = (double*)sim_alloc(sizeof(double)*v->height*v->width);
+		for (int i=0;i<v->height*v->width;i++) {
+			v->data[i] = NAN;
+		}
+		v->rows = (double**)malloc(sizeof(double*)*v->height);
+		for (int i=0;i<v->height;i++) {
+			v->rows[i] = v->data + i*v->width;
+		}
+	}
+	bc_membranes = (int*)sim_alloc(sizeof(int)*SIM_MAX_MEMBRANES);
+	memset(bc_membranes,0,sizeof(int)*SIM_MAX_MEMBRANES);
+	for (int i=0;i<labels_count;i++) {
+		bc_members[i] = (int*)sim_alloc(sizeof(int)*SIM_MAX_MEMBRANES);
+		bc_members_size[i] = 0;
+	}
+	RULE rule;
+	memset(&rule,0,sizeof(RULE));
+	for (int i=0;i<defs->size;i++) {
+		DEFINITION* def = defs->definitions[i];
+		for (int j=0;j<def->size;j++) {
+			INSTRUCTION* inst = def->instructions[j];
+			if (inst->type==INIT_VARIABLE) {
+				int start = bc_code_size;
+				bc_compile_expr(inst->expr,0,&rule);
+				bc_compile_target(inst->object,&rule);
+				bc_emit(BC_END,0,0,0,0,0);
+				bc_eval(&bc_code[start],r,bc_no_membrane,1,0,NULL);
+				bc_store(&rule,r,bc_no_membrane,1);
+			} else if (inst->type==MU) {
+				int label0 = bc_label_index(inst->mu->label->intValue);
+				for (int k=0;k<inst->mu->size;k++) {
+					int label1 = inst->mu->membranes[k]->label->intValue;
+					bc_members[label0][bc_members_size[label0]++] = label1;
+					bc_members[bc_label_index(label1)][bc_members_size[bc_label_index(label1)]++] = label1;
+				}
+			}
+		}
+	}
+	for (int i=1;i<labels_count;i++) {
+		bc_membranes[labels[i]] = labels[0] | 0x01000000 | (int)(0x01000000u<<i);
+	}
+}
+
+/*
+ * Runs the model with the options of the generated simulator
+ * (-t, -s, -d, -r, -m, -o, --deterministic, --bind and --alloc).
+ */
+int interpret(int argc, char* argv[], DEFINITIONS* defs)
+{
+	OPTIONS options;
+	default_options(&options,bc_max_steps);
+	parse_input(argc,argv,&options);
+	bc_debug = options.debug;
+	bc_threads = options.threads;
+	bc_max_steps = options.steps;
+	deterministic = options.deterministic;
+	if (options.server) {
+		bc_error("Server mode needs the generated simulator:","--server");
+	}
+	if (options.expected_hash[0]!=0) {
+		bc_error("The state hash self-check needs the generated simulator:","--deterministic=hash");
+	}
+	if (options.reorder>=0) {
+		bc_error("Reordering needs the generated simulator:","--reorder");
+	}
+	if (options.deadline>0) {
+		bc_error("The deadline needs the generated simulator:","-T");
+	}
+	if (options.metrics_target[0]!=0) {
+		bc_error("Metrics need the generated simulator:","--metrics");
+	}
+	if (options.profile_file[0]!=0 || options.threshold>=0) {
+		bc_error("Loop thresholds need the generated simulator:",options.profile_file[0]!=0 ? "--profile" : "--threshold");
+	}
+	if (options.allocation>=0) {
+		alloc_mode = options.allocation;
+		tlb_open();
+	}
+	bind_threads(bc_threads,options.binding);
+	srand(options.seed);
+	rng_seed = options.seed;
+	print_header(bc_debug,bc_threads,bc_max_steps,options.map_file,options.out_file,deterministic);
+	map = load_pgm(options.map_file);
+	if (map==NULL) {
+		bc_error("Cannot open",options.map_file);
+	}
+	REGISTERS* r = (REGISTERS*)malloc(sizeof(REGISTERS));
+	bc_compile(defs);
+	bc_init(defs,*r);
+	VAR* halt = searchVar("Halt",1);
+	double* halt_value = halt!=NULL ? bc_vars[halt-vars].data : NULL;
+	RULE** active = (RULE**)malloc(sizeof(RULE*)*3*(bc_rules_count>0 ? bc_rules_count : 1));
+	tlb_begin();
+	double init_time = omp_get_wtime();
+	while (bc_step<bc_max_steps && (halt_value==NULL || isnan(halt_value[0]) || halt_value[0]==0)) {
+		if (bc_debug) {
+			printf("\n\n------ STEP %d protein = %d------\n",bc_step+1,bc_protein);
+		}
+		bc_run_step(active,*r);
+		bc_protein = bc_next_protein;
+		if (bc_debug) {
+			bc_print_state();
+		}
+		++bc_step;
+	}
+	double end_time = omp_get_wtime();
+	printf("Wall time: %f seconds\n",end_time - init_time);
+	if (options.allocation>=0) {
+		alloc_report();
+	}
+	printf("Steps: %d\n",bc_step);
+	VAR* y = searchVar("Y",2);
+	SLOT* v = y!=NULL ? &bc_vars[y-vars] : NULL;
+	for (int i=0;v!=NULL && v->height>2 && i<bc_members_size[0];i++) {
+		int child = bc_members[0][i];
+		int parent = bc_membranes[child] & 0x00FFFFFF;
+		if (parent == labels[0] || child>=v->width || parent>=v->width) {
+			continue;
+		}
+		int x0 = (int)round(v->rows[1][child]);
+		int y0 = (int)round(v->rows[2][child]);
+		int x1 = (int)round(v->rows[1][parent]);
+		int y1 = (int)round(v->rows[2][parent]);
+		draw_line(map,x0,y0,x1,y1,0);
+	}
+	strcpy(map->file,options.out_file);
+	save_pgm(map);
+	free(active);
+	free(r);
+	return 0;
+}
+
+#endif
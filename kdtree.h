@@ -0,0 +1,318 @@
+/*
+ * kdtree.h:
+ *
+ * This file contains the incremental 2-d tree used by the generated RENPSM
+ * simulators to answer the nearest-node queries of the fused kernels (the
+ * nearest node of a tree to a point) in logarithmic time instead of
+ * scanning the whole label list.
+ *
+ * The points are the packed positions of a label, inserted when they are
+ * packed. The tree is kept balanced as a scapegoat tree: an insertion
+ * deeper than log(n)/log(1/KDTREE_ALPHA) rebuilds the deepest unbalanced
+ * subtree of its path. A point moved after it was inserted marks the tree
+ * dirty and it is rebuilt before the next query. Points with an unset
+ * (NaN) coordinate are not in the tree.
+ *
+ * The query gives the same result as the min_loc reduction of the kernels:
+ * the smallest squared distance and, among the points at that distance,
+ * the lowest label. Subtrees are only skipped when their distance bound
+ * is strictly greater than the best distance found.
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _KDTREE_H_
+#define _KDTREE_H_
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "reductions.h"
+#include "alloc.h"
+#include "reorder.h"
+
+#define KDTREE_ALPHA 0.7
+#define KDTREE_MAX_DEPTH 128
+
+/* Node i is the packed position i, the axis of a node is its depth modulo 2 */
+typedef struct KdTree
+{
+	double* x;
+	double* y;
+	int* label;
+	int* left;
+	int* right;
+	int* size;
+	int* order;
+	int capacity;
+	int count;
+	int root;
+	int lowest;
+	int dirty;
+} KDTREE;
+
+KDTREE* kdtree_create(int capacity)
+{
+	KDTREE* t = (KDTREE*)calloc(1,sizeof(KDTREE));
+	t->x = (double*)sim_alloc(sizeof(double)*capacity);
+	t->y = (double*)sim_alloc(sizeof(double)*capacity);
+	t->label = (int*)sim_alloc(sizeof(int)*capacity);
+	t->left = (int*)sim_alloc(sizeof(int)*capacity);
+	t->right = (int*)sim_alloc(sizeof(int)*capacity);
+	t->size = (int*)sim_alloc(sizeof(int)*capacity);
+	t->order = (int*)sim_alloc(sizeof(int)*capacity);
+	t->capacity = capacity;
+	t->count = 0;
+	t->root = -1;
+	t->lowest = INT_MAX;
+	t->dirty = 0;
+	return t;
+}
+
+void kdtree_free(KDTREE* t)
+{
+	sim_free(t->x);
+	sim_free(t->y);
+	sim_free(t->label);
+	sim_free(t->left);
+	sim_free(t->right);
+	sim_free(t->size);
+	sim_free(t->order);
+	free(t);
+}
+
+void kdtree_clear(KDTREE* t)
+{
+	t->count = 0;
+	t->root = -1;
+	t->lowest = INT_MAX;
+	t->dirty = 0;
+}
+
+/* Coordinates are ordered by value and then by position, so no two are equal */
+int kdtree_less(KDTREE* t, int a, int b, int axis)
+{
+	double ka = axis ? t->y[a] : t->x[a];
+	double kb = axis ? t->y[b] : t->x[b];
+	return ka<kb || (ka==kb && a<b);
+}
+
+/* Moves the k-th point of p along axis to p[k], smaller ones before it */
+void kdtree_select(KDTREE* t, int* p, int n, int k, int axis)
+{
+	int lo = 0;
+	int hi = n-1;
+	while (lo<hi) {
+		int pivot = p[lo+(hi-lo)/2];
+		int i = lo;
+		int j = hi;
+		while (i<=j) {
+			while (kdtree_less(t,p[i],pivot,axis)) {
+				i++;
+			}
+			while (kdtree_less(t,pivot,p[j],axis)) {
+				j--;
+			}
+			if (i<=j) {
+				int swap = p[i];
+				p[i++] = p[j];
+				p[j--] = swap;
+			}
+		}
+		if (k<=j) {
+			hi = j;
+		} else if (k>=i) {
+			lo = i;
+		} else {
+			return;
+		}
+	}
+}
+
+int kdtree_build(KDTREE* t, int* p, int n, int depth)
+{
+	if (n==0) {
+		return -1;
+	}
+	int m = n/2;
+	kdtree_select(t,p,n,m,depth & 1);
+	int node = p[m];
+	t->left[node] = kdtree_build(t,p,m,depth+1);
+	t->right[node] = kdtree_build(t,p+m+1,n-m-1,depth+1);
+	t->size[node] = n;
+	return node;
+}
+
+/* Balanced copy of the subtree of node, whose depth is given */
+int kdtree_rebuild_subtree(KDTREE* t, int node, int depth)
+{
+	int n = 0;
+	t->order[n++] = node;
+	for (int i=0;i<n;i++) {
+		int k = t->order[i];
+		if (t->left[k]>=0) {
+			t->order[n++] = t->left[k];
+		}
+		if (t->right[k]>=0) {
+			t->order[n++] = t->right[k];
+		}
+	}
+	return kdtree_build(t,t->order,n,depth);
+}
+
+void kdtree_rebuild(KDTREE* t)
+{
+	int n = 0;
+	for (int i=0;i<t->count;i++) {
+		if (!isnan(t->x[i]) && !isnan(t->y[i])) {
+			t->order[n++] = i;
+		}
+	}
+	t->root = kdtree_build(t,t->order,n,0);
+	t->dirty = 0;
+}
+
+void kdtree_link(KDTREE* t, int pos)
+{
+	int path[KDTREE_MAX_DEPTH];
+	int depth = 0;
+	int* link = &t->root;
+	while (*link>=0 && depth<KDTREE_MAX_DEPTH) {
+		int node = *link;
+		path[depth] = node;
+		t->size[node]++;
+		link = kdtree_less(t,pos,node,depth & 1) ? &t->left[node] : &t->right[node];
+		depth++;
+	}
+	if (*link>=0) {
+		t->dirty = 1;
+		return;
+	}
+	*link = pos;
+	if (depth<=log(t->size[t->root])/log(1/KDTREE_ALPHA)+1) {
+		return;
+	}
+	for (int i=depth-1;i>=0;i--) {
+		int node = path[i];
+		int child = i+1<depth ? path[i+1] : pos;
+		if (t->size[child]>KDTREE_ALPHA*t->size[node]) {
+			int rebuilt = kdtree_rebuild_subtree(t,node,i);
+			if (i==0) {
+				t->root = rebuilt;
+			} else if (t->left[path[i-1]]==node) {
+				t->left[path[i-1]] = rebuilt;
+			} else {
+				t->right[path[i-1]] = rebuilt;
+			}
+			return;
+		}
+	}
+}
+
+/* Appends the next packed position, of membrane label */
+void kdtree_insert(KDTREE* t, double x, double y, int label)
+{
+	int pos = t->count++;
+	t->x[pos] = x;
+	t->y[pos] = y;
+	t->label[pos] = label;
+	t->left[pos] = -1;
+	t->right[pos] = -1;
+	t->size[pos] = 1;
+	if (label<t->lowest) {
+		t->lowest = label;
+	}
+	if (!t->dirty && !isnan(x) && !isnan(y)) {
+		kdtree_link(t,pos);
+	}
+}
+
+void kdtree_move(KDTREE* t, int pos, double x, double y)
+{
+	if (t->x[pos]==x && t->y[pos]==y) {
+		return;
+	}
+	t->x[pos] = x;
+	t->y[pos] = y;
+	t->dirty = 1;
+}
+
+/*
+ * Position q gets the point of position from[q], to is the inverse
+ * permutation (reorder.h). The links are renumbered, so the tree keeps its
+ * shape and is not rebuilt.
+ */
+void kdtree_permute(KDTREE* t, const int* from, const int* to, int n, void* buffer, int threads)
+{
+	reorder_double(t->x,from,n,buffer,threads);
+	reorder_double(t->y,from,n,buffer,threads);
+	reorder_int(t->label,from,n,buffer,threads);
+	reorder_int(t->size,from,n,buffer,threads);
+	reorder_int(t->left,from,n,buffer,threads);
+	reorder_int(t->right,from,n,buffer,threads);
+	#pragma omp parallel for num_threads(threads)
+	for (int q=0;q<n;q++) {
+		t->left[q] = t->left[q]<0 ? -1 : to[t->left[q]];
+		t->right[q] = t->right[q]<0 ? -1 : to[t->right[q]];
+	}
+	if (t->root>=0) {
+		t->root = to[t->root];
+	}
+}
+
+void kdtree_search(KDTREE* t, int node, int depth, double x, double y, VALUE_LOC* best)
+{
+	if (node<0) {
+		return;
+	}
+	double dx = x - t->x[node];
+	double dy = y - t->y[node];
+	double d = dx*dx + dy*dy;
+	if (d<best->value || (d==best->value && t->label[node]<best->arg)) {
+		best->value = d;
+		best->arg = t->label[node];
+	}
+	double split = depth & 1 ? dy : dx;
+	kdtree_search(t,split<0 ? t->left[node] : t->right[node],depth+1,x,y,best);
+	if (split*split<=best->value) {
+		kdtree_search(t,split<0 ? t->right[node] : t->left[node],depth+1,x,y,best);
+	}
+}
+
+/* Nearest point to (x,y), {INFINITY,INT_MAX} if there is none */
+VALUE_LOC kdtree_nearest(KDTREE* t, double x, double y)
+{
+	VALUE_LOC best = {INFINITY,INT_MAX};
+	if (t->dirty) {
+		kdtree_rebuild(t);
+	}
+	if (!isnan(x) && !isnan(y)) {
+		kdtree_search(t,t->root,0,x,y,&best);
+	}
+	return best;
+}
+
+#endif
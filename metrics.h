@@ -0,0 +1,332 @@
+/*
+ * metrics.h:
+ *
+ * This file contains the live metrics of the generated RENPSM simulators
+ * (--metrics): counters written without locks by the threads running the
+ * steps, and a reporter thread of the lowest priority that aggregates
+ * them every interval in the Prometheus text exposition format, written
+ * to a file or answered on a Unix domain socket.
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define METRICS_SLOTS 256
+#define METRICS_PROTEINS 64
+#define METRICS_GAUGES 64
+#define METRICS_TEXT 65536
+
+/* Linux policy of the reporter, hidden by sched.h without _GNU_SOURCE */
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+
+/* Counters of one thread, only written by it */
+typedef struct
+{
+	uint64_t rules;
+	char pad[56];
+} METRICS_THREAD;
+
+typedef struct
+{
+	const char* name;
+	const char* help;
+	char labels[64];
+	const int* value;
+} METRICS_GAUGE;
+
+int metrics_on = 0;
+
+METRICS_THREAD metrics_threads[METRICS_SLOTS];
+int metrics_slots = 0;
+int metrics_slot = -1;
+#pragma omp threadprivate(metrics_slot)
+
+/* Written by the thread running the steps */
+uint64_t metrics_protein_ns[METRICS_PROTEINS];
+uint64_t metrics_protein_steps[METRICS_PROTEINS];
+uint64_t metrics_last_ns = 0;
+int metrics_last_protein = -1;
+
+METRICS_GAUGE metrics_gauges[METRICS_GAUGES];
+int metrics_gauges_count = 0;
+
+const char* metrics_path = NULL;
+int metrics_period = 1000;
+const int* metrics_step_value = NULL;
+double metrics_rate = 0;
+int metrics_socket = -1;
+int metrics_stopping = 0;
+pthread_t metrics_reporter;
+
+uint64_t metrics_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* The time since the previous step goes to the protein of that step */
+static inline void metrics_step(int protein)
+{
+	uint64_t now = metrics_now();
+	int last = metrics_last_protein;
+	if (last>=0 && last<METRICS_PROTEINS) {
+		__atomic_store_n(&metrics_protein_ns[last],metrics_protein_ns[last]+now-metrics_last_ns,__ATOMIC_RELAXED);
+		__atomic_store_n(&metrics_protein_steps[last],metrics_protein_steps[last]+1,__ATOMIC_RELAXED);
+	}
+	metrics_last_ns = now;
+	metrics_last_protein = protein;
+}
+
+/* A rule past its guards, counted in the slot of the calling thread */
+static inline void metrics_rule()
+{
+	if (metrics_slot<0) {
+		#pragma omp atomic capture
+		metrics_slot = metrics_slots++;
+	}
+	if (metrics_slot<METRICS_SLOTS) {
+		METRICS_THREAD* t = &metrics_threads[metrics_slot];
+		__atomic_store_n(&t->rules,t->rules+1,__ATOMIC_RELAXED);
+	}
+}
+
+void metrics_gauge(const char* name, const char* help, const char* labels, const int* value)
+{
+	if (metrics_gauges_count<METRICS_GAUGES) {
+		METRICS_GAUGE* g = &metrics_gauges[metrics_gauges_count++];
+		g->name = name;
+		g->help = help;
+		snprintf(g->labels,sizeof(g->labels),"%s",labels);
+		g->value = value;
+	}
+}
+
+long metrics_resident()
+{
+	long pages = 0;
+	long resident = 0;
+	FILE* fp = fopen("/proc/self/statm","r");
+	if (fp==NULL) {
+		return 0;
+	}
+	if (fscanf(fp,"%ld %ld",&pages,&resident)!=2) {
+		resident = 0;
+	}
+	fclose(fp);
+	return resident*sysconf(_SC_PAGESIZE);
+}
+
+int metrics_format(char* text, int size)
+{
+	int n = 0;
+	const char* last = "";
+	for (int i=0;i<metrics_gauges_count;i++) {
+		METRICS_GAUGE* g = &metrics_gauges[i];
+		if (strcmp(g->name,last)!=0) {
+			n += snprintf(text+n,size-n,"# HELP %s %s\n# TYPE %s gauge\n",g->name,g->help,g->name);
+			last = g->name;
+		}
+		n += snprintf(text+n,size-n,"%s%s%s%s %d\n",g->name,g->labels[0] ? "{" : "",g->labels,g->labels[0] ? "}" : "",
+		  __atomic_load_n(g->value,__ATOMIC_RELAXED));
+	}
+	n += snprintf(text+n,size-n,"# HELP renpsm_steps_per_second Steps per second over the last interval.\n");
+	n += snprintf(text+n,size-n,"# TYPE renpsm_steps_per_second gauge\nrenpsm_steps_per_second %.1f\n",metrics_rate);
+	n += snprintf(text+n,size-n,"# HELP renpsm_protein_seconds_total Time spent in the steps of a protein.\n");
+	n += snprintf(text+n,size-n,"# TYPE renpsm_protein_seconds_total counter\n");
+	for (int p=0;p<METRICS_PROTEINS && n<size;p++) {
+		uint64_t ns = __atomic_load_n(&metrics_protein_ns[p],__ATOMIC_RELAXED);
+		if (__atomic_load_n(&metrics_protein_steps[p],__ATOMIC_RELAXED)>0) {
+			n += snprintf(text+n,size-n,"renpsm_protein_seconds_total{protein=\"%d\"} %.9f\n",p,ns/1e9);
+		}
+	}
+	n += snprintf(text+n,size-n,"# HELP renpsm_protein_steps_total Steps run with a protein.\n");
+	n += snprintf(text+n,size-n,"# TYPE renpsm_protein_steps_total counter\n");
+	for (int p=0;p<METRICS_PROTEINS && n<size;p++) {
+		uint64_t steps = __atomic_load_n(&metrics_protein_steps[p],__ATOMIC_RELAXED);
+		if (steps>0) {
+			n += snprintf(text+n,size-n,"renpsm_protein_steps_total{protein=\"%d\"} %llu\n",p,(unsigned long long)steps);
+		}
+	}
+	n += snprintf(text+n,size-n,"# HELP renpsm_thread_rules_total Rules run past their guards by a thread.\n");
+	n += snprintf(text+n,size-n,"# TYPE renpsm_thread_rules_total counter\n");
+	int slots = __atomic_load_n(&metrics_slots,__ATOMIC_RELAXED);
+	for (int t=0;t<slots && t<METRICS_SLOTS && n<size;t++) {
+		n += snprintf(text+n,size-n,"renpsm_thread_rules_total{thread=\"%d\"} %llu\n",t,
+		  (unsigned long long)__atomic_load_n(&metrics_threads[t].rules,__ATOMIC_RELAXED));
+	}
+	n += snprintf(text+n,size-n,"# HELP renpsm_resident_bytes Resident set size of the process.\n");
+	n += snprintf(text+n,size-n,"# TYPE renpsm_resident_bytes gauge\nrenpsm_resident_bytes %ld\n",metrics_resident());
+	return n<size ? n : size-1;
+}
+
+/* The file is replaced at once, so a scraper never reads half of it */
+void metrics_write_file(const char* text, int n)
+{
+	char tmp[300];
+	snprintf(tmp,sizeof(tmp),"%s.tmp",metrics_path);
+	FILE* fp = fopen(tmp,"w");
+	if (fp==NULL) {
+		return;
+	}
+	fwrite(text,1,n,fp);
+	fclose(fp);
+	rename(tmp,metrics_path);
+}
+
+/* A connection gets a plain HTTP answer after its request, or after 100 ms without one */
+void metrics_answer(int fd, char* text)
+{
+	char request[1024];
+	struct pollfd p = {fd,POLLIN,0};
+	while (poll(&p,1,100)>0) {
+		ssize_t r = read(fd,request,sizeof(request)-1);
+		if (r<=0) {
+			break;
+		}
+		request[r] = 0;
+		if (strstr(request,"\r\n\r\n")!=NULL || strstr(request,"\n\n")!=NULL) {
+			break;
+		}
+	}
+	int n = metrics_format(text,METRICS_TEXT);
+	dprintf(fd,"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n",n);
+	if (write(fd,text,n)<0) {
+		/* the scraper went away */
+	}
+	close(fd);
+}
+
+void* metrics_run(void* arg)
+{
+	struct sched_param param;
+	memset(&param,0,sizeof(param));
+	if (pthread_setschedparam(pthread_self(),SCHED_IDLE,&param)!=0) {
+		setpriority(PRIO_PROCESS,(id_t)syscall(SYS_gettid),19);
+	}
+	char* text = (char*)malloc(METRICS_TEXT);
+	uint64_t last = metrics_now();
+	int last_step = __atomic_load_n(metrics_step_value,__ATOMIC_RELAXED);
+	while (!__atomic_load_n(&metrics_stopping,__ATOMIC_ACQUIRE)) {
+		uint64_t next = last + (uint64_t)metrics_period*1000000ULL;
+		for (uint64_t now=metrics_now();now<next && !__atomic_load_n(&metrics_stopping,__ATOMIC_ACQUIRE);now=metrics_now()) {
+			int wait = (int)((next-now)/1000000ULL) + 1;
+			if (metrics_socket>=0) {
+				struct pollfd p = {metrics_socket,POLLIN,0};
+				if (poll(&p,1,wait<50 ? wait : 50)>0) {
+					int fd = accept(metrics_socket,NULL,NULL);
+					if (fd>=0) {
+						metrics_answer(fd,text);
+					}
+				}
+			} else {
+				usleep((wait<50 ? wait : 50)*1000);
+			}
+		}
+		uint64_t now = metrics_now();
+		int step = __atomic_load_n(metrics_step_value,__ATOMIC_RELAXED);
+		metrics_rate = (step-last_step)/((now-last)/1e9);
+		last = now;
+		last_step = step;
+		if (metrics_socket<0) {
+			metrics_write_file(text,metrics_format(text,METRICS_TEXT));
+		}
+	}
+	free(text);
+	return arg;
+}
+
+/*
+ * Starts the reporter on target, a file or unix:path for a socket, every
+ * interval milliseconds. step is the step counter of the steps per second.
+ */
+int metrics_start(const char* target, int interval, const int* step)
+{
+	metrics_path = target;
+	metrics_period = interval>0 ? interval : 1000;
+	metrics_step_value = step;
+	if (strncmp(target,"unix:",5)==0) {
+		struct sockaddr_un addr;
+		memset(&addr,0,sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(target+5)>=sizeof(addr.sun_path)) {
+			fprintf(stderr,"Metrics: socket path too long\n");
+			return -1;
+		}
+		strcpy(addr.sun_path,target+5);
+		unlink(addr.sun_path);
+		metrics_socket = socket(AF_UNIX,SOCK_STREAM,0);
+		if (metrics_socket<0 || bind(metrics_socket,(struct sockaddr*)&addr,sizeof(addr))<0 || listen(metrics_socket,8)<0) {
+			perror("Metrics");
+			return -1;
+		}
+	}
+	metrics_on = 1;
+	if (pthread_create(&metrics_reporter,NULL,metrics_run,NULL)!=0) {
+		metrics_on = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Closes the last step, stops the reporter and writes the final values */
+void metrics_stop()
+{
+	if (!metrics_on) {
+		return;
+	}
+	metrics_step(-1);
+	__atomic_store_n(&metrics_stopping,1,__ATOMIC_RELEASE);
+	pthread_join(metrics_reporter,NULL);
+	metrics_on = 0;
+	if (metrics_socket>=0) {
+		close(metrics_socket);
+		unlink(metrics_path+5);
+	} else {
+		char* text = (char*)malloc(METRICS_TEXT);
+		metrics_write_file(text,metrics_format(text,METRICS_TEXT));
+		free(text);
+	}
+}
+
+#endif
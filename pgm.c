@@ -32,131 +32,394 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "pgm.h"
 
 char last_error[256];
 
-int next_line(FILE* fp, char* buffer, PGM* pgm) {
-	int i,error;
-	buffer[0]=0;
-	int counter=0;
-	do{
-		i=0;
-		do{
-			if ( (error = fscanf(fp,"%c",&buffer[i++])) != EOF) {
-				if (buffer[i-1]=='\n') {
-					buffer[i-1]=0;
-				}
-				counter++;
-			} 
-		} while(error!=EOF && buffer[i-1]!=0);
-	} while(error!=EOF && (buffer[0]=='#' || buffer[0]==0));
-	
-	if (error==EOF) {
-		counter=0;
-		fclose(fp);
-		sprintf(last_error,"Error reading file.");
-		free(pgm);
+/* Skips whitespace and comments, returns the offset of the next token */
+size_t next_token(const unsigned char* data, size_t size, size_t offset)
+{
+	while (offset<size) {
+		if (data[offset]=='#') {
+			while (offset<size && data[offset]!='\n') {
+				offset++;
+			}
+		} else if (data[offset]==' ' || data[offset]=='\t' || data[offset]=='\r' || data[offset]=='\n') {
+			offset++;
+		} else {
+			break;
+		}
 	}
-	return counter;
+	return offset;
 }
 
-PGM* load_pgm(const char* file)
+/* Reads a positive decimal number, -1 on error */
+long next_number(const unsigned char* data, size_t size, size_t* offset)
 {
-	PGM* pgm=NULL;
-	char buffer[256];
-	int bytes;
-	int offset=0;
-	int raster_size;
-	FILE* fp = fopen(file,"r");
-	if (fp==NULL) {
-		sprintf(last_error,"Error: Cannot open %s.",file);
-		return NULL;
+	long value = 0;
+	size_t i = next_token(data,size,*offset);
+	if (i>=size || data[i]<'0' || data[i]>'9') {
+		return -1;
 	}
-	pgm = (PGM*)malloc(sizeof(PGM));
-	strcpy(pgm->file,file);
-	
-	if ((bytes= next_line(fp,buffer,pgm))==0) {
-		return NULL;
-	} else {
-		offset+=bytes;
+	for (;i<size && data[i]>='0' && data[i]<='9';i++) {
+		value = value*10 + (data[i]-'0');
+		if (value>=(1L<<30)) {
+			return -1;
+		}
 	}
-	if (strcmp(buffer,"P5")!=0) {
-		fclose(fp);
+	*offset = i;
+	return value;
+}
+
+/*
+ * Parses the header of a binary PGM in data, returns the offset of the
+ * raster or 0 on error.
+ */
+size_t parse_pgm_header(const unsigned char* data, size_t size, PGM* pgm)
+{
+	size_t offset = 0;
+	if (size<2 || data[0]!='P' || data[1]!='5') {
 		sprintf(last_error,"Error: Invalid PGM file.");
-		free(pgm);
-		return NULL;
+		return 0;
 	}
-	if ((bytes= next_line(fp,buffer,pgm))==0) {
-		return NULL;
-	} else {
-		offset+=bytes;
-	}	
-	sscanf(buffer,"%d %d",&(pgm->width),&(pgm->height));
-	
-	if (pgm->width<=0 || pgm->width>=65536  || pgm->height<=0 || pgm->width>=65536) {
-		fclose(fp);
+	offset = 2;
+	long width = next_number(data,size,&offset);
+	long height = next_number(data,size,&offset);
+	if (width<=0 || width>=65536 || height<=0 || height>=65536) {
 		sprintf(last_error,"Error: Invalid raster size.");
-		free(pgm);
-		return NULL;
+		return 0;
 	}
-	
-	if ((bytes= next_line(fp,buffer,pgm))==0) {
+	long maxval = next_number(data,size,&offset);
+	if (maxval<=0 || maxval>=256) {
+		sprintf(last_error,"Error: Invalid maximum gray value.");
+		return 0;
+	}
+	/* A single whitespace character separates the header from the raster */
+	if (offset>=size || (data[offset]!=' ' && data[offset]!='\t' && data[offset]!='\r' && data[offset]!='\n')) {
+		sprintf(last_error,"Error: Invalid PGM file.");
+		return 0;
+	}
+	offset++;
+	if (size-offset < (size_t)width*height) {
+		sprintf(last_error,"Error reading raster data.");
+		return 0;
+	}
+	pgm->width = width;
+	pgm->height = height;
+	pgm->maxval = maxval;
+	return offset;
+}
+
+/*
+ * .rmap files: a page of header followed by page-aligned sections (the
+ * raster, the occupancy bits of the cells darker than the threshold,
+ * one bit per cell and 64-bit words per row, the Euclidean distance in
+ * cells from every cell to the closest occupied one, and the occupancy
+ * pyramid, where a bit of level k is set if any cell of its 2^k x 2^k
+ * block is occupied). The file is mapped and used as it is. The header
+ * keeps the path, size, time and content hash of the source PGM, which
+ * is hashed again on every load.
+ */
+#define RMAP_MAGIC "RENPSMAP"
+#define RMAP_VERSION 3
+#define RMAP_PAGE 4096
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t maxval;
+	uint32_t threshold;
+	uint32_t levels;
+	uint64_t source_hash;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t raster;
+	uint64_t occupancy;
+	uint64_t distance;
+	uint64_t level[RMAP_MAX_LEVELS];
+	uint64_t size;
+	char source[1024];
+} RMAP_HEADER;
+
+uint64_t pgm_hash(const unsigned char* data, size_t size)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (size_t i=0;i<size;i++) {
+		hash = (hash ^ data[i]) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+/* Content hash of a file, 0 if it cannot be read */
+int file_hash(const char* file, uint64_t* hash, struct stat* st)
+{
+	int fd = open(file,O_RDONLY);
+	if (fd<0 || fstat(fd,st)!=0 || !S_ISREG(st->st_mode)) {
+		if (fd>=0) {
+			close(fd);
+		}
+		return 0;
+	}
+	unsigned char* data = st->st_size>0 ? (unsigned char*)mmap(NULL,st->st_size,PROT_READ,MAP_PRIVATE,fd,0) : NULL;
+	close(fd);
+	if (data==MAP_FAILED) {
+		return 0;
+	}
+	*hash = pgm_hash(data,st->st_size);
+	if (data!=NULL) {
+		munmap(data,st->st_size);
+	}
+	return 1;
+}
+
+int rmap_stride(int width, int level)
+{
+	return (((width + (1<<level) - 1) >> level) + 63) / 64;
+}
+
+int rmap_rows(int height, int level)
+{
+	return (height + (1<<level) - 1) >> level;
+}
+
+size_t rmap_page(size_t offset)
+{
+	return (offset + RMAP_PAGE - 1) / RMAP_PAGE * RMAP_PAGE;
+}
+
+/* Occupancy of the block (x,y) of a level of a .rmap, level 0 being the cells */
+int pgm_occupied(const PGM* pgm, int level, int x, int y)
+{
+	const uint64_t* bits = level==0 ? pgm->occupancy : pgm->level[level-1];
+	return (bits[(size_t)y*rmap_stride(pgm->width,level) + x/64] >> (x%64)) & 1;
+}
+
+/*
+ * Whether every cell of the box (x0,y0)-(x1,y1), inside the map, is free
+ * in a .rmap: the blocks covering it are read at the finest level where
+ * they are at most 4x4. 0 if one of them holds an occupied cell.
+ */
+int rmap_free_box(const PGM* pgm, int x0, int y0, int x1, int y1)
+{
+	int k = 0;
+	while ((x1>>k)-(x0>>k)>3 || (y1>>k)-(y0>>k)>3) {
+		k++;
+	}
+	if (k>pgm->levels) {
+		return 0;
+	}
+	for (int y=y0>>k;y<=y1>>k;y++) {
+		for (int x=x0>>k;x<=x1>>k;x++) {
+			if (pgm_occupied(pgm,k,x,y)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Whether a section of length bytes at offset is page-aligned and within the file */
+int rmap_section(const RMAP_HEADER* header, uint64_t offset, uint64_t length)
+{
+	return offset>=RMAP_PAGE && offset%RMAP_PAGE==0 && offset<=header->size && length<=header->size-offset;
+}
+
+/* Sets up pgm from a mapped .rmap, returns 0 if it is invalid or stale */
+int parse_rmap(const unsigned char* data, size_t size, PGM* pgm)
+{
+	const RMAP_HEADER* header = (const RMAP_HEADER*)data;
+	uint64_t cells = (uint64_t)header->width*header->height;
+	if (size<RMAP_PAGE || header->version!=RMAP_VERSION || header->size!=size ||
+		header->width==0 || header->width>=65536 || header->height==0 || header->height>=65536 ||
+		header->levels>RMAP_MAX_LEVELS || !rmap_section(header,header->raster,cells) ||
+		!rmap_section(header,header->occupancy,sizeof(uint64_t)*rmap_stride(header->width,0)*header->height) ||
+		!rmap_section(header,header->distance,sizeof(float)*cells) ||
+		memchr(header->source,0,sizeof(header->source))==NULL) {
+		sprintf(last_error,"Error: Invalid RMAP file.");
+		return 0;
+	}
+	for (int k=0;k<(int)header->levels;k++) {
+		if (!rmap_section(header,header->level[k],
+			sizeof(uint64_t)*rmap_stride(header->width,k+1)*rmap_rows(header->height,k+1))) {
+			sprintf(last_error,"Error: Invalid RMAP file.");
+			return 0;
+		}
+	}
+	/* The source is hashed whatever its size and time, which is cheap next to building the file */
+	struct stat st;
+	uint64_t hash;
+	if (stat(header->source,&st)==0 && (!file_hash(header->source,&hash,&st) || hash!=header->source_hash)) {
+		snprintf(last_error,sizeof(last_error),"Error: %.64s is stale, %.160s has changed.",pgm->file,header->source);
+		return 0;
+	}
+	pgm->width = header->width;
+	pgm->height = header->height;
+	pgm->maxval = header->maxval;
+	pgm->threshold = header->threshold;
+	pgm->levels = header->levels;
+	pgm->raster = (unsigned char*)data + header->raster;
+	pgm->occupancy = (const uint64_t*)(data + header->occupancy);
+	pgm->distance = (const float*)(data + header->distance);
+	for (int k=0;k<pgm->levels;k++) {
+		pgm->level[k] = (const uint64_t*)(data + header->level[k]);
+	}
+	return 1;
+}
+
+/*
+ * The file is mapped privately and read-only: concurrent simulators share
+ * the page cache and nothing is copied. draw_line makes the mapping
+ * writable, so only the pages it changes are copied. Files which cannot be
+ * mapped (pipes) are read into memory. .rmap files are recognised by their
+ * magic number.
+ */
+PGM* load_pgm(const char* file)
+{
+	struct stat st;
+	int fd = open(file,O_RDONLY);
+	if (fd<0) {
+		sprintf(last_error,"Error: Cannot open %s.",file);
 		return NULL;
+	}
+	PGM* pgm = (PGM*)calloc(1,sizeof(PGM));
+	snprintf(pgm->file,sizeof(pgm->file),"%s",file);
+	pgm->fd = -1;
+	unsigned char* data = NULL;
+	size_t size = 0;
+	if (fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>0) {
+		size = st.st_size;
+		data = (unsigned char*)mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+		if (data==MAP_FAILED) {
+			data = NULL;
+		}
+	}
+	if (data!=NULL) {
+		pgm->mapping = data;
+		pgm->mapping_size = size;
+		pgm->fd = fd;
 	} else {
-		offset+=bytes;
-	}	
-	
-	sscanf(buffer,"%d",&(pgm->maxval));
-	
-	if (pgm->maxval<=0 || pgm->maxval>=256) {
-		fclose(fp);
-		sprintf(last_error,"Error: Invalid maximum gray value.");
-		free(pgm);
+		size_t capacity = 1<<16;
+		ssize_t bytes;
+		size = 0;
+		data = (unsigned char*)malloc(capacity);
+		while ((bytes = read(fd,data+size,capacity-size))>0) {
+			size += bytes;
+			if (size==capacity) {
+				capacity *= 2;
+				data = (unsigned char*)realloc(data,capacity);
+			}
+		}
+		close(fd);
+	}
+	if (size>=8 && memcmp(data,RMAP_MAGIC,8)==0) {
+		if (pgm->mapping!=NULL && parse_rmap(data,size,pgm)) {
+			return pgm;
+		}
+		if (pgm->mapping==NULL) {
+			sprintf(last_error,"Error: Cannot map %s.",file);
+			free(data);
+		}
+		pgm->raster = NULL;
+		destroy_pgm(pgm);
 		return NULL;
 	}
-	
-	fclose(fp);
-	
-	raster_size = pgm->width * pgm->height;
-	
-	pgm->raster = (unsigned char*)malloc(raster_size);
-	
-	fp=fopen(file,"rb");
-	fseek(fp,offset,SEEK_SET);
-	
-	if (fread(pgm->raster,1,raster_size,fp) != raster_size) {
-		fclose(fp);
-		sprintf(last_error,"Error reading raster data.");
-		free(pgm->raster);
-		free(pgm);
+	size_t offset = parse_pgm_header(data,size,pgm);
+	if (offset==0) {
+		if (pgm->mapping==NULL) {
+			free(data);
+		}
+		pgm->raster = NULL;
+		destroy_pgm(pgm);
 		return NULL;
 	}
-	
-	fclose(fp);
+	if (pgm->mapping!=NULL) {
+		pgm->raster = data+offset;
+	} else {
+		pgm->raster = (unsigned char*)malloc((size_t)pgm->width*pgm->height);
+		memcpy(pgm->raster,data+offset,(size_t)pgm->width*pgm->height);
+		free(data);
+	}
 	return pgm;
 }
 
+/* Another view of the same raster, mapped files are shared until drawn on */
+PGM* copy_pgm(const PGM* pgm)
+{
+	PGM* copy = (PGM*)malloc(sizeof(PGM));
+	*copy = *pgm;
+	copy->writable = 0;
+	copy->free_cells = NULL;
+	if (pgm->mapping!=NULL) {
+		copy->fd = dup(pgm->fd);
+		copy->mapping = (unsigned char*)mmap(NULL,pgm->mapping_size,PROT_READ,MAP_PRIVATE,copy->fd,0);
+		if (copy->mapping!=MAP_FAILED) {
+			ptrdiff_t offset = copy->mapping - pgm->mapping;
+			copy->raster += offset;
+			if (pgm->occupancy!=NULL) {
+				copy->occupancy = (const uint64_t*)((const unsigned char*)pgm->occupancy + offset);
+				copy->distance = (const float*)((const unsigned char*)pgm->distance + offset);
+				for (int k=0;k<pgm->levels;k++) {
+					copy->level[k] = (const uint64_t*)((const unsigned char*)pgm->level[k] + offset);
+				}
+			}
+			return copy;
+		}
+		close(copy->fd);
+		copy->mapping = NULL;
+		copy->fd = -1;
+	}
+	size_t size = (size_t)pgm->width*pgm->height;
+	copy->occupancy = NULL;
+	copy->distance = NULL;
+	copy->levels = 0;
+	copy->raster = (unsigned char*)malloc(size);
+	memcpy(copy->raster,pgm->raster,size);
+	return copy;
+}
+
+/* Copy-on-write: written pages of a mapped file become private copies */
+void writable_pgm(PGM* pgm)
+{
+	if (pgm->mapping!=NULL && !pgm->writable) {
+		mprotect(pgm->mapping,pgm->mapping_size,PROT_READ | PROT_WRITE);
+		pgm->writable = 1;
+	}
+}
+
 
+/* Written to a temporary file renamed at the end, the output may replace a mapped map */
 int save_pgm(PGM* pgm)
 {
-	FILE* fp = fopen(pgm->file,"w");
+	char tmp[96];
+	snprintf(tmp,sizeof(tmp),"%s.%d",pgm->file,(int)getpid());
+	FILE* fp = fopen(tmp,"w");
 	if (fp==NULL) {
 		sprintf(last_error,"Cannot save file.");
 		return 0;
 	}
-	if (fprintf(fp,"P5\n# PGM file\n%d %d\n255\n",pgm->width,pgm->height)<0) {
+	size_t raster_size = (size_t)pgm->width * pgm->height;
+	if (fprintf(fp,"P5\n# PGM file\n%d %d\n255\n",pgm->width,pgm->height)<0 ||
+		fwrite(pgm->raster,1,raster_size,fp) != raster_size) {
 		sprintf(last_error,"Cannot save file.");
 		fclose(fp);
+		unlink(tmp);
 		return 0;
 	}
-	int raster_size = pgm->width * pgm->height;
-	if (fwrite(pgm->raster,1,raster_size,fp) != raster_size) {
+	if (fclose(fp)!=0 || rename(tmp,pgm->file)!=0) {
 		sprintf(last_error,"Cannot save file.");
-		fclose(fp);
+		unlink(tmp);
 		return 0;
 	}
-	fclose(fp);
 	return 1;
 }
 
@@ -164,7 +427,18 @@ int save_pgm(PGM* pgm)
 void destroy_pgm(PGM* pgm)
 {
 	if (pgm!=NULL) {
-		free(pgm->raster);
+		while (pgm->free_cells!=NULL) {
+			FREE_CELLS* next = pgm->free_cells->next;
+			free(pgm->free_cells->cells);
+			free(pgm->free_cells);
+			pgm->free_cells = next;
+		}
+		if (pgm->mapping!=NULL) {
+			munmap(pgm->mapping,pgm->mapping_size);
+			close(pgm->fd);
+		} else {
+			free(pgm->raster);
+		}
 		free(pgm);
 	}
 }
@@ -185,6 +459,7 @@ void draw_line(PGM* pgm, int x0, int y0, int x1, int y1, unsigned char color)
 	double ix = (gx-x)/d;
 	double iy = (gy-y)/d;
 	
+	writable_pgm(pgm);
 	do {
 		d1 = d2;
 		pgm->raster[(int)y * pgm->width + (int)x] = color;
@@ -195,9 +470,26 @@ void draw_line(PGM* pgm, int x0, int y0, int x1, int y1, unsigned char color)
 	
 }
 
-int detect_obstacle(PGM* pgm, int x0, int y0, int x1, int y1, unsigned char threshold)
+int detect_obstacle(const PGM* pgm, int x0, int y0, int x1, int y1, unsigned char threshold)
 {
 	int obstacle = 0;
+	/*
+	 * Every cell checked below is closer than length+3 to the first one,
+	 * and within a cell of the box of the segment
+	 */
+	if (pgm->distance!=NULL && threshold==pgm->threshold && x0>=0 && y0>=0 && x0<pgm->width && y0<pgm->height) {
+		double length = sqrt((double)(x1-x0)*(x1-x0) + (double)(y1-y0)*(y1-y0));
+		if (pgm->distance[(size_t)y0*pgm->width + x0] > length+3) {
+			return 0;
+		}
+		int bx0 = (x0<x1 ? x0 : x1) - 1;
+		int by0 = (y0<y1 ? y0 : y1) - 1;
+		int bx1 = (x0>x1 ? x0 : x1) + 1;
+		int by1 = (y0>y1 ? y0 : y1) + 1;
+		if (bx0>=0 && by0>=0 && bx1<pgm->width && by1<pgm->height && rmap_free_box(pgm,bx0,by0,bx1,by1)) {
+			return 0;
+		}
+	}
 	double x = x0;
 	double y = y0;
 	
@@ -225,3 +517,295 @@ int detect_obstacle(PGM* pgm, int x0, int y0, int x1, int y1, unsigned char thre
 	return obstacle;
 }
 
+/*
+ * Marks the cells 8-connected to the free cell start. The flood fill is
+ * level-synchronous: the cells of a frontier are expanded in parallel,
+ * claiming their neighbours with an atomic exchange.
+ */
+void flood_fill(const PGM* pgm, unsigned char threshold, int start, unsigned char* mark)
+{
+	int w = pgm->width;
+	int h = pgm->height;
+	int* frontier = (int*)malloc(sizeof(int)*(size_t)w*h);
+	int* next = (int*)malloc(sizeof(int)*(size_t)w*h);
+	int size = 1;
+	frontier[0] = start;
+	mark[start] = 1;
+	while (size>0) {
+		int next_size = 0;
+		#pragma omp parallel for if(size>1024)
+		for (int i=0;i<size;i++) {
+			int cx = frontier[i] % w;
+			int cy = frontier[i] / w;
+			for (int ny=cy-1;ny<=cy+1;ny++) {
+				for (int nx=cx-1;nx<=cx+1;nx++) {
+					if (nx<0 || ny<0 || nx>=w || ny>=h) {
+						continue;
+					}
+					int c = ny*w + nx;
+					if (pgm->raster[c]>=threshold && __atomic_exchange_n(&mark[c],1,__ATOMIC_RELAXED)==0) {
+						int k;
+						#pragma omp atomic capture
+						k = next_size++;
+						next[k] = c;
+					}
+				}
+			}
+		}
+		int* t = frontier;
+		frontier = next;
+		next = t;
+		size = next_size;
+	}
+	free(frontier);
+	free(next);
+}
+
+/*
+ * Table of the cells not darker than 250 (the threshold of collision)
+ * connected to (x,y), or of every such cell if (x,y) is not one. The cells
+ * are listed in raster order whatever the order of the fill, and the table
+ * is kept in the map: threads race to add it without locks, the losers
+ * take the winner's one.
+ */
+const FREE_CELLS* pgm_free_cells(const PGM* pgm, int x, int y)
+{
+	const unsigned char threshold = 250;
+	int w = pgm->width;
+	size_t n = (size_t)w*pgm->height;
+	if (x<0 || y<0 || x>=w || y>=pgm->height || pgm->raster[(size_t)y*w+x]<threshold) {
+		x = -1;
+		y = -1;
+	}
+	FREE_CELLS** list = (FREE_CELLS**)&pgm->free_cells;
+	FREE_CELLS* head = __atomic_load_n(list,__ATOMIC_ACQUIRE);
+	for (FREE_CELLS* f=head;f!=NULL;f=f->next) {
+		if (f->x==x && f->y==y) {
+			return f;
+		}
+	}
+	unsigned char* mark = (unsigned char*)calloc(n,1);
+	if (x<0) {
+		for (size_t i=0;i<n;i++) {
+			mark[i] = pgm->raster[i]>=threshold;
+		}
+	} else {
+		flood_fill(pgm,threshold,y*w+x,mark);
+	}
+	FREE_CELLS* table = (FREE_CELLS*)malloc(sizeof(FREE_CELLS));
+	table->x = x;
+	table->y = y;
+	table->size = 0;
+	for (size_t i=0;i<n;i++) {
+		table->size += mark[i];
+	}
+	table->cells = (int*)malloc(sizeof(int)*(table->size>0 ? table->size : 1));
+	for (size_t i=0,k=0;i<n;i++) {
+		if (mark[i]) {
+			table->cells[k++] = (int)i;
+		}
+	}
+	free(mark);
+	do {
+		for (FREE_CELLS* f=head;f!=NULL;f=f->next) {
+			if (f->x==x && f->y==y) {
+				free(table->cells);
+				free(table);
+				return f;
+			}
+		}
+		table->next = head;
+	} while (!__atomic_compare_exchange_n(list,&head,table,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE));
+	return table;
+}
+
+/*
+ * Number of steps of length delta, at most most, that a point can move from
+ * (x0,y0) along the unit vector (ux,uy) with every cell under the segment
+ * and every rounded end not darker than threshold. The segment is walked
+ * once, in unit steps as detect_obstacle, for all the steps; with a .rmap,
+ * not at all if the distance field shows no obstacle that close or the
+ * occupancy pyramid none in the box of the segment.
+ */
+int extend_free(const PGM* pgm, int x0, int y0, double ux, double uy, double delta, int most, unsigned char threshold)
+{
+	int w = pgm->width;
+	int h = pgm->height;
+	if (x0<0 || y0<0 || x0>=w || y0>=h) {
+		return 0;
+	}
+	double length = most*delta;
+	double ex = x0 + ux*length;
+	double ey = y0 + uy*length;
+	if (pgm->distance!=NULL && threshold==pgm->threshold && ex>=0 && ey>=0 && ex<w-0.5 && ey<h-0.5) {
+		if (pgm->distance[(size_t)y0*w + x0] > length+3) {
+			return most;
+		}
+		/* The cells walked and the rounded ends are within the box of the two ends, rounded out */
+		if (rmap_free_box(pgm,(int)floor(x0<ex ? x0 : ex),(int)floor(y0<ey ? y0 : ey),
+			(int)round(x0>ex ? x0 : ex),(int)round(y0>ey ? y0 : ey))) {
+			return most;
+		}
+	}
+	double t = 0;
+	for (int k=1;k<=most;k++) {
+		double end = k*delta;
+		for (;t<=end;t+=1) {
+			int x = (int)(x0 + ux*t);
+			int y = (int)(y0 + uy*t);
+			if (x<0 || y<0 || x>=w || y>=h || pgm->raster[(size_t)y*w + x] < threshold) {
+				return k-1;
+			}
+		}
+		int x = (int)round(x0 + ux*end);
+		int y = (int)round(y0 + uy*end);
+		if (x<0 || y<0 || x>=w || y>=h || pgm->raster[(size_t)y*w + x] < threshold) {
+			return k-1;
+		}
+	}
+	return most;
+}
+
+/* Squared distance transform of one row or column (Felzenszwalb and Huttenlocher) */
+void distance_1d(const double* f, int n, double* d, int* v, double* z)
+{
+	int k = 0;
+	v[0] = 0;
+	z[0] = -INFINITY;
+	z[1] = INFINITY;
+	for (int q=1;q<n;q++) {
+		double s;
+		for (;;) {
+			int p = v[k];
+			s = ((f[q]+(double)q*q) - (f[p]+(double)p*p)) / (2.0*q - 2.0*p);
+			if (s>z[k] || k==0) {
+				break;
+			}
+			k--;
+		}
+		if (s<=z[k]) {
+			s = z[k];
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k+1] = INFINITY;
+	}
+	k = 0;
+	for (int q=0;q<n;q++) {
+		while (z[k+1]<q) {
+			k++;
+		}
+		d[q] = (double)(q-v[k])*(q-v[k]) + f[v[k]];
+	}
+}
+
+/*
+ * Writes the .rmap of a PGM file, the cells darker than threshold being
+ * occupied. Returns 1 on success.
+ */
+int save_rmap(const char* source, const char* file, unsigned char threshold)
+{
+	PGM* pgm = load_pgm(source);
+	if (pgm==NULL) {
+		return 0;
+	}
+	RMAP_HEADER header;
+	struct stat st;
+	memset(&header,0,sizeof(header));
+	if (!file_hash(source,&header.source_hash,&st) || realpath(source,header.source)==NULL) {
+		sprintf(last_error,"Error: Cannot read %s.",source);
+		destroy_pgm(pgm);
+		return 0;
+	}
+	memcpy(header.magic,RMAP_MAGIC,8);
+	header.version = RMAP_VERSION;
+	header.width = pgm->width;
+	header.height = pgm->height;
+	header.maxval = pgm->maxval;
+	header.threshold = threshold;
+	header.source_size = st.st_size;
+	header.source_mtime = st.st_mtime;
+	int width = pgm->width;
+	int height = pgm->height;
+	size_t cells = (size_t)width*height;
+	while (header.levels<RMAP_MAX_LEVELS && (rmap_rows(width,header.levels)>1 || rmap_rows(height,header.levels)>1)) {
+		header.levels++;
+	}
+	header.raster = RMAP_PAGE;
+	header.occupancy = rmap_page(header.raster + cells);
+	header.distance = rmap_page(header.occupancy + sizeof(uint64_t)*rmap_stride(width,0)*height);
+	size_t end = rmap_page(header.distance + sizeof(float)*cells);
+	for (int k=0;k<(int)header.levels;k++) {
+		header.level[k] = end;
+		end = rmap_page(end + sizeof(uint64_t)*rmap_stride(width,k+1)*rmap_rows(height,k+1));
+	}
+	header.size = end;
+	unsigned char* data = (unsigned char*)calloc(1,end);
+	memcpy(data,&header,sizeof(header));
+	memcpy(data+header.raster,pgm->raster,cells);
+	uint64_t* occupancy = (uint64_t*)(data+header.occupancy);
+	for (int y=0;y<height;y++) {
+		for (int x=0;x<width;x++) {
+			if (pgm->raster[(size_t)y*width+x] < threshold) {
+				occupancy[(size_t)y*rmap_stride(width,0) + x/64] |= 1ULL << (x%64);
+			}
+		}
+	}
+	for (int k=1;k<=(int)header.levels;k++) {
+		uint64_t* fine = k==1 ? occupancy : (uint64_t*)(data+header.level[k-2]);
+		uint64_t* coarse = (uint64_t*)(data+header.level[k-1]);
+		for (int y=0;y<rmap_rows(height,k-1);y++) {
+			for (int x=0;x<rmap_rows(width,k-1);x++) {
+				if ((fine[(size_t)y*rmap_stride(width,k-1) + x/64] >> (x%64)) & 1) {
+					coarse[(size_t)(y/2)*rmap_stride(width,k) + (x/2)/64] |= 1ULL << ((x/2)%64);
+				}
+			}
+		}
+	}
+	int n = width>height ? width : height;
+	double* f = (double*)malloc(sizeof(double)*cells);
+	double* line = (double*)calloc(n,sizeof(double));
+	double* d = (double*)malloc(sizeof(double)*n);
+	double* z = (double*)malloc(sizeof(double)*(n+1));
+	int* v = (int*)malloc(sizeof(int)*n);
+	for (size_t i=0;i<cells;i++) {
+		f[i] = pgm->raster[i] < threshold ? 0 : 1e20;
+	}
+	for (int x=0;x<width;x++) {
+		for (int y=0;y<height;y++) {
+			line[y] = f[(size_t)y*width+x];
+		}
+		distance_1d(line,height,d,v,z);
+		for (int y=0;y<height;y++) {
+			f[(size_t)y*width+x] = d[y];
+		}
+	}
+	float* distance = (float*)(data+header.distance);
+	for (int y=0;y<height;y++) {
+		distance_1d(f+(size_t)y*width,width,d,v,z);
+		for (int x=0;x<width;x++) {
+			distance[(size_t)y*width+x] = d[x]>=1e20 ? INFINITY : sqrt(d[x]);
+		}
+	}
+	free(f);
+	free(line);
+	free(d);
+	free(z);
+	free(v);
+	destroy_pgm(pgm);
+	char tmp[1100];
+	snprintf(tmp,sizeof(tmp),"%s.%d",file,(int)getpid());
+	FILE* fp = fopen(tmp,"wb");
+	int ok = fp!=NULL && fwrite(data,1,end,fp)==end;
+	if (fp!=NULL && fclose(fp)!=0) {
+		ok = 0;
+	}
+	free(data);
+	if (!ok || rename(tmp,file)!=0) {
+		sprintf(last_error,"Cannot save file.");
+		unlink(tmp);
+		return 0;
+	}
+	return 1;
+}
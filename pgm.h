@@ -31,6 +31,21 @@
 #ifndef _PGM_H_
 #define _PGM_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define RMAP_MAX_LEVELS 16
+
+/* Free cells (y*width+x) of a map in raster order, those 8-connected to (x,y) if it is free */
+typedef struct FreeCells
+{
+	int x;
+	int y;
+	int size;
+	int *cells;
+	struct FreeCells *next;
+} FREE_CELLS;
+
 typedef struct
 {
 	char file[64];
@@ -38,16 +53,41 @@ typedef struct
 	int height;
 	int maxval;
 	unsigned char *raster;
+	/* Private mapping of the file holding the raster, NULL if it was read into memory */
+	unsigned char *mapping;
+	size_t mapping_size;
+	int fd;
+	int writable;
+	/* Preprocessed data of .rmap files, NULL for PGM files */
+	int threshold;
+	int levels;
+	const uint64_t *occupancy;
+	const float *distance;
+	const uint64_t *level[RMAP_MAX_LEVELS];
+	/* Tables of pgm_free_cells, built on first use and released with the map */
+	FREE_CELLS *free_cells;
 } PGM;
 
+extern char last_error[256];
+
 int save_pgm(PGM* pgm);
 
 PGM* load_pgm(const char* file);
 
 void draw_line(PGM* pgm, int x0, int y0, int x1, int y1, unsigned char color);
 
-int detect_obstacle(PGM* pgm, int x0, int y0, int x1, int y1, unsigned char threshold);
+int detect_obstacle(const PGM* pgm, int x0, int y0, int x1, int y1, unsigned char threshold);
+
+int extend_free(const PGM* pgm, int x0, int y0, double ux, double uy, double delta, int most, unsigned char threshold);
     
+PGM* copy_pgm(const PGM* pgm);
+
+int save_rmap(const char* source, const char* file, unsigned char threshold);
+
+int pgm_occupied(const PGM* pgm, int level, int x, int y);
+
+const FREE_CELLS* pgm_free_cells(const PGM* pgm, int x, int y);
+
 void destroy_pgm(PGM* pgm);
 
 #endif
@@ -0,0 +1,75 @@
+/* 
+ * pgm_convert.c:
+ *
+ * This file contains the conversion tool from PGM maps to the
+ * preprocessed .rmap format (see pgm.c), which the simulators load
+ * through -m like a PGM file.
+ *
+ * Usage: pgm_convert map.pgm [map.rmap] [threshold]
+ *
+ * Build: gcc -O3 pgm_convert.c pgm.c -lm -o pgm_convert
+ * 
+ * More information can be found in:
+ * 
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing 
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pgm.h"
+
+int main(int argc, char* argv[])
+{
+	char file[1024];
+	if (argc<2) {
+		fprintf(stderr,"Usage: %s map.pgm [map.rmap] [threshold]\n",argv[0]);
+		return 1;
+	}
+	if (argc>2) {
+		snprintf(file,sizeof(file),"%s",argv[2]);
+	} else {
+		/* map.pgm -> map.rmap */
+		snprintf(file,sizeof(file),"%s",argv[1]);
+		char* dot = strrchr(file,'.');
+		if (dot==NULL || strchr(dot,'/')!=NULL) {
+			dot = file+strlen(file);
+		}
+		snprintf(dot,sizeof(file)-(dot-file),".rmap");
+	}
+	/* detect_obstacle's threshold in the collision function */
+	int threshold = argc>3 ? atoi(argv[3]) : 250;
+	if (!save_rmap(argv[1],file,threshold)) {
+		fprintf(stderr,"%s\n",last_error);
+		return 1;
+	}
+	PGM* rmap = load_pgm(file);
+	if (rmap==NULL) {
+		fprintf(stderr,"%s\n",last_error);
+		return 1;
+	}
+	printf("%s: %dx%d, threshold %d, %d levels, %zu bytes\n",file,rmap->width,rmap->height,rmap->threshold,
+	  rmap->levels,rmap->mapping_size);
+	destroy_pgm(rmap);
+	return 0;
+}
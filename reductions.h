@@ -0,0 +1,215 @@
+/* 
+ * reductions.h:
+ *
+ * This file contains the C/OpenMP implementation of the reductions over
+ * membrane sets (min, max, sum, count, arg_min, arg_max) used by the
+ * generated RENPSM simulators.
+ *
+ * Every reduction is computed over fixed blocks of the label list, so the
+ * result does not depend on the number of threads. Values which have not
+ * been produced yet (NaN) are ignored. Ties are broken on the lowest label.
+ * 
+ * More information can be found in:
+ * 
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing 
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#ifndef _REDUCTIONS_H_
+#define _REDUCTIONS_H_
+
+#include <limits.h>
+#include <math.h>
+
+#define REDUCTION_BLOCK 256
+
+/*
+ * Kernels marked SIMD_CLONES are compiled for AVX-512, AVX2 and the
+ * baseline, and the loader picks the version the CPU supports.
+ */
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define SIMD_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#endif
+#endif
+#ifndef SIMD_CLONES
+#define SIMD_CLONES
+#endif
+
+const char* simd_level()
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return "avx512f";
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return "avx2";
+	}
+#endif
+	return "default";
+}
+
+typedef struct
+{
+	double value;
+	int arg;
+} VALUE_LOC;
+
+VALUE_LOC min_loc_combine(VALUE_LOC a, VALUE_LOC b)
+{
+	if (b.value<a.value || (b.value==a.value && b.arg<a.arg)) {
+		return b;
+	}
+	return a;
+}
+
+VALUE_LOC max_loc_combine(VALUE_LOC a, VALUE_LOC b)
+{
+	if (b.value>a.value || (b.value==a.value && b.arg<a.arg)) {
+		return b;
+	}
+	return a;
+}
+
+VALUE_LOC min_loc(VALUE_LOC a, double value, int arg)
+{
+	VALUE_LOC b = {value,arg};
+	return min_loc_combine(a,b);
+}
+
+VALUE_LOC max_loc(VALUE_LOC a, double value, int arg)
+{
+	VALUE_LOC b = {value,arg};
+	return max_loc_combine(a,b);
+}
+
+#pragma omp declare reduction(min_loc : VALUE_LOC : omp_out = min_loc_combine(omp_out,omp_in)) \
+	initializer(omp_priv = (VALUE_LOC){INFINITY,INT_MAX})
+
+#pragma omp declare reduction(max_loc : VALUE_LOC : omp_out = max_loc_combine(omp_out,omp_in)) \
+	initializer(omp_priv = (VALUE_LOC){-INFINITY,INT_MAX})
+
+VALUE_LOC reduce_min_loc(double** values, int column, int* indexes, int size_indexes)
+{
+	VALUE_LOC acc = {INFINITY,INT_MAX};
+	#pragma omp parallel for reduction(min_loc:acc)
+	for (int b=0;b<size_indexes;b+=REDUCTION_BLOCK) {
+		int n = size_indexes-b < REDUCTION_BLOCK ? size_indexes-b : REDUCTION_BLOCK;
+		double min = INFINITY;
+		int arg = INT_MAX;
+		#pragma omp simd reduction(min:min)
+		for (int i=0;i<n;i++) {
+			double v = values[indexes[b+i]][column];
+			min = v < min ? v : min;
+		}
+		#pragma omp simd reduction(min:arg)
+		for (int i=0;i<n;i++) {
+			int h = indexes[b+i];
+			arg = values[h][column] == min && h < arg ? h : arg;
+		}
+		acc = min_loc(acc,min,arg);
+	}
+	return acc;
+}
+
+VALUE_LOC reduce_max_loc(double** values, int column, int* indexes, int size_indexes)
+{
+	VALUE_LOC acc = {-INFINITY,INT_MAX};
+	#pragma omp parallel for reduction(max_loc:acc)
+	for (int b=0;b<size_indexes;b+=REDUCTION_BLOCK) {
+		int n = size_indexes-b < REDUCTION_BLOCK ? size_indexes-b : REDUCTION_BLOCK;
+		double max = -INFINITY;
+		int arg = INT_MAX;
+		#pragma omp simd reduction(max:max)
+		for (int i=0;i<n;i++) {
+			double v = values[indexes[b+i]][column];
+			max = v > max ? v : max;
+		}
+		#pragma omp simd reduction(min:arg)
+		for (int i=0;i<n;i++) {
+			int h = indexes[b+i];
+			arg = values[h][column] == max && h < arg ? h : arg;
+		}
+		acc = max_loc(acc,max,arg);
+	}
+	return acc;
+}
+
+double function_min(double** values, int column, int* indexes, int size_indexes)
+{
+	VALUE_LOC acc = reduce_min_loc(values,column,indexes,size_indexes);
+	return acc.arg==INT_MAX ? NAN : acc.value;
+}
+
+double function_arg_min(double** values, int column, int* indexes, int size_indexes)
+{
+	VALUE_LOC acc = reduce_min_loc(values,column,indexes,size_indexes);
+	return acc.arg==INT_MAX ? NAN : acc.arg;
+}
+
+double function_max(double** values, int column, int* indexes, int size_indexes)
+{
+	VALUE_LOC acc = reduce_max_loc(values,column,indexes,size_indexes);
+	return acc.arg==INT_MAX ? NAN : acc.value;
+}
+
+double function_arg_max(double** values, int column, int* indexes, int size_indexes)
+{
+	VALUE_LOC acc = reduce_max_loc(values,column,indexes,size_indexes);
+	return acc.arg==INT_MAX ? NAN : acc.arg;
+}
+
+double function_sum(double** values, int column, int* indexes, int size_indexes)
+{
+	int blocks = (size_indexes+REDUCTION_BLOCK-1)/REDUCTION_BLOCK;
+	double partial[blocks>0 ? blocks : 1];
+	#pragma omp parallel for
+	for (int k=0;k<blocks;k++) {
+		int b = k*REDUCTION_BLOCK;
+		int n = size_indexes-b < REDUCTION_BLOCK ? size_indexes-b : REDUCTION_BLOCK;
+		double sum = 0;
+		#pragma omp simd reduction(+:sum)
+		for (int i=0;i<n;i++) {
+			double v = values[indexes[b+i]][column];
+			sum += isnan(v) ? 0 : v;
+		}
+		partial[k] = sum;
+	}
+	double sum = 0;
+	for (int k=0;k<blocks;k++) {
+		sum += partial[k];
+	}
+	return sum;
+}
+
+double function_count(double** values, int column, int* indexes, int size_indexes)
+{
+	int count = 0;
+	#pragma omp parallel for simd reduction(+:count)
+	for (int i=0;i<size_indexes;i++) {
+		count += !isnan(values[indexes[i]][column]);
+	}
+	return count;
+}
+
+#endif
@@ -31,8 +31,12 @@
 %{
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include "renpsm_parser.h"
 #include "gen_c.h"
+#include "interpreter.h"
+#include "cache.h"
 
 #define YYERROR_VERBOSE
 
@@ -249,17 +253,85 @@ expr : object {$$ = $1;}
 
 %%
 
-int main() {
+double seconds()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+int main(int argc, char* argv[]) {
+	int timing = 0;
+	int interpreter = 0;
+	int cached = 0;
+	int shared = 0;
+	int api = 0;
+	int c;
+	while (!interpreter && !cached && (c = getopt(argc,argv,"biclaf"))!=-1) {
+		switch(c) {
+			case 'b':
+				timing = 1;
+			break;
+			case 'i':
+				interpreter = 1;
+			break;
+			case 'c':
+				cached = 1;
+			break;
+			case 'l':
+				shared = 1;
+			break;
+			case 'a':
+				api = 1;
+			break;
+			case 'f':
+				single = 1;
+			break;
+			default:
+				fprintf(stderr,"Usage: %s [-b] [-f] [-a | -i | [-l] -c [simulator options]] < model.pli\n",argv[0]);
+				exit(1);
+		}
+	}
+	double t0 = seconds();
 	yyin = stdin;
 	do { 
 		yyparse();
 	} while(!feof(yyin));
+	double t1 = seconds();
 	DEFINITIONS* code1 = rollOut(code);
 	code = code1;
+	double t2 = seconds();
+	if (interpreter || cached) {
+		if (timing) {
+			fprintf(stderr,"Instructions: %d\n",code->definitions[0]->size);
+			fprintf(stderr,"Parse: %f seconds\n",t1-t0);
+			fprintf(stderr,"Roll out: %f seconds\n",t2-t1);
+		}
+		/* The simulator options follow -i or -c */
+		int first = optind-1;
+		optind = 1;
+		int status = interpreter ? interpret(argc-first,argv+first,code) : run_cached(argc-first,argv+first,code,shared,timing);
+		arenaFree();
+		return status;
+	}
 	printTree(stdout,code);
 	FILE *fp = fopen("simulator.c","w");
-	generate_c_simulator(fp,code);
+	if (api) {
+		FILE *header = fopen("simulator.h","w");
+		generate_c_library(header,fp,code);
+		fclose(header);
+	} else {
+		generate_c_simulator(fp,code);
+	}
 	fclose(fp);
+	double t3 = seconds();
+	if (timing) {
+		fprintf(stderr,"Instructions: %d\n",code->definitions[0]->size);
+		fprintf(stderr,"Parse: %f seconds\n",t1-t0);
+		fprintf(stderr,"Roll out: %f seconds\n",t2-t1);
+		fprintf(stderr,"Generate: %f seconds\n",t3-t2);
+	}
+	arenaFree();
 	return 0;
 }
 
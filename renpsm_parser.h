@@ -1,6 +1,7 @@
 #ifndef _RENPSM_COMPILER_H_
 #define _RENPSM_COMPILER_H_
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -8,14 +9,148 @@
 
 #define TABS 2
 
-#define MAX_DEFINITIONS 64
 #define MAX_PARAMS 64
-#define MAX_INSTRUCTIONS 2048
 #define MAX_INDEXES 8
 #define MAX_ITERATORS 8
-#define MAX_ARGUMENTS 64
 #define MAX_MEMBRANES 64
-#define MAX_VARIABLES 1024
+#define UNROLL_THRESHOLD 4
+
+#define ARENA_BLOCK_SIZE (1<<20)
+#define SYMBOLS_INITIAL_SIZE 64
+
+/*
+ * All the AST nodes are allocated in an arena, zero filled, and released
+ * at once with arenaFree().
+ */
+typedef struct ArenaBlock
+{
+	struct ArenaBlock* next;
+	size_t used;
+	size_t size;
+	char data[];
+} ARENA_BLOCK;
+
+ARENA_BLOCK* arena = NULL;
+
+void* arenaAlloc(size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	if (arena==NULL || arena->used + size > arena->size) {
+		size_t block = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		ARENA_BLOCK* b = (ARENA_BLOCK*)calloc(1,sizeof(ARENA_BLOCK)+block);
+		if (b==NULL) {
+			fprintf(stderr,"Out of memory\n");
+			exit(1);
+		}
+		b->size = block;
+		b->next = arena;
+		arena = b;
+	}
+	void* ptr = arena->data + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
+char* arenaStrdup(const char* s)
+{
+	char* copy = (char*)arenaAlloc(strlen(s)+1);
+	strcpy(copy,s);
+	return copy;
+}
+
+/* Grows an arena array of pointers to hold at least size+1 elements */
+void* arenaGrow(void* array, int size, int* capacity)
+{
+	if (size < *capacity) {
+		return array;
+	}
+	int n = *capacity==0 ? 4 : *capacity*2;
+	void** copy = (void**)arenaAlloc(sizeof(void*)*n);
+	if (size>0) {
+		memcpy(copy,array,sizeof(void*)*size);
+	}
+	*capacity = n;
+	return copy;
+}
+
+void arenaFree()
+{
+	while (arena!=NULL) {
+		ARENA_BLOCK* next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
+/* Hash table from names to pointers, open addressing with linear probing */
+typedef struct SymbolTable
+{
+	char** keys;
+	void** values;
+	int size;
+	int capacity;
+} SYMBOL_TABLE;
+
+unsigned int hashString(const char* s)
+{
+	unsigned int hash = 2166136261u;
+	while (*s) {
+		hash = (hash ^ (unsigned char)*s++) * 16777619u;
+	}
+	return hash;
+}
+
+int symbolSlot(SYMBOL_TABLE* table, const char* key)
+{
+	unsigned int i = hashString(key) & (table->capacity-1);
+	while (table->keys[i]!=NULL && strcmp(table->keys[i],key)!=0) {
+		i = (i+1) & (table->capacity-1);
+	}
+	return i;
+}
+
+void* symbolGet(SYMBOL_TABLE* table, const char* key)
+{
+	if (table->capacity==0) {
+		return NULL;
+	}
+	return table->values[symbolSlot(table,key)];
+}
+
+void symbolPut(SYMBOL_TABLE* table, const char* key, void* value)
+{
+	if ((table->size+1)*4 > table->capacity*3) {
+		SYMBOL_TABLE old = *table;
+		table->capacity = old.capacity==0 ? SYMBOLS_INITIAL_SIZE : old.capacity*2;
+		table->keys = (char**)calloc(table->capacity,sizeof(char*));
+		table->values = (void**)calloc(table->capacity,sizeof(void*));
+		for (int i=0;i<old.capacity;i++) {
+			if (old.keys[i]!=NULL) {
+				int j = symbolSlot(table,old.keys[i]);
+				table->keys[j] = old.keys[i];
+				table->values[j] = old.values[i];
+			}
+		}
+		free(old.keys);
+		free(old.values);
+	}
+	int i = symbolSlot(table,key);
+	if (table->keys[i]==NULL) {
+		table->keys[i] = strdup(key);
+		table->size++;
+	}
+	table->values[i] = value;
+}
+
+void symbolFree(SYMBOL_TABLE* table)
+{
+	for (int i=0;i<table->capacity;i++) {
+		free(table->keys[i]);
+	}
+	free(table->keys);
+	free(table->values);
+	memset(table,0,sizeof(SYMBOL_TABLE));
+}
 
 
 extern int yylineno;
@@ -34,8 +169,7 @@ typedef struct Expr
 } EXPR;
 
 
-EXPR variables[MAX_VARIABLES];
-int variables_size = 0;
+SYMBOL_TABLE variables;
 
 typedef struct Iterator
 {
@@ -55,7 +189,8 @@ typedef struct Iterators
 typedef struct Arguments
 {
 	int size;
-	EXPR* args[MAX_ARGUMENTS];
+	int capacity;
+	EXPR** args;
 	ITERATORS* iterators;
 } ARGUMENTS;
 
@@ -96,7 +231,8 @@ typedef struct Definition
 	char* id;
 	PARAMS* params;
 	int size;
-	INSTRUCTION* instructions[MAX_INSTRUCTIONS];
+	int capacity;
+	INSTRUCTION** instructions;
 	
 } DEFINITION;
 
@@ -105,7 +241,9 @@ typedef struct Definitions
 {
 	char* model;
 	int size;
-	DEFINITION* definitions[MAX_DEFINITIONS];
+	int capacity;
+	DEFINITION** definitions;
+	SYMBOL_TABLE index;
 } DEFINITIONS;
 
 void printExpr(FILE* fp, EXPR* expr, int tabs);
@@ -114,31 +252,23 @@ void printExpr(FILE* fp, EXPR* expr, int tabs);
 
 EXPR *getVariable(char* name)
 {
-	for (int i=0;i<variables_size;i++) {
-		if (strcmp(variables[i].id,name)==0) {
-			return &variables[i];
-		}
-	}
-	return NULL;
+	return (EXPR*)symbolGet(&variables,name);
 }
 
 void delVariable(char* name)
 {
-	for (int i=0;i<variables_size;i++) {
-		if (strcmp(variables[i].id,name)==0) {
-			strcpy(variables[i].id,"0");
-			return ;
-		}
+	if (getVariable(name)!=NULL) {
+		symbolPut(&variables,name,NULL);
 	}
-	
 }
 
 EXPR *setIntVariable(char* name, int value)
 {
 	EXPR* var = getVariable(name);
 	if (var==NULL) {
-		var = &variables[variables_size++];
-		var->id = strdup(name);
+		var = (EXPR*)arenaAlloc(sizeof(EXPR));
+		var->id = arenaStrdup(name);
+		symbolPut(&variables,name,var);
 	}
 	var->type = INTEGER;
 	var->intValue = value;
@@ -150,32 +280,35 @@ EXPR *setDoubleVariable(char* name, double value)
 {
 	EXPR* var = getVariable(name);
 	if (var==NULL) {
-		var = &variables[variables_size++];
-		var->id = strdup(name);
+		var = (EXPR*)arenaAlloc(sizeof(EXPR));
+		var->id = arenaStrdup(name);
+		symbolPut(&variables,name,var);
 	}
 	var->type = REAL;
 	var->doubleValue = value;
 	return var;
 }
 
-DEFINITIONS* createDefinitions(DEFINITION* definition)
+DEFINITION* appendInstruction(DEFINITION* def, INSTRUCTION* inst)
 {
-	DEFINITIONS* definitions = (DEFINITIONS*)malloc(sizeof(DEFINITIONS));
-	definitions->size=1;
-	definitions->definitions[0] = definition;
-	return definitions;
+	def->instructions = (INSTRUCTION**)arenaGrow(def->instructions,def->size,&def->capacity);
+	def->instructions[def->size++] = inst;
+	return def;
 }
 
 DEFINITIONS* addDefinition(DEFINITIONS* definitions, DEFINITION* definition)
 {
-	if (definitions->size==MAX_DEFINITIONS) {
-		fprintf(stderr,"Line %d: Too much definitions\n",yylineno);
-		exit(1);
-	}
+	definitions->definitions = (DEFINITION**)arenaGrow(definitions->definitions,definitions->size,&definitions->capacity);
 	definitions->definitions[definitions->size++] = definition;
 	return definitions;
 }
 
+DEFINITIONS* createDefinitions(DEFINITION* definition)
+{
+	DEFINITIONS* definitions = (DEFINITIONS*)arenaAlloc(sizeof(DEFINITIONS));
+	return addDefinition(definitions,definition);
+}
+
 
 DEFINITION* createDefinition(char* id, PARAMS* params, DEFINITION* definition)
 {
@@ -187,14 +320,14 @@ DEFINITION* createDefinition(char* id, PARAMS* params, DEFINITION* definition)
 
 PARAMS* createEmptyParams()
 {
-	PARAMS* params = (PARAMS*)malloc(sizeof(PARAMS));
+	PARAMS* params = (PARAMS*)arenaAlloc(sizeof(PARAMS));
 	params->size=0;
 	return params;
 }
 
 PARAMS* createParams(char* param)
 {
-	PARAMS* params = (PARAMS*)malloc(sizeof(PARAMS));
+	PARAMS* params = (PARAMS*)arenaAlloc(sizeof(PARAMS));
 	params->params[0] = param;
 	params->size=1;
 	return params;
@@ -214,7 +347,7 @@ MEMBRANE* createMembrane(MEMBRANE* inner, EXPR* label)
 {
 	
 	if (inner==NULL) {
-		MEMBRANE* membrane = (MEMBRANE*)malloc(sizeof(MEMBRANE));
+		MEMBRANE* membrane = (MEMBRANE*)arenaAlloc(sizeof(MEMBRANE));
 		membrane->size=0;
 		membrane->label=label;
 		return membrane;
@@ -226,7 +359,7 @@ MEMBRANE* createMembrane(MEMBRANE* inner, EXPR* label)
 
 INSTRUCTION* createMu(MEMBRANE* membrane)
 {
-	INSTRUCTION* mu = (INSTRUCTION*)malloc(sizeof(INSTRUCTION));
+	INSTRUCTION* mu = (INSTRUCTION*)arenaAlloc(sizeof(INSTRUCTION));
 	mu->type = MU;
 	mu->mu = membrane;
 	return mu;
@@ -235,7 +368,7 @@ INSTRUCTION* createMu(MEMBRANE* membrane)
 
 MEMBRANE* createInnerMembrane(MEMBRANE* inner)
 {
-	MEMBRANE* membrane = (MEMBRANE*)malloc(sizeof(MEMBRANE));
+	MEMBRANE* membrane = (MEMBRANE*)arenaAlloc(sizeof(MEMBRANE));
 	membrane->size=1;
 	membrane->membranes[0] = inner;
 	return membrane;
@@ -260,30 +393,23 @@ DEFINITIONS* createCode(char* model, DEFINITIONS* code)
 
 DEFINITION* createInstructions(INSTRUCTION* instruction)
 {
-	DEFINITION* instructions = (DEFINITION*)malloc(sizeof(DEFINITION));
-	instructions->size = 1;
-	instructions->instructions[0] = instruction;
-	return instructions;
+	DEFINITION* instructions = (DEFINITION*)arenaAlloc(sizeof(DEFINITION));
+	return appendInstruction(instructions,instruction);
 }
 
 DEFINITION* addInstruction(DEFINITION* instructions, INSTRUCTION* instruction)
 {
-	if (instructions->size==MAX_INSTRUCTIONS) {
-		fprintf(stderr,"Line: %d: Too much instructions\n",yylineno);
-		exit(1);
-	}
-	instructions->instructions[instructions->size++] = instruction;
-	return instructions;
+	return appendInstruction(instructions,instruction);
 }
 
 INSTRUCTION* createInstruction()
 {
-	return (INSTRUCTION*)malloc(sizeof(INSTRUCTION));
+	return (INSTRUCTION*)arenaAlloc(sizeof(INSTRUCTION));
 }
 
 INSTRUCTION* createCall(char* id, ARGUMENTS* arguments)
 {
-	INSTRUCTION* call = (INSTRUCTION*)malloc(sizeof(INSTRUCTION));
+	INSTRUCTION* call = (INSTRUCTION*)arenaAlloc(sizeof(INSTRUCTION));
 	call->type = CALL;
 	call->id = id;
 	call->arguments = arguments;
@@ -292,7 +418,7 @@ INSTRUCTION* createCall(char* id, ARGUMENTS* arguments)
 
 INSTRUCTION* createAsigInst(EXPR* obj, EXPR* expr, int initModelVariable)
 {
-	INSTRUCTION* asig = (INSTRUCTION*)malloc(sizeof(INSTRUCTION));
+	INSTRUCTION* asig = (INSTRUCTION*)arenaAlloc(sizeof(INSTRUCTION));
 	asig->type = initModelVariable? INIT_VARIABLE: ASIG;
 	asig->object = obj;
 	asig->expr = expr;
@@ -306,7 +432,7 @@ INSTRUCTION* createAsigInst(EXPR* obj, EXPR* expr, int initModelVariable)
 
 INSTRUCTION* createProductionRule(EXPR* obj, EXPR* expr, EXPR* protein, EXPR* enzyme)
 {
-	INSTRUCTION* rule = (INSTRUCTION*)malloc(sizeof(INSTRUCTION));
+	INSTRUCTION* rule = (INSTRUCTION*)arenaAlloc(sizeof(INSTRUCTION));
 	rule->type = PRODUCTION_RULE;
 	rule->object = obj;
 	rule->expr = expr;
@@ -319,7 +445,7 @@ INSTRUCTION* createProductionRule(EXPR* obj, EXPR* expr, EXPR* protein, EXPR* en
 
 INSTRUCTION* createCreationRule(EXPR* inner_label, EXPR* outer_label, EXPR* protein, EXPR* enzyme)
 {
-	INSTRUCTION* rule = (INSTRUCTION*)malloc(sizeof(INSTRUCTION));
+	INSTRUCTION* rule = (INSTRUCTION*)arenaAlloc(sizeof(INSTRUCTION));
 	rule->type = CREATION_RULE;
 	rule->object = inner_label;
 	rule->expr = outer_label;
@@ -331,7 +457,7 @@ INSTRUCTION* createCreationRule(EXPR* inner_label, EXPR* outer_label, EXPR* prot
 
 INSTRUCTION* createEvolutionRule(EXPR* obj0, EXPR* obj1, EXPR* label, EXPR* protein, EXPR* enzyme)
 {
-	INSTRUCTION* rule = (INSTRUCTION*)malloc(sizeof(INSTRUCTION));
+	INSTRUCTION* rule = (INSTRUCTION*)arenaAlloc(sizeof(INSTRUCTION));
 	rule->type = EVOLUTION_RULE;
 	rule->object = obj0;
 	rule->expr = obj1;
@@ -345,10 +471,11 @@ INSTRUCTION* createEvolutionRule(EXPR* obj0, EXPR* obj1, EXPR* label, EXPR* prot
 
 INSTRUCTION* createMultisetInst(EXPR* label, ARGUMENTS* arguments)
 {
-	INSTRUCTION* ms = (INSTRUCTION*)malloc(sizeof(INSTRUCTION));
+	INSTRUCTION* ms = (INSTRUCTION*)arenaAlloc(sizeof(INSTRUCTION));
 	ms->type = MS;
 	ms->object = label;
 	ms->arguments = arguments;
+	return ms;
 }
 
 int isNumeric(EXPR* expr) {
@@ -358,7 +485,7 @@ int isNumeric(EXPR* expr) {
 }
 
 EXPR* reduceInteger(int type, int op1, int op2) {
-	EXPR* expr = (EXPR*)malloc(sizeof(EXPR));
+	EXPR* expr = (EXPR*)arenaAlloc(sizeof(EXPR));
 	expr->type = INTEGER;
 	
 	switch(type) {
@@ -407,11 +534,11 @@ EXPR* reduceInteger(int type, int op1, int op2) {
 		default:
 		;
 	}
-	
+	return expr;
 }
 
 EXPR* reduceDouble(int type, double op1, double op2) {
-	EXPR* expr = (EXPR*)malloc(sizeof(EXPR));
+	EXPR* expr = (EXPR*)arenaAlloc(sizeof(EXPR));
 	expr->type = REAL;
 	
 	switch(type) {
@@ -469,17 +596,17 @@ EXPR* reduceDouble(int type, double op1, double op2) {
 		default:
 		;
 	}
-	
+	return expr;
 }
 
 
 EXPR* reduce(int type, EXPR* op1, EXPR* op2) {
 	EXPR* expr;
 	
-	if (op1->type==OBJECT || op1->type==ID) {
+	if (op1!=NULL && (op1->type==OBJECT || op1->type==ID)) {
 		op1 = getVariable(op1->id);
 	}
-	if (op2->type==OBJECT || op2->type==ID) {
+	if (op2!=NULL && (op2->type==OBJECT || op2->type==ID)) {
 		op2 = getVariable(op2->id);
 	}
 	
@@ -512,7 +639,7 @@ EXPR* createExpr(int type, EXPR* op1, EXPR* op2)
 	if (isNumeric(op1) && isNumeric(op2)) {
 		expr = reduce(type,op1,op2);
 	} else {
-		expr = (EXPR*)malloc(sizeof(EXPR));
+		expr = (EXPR*)arenaAlloc(sizeof(EXPR));
 		expr->type = type;
 		expr->left = op1;
 		expr->right = op2;
@@ -522,7 +649,7 @@ EXPR* createExpr(int type, EXPR* op1, EXPR* op2)
 
 EXPR* createId(char* id)
 {
-	EXPR* expr = (EXPR*)malloc(sizeof(EXPR));
+	EXPR* expr = (EXPR*)arenaAlloc(sizeof(EXPR));
 	EXPR* value = getVariable(id); 
 	if (value!=NULL) {
 		expr->type=value->type;
@@ -544,7 +671,7 @@ EXPR* createId(char* id)
 
 EXPR* createInteger(int value)
 {
-	EXPR* expr = (EXPR*)malloc(sizeof(EXPR));
+	EXPR* expr = (EXPR*)arenaAlloc(sizeof(EXPR));
 	expr->type = INTEGER;
 	expr->intValue = value;
 	return expr;
@@ -552,7 +679,7 @@ EXPR* createInteger(int value)
 
 EXPR* createReal(double value)
 {
-	EXPR* expr = (EXPR*)malloc(sizeof(EXPR));
+	EXPR* expr = (EXPR*)arenaAlloc(sizeof(EXPR));
 	expr->type = REAL;
 	expr->doubleValue = value;
 	return expr;
@@ -560,7 +687,7 @@ EXPR* createReal(double value)
 
 EXPR* createObject(char* id, ARGUMENTS* indexes)
 {
-	EXPR* expr = (EXPR*)malloc(sizeof(EXPR));
+	EXPR* expr = (EXPR*)arenaAlloc(sizeof(EXPR));
 	EXPR* value = indexes==NULL?getVariable(id):NULL; 
 	if (value!=NULL) {
 		expr->type=value->type;
@@ -589,7 +716,7 @@ EXPR* addMultiplicity(EXPR* object,EXPR* multiplicity)
 
 EXPR* createFunction(char* id, ARGUMENTS* arguments)
 {
-	EXPR* expr = (EXPR*)malloc(sizeof(EXPR));
+	EXPR* expr = (EXPR*)arenaAlloc(sizeof(EXPR));
 	expr->type = FUNCTION;
 	expr->id = id;
 	expr->arguments = arguments;
@@ -598,14 +725,14 @@ EXPR* createFunction(char* id, ARGUMENTS* arguments)
 
 ITERATORS* createEmptyIterators()
 {
-	ITERATORS* iterators = (ITERATORS*)malloc(sizeof(ITERATORS));
+	ITERATORS* iterators = (ITERATORS*)arenaAlloc(sizeof(ITERATORS));
 	iterators->size = 0;
 	return iterators;
 }
 
 ITERATORS* createIterators(ITERATOR* iterator)
 {
-	ITERATORS* iterators = (ITERATORS*)malloc(sizeof(ITERATORS));
+	ITERATORS* iterators = (ITERATORS*)arenaAlloc(sizeof(ITERATORS));
 	iterators->size = 1;
 	iterators->iterators[0] = iterator;
 	return iterators;
@@ -625,11 +752,12 @@ ITERATORS* addIterator(ITERATORS* iterators, ITERATOR* iterator)
 INSTRUCTION* addIterators(INSTRUCTION* instruction, ITERATORS* iterators)
 {
 	instruction->iterators = iterators;
+	return instruction;
 }
 
 ITERATOR* createSetIterator(char* id, EXPR* expr)
 {
-	ITERATOR* iterator = (ITERATOR*)malloc(sizeof(ITERATOR));
+	ITERATOR* iterator = (ITERATOR*)arenaAlloc(sizeof(ITERATOR));
 	iterator->type = SET_ITERATOR;
 	iterator->id = id;
 	iterator->left = expr;
@@ -639,7 +767,7 @@ ITERATOR* createSetIterator(char* id, EXPR* expr)
 
 ITERATOR* createRangeIterator(char* id, EXPR* left, EXPR* right)
 {
-	ITERATOR* iterator = (ITERATOR*)malloc(sizeof(ITERATOR));
+	ITERATOR* iterator = (ITERATOR*)arenaAlloc(sizeof(ITERATOR));
 	iterator->type = RANGE_ITERATOR;
 	iterator->id = id;
 	iterator->left = left;
@@ -648,9 +776,16 @@ ITERATOR* createRangeIterator(char* id, EXPR* left, EXPR* right)
 	
 }
 
+ARGUMENTS* addArgument(ARGUMENTS* args, EXPR* expr)
+{
+	args->args = (EXPR**)arenaGrow(args->args,args->size,&args->capacity);
+	args->args[args->size++]=expr;
+	return args;
+}
+
 ARGUMENTS* createEmptyArguments()
 {
-	ARGUMENTS* args = (ARGUMENTS*)malloc(sizeof(ARGUMENTS));
+	ARGUMENTS* args = (ARGUMENTS*)arenaAlloc(sizeof(ARGUMENTS));
 	args->size=0;
 	args->iterators = NULL;
 	return args;
@@ -658,33 +793,16 @@ ARGUMENTS* createEmptyArguments()
 
 ARGUMENTS* createArguments(EXPR* expr)
 {
-	ARGUMENTS* args = (ARGUMENTS*)malloc(sizeof(ARGUMENTS));
-	args->size=1;
-	args->args[0] = expr;
-	args->iterators = NULL;
-	return args;
+	return addArgument(createEmptyArguments(),expr);
 }
 
 ARGUMENTS* createIteratorArguments(EXPR* expr, ITERATORS* iterators)
 {
-	ARGUMENTS* args = (ARGUMENTS*)malloc(sizeof(ARGUMENTS));
-	args->size=1;
-	args->args[0] = expr;
+	ARGUMENTS* args = createArguments(expr);
 	args->iterators = iterators;
 	return args;
 }
 
-
-ARGUMENTS* addArgument(ARGUMENTS* args, EXPR* expr)
-{
-	if (args->size==MAX_ARGUMENTS) {
-		fprintf(stderr,"Line: %d: Too much arguments\n",yylineno);
-		exit(1);
-	}
-	args->args[args->size++]=expr;
-	return args;
-}
-
 void printTabs(FILE* fp,int tabs)
 {
 	for (int i=0;i<tabs;i++) {
@@ -954,12 +1072,12 @@ void printTree(FILE* fp, DEFINITIONS* code)
 
 DEFINITION *searchDefinition(DEFINITIONS* definitions, char* id)
 {
-	for (int i = 0;i<definitions->size;i++) {
-		if (strcmp(definitions->definitions[i]->id,id)==0) {
-			return definitions->definitions[i];
+	if (definitions->index.size==0) {
+		for (int i = definitions->size-1;i>=0;i--) {
+			symbolPut(&definitions->index,definitions->definitions[i]->id,definitions->definitions[i]);
 		}
 	}
-	return NULL;
+	return (DEFINITION*)symbolGet(&definitions->index,id);
 }
 EXPR* unrollExpr(EXPR* expr);
 
@@ -1006,13 +1124,13 @@ EXPR* unrollExpr(EXPR* expr)
 		case NEQ:
 		 return createExpr(expr->type,unrollExpr(expr->left),unrollExpr(expr->right));
 	}
-	
+	return expr;
 }
 
 
 INSTRUCTION* unrollInst(INSTRUCTION* instruction)
 {
-	INSTRUCTION* inst = (INSTRUCTION*)malloc(sizeof(INSTRUCTION));
+	INSTRUCTION* inst = (INSTRUCTION*)arenaAlloc(sizeof(INSTRUCTION));
 	
 	inst->type = instruction->type;
 	inst->id = instruction->id;
@@ -1037,6 +1155,72 @@ INSTRUCTION* unrollInst(INSTRUCTION* instruction)
 	
 }
 
+int usesId(EXPR* expr, char* id)
+{
+	if (expr==NULL) {
+		return 0;
+	}
+	switch(expr->type) {
+		case OBJECT:
+			if (expr->arguments==NULL) {
+				return strcmp(expr->id,id)==0;
+			}
+		case FUNCTION:
+			for (int i=0;i<expr->arguments->size;i++) {
+				if (usesId(expr->arguments->args[i],id)) {
+					return 1;
+				}
+			}
+			return 0;
+		case ID: case INTEGER: case REAL:
+			return 0;
+		default:
+			return usesId(expr->left,id) || usesId(expr->right,id);
+	}
+}
+
+/* Affine in the iterator, so the extreme values are at the ends of its range */
+int affineIn(EXPR* expr, char* id)
+{
+	if (expr==NULL) {
+		return 1;
+	}
+	switch(expr->type) {
+		case INTEGER:
+			return 1;
+		case OBJECT:
+			return expr->arguments==NULL || !usesId(expr,id);
+		case ADD: case SUB:
+			return affineIn(expr->left,id) && affineIn(expr->right,id);
+		case MUL:
+			return (affineIn(expr->left,id) && !usesId(expr->right,id)) ||
+				(!usesId(expr->left,id) && affineIn(expr->right,id));
+		default:
+			return !usesId(expr,id);
+	}
+}
+
+/*
+ * Large ranges are kept as loops when the rule guard does not depend on the
+ * iterator and the indexes written are affine in it, since the variable
+ * limits are taken from the ends of the range (create_vars)
+ */
+int keepLoop(INSTRUCTION* inst, char* id, int init, int end)
+{
+	if (end-init+1<=UNROLL_THRESHOLD || usesId(inst->enzyme,id)) {
+		return 0;
+	}
+	if (inst->type==PRODUCTION_RULE) {
+		for (int k=0;k<inst->object->arguments->size;k++) {
+			if (!affineIn(inst->object->arguments->args[k],id)) {
+				return 0;
+			}
+		}
+		return !usesId(inst->protein,id);
+	}
+	return inst->type==EVOLUTION_RULE && inst->protein==NULL;
+}
+
 void rollOutDefinition(DEFINITIONS* code, DEFINITION* def, DEFINITION* def1)
 {
 	char id[8];
@@ -1055,6 +1239,10 @@ void rollOutDefinition(DEFINITIONS* code, DEFINITION* def, DEFINITION* def1)
 				strcpy(id,it->id);
 			}
 		}
+		if (keepLoop(inst,id,init,end)) {
+			appendInstruction(def1,inst);
+			continue;
+		}
 		for (int j=init;j<=end;j++) {
 			if (init!=end) {
 				setIntVariable(id,j);
@@ -1067,9 +1255,9 @@ void rollOutDefinition(DEFINITIONS* code, DEFINITION* def, DEFINITION* def1)
 			break;
 			default:
 				if (init==end) {
-					def1->instructions[def1->size++] = inst;
+					appendInstruction(def1,inst);
 				} else {
-					def1->instructions[def1->size++] = unrollInst(inst);
+					appendInstruction(def1,unrollInst(inst));
 				}
 				
 				;
@@ -1084,11 +1272,9 @@ void rollOutDefinition(DEFINITIONS* code, DEFINITION* def, DEFINITION* def1)
 
 DEFINITIONS* rollOut(DEFINITIONS* code)
 {
-	DEFINITIONS* code1 = (DEFINITIONS*) malloc(sizeof(DEFINITIONS));
+	DEFINITIONS* code1 = (DEFINITIONS*)arenaAlloc(sizeof(DEFINITIONS));
 	code1->model = code->model;
-	code1->size = 1;
-	code1->definitions[0] = (DEFINITION*)malloc(sizeof(DEFINITION));
-	code1->definitions[0]->size=0;
+	addDefinition(code1,(DEFINITION*)arenaAlloc(sizeof(DEFINITION)));
 	DEFINITION* main = searchDefinition(code,"main");
 	code1->definitions[0]->id = main->id;
 	code1->definitions[0]->params = createEmptyParams();
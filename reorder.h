@@ -0,0 +1,250 @@
+/*
+ * reorder.h:
+ *
+ * This file contains the spatial reordering of the generated RENPSM
+ * simulators (--reorder): Morton (Z-order) keys of the node positions, the
+ * parallel sort of the packed positions of a label by key, the permutation
+ * of the packed columns, and the count of the cache misses of the fused
+ * kernels (the scans over the packed columns and the nearest queries).
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _REORDER_H_
+#define _REORDER_H_
+
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Labels shorter than this are sorted by one thread */
+#define REORDER_PARALLEL 4096
+
+typedef struct MortonEntry
+{
+	uint64_t key;
+	int pos;
+} MORTON_ENTRY;
+
+int reorder_count = 0;
+double reorder_seconds = 0;
+
+int scan_fd = -1;
+long long scan_misses = 0;
+long long scan_start = 0;
+
+/* Spreads the bits of x to the even bits of the result */
+uint64_t morton_spread(uint32_t x)
+{
+	uint64_t v = x;
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+	v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+	v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	v = (v | (v << 2)) & 0x3333333333333333ULL;
+	v = (v | (v << 1)) & 0x5555555555555555ULL;
+	return v;
+}
+
+uint32_t morton_coordinate(double x)
+{
+	if (x<=0) {
+		return 0;
+	}
+	return x>=UINT32_MAX ? UINT32_MAX : (uint32_t)x;
+}
+
+/* Points not set yet (NaN) go last */
+uint64_t morton_key(double x, double y)
+{
+	if (isnan(x) || isnan(y)) {
+		return UINT64_MAX;
+	}
+	return morton_spread(morton_coordinate(x)) | (morton_spread(morton_coordinate(y)) << 1);
+}
+
+/* Equal keys keep their position order, so the sort gives the same result for any number of threads */
+int morton_compare(const void* a, const void* b)
+{
+	const MORTON_ENTRY* x = (const MORTON_ENTRY*)a;
+	const MORTON_ENTRY* y = (const MORTON_ENTRY*)b;
+	if (x->key!=y->key) {
+		return x->key<y->key ? -1 : 1;
+	}
+	return x->pos<y->pos ? -1 : x->pos>y->pos;
+}
+
+void morton_merge(const MORTON_ENTRY* a, int n, const MORTON_ENTRY* b, int m, MORTON_ENTRY* out)
+{
+	int i = 0;
+	int j = 0;
+	while (i<n && j<m) {
+		*out++ = morton_compare(&b[j],&a[i])<0 ? b[j++] : a[i++];
+	}
+	memcpy(out,a+i,sizeof(MORTON_ENTRY)*(n-i));
+	memcpy(out+n-i,b+j,sizeof(MORTON_ENTRY)*(m-j));
+}
+
+/* One run per thread, then rounds of pairwise merges */
+void morton_sort_runs(MORTON_ENTRY* a, MORTON_ENTRY* tmp, int n, int threads)
+{
+	int runs = n<REORDER_PARALLEL || threads<1 ? 1 : threads;
+	int width = (n+runs-1)/runs;
+	#pragma omp parallel for num_threads(threads)
+	for (int r=0;r<runs;r++) {
+		int lo = r*width;
+		if (lo<n) {
+			qsort(a+lo,n-lo<width ? n-lo : width,sizeof(MORTON_ENTRY),morton_compare);
+		}
+	}
+	MORTON_ENTRY* from = a;
+	MORTON_ENTRY* to = tmp;
+	for (;width<n;width*=2) {
+		int pairs = (n+2*width-1)/(2*width);
+		#pragma omp parallel for num_threads(threads)
+		for (int p=0;p<pairs;p++) {
+			int lo = 2*p*width;
+			int mid = lo+width<n ? lo+width : n;
+			int hi = mid+width<n ? mid+width : n;
+			morton_merge(from+lo,mid-lo,from+mid,hi-mid,to+lo);
+		}
+		MORTON_ENTRY* swap = from;
+		from = to;
+		to = swap;
+	}
+	if (from!=a) {
+		memcpy(a,from,sizeof(MORTON_ENTRY)*n);
+	}
+}
+
+/*
+ * Sorts a by key, tmp holds n entries. The positions sorted by the last
+ * reorder come first, so only the new ones are sorted and then merged.
+ */
+void morton_sort(MORTON_ENTRY* a, MORTON_ENTRY* tmp, int n, int threads)
+{
+	int sorted = 1;
+	while (sorted<n && morton_compare(&a[sorted-1],&a[sorted])<=0) {
+		sorted++;
+	}
+	if (sorted>=n) {
+		return;
+	}
+	morton_sort_runs(a+sorted,tmp,n-sorted,threads);
+	morton_merge(a,sorted,a+sorted,n-sorted,tmp);
+	memcpy(a,tmp,sizeof(MORTON_ENTRY)*n);
+}
+
+/* a[q] = a[from[q]] for the n first positions, buffer holds n values */
+void reorder_double(double* a, const int* from, int n, void* buffer, int threads)
+{
+	double* t = (double*)buffer;
+	#pragma omp parallel for num_threads(threads)
+	for (int q=0;q<n;q++) {
+		t[q] = a[from[q]];
+	}
+	memcpy(a,t,sizeof(double)*n);
+}
+
+void reorder_float(float* a, const int* from, int n, void* buffer, int threads)
+{
+	float* t = (float*)buffer;
+	#pragma omp parallel for num_threads(threads)
+	for (int q=0;q<n;q++) {
+		t[q] = a[from[q]];
+	}
+	memcpy(a,t,sizeof(float)*n);
+}
+
+void reorder_int(int* a, const int* from, int n, void* buffer, int threads)
+{
+	int* t = (int*)buffer;
+	#pragma omp parallel for num_threads(threads)
+	for (int q=0;q<n;q++) {
+		t[q] = a[from[q]];
+	}
+	memcpy(a,t,sizeof(int)*n);
+}
+
+/*
+ * Cache misses of the process, threads included, counted only inside the
+ * fused kernels. As the TLB counter of alloc.h it is inherited by the
+ * threads, so it has to be opened before the first parallel region.
+ */
+void scan_open()
+{
+	struct perf_event_attr attr;
+	memset(&attr,0,sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	scan_fd = (int)syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+}
+
+long long scan_read()
+{
+	long long count = -1;
+	if (scan_fd<0 || read(scan_fd,&count,sizeof(count))!=sizeof(count)) {
+		return -1;
+	}
+	return count;
+}
+
+void scan_begin()
+{
+	if (scan_fd>=0) {
+		scan_start = scan_read();
+	}
+}
+
+void scan_end()
+{
+	if (scan_fd>=0) {
+		scan_misses += scan_read()-scan_start;
+	}
+}
+
+void reorder_report(int interval)
+{
+	if (interval>0) {
+		printf("Reorder: every %d steps, %d times, %f seconds\n",interval,reorder_count,reorder_seconds);
+	} else {
+		printf("Reorder: off\n");
+	}
+	if (scan_fd>=0) {
+		printf("Scan cache misses: %lld\n",scan_misses);
+	} else {
+		printf("Scan cache misses: unavailable (perf_event_open)\n");
+	}
+}
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * schedule.h:
+ *
+ * This file contains the scheduling of the loops over the label lists of
+ * the generated RENPSM simulators: every loop runs in parallel only above
+ * a threshold number of iterations, with a dynamic chunk size, both
+ * calibrated at run time (fork/join cost of a team against the time of an
+ * iteration) or read from a profile file written by a previous run
+ * (--profile).
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#include <limits.h>
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Sequential runs of at least LOOP_MIN_SAMPLE iterations timed before a loop is calibrated */
+#define LOOP_SAMPLES 32
+#define LOOP_MIN_SAMPLE 8
+/* Empty teams timed to measure the fork/join cost */
+#define LOOP_FORKS 64
+/* Work of a chunk of the dynamic schedule, in seconds */
+#define LOOP_CHUNK_SECONDS 2e-6
+#define LOOP_SEQUENTIAL INT_MAX
+
+typedef struct LoopProfile
+{
+	uint64_t shape;
+	int threads;
+	double overhead;
+	int threshold;
+	int chunk;
+	int samples;
+	long long iterations;
+	double seconds;
+	double cost;
+} LOOP_PROFILE;
+
+int loop_sink[64];
+
+int loop_compare(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x<y ? -1 : x>y;
+}
+
+/*
+ * Median time of an empty team of threads. The rules with a loop run
+ * after the sections of a step, so their teams are not nested.
+ */
+double loop_overhead(int threads)
+{
+	double times[LOOP_FORKS];
+	if (threads<2) {
+		return INFINITY;
+	}
+	for (int r=-LOOP_FORKS/4;r<LOOP_FORKS;r++) {
+		double start = omp_get_wtime();
+		#pragma omp parallel for num_threads(threads)
+		for (int i=0;i<threads;i++) {
+			loop_sink[i%64] = i;
+		}
+		if (r>=0) {
+			times[r] = omp_get_wtime()-start;
+		}
+	}
+	qsort(times,LOOP_FORKS,sizeof(double),loop_compare);
+	return times[LOOP_FORKS/2];
+}
+
+/*
+ * Profiles of count loops. threshold<0 calibrates them, otherwise every
+ * loop runs in parallel above threshold iterations.
+ */
+LOOP_PROFILE* loops_create(const uint64_t* shapes, int count, int threads, int threshold)
+{
+	LOOP_PROFILE* loops = (LOOP_PROFILE*)calloc(count>0 ? count : 1,sizeof(LOOP_PROFILE));
+	double overhead = threshold<0 ? loop_overhead(threads) : 0;
+	for (int k=0;k<count;k++) {
+		LOOP_PROFILE* l = &loops[k];
+		l->shape = shapes[k];
+		l->threads = threads;
+		l->overhead = overhead;
+		if (threads<2 || threshold>=0) {
+			l->threshold = threads<2 ? LOOP_SEQUENTIAL : threshold;
+			l->samples = LOOP_SAMPLES;
+		} else {
+			l->threshold = LOOP_SEQUENTIAL;
+		}
+	}
+	return loops;
+}
+
+/*
+ * Break-even of the loop: n iterations of t seconds take n*t alone and
+ * overhead+n*t/threads in parallel. A chunk takes LOOP_CHUNK_SECONDS and
+ * every thread gets one at the threshold.
+ */
+void loop_calibrate(LOOP_PROFILE* l)
+{
+	double t = l->seconds/l->iterations;
+	if (!(t>0)) {
+		t = 1e-9;
+	}
+	l->cost = t;
+	double threshold = l->overhead/(t*(1-1.0/l->threads));
+	l->threshold = threshold<l->threads ? l->threads : threshold>=LOOP_SEQUENTIAL ? LOOP_SEQUENTIAL : (int)threshold;
+	double chunk = ceil(LOOP_CHUNK_SECONDS/t);
+	int most = l->threshold/l->threads;
+	l->chunk = chunk>most ? most : (int)chunk;
+	if (l->chunk<1) {
+		l->chunk = 1;
+	}
+	l->samples = LOOP_SAMPLES;
+}
+
+/* Time of a sequential run of n iterations, 0 when it is not sampled */
+static inline double loop_start(LOOP_PROFILE* l, int n)
+{
+	return l->samples<LOOP_SAMPLES && n>=LOOP_MIN_SAMPLE ? omp_get_wtime() : 0;
+}
+
+static inline void loop_end(LOOP_PROFILE* l, int n, double start)
+{
+	if (start>0) {
+		l->seconds += omp_get_wtime()-start;
+		l->iterations += n;
+		if (++l->samples==LOOP_SAMPLES) {
+			loop_calibrate(l);
+		}
+	}
+}
+
+/* A fixed threshold gives every thread a block of the loop */
+static inline int loop_chunk(LOOP_PROFILE* l, int n)
+{
+	if (l->chunk>0) {
+		return l->chunk;
+	}
+	int chunk = (n+l->threads-1)/l->threads;
+	return chunk>0 ? chunk : 1;
+}
+
+void loops_free(LOOP_PROFILE* loops)
+{
+	free(loops);
+}
+
+/*
+ * Reads the thresholds of a previous run with the same number of threads.
+ * Every line is a loop: index, shape, threshold, chunk and seconds per
+ * iteration; loops not calibrated then (threshold 0) are calibrated again.
+ * Returns the number of loops read, -1 if the file does not match.
+ */
+int profile_load(const char* file, LOOP_PROFILE* loops, int count, int threads)
+{
+	FILE* fp = fopen(file,"r");
+	if (fp==NULL) {
+		return -1;
+	}
+	int file_count, file_threads;
+	if (fscanf(fp,"renpsm-profile %d %d\n",&file_count,&file_threads)!=2 || file_count!=count || file_threads!=threads) {
+		fclose(fp);
+		return -1;
+	}
+	LOOP_PROFILE* rows = (LOOP_PROFILE*)calloc(count>0 ? count : 1,sizeof(LOOP_PROFILE));
+	int lines = 0;
+	int k, threshold, chunk;
+	unsigned long long shape;
+	double t;
+	while (fscanf(fp,"%d %llx %d %d %lf\n",&k,&shape,&threshold,&chunk,&t)==5 && k==lines && k<count && loops[k].shape==shape) {
+		rows[k].threshold = threshold;
+		rows[k].chunk = chunk;
+		rows[k].cost = t;
+		lines++;
+	}
+	fclose(fp);
+	int loaded = lines==count ? 0 : -1;
+	for (k=0;k<count && loaded>=0;k++) {
+		if (rows[k].threshold>0 && loops[k].samples<LOOP_SAMPLES) {
+			loops[k].threshold = rows[k].threshold;
+			loops[k].chunk = rows[k].chunk;
+			loops[k].cost = rows[k].cost;
+			loops[k].samples = LOOP_SAMPLES;
+			loaded++;
+		}
+	}
+	free(rows);
+	return loaded;
+}
+
+/* Returns the number of loops calibrated, -1 if the file cannot be written */
+int profile_save(const char* file, LOOP_PROFILE* loops, int count, int threads)
+{
+	FILE* fp = fopen(file,"w");
+	if (fp==NULL) {
+		return -1;
+	}
+	int calibrated = 0;
+	fprintf(fp,"renpsm-profile %d %d\n",count,threads);
+	for (int k=0;k<count;k++) {
+		LOOP_PROFILE* l = &loops[k];
+		int done = l->chunk>0;
+		fprintf(fp,"%d %016llx %d %d %.3e\n",k,(unsigned long long)l->shape,done ? l->threshold : 0,l->chunk,l->cost);
+		calibrated += done;
+	}
+	fclose(fp);
+	return calibrated;
+}
+
+#endif
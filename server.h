@@ -0,0 +1,471 @@
+/*
+ * server.h:
+ *
+ * This file contains the server mode of the generated RENPSM simulators:
+ * newline-delimited JSON requests read from the standard input or from a
+ * Unix domain socket, and the extraction of the path between the roots
+ * of the two trees of a bidirectional RRT, also the partial one of a run
+ * stopped by its deadline (-T).
+ *
+ * More information can be found in:
+ *
+ * I. Perez-Hurtado, G. Zang, M.J. Perez-Jimenez, D. Orellana
+ * Simulation of Rapidly-Exploring Random Trees in Membrane Computing
+ * with P-Lingua and Automatic Programing
+ * International Journal of Computers, Communications and Control, in press.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Copyright (C) 2018  Ignacio Perez-Hurtado (perezh@us.es)
+ *                     Research Group On Natural Computing
+ *                     http://www.gcn.us.es
+ *
+ * You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * A request is a JSON object on one line, every member is optional:
+ * {"id":1,"start":[x,y],"goal":[x,y],"seed":42,"steps":100000}
+ */
+typedef struct
+{
+	char id[64];
+	int has_start;
+	int start[2];
+	int has_goal;
+	int goal[2];
+	int has_seed;
+	unsigned int seed;
+	int steps;
+} SERVER_REQUEST;
+
+typedef void (*SERVER_HANDLER)(SERVER_REQUEST* req, FILE* out);
+
+const char* json_space(const char* s)
+{
+	while (isspace((unsigned char)*s)) {
+		s++;
+	}
+	return s;
+}
+
+/* Parses a whole decimal integer in min..max, returns 0 if value is not one */
+int json_integer(const char* value, long long min, long long max, long long* n)
+{
+	char* end;
+	if (!isdigit((unsigned char)value[0]) && (value[0]!='-' || min>=0)) {
+		return 0;
+	}
+	errno = 0;
+	*n = strtoll(value,&end,10);
+	return *end==0 && errno==0 && *n>=min && *n<=max;
+}
+
+/* Copies a string (unescaped, \\u in UTF-8) or a number into value, returns NULL on error */
+const char* json_scalar(const char* s, char* value, int size)
+{
+	int n = 0;
+	if (*s=='"') {
+		for (s++;*s!='"';s++) {
+			if (*s==0) {
+				return NULL;
+			}
+			char bytes[4];
+			int count = 1;
+			bytes[0] = *s;
+			if (*s=='\\') {
+				s++;
+				switch (*s) {
+					case 'b': bytes[0] = '\b'; break;
+					case 'f': bytes[0] = '\f'; break;
+					case 'n': bytes[0] = '\n'; break;
+					case 'r': bytes[0] = '\r'; break;
+					case 't': bytes[0] = '\t'; break;
+					case '"': case '\\': case '/': bytes[0] = *s; break;
+					case 'u': {
+						unsigned int c = 0;
+						for (int i=1;i<=4;i++) {
+							if (!isxdigit((unsigned char)s[i])) {
+								return NULL;
+							}
+							c = c*16 + (isdigit((unsigned char)s[i]) ? s[i]-'0' : (tolower((unsigned char)s[i])-'a'+10));
+						}
+						s += 4;
+						if (c<0x80) {
+							bytes[0] = c;
+						} else if (c<0x800) {
+							bytes[0] = 0xC0 | (c>>6);
+							bytes[1] = 0x80 | (c & 0x3F);
+							count = 2;
+						} else {
+							bytes[0] = 0xE0 | (c>>12);
+							bytes[1] = 0x80 | ((c>>6) & 0x3F);
+							bytes[2] = 0x80 | (c & 0x3F);
+							count = 3;
+						}
+						break;
+					}
+					default:
+						return NULL;
+				}
+			}
+			if (n+count<size) {
+				memcpy(value+n,bytes,count);
+				n += count;
+			}
+		}
+		s++;
+	} else {
+		while (*s!=0 && *s!=',' && *s!='}' && *s!=']' && !isspace((unsigned char)*s)) {
+			if (n<size-1) {
+				value[n++] = *s;
+			}
+			s++;
+		}
+		if (n==0) {
+			return NULL;
+		}
+	}
+	value[n] = 0;
+	return s;
+}
+
+const char* json_point(const char* s, int* point)
+{
+	char value[64];
+	s = json_space(s);
+	if (*s!='[') {
+		return NULL;
+	}
+	for (int i=0;i<2;i++) {
+		s = json_scalar(json_space(s+1),value,sizeof(value));
+		if (s==NULL) {
+			return NULL;
+		}
+		long long n;
+		if (!json_integer(value,INT_MIN,INT_MAX,&n)) {
+			return NULL;
+		}
+		point[i] = n;
+		s = json_space(s);
+		if (*s!=(i==0 ? ',' : ']')) {
+			return NULL;
+		}
+	}
+	return s+1;
+}
+
+/* Returns NULL on success or the error message */
+const char* parse_request(const char* line, SERVER_REQUEST* req)
+{
+	char key[64];
+	char value[64];
+	memset(req,0,sizeof(SERVER_REQUEST));
+	const char* s = json_space(line);
+	if (*s!='{') {
+		return "expected a JSON object";
+	}
+	s = json_space(s+1);
+	while (*s!='}') {
+		if (*s!='"' || (s = json_scalar(s,key,sizeof(key)))==NULL) {
+			return "expected a member name";
+		}
+		s = json_space(s);
+		if (*s!=':') {
+			return "expected ':'";
+		}
+		s = json_space(s+1);
+		if (strcmp(key,"start")==0) {
+			s = json_point(s,req->start);
+			req->has_start = 1;
+		} else if (strcmp(key,"goal")==0) {
+			s = json_point(s,req->goal);
+			req->has_goal = 1;
+		} else {
+			s = json_scalar(s,value,sizeof(value));
+			if (s==NULL) {
+				return "bad value";
+			}
+			long long n = 0;
+			if (strcmp(key,"id")==0) {
+				snprintf(req->id,sizeof(req->id),"%s",value);
+			} else if (strcmp(key,"seed")==0) {
+				if (!json_integer(value,0,UINT_MAX,&n)) {
+					return "bad seed";
+				}
+				req->seed = n;
+				req->has_seed = 1;
+			} else if (strcmp(key,"steps")==0) {
+				if (!json_integer(value,0,INT_MAX,&n)) {
+					return "bad steps";
+				}
+				req->steps = n;
+			}
+		}
+		if (s==NULL) {
+			return "bad value";
+		}
+		s = json_space(s);
+		if (*s==',') {
+			s = json_space(s+1);
+		} else if (*s!='}') {
+			return "expected ',' or '}'";
+		}
+	}
+	return NULL;
+}
+
+/* Writes s as a JSON string, escaping quotes, backslashes and control characters */
+void json_string(FILE* out, const char* s)
+{
+	fputc('"',out);
+	for (;*s!=0;s++) {
+		unsigned char c = *s;
+		if (c=='"' || c=='\\') {
+			fprintf(out,"\\%c",c);
+		} else if (c=='\n') {
+			fputs("\\n",out);
+		} else if (c=='\r') {
+			fputs("\\r",out);
+		} else if (c=='\t') {
+			fputs("\\t",out);
+		} else if (c<0x20 || c==0x7F) {
+			fprintf(out,"\\u%04x",c);
+		} else {
+			fputc(c,out);
+		}
+	}
+	fputc('"',out);
+}
+
+void server_error(FILE* out, SERVER_REQUEST* req, const char* error)
+{
+	fprintf(out,"{\"id\":");
+	json_string(out,req->id);
+	fprintf(out,",\"status\":\"error\",\"error\":");
+	json_string(out,error);
+	fprintf(out,"}\n");
+}
+
+/*
+ * Path from the root of tree a to the root of tree b (the first membrane
+ * of each label list) through the membranes best_a of a and best_b of b.
+ * membranes gives the parent of every membrane. Returns the number of
+ * membranes written to path (at most size_a+size_b).
+ */
+int tree_path(const int* membranes, const int* a, int size_a, const int* b, int size_b, int best_a, int best_b, int* path)
+{
+	int n = 0;
+	for (int h=best_a, k=0;k<size_a;k++) {
+		path[n++] = h;
+		if (h==a[0]) {
+			break;
+		}
+		h = membranes[h] & 0x00FFFFFF;
+	}
+	for (int i=0;i<n/2;i++) {
+		int t = path[i];
+		path[i] = path[n-1-i];
+		path[n-1-i] = t;
+	}
+	for (int h=best_b, k=0;k<size_b;k++) {
+		path[n++] = h;
+		if (h==b[0]) {
+			break;
+		}
+		h = membranes[h] & 0x00FFFFFF;
+	}
+	return n;
+}
+
+/*
+ * Path through the closest pair formed by the newest node of a tree and
+ * any node of the other one, the pair that halts the bidirectional RRT.
+ * position gives the coordinates of a membrane.
+ */
+int server_path(const int* membranes, const int* a, int size_a, const int* b, int size_b,
+	void (*position)(int h, double* x, double* y), int* path)
+{
+	int best_a = -1;
+	int best_b = -1;
+	double best = INFINITY;
+	for (int side=0;side<2;side++) {
+		const int* from = side==0 ? a : b;
+		const int* to = side==0 ? b : a;
+		int size_from = side==0 ? size_a : size_b;
+		int size_to = side==0 ? size_b : size_a;
+		if (size_from==0) {
+			continue;
+		}
+		double x0, y0, x1, y1;
+		position(from[size_from-1],&x0,&y0);
+		for (int i=0;i<size_to;i++) {
+			position(to[i],&x1,&y1);
+			double d = (x0-x1)*(x0-x1) + (y0-y1)*(y0-y1);
+			if (d<best) {
+				best = d;
+				best_a = side==0 ? from[size_from-1] : to[i];
+				best_b = side==0 ? to[i] : from[size_from-1];
+			}
+		}
+	}
+	if (best_a<0) {
+		return 0;
+	}
+	return tree_path(membranes,a,size_a,b,size_b,best_a,best_b,path);
+}
+
+typedef struct
+{
+	double x;
+	double y;
+	int h;
+} PAIR_POINT;
+
+int pair_compare(const void* p, const void* q)
+{
+	double x = ((const PAIR_POINT*)p)->x;
+	double y = ((const PAIR_POINT*)q)->x;
+	return x<y ? -1 : x>y;
+}
+
+/*
+ * Closest pair of any node of a and any node of b, for a run stopped
+ * before the trees meet. The nodes of b are sorted by x and every node of
+ * a only looks at the ones closer in x than the best pair so far. Returns
+ * the squared distance, INFINITY when a tree has no node with a position.
+ */
+double closest_pair(const int* a, int size_a, const int* b, int size_b,
+	void (*position)(int h, double* x, double* y), int* best_a, int* best_b)
+{
+	PAIR_POINT* p = (PAIR_POINT*)malloc(sizeof(PAIR_POINT)*(size_b>0 ? size_b : 1));
+	int n = 0;
+	for (int i=0;i<size_b;i++) {
+		position(b[i],&p[n].x,&p[n].y);
+		p[n].h = b[i];
+		n += !isnan(p[n].x) && !isnan(p[n].y);
+	}
+	qsort(p,n,sizeof(PAIR_POINT),pair_compare);
+	double best = INFINITY;
+	*best_a = -1;
+	*best_b = -1;
+	for (int i=0;i<size_a;i++) {
+		double x, y;
+		position(a[i],&x,&y);
+		if (isnan(x) || isnan(y)) {
+			continue;
+		}
+		int lo = 0;
+		int hi = n;
+		while (lo<hi) {
+			int mid = (lo+hi)/2;
+			if (p[mid].x<x) {
+				lo = mid+1;
+			} else {
+				hi = mid;
+			}
+		}
+		for (int side=0;side<2;side++) {
+			for (int j=side==0 ? lo : lo-1;j>=0 && j<n;j+=side==0 ? 1 : -1) {
+				double dx = p[j].x-x;
+				if (dx*dx>=best) {
+					break;
+				}
+				double d = dx*dx + (p[j].y-y)*(p[j].y-y);
+				if (d<best) {
+					best = d;
+					*best_a = a[i];
+					*best_b = p[j].h;
+				}
+			}
+		}
+	}
+	free(p);
+	return best;
+}
+
+void server_lines(FILE* in, FILE* out, SERVER_HANDLER handler)
+{
+	char* line = NULL;
+	size_t capacity = 0;
+	SERVER_REQUEST req;
+	while (getline(&line,&capacity,in)>0) {
+		if (json_space(line)[0]==0) {
+			continue;
+		}
+		const char* error = parse_request(line,&req);
+		if (error!=NULL) {
+			server_error(out,&req,error);
+		} else {
+			handler(&req,out);
+		}
+		fflush(out);
+	}
+	free(line);
+}
+
+/*
+ * Serves the standard input (socket NULL or empty) until end of file, or
+ * the connections to a Unix domain socket one after the other.
+ */
+int serve(const char* socket_path, SERVER_HANDLER handler)
+{
+	if (socket_path==NULL || socket_path[0]==0) {
+		server_lines(stdin,stdout,handler);
+		return 0;
+	}
+	struct sockaddr_un addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path)>=sizeof(addr.sun_path)) {
+		fprintf(stderr,"Server: socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path,socket_path);
+	int fd = socket(AF_UNIX,SOCK_STREAM,0);
+	unlink(socket_path);
+	if (fd<0 || bind(fd,(struct sockaddr*)&addr,sizeof(addr))!=0 || listen(fd,16)!=0) {
+		perror("Server");
+		return 1;
+	}
+	signal(SIGPIPE,SIG_IGN);
+	fprintf(stderr,"Server: listening on %s\n",socket_path);
+	for (;;) {
+		int client = accept(fd,NULL,NULL);
+		if (client<0) {
+			continue;
+		}
+		FILE* in = fdopen(client,"r");
+		FILE* out = fdopen(dup(client),"w");
+		server_lines(in,out,handler);
+		fclose(out);
+		fclose(in);
+	}
+	return 0;
+}
+
+#endif